@@ -0,0 +1,376 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * batch.c
+ * Runs many independent emulator instances on a pool of threads
+ *
+ * The jobs are split evenly between the threads up front. Each thread takes
+ * jobs from the front of its own range; a thread that runs out steals the
+ * back half of another thread's remaining range, so long jobs don't leave
+ * the other threads idle. The core keeps no global state, so the instances
+ * only share what the callbacks share. On Windows the jobs run one after
+ * another on the calling thread.
+ *
+ * run_lanes() runs jobs of the same firmware in groups, one job of
+ * run_jobs() each. The lanes of a group are copies of the instance loaded
+ * for the group, with their own data memories, and share its code memory,
+ * decode cache and JIT code; they take turns running a stretch of ticks.
+ * The firmware is loaded, decoded and compiled once per group instead of
+ * once per job, and the decoded code stays in the host caches.
+ */
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+// longest stretch given to run() at once
+#define RUN_CHUNK (1u << 30)
+
+#ifndef _WIN32
+struct worker {
+	pthread_t mThread;
+	bool mStarted;
+	pthread_mutex_t mLock;
+	unsigned int mNext; // next job to take
+	unsigned int mEnd; // end of this worker's range
+	unsigned int mIndex;
+	struct batch *mBatch;
+};
+
+struct batch {
+	struct em8051_job *mJobs;
+	struct worker *mWorkers;
+	unsigned int mThreads;
+};
+#endif
+
+// The lanes of one run_lanes() group
+struct lanes {
+	struct em8051_job *mJobs;
+	unsigned int mCount;
+	unsigned int mStep;
+};
+
+static void run_job(struct em8051_job *aJob) {
+	struct em8051 emu;
+
+	aJob->mTicksRun = 0;
+	if (em8051_alloc_instance(&emu, aJob->mEngine) != 0) {
+		aJob->mResult = -9;
+		return;
+	}
+	emu.mUserData = aJob->mUserData;
+	// reset() fills SBUF from rand(), which the threads share; a fixed value
+	// keeps the results the same whatever the thread count
+	emu.mSFR[REG_SBUF] = 0;
+
+	aJob->mResult = 0;
+	if (aJob->mFilename) {
+		aJob->mResult = load_image(&emu, aJob->mFilename, NULL, &aJob->mLoad);
+	} else if (aJob->mCode) {
+		unsigned int size = aJob->mCodeSize;
+		if (size > (unsigned int)emu.mCodeMemMaxIdx + 1)
+			size = emu.mCodeMemMaxIdx + 1;
+		memcpy(emu.mCodeMem, aJob->mCode, size);
+	}
+	if (aJob->mResult == 0 && aJob->mSnapshot)
+		aJob->mResult = snapshot_restore(&emu, aJob->mSnapshot, NULL);
+
+	if (aJob->mResult == 0) {
+		if (aJob->setup)
+			aJob->setup(&emu, aJob);
+		if (aJob->run) {
+			aJob->run(&emu, aJob);
+		} else {
+			while (aJob->mTicksRun < aJob->mTicks) {
+				unsigned long long left = aJob->mTicks - aJob->mTicksRun;
+				aJob->mTicksRun += run(&emu, left < RUN_CHUNK ? (unsigned int)left : RUN_CHUNK);
+				if (emu.mStop)
+					break;
+			}
+		}
+		// tick() from a run callback leaves events buffered
+		if (INSTRUMENTED(&emu))
+			instrument_flush();
+		if (aJob->finish)
+			aJob->finish(&emu, aJob);
+	}
+
+	em8051_free_instance(&emu);
+}
+
+#ifndef _WIN32
+// Returns the next job of aWorker's own range, or -1 if it is empty
+static int take(struct worker *aWorker) {
+	int job = -1;
+	pthread_mutex_lock(&aWorker->mLock);
+	if (aWorker->mNext < aWorker->mEnd)
+		job = aWorker->mNext++;
+	pthread_mutex_unlock(&aWorker->mLock);
+	return job;
+}
+
+// Moves the back half of some other worker's range to aWorker. Returns false
+// if there was nothing left anywhere.
+static bool steal(struct worker *aWorker) {
+	struct batch *batch = aWorker->mBatch;
+	unsigned int i;
+
+	for (i = 1; i < batch->mThreads; i++) {
+		struct worker *victim = &batch->mWorkers[(aWorker->mIndex + i) % batch->mThreads];
+		unsigned int start = 0, end = 0;
+
+		pthread_mutex_lock(&victim->mLock);
+		if (victim->mNext < victim->mEnd) {
+			end = victim->mEnd;
+			start = end - (end - victim->mNext + 1) / 2;
+			victim->mEnd = start;
+		}
+		pthread_mutex_unlock(&victim->mLock);
+
+		if (start != end) {
+			pthread_mutex_lock(&aWorker->mLock);
+			aWorker->mNext = start;
+			aWorker->mEnd = end;
+			pthread_mutex_unlock(&aWorker->mLock);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void *worker_main(void *aWorker) {
+	struct worker *worker = aWorker;
+
+	for (;;) {
+		int job = take(worker);
+		if (job < 0) {
+			if (!steal(worker))
+				break;
+			continue;
+		}
+		run_job(&worker->mBatch->mJobs[job]);
+	}
+	return NULL;
+}
+#endif
+
+// run callback of a run_lanes() group; aCPU has the firmware loaded
+static void run_lane_group(struct em8051 *aCPU, struct em8051_job *aJob) {
+	struct lanes *group = aJob->mUserData;
+	struct em8051 *lanes = calloc(group->mCount, sizeof(struct em8051));
+	bool *done = calloc(group->mCount, sizeof(bool));
+	unsigned int i, running = 0;
+
+	if (!lanes || !done) {
+		for (i = 0; i < group->mCount; i++)
+			group->mJobs[i].mResult = -9;
+		free(lanes);
+		free(done);
+		return;
+	}
+
+	for (i = 0; i < group->mCount; i++) {
+		struct em8051_job *job = &group->mJobs[i];
+		struct em8051 *lane = &lanes[i];
+
+		*lane = *aCPU;
+		lane->mExtData = malloc(aCPU->mExtDataMaxIdx + 1);
+		lane->mUpperData = malloc(128);
+		if (!lane->mExtData || !lane->mUpperData) {
+			job->mResult = -9;
+			done[i] = true;
+			continue;
+		}
+		memcpy(lane->mExtData, aCPU->mExtData, aCPU->mExtDataMaxIdx + 1);
+		memcpy(lane->mUpperData, aCPU->mUpperData, 128);
+		lane->mEngine = job->mEngine;
+		lane->mUserData = job->mUserData;
+		lane->mJit = NULL;
+		job->mResult = 0;
+		job->mLoad = aJob->mLoad;
+		job->mTicksRun = 0;
+		if (job->setup)
+			job->setup(lane, job);
+		running++;
+	}
+
+	// Lanes with a run callback go one after another, then the others take
+	// turns; the JIT code follows the lane that runs
+	for (i = 0; i < group->mCount; i++) {
+		if (done[i] || !group->mJobs[i].run)
+			continue;
+		lanes[i].mJit = aCPU->mJit;
+		group->mJobs[i].run(&lanes[i], &group->mJobs[i]);
+		aCPU->mJit = lanes[i].mJit;
+		lanes[i].mJit = NULL;
+		done[i] = true;
+		running--;
+	}
+	while (running) {
+		for (i = 0; i < group->mCount; i++) {
+			struct em8051_job *job = &group->mJobs[i];
+			unsigned long long left = job->mTicks - job->mTicksRun;
+
+			if (done[i])
+				continue;
+			lanes[i].mJit = aCPU->mJit;
+			job->mTicksRun += run(&lanes[i], left < group->mStep ? (unsigned int)left : group->mStep);
+			aCPU->mJit = lanes[i].mJit;
+			lanes[i].mJit = NULL;
+			if (lanes[i].mStop || job->mTicksRun >= job->mTicks) {
+				done[i] = true;
+				running--;
+			}
+		}
+	}
+
+	for (i = 0; i < group->mCount; i++) {
+		struct em8051_job *job = &group->mJobs[i];
+
+		if (job->mResult == 0) {
+			if (INSTRUMENTED(&lanes[i]))
+				instrument_flush();
+			if (job->finish)
+				job->finish(&lanes[i], job);
+		}
+		free(lanes[i].mExtData);
+		free(lanes[i].mUpperData);
+	}
+	free(lanes);
+	free(done);
+}
+
+int run_lanes(struct em8051_job *aJobs, unsigned int aCount, unsigned int aWidth, unsigned int aStep,
+	unsigned int aThreads) {
+	unsigned int groups, i;
+	struct em8051_job *jobs;
+	struct lanes *lanes;
+	int failed = 0;
+
+	if (aWidth == 0)
+		aWidth = 1;
+	if (aStep == 0)
+		aStep = 1;
+	groups = (aCount + aWidth - 1) / aWidth;
+	jobs = calloc(groups, sizeof(struct em8051_job));
+	lanes = calloc(groups, sizeof(struct lanes));
+	if (!jobs || !lanes) {
+		free(jobs);
+		free(lanes);
+		return -1;
+	}
+
+	for (i = 0; i < groups; i++) {
+		struct em8051_job *first = &aJobs[i * aWidth];
+
+		lanes[i].mJobs = first;
+		lanes[i].mCount = aCount - i * aWidth < aWidth ? aCount - i * aWidth : aWidth;
+		lanes[i].mStep = aStep;
+		jobs[i].mFilename = first->mFilename;
+		jobs[i].mCode = first->mCode;
+		jobs[i].mCodeSize = first->mCodeSize;
+		jobs[i].mSnapshot = first->mSnapshot;
+		jobs[i].mEngine = first->mEngine;
+		jobs[i].mUserData = &lanes[i];
+		jobs[i].run = run_lane_group;
+	}
+	run_jobs(jobs, groups, aThreads);
+
+	// a group that failed to load never ran its lanes
+	for (i = 0; i < groups; i++) {
+		unsigned int j;
+		for (j = 0; j < lanes[i].mCount && jobs[i].mResult != 0; j++) {
+			lanes[i].mJobs[j].mResult = jobs[i].mResult;
+			lanes[i].mJobs[j].mLoad = jobs[i].mLoad;
+			lanes[i].mJobs[j].mTicksRun = 0;
+		}
+	}
+	free(jobs);
+	free(lanes);
+
+	for (i = 0; i < aCount; i++)
+		if (aJobs[i].mResult != 0)
+			failed++;
+	return failed;
+}
+
+int run_jobs(struct em8051_job *aJobs, unsigned int aCount, unsigned int aThreads) {
+	unsigned int i;
+	int failed = 0;
+#ifdef _WIN32
+	for (i = 0; i < aCount; i++)
+		run_job(&aJobs[i]);
+#else
+	struct batch batch;
+
+	if (aThreads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		aThreads = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	if (aThreads > aCount)
+		aThreads = aCount;
+	if (aThreads == 0)
+		return 0;
+
+	batch.mJobs = aJobs;
+	batch.mThreads = aThreads;
+	batch.mWorkers = calloc(aThreads, sizeof(struct worker));
+	if (!batch.mWorkers) {
+		for (i = 0; i < aCount; i++)
+			aJobs[i].mResult = -9;
+		return aCount;
+	}
+
+	for (i = 0; i < aThreads; i++) {
+		struct worker *worker = &batch.mWorkers[i];
+		pthread_mutex_init(&worker->mLock, NULL);
+		worker->mNext = (unsigned int)((unsigned long long)aCount * i / aThreads);
+		worker->mEnd = (unsigned int)((unsigned long long)aCount * (i + 1) / aThreads);
+		worker->mIndex = i;
+		worker->mBatch = &batch;
+	}
+	// the calling thread is worker 0; the range of a thread that fails to
+	// start gets stolen by the others
+	for (i = 1; i < aThreads; i++)
+		batch.mWorkers[i].mStarted = pthread_create(&batch.mWorkers[i].mThread, NULL, worker_main, &batch.mWorkers[i]) == 0;
+	worker_main(&batch.mWorkers[0]);
+	for (i = 1; i < aThreads; i++)
+		if (batch.mWorkers[i].mStarted)
+			pthread_join(batch.mWorkers[i].mThread, NULL);
+
+	for (i = 0; i < aThreads; i++)
+		pthread_mutex_destroy(&batch.mWorkers[i].mLock);
+	free(batch.mWorkers);
+#endif
+
+	for (i = 0; i < aCount; i++)
+		if (aJobs[i].mResult != 0)
+			failed++;
+	return failed;
+}
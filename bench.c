@@ -0,0 +1,242 @@
+/* 8051 emulator
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ *
+ * bench.c
+ * Benchmark front-end: runs workloads under every engine and reports the
+ * emulation speed as JSON
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emu8051.h"
+
+static unsigned int opt_cycles = 10000000;
+static unsigned int opt_repeat = 3;
+static double opt_clock_hz = 12 * 1000 * 1000;
+static unsigned int opt_lanes = 0;
+
+static void bench_sfrwrite_SBUF(struct em8051 *aCPU, uint8_t aRegister) {
+	aCPU->serial_out_remaining_bits = 8;
+}
+
+// A fresh instance with aFilename loaded, as run_jobs() would make it. Out of
+// memory exits, as the timings would be worthless anyway.
+static int setup(struct em8051 *aCPU, char *aFilename, uint8_t aEngine) {
+	if (em8051_alloc_instance(aCPU, aEngine) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	aCPU->mSFR[REG_SBUF] = 0;
+	aCPU->sfrwrite[REG_SBUF] = bench_sfrwrite_SBUF;
+	return load_obj(aCPU, aFilename);
+}
+
+static double now(void) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Instructions started in opt_cycles ticks; the same for every engine
+static unsigned long long count_instructions(char *aFilename) {
+	struct em8051 emu;
+	unsigned long long instructions = 0;
+	unsigned int i;
+
+	setup(&emu, aFilename, ENGINE_TABLE);
+	for (i = 0; i < opt_cycles; i++)
+		if (tick(&emu))
+			instructions++;
+	em8051_free_instance(&emu);
+	return instructions;
+}
+
+// Seconds for the fastest of opt_repeat runs of opt_cycles ticks from reset
+static double time_engine(char *aFilename, uint8_t aEngine) {
+	double best = 0;
+	unsigned int i;
+
+	for (i = 0; i < opt_repeat; i++) {
+		struct em8051 emu;
+		unsigned int ticks = 0;
+		double start, seconds;
+
+		setup(&emu, aFilename, aEngine);
+		start = now();
+		while (ticks < opt_cycles)
+			ticks += run(&emu, opt_cycles - ticks);
+		seconds = now() - start;
+		em8051_free_instance(&emu);
+		if (i == 0 || seconds < best)
+			best = seconds;
+	}
+	return best;
+}
+
+static void lane_setup(struct em8051 *aCPU, struct em8051_job *aJob) {
+	aCPU->sfrwrite[REG_SBUF] = bench_sfrwrite_SBUF;
+}
+
+// Seconds for the fastest of opt_repeat runs of opt_lanes lanes of opt_cycles
+// ticks each, on one thread, load included
+static double time_lanes(char *aFilename, uint8_t aEngine) {
+	struct em8051_job *jobs = calloc(opt_lanes, sizeof(struct em8051_job));
+	double best = 0;
+	unsigned int i, j;
+
+	if (!jobs) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < opt_repeat; i++) {
+		double start, seconds;
+
+		memset(jobs, 0, opt_lanes * sizeof(struct em8051_job));
+		for (j = 0; j < opt_lanes; j++) {
+			jobs[j].mFilename = aFilename;
+			jobs[j].mTicks = opt_cycles;
+			jobs[j].mEngine = aEngine;
+			jobs[j].setup = lane_setup;
+		}
+		start = now();
+		if (run_lanes(jobs, opt_lanes, opt_lanes, 10000, 1) != 0) {
+			fprintf(stderr, "File '%s' lanes failed\n", aFilename);
+			exit(1);
+		}
+		seconds = now() - start;
+		if (i == 0 || seconds < best)
+			best = seconds;
+	}
+	free(jobs);
+	return best;
+}
+
+// The file name without the directory and extension
+static void workload_name(const char *aFilename, char *aName) {
+	const char *start = strrchr(aFilename, '/');
+	char *dot;
+
+	strcpy(aName, start ? start + 1 : aFilename);
+	dot = strrchr(aName, '.');
+	if (dot)
+		*dot = 0;
+}
+
+static void help() {
+	printf("Help:\n\n"
+	       "emu8051-bench [options] filename [filename...]\n\n"
+	       "Runs intel hex files under every execution engine and writes the speed as\n"
+	       "JSON: emulated MIPS, host nanoseconds per emulated instruction, and the\n"
+	       "effective clock in MHz and relative to the real one. `make bench` runs the\n"
+	       "workloads in bench/.\n"
+	       "Available options:\n\n"
+	       "-cycles=value     Machine cycles per run; default 10000000\n"
+	       "-repeat=value     Runs per engine, the fastest counts; default 3\n"
+	       "-clock=value      Clock speed in Hz the effective clock is compared to;\n"
+	       "                  default 12MHz, like the emulator's\n"
+	       "-lanes=value      Also time this many runs as run_lanes() lanes on one\n"
+	       "                  thread, and give their combined MIPS as lanes_mips\n");
+}
+
+int main(int parc, char **pars) {
+	char **files = calloc(parc, sizeof(char *));
+	unsigned int count = 0, i, engine;
+
+	for (i = 1; i < (unsigned int)parc; i++) {
+		if (pars[i][0] == '-' || pars[i][0] == '/') {
+			if (strncmp("cycles=", pars[i] + 1, 7) == 0) {
+				opt_cycles = strtoul(pars[i] + 8, NULL, 0);
+			} else if (strncmp("repeat=", pars[i] + 1, 7) == 0) {
+				opt_repeat = strtoul(pars[i] + 8, NULL, 0);
+			} else if (strncmp("clock=", pars[i] + 1, 6) == 0) {
+				opt_clock_hz = atoi(pars[i] + 7);
+			} else if (strncmp("lanes=", pars[i] + 1, 6) == 0) {
+				opt_lanes = strtoul(pars[i] + 7, NULL, 0);
+			} else {
+				help();
+				return 1;
+			}
+		} else {
+			files[count++] = pars[i];
+		}
+	}
+	if (!count || !opt_cycles || !opt_repeat || opt_clock_hz <= 0) {
+		help();
+		return 1;
+	}
+	for (i = 0; i < count; i++) {
+		struct em8051 emu;
+		int result = setup(&emu, files[i], ENGINE_TABLE);
+		em8051_free_instance(&emu);
+		if (result != 0) {
+			fprintf(stderr, "File '%s' load failure\n", files[i]);
+			return 1;
+		}
+	}
+
+	printf("{\n");
+	printf("\t\"clock_hz\": %.0f,\n", opt_clock_hz);
+	printf("\t\"cycles\": %u,\n", opt_cycles);
+	printf("\t\"repeat\": %u,\n", opt_repeat);
+	if (opt_lanes)
+		printf("\t\"lanes\": %u,\n", opt_lanes);
+	printf("\t\"workloads\": [\n");
+	for (i = 0; i < count; i++) {
+		unsigned long long instructions = count_instructions(files[i]);
+		char name[256];
+
+		workload_name(files[i], name);
+		printf("\t\t{\n");
+		printf("\t\t\t\"name\": \"%s\",\n", name);
+		printf("\t\t\t\"instructions\": %llu,\n", instructions);
+		printf("\t\t\t\"engines\": {\n");
+		for (engine = 0; engine < ENGINE_COUNT; engine++) {
+			double seconds = time_engine(files[i], engine);
+			// 12 clocks per machine cycle
+			double hz = opt_cycles * 12.0 / seconds;
+
+			printf("\t\t\t\t\"%s\": { \"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.3f, "
+			       "\"effective_mhz\": %.3f, \"realtime\": %.3f",
+				engine_name(engine), seconds, instructions / seconds / 1e6, seconds * 1e9 / instructions,
+				hz / 1e6, hz / opt_clock_hz);
+			if (opt_lanes) {
+				seconds = time_lanes(files[i], engine);
+				printf(", \"lanes_seconds\": %.6f, \"lanes_mips\": %.3f", seconds,
+					instructions * opt_lanes / seconds / 1e6);
+			}
+			printf(" }%s\n", engine + 1 < ENGINE_COUNT ? "," : "");
+			fflush(stdout);
+		}
+		printf("\t\t\t}\n");
+		printf("\t\t}%s\n", i + 1 < count ? "," : "");
+	}
+	printf("\t]\n");
+	printf("}\n");
+
+	free(files);
+	return 0;
+}
@@ -0,0 +1,292 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * block.c
+ * Basic block execution engine
+ *
+ * A basic block is a run of predecoded instructions ending in a jump or a
+ * branch. Blocks only contain instructions that can't change the timers,
+ * interrupts, power modes or the stack, and don't read the parity flag, so
+ * the tick bookkeeping (interrupt checks, timers) can be done once
+ * per block instead of once per instruction. Anything else runs one
+ * instruction at a time, exactly like tick().
+ */
+
+#include <stdlib.h>
+#include "emu8051.h"
+
+static struct em8051_decoded *lookup(struct em8051 *aCPU) {
+	struct em8051_decoded *entry = &aCPU->mDecodeCache[aCPU->mPC & (aCPU->mCodeMemMaxIdx)];
+	if (!entry->op || entry->address != aCPU->mPC)
+		entry = predecode(aCPU, aCPU->mPC);
+	return entry;
+}
+
+// SFRs a block may access directly; they have no side effects in the core,
+// but may have callbacks, see block_runnable()
+static const uint8_t block_sfrs[] = { REG_ACC, REG_B, REG_SP, REG_DPL, REG_DPH };
+
+// Direct addresses a block may access: lower data, and block_sfrs. Sets
+// DECODED_SFR in *aFlags for the latter.
+static bool safe_direct(uint8_t aAddress, uint8_t *aFlags) {
+	unsigned int i;
+
+	if (aAddress < 0x80)
+		return true;
+	for (i = 0; i < sizeof(block_sfrs); i++) {
+		if (aAddress - 0x80 == block_sfrs[i]) {
+			*aFlags |= DECODED_SFR;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool safe_bit(uint8_t aAddress, uint8_t *aFlags) {
+	if (aAddress < 0x80)
+		return true;
+	aAddress &= 0xf8;
+	return (aAddress == REG_ACC + 0x80 || aAddress == REG_B + 0x80) && safe_direct(aAddress, aFlags);
+}
+
+static bool block_safe(struct em8051_decoded *aEntry, uint8_t aOpcode, uint8_t *aFlags) {
+	if (aEntry->flags & (DECODED_CALL | DECODED_RETURN))
+		return false;
+
+	switch (aOpcode) {
+	case 0x05: // inc mem
+	case 0x15: // dec mem
+	case 0x25: // add a, mem
+	case 0x35: // addc a, mem
+	case 0x42: // orl mem, a
+	case 0x43: // orl mem, #data
+	case 0x45: // orl a, mem
+	case 0x52: // anl mem, a
+	case 0x53: // anl mem, #data
+	case 0x55: // anl a, mem
+	case 0x62: // xrl mem, a
+	case 0x63: // xrl mem, #data
+	case 0x65: // xrl a, mem
+	case 0x75: // mov mem, #data
+	case 0x88:
+	case 0x89:
+	case 0x8a:
+	case 0x8b:
+	case 0x8c:
+	case 0x8d:
+	case 0x8e:
+	case 0x8f: // mov mem, rx
+	case 0x95: // subb a, mem
+	case 0xa6:
+	case 0xa7: // mov @rx, mem
+	case 0xa8:
+	case 0xa9:
+	case 0xaa:
+	case 0xab:
+	case 0xac:
+	case 0xad:
+	case 0xae:
+	case 0xaf: // mov rx, mem
+	case 0xb5: // cjne a, mem, offset
+	case 0xc5: // xch a, mem
+	case 0xd5: // djnz mem, offset
+	case 0xf5: // mov mem, a
+		return safe_direct(aEntry->operand1, aFlags);
+	case 0xe5: // mov a, mem; mov a, acc raises an exception
+		return aEntry->operand1 != REG_ACC + 0x80 && safe_direct(aEntry->operand1, aFlags);
+	case 0x85: // mov mem, mem
+		return safe_direct(aEntry->operand1, aFlags) && safe_direct(aEntry->operand2, aFlags);
+	case 0x10: // jbc bitaddr, offset
+	case 0x20: // jb bitaddr, offset
+	case 0x30: // jnb bitaddr, offset
+	case 0x72: // orl c, bitaddr
+	case 0x82: // anl c, bitaddr
+	case 0x92: // mov bitaddr, c
+	case 0xa0: // orl c, /bitaddr
+	case 0xa2: // mov c, bitaddr
+	case 0xb0: // anl c, /bitaddr
+	case 0xb2: // cpl bitaddr
+	case 0xc2: // clr bitaddr
+	case 0xd2: // setb bitaddr
+		return safe_bit(aEntry->operand1, aFlags);
+	case 0x86:
+	case 0x87: // mov mem, @rx; writes through write_mem
+	case 0xa5: // illegal opcode
+	case 0xc0: // push mem
+	case 0xd0: // pop mem
+		return false;
+	}
+	return true;
+}
+
+static bool is_movx(uint8_t aOpcode) {
+	switch (aOpcode) {
+	case 0xe0: // movx a, @dptr
+	case 0xe2:
+	case 0xe3: // movx a, @rx
+	case 0xf0: // movx @dptr, a
+	case 0xf2:
+	case 0xf3: // movx @rx, a
+		return true;
+	}
+	return false;
+}
+
+static void build_block(struct em8051 *aCPU, struct em8051_decoded *aEntry) {
+	struct em8051_decoded *entry = aEntry;
+	uint16_t pc = aEntry->address;
+	uint8_t length = 0, ticks = 1, delay = 0, flags = 0;
+
+	while (length < BLOCK_MAX_LENGTH) {
+		uint8_t opcode = aCPU->mCodeMem[pc & (aCPU->mCodeMemMaxIdx)];
+
+		uint8_t sfr = 0;
+
+		if (!block_safe(entry, opcode, &sfr))
+			break;
+		// only the first instruction of a block may have a breakpoint
+		if (length && aCPU->mBreakpoints && BREAKPOINT_AT(aCPU->mBreakpoints, pc))
+			break;
+		if (is_movx(opcode))
+			flags |= DECODED_MOVX;
+		flags |= sfr;
+		// the previous operation takes at least one tick
+		if (length)
+			ticks += delay ? delay : 1;
+		delay = op_delays[opcode];
+		length++;
+		if (entry->flags & (DECODED_BRANCH | DECODED_JUMP | DECODED_INDIRECT))
+			break;
+
+		pc += entry->length;
+		entry = &aCPU->mDecodeCache[pc & (aCPU->mCodeMemMaxIdx)];
+		if (!entry->op || entry->address != pc)
+			entry = predecode(aCPU, pc);
+	}
+
+	aEntry->block_length = length;
+	aEntry->block_ticks = ticks;
+	aEntry->block_hits = 0;
+	aEntry->block_code = NULL;
+	aEntry->flags = (aEntry->flags & ~(DECODED_MOVX | DECODED_SFR)) | DECODED_BLOCK | flags;
+}
+
+// movx is fine unless it calls out, or may write over the code. The
+// callbacks may be installed at any time, so they are checked on each run.
+static bool block_runnable(struct em8051 *aCPU, struct em8051_decoded *aEntry) {
+	unsigned int i;
+
+	if (!aEntry->block_length)
+		return false;
+	if ((aEntry->flags & DECODED_MOVX) && (aCPU->xread || aCPU->xwrite || aCPU->mExtData == aCPU->mCodeMem))
+		return false;
+	if (aEntry->flags & DECODED_SFR) {
+		for (i = 0; i < sizeof(block_sfrs); i++)
+			if (aCPU->sfrread[block_sfrs[i]] || aCPU->sfrwrite[block_sfrs[i]])
+				return false;
+	}
+	return true;
+}
+
+// Runs the block starting at aEntry, returns the last operation's delay
+static uint8_t run_block(struct em8051 *aCPU, struct em8051_decoded *aEntry) {
+	uint8_t i, length = aEntry->block_length;
+	struct em8051_decoded *entry = aEntry;
+
+	for (i = 1; i < length; i++) {
+		entry->op(aCPU);
+		entry = lookup(aCPU);
+	}
+	return entry->op(aCPU);
+}
+
+unsigned int run_blocks(struct em8051 *aCPU, unsigned int aTicks) {
+	unsigned int ticks = 0;
+
+	if (!aCPU->mDecodeCache) {
+		for (; ticks < aTicks && !aCPU->mStop; ticks++)
+			tick(aCPU);
+		return ticks;
+	}
+
+	while (ticks < aTicks && !aCPU->mStop) {
+		struct em8051_decoded *entry;
+		unsigned int budget, used = 0;
+		uint8_t state;
+
+		ticks++;
+		state = tick_prologue(aCPU);
+		if (state == TICK_HALTED)
+			ticks += skip_halted(aCPU, aTicks - ticks);
+		if (state != TICK_EXECUTE)
+			continue;
+
+		// Chain blocks for as long as the ticks asked for last, and the timers
+		// have nothing to do but count.
+		budget = aTicks - ticks + 1;
+		if (aCPU->mTimerEvent - 1 < budget)
+			budget = aCPU->mTimerEvent - 1;
+
+		entry = lookup(aCPU);
+		for (;;) {
+			unsigned int gap = 0;
+
+			if (!(entry->flags & DECODED_BLOCK))
+				build_block(aCPU, entry);
+			if (!block_runnable(aCPU, entry))
+				break;
+			// ticks spent waiting for the previous block's last operation
+			if (used && aCPU->mTickDelay)
+				gap = aCPU->mTickDelay - 1;
+			if (used + gap + entry->block_ticks > budget)
+				break;
+			used += gap + entry->block_ticks;
+			// once for the hot block, once more to run it if it's still queued
+			if (aCPU->mEngine == ENGINE_JIT && !entry->block_code && entry->block_hits <= JIT_HOT_COUNT &&
+				++entry->block_hits >= JIT_HOT_COUNT)
+				entry->block_code = jit_compile(aCPU, entry);
+			if (aCPU->mEngine == ENGINE_JIT && entry->block_code)
+				aCPU->mTickDelay = entry->block_code(aCPU);
+			else
+				aCPU->mTickDelay = run_block(aCPU, entry);
+			BREAKPOINT_STOP(aCPU);
+			if (aCPU->mStop)
+				break;
+			entry = lookup(aCPU);
+		}
+
+		if (!used) {
+			aCPU->mTickDelay = entry->op(aCPU);
+			BREAKPOINT_STOP(aCPU);
+			tick_epilogue(aCPU);
+			continue;
+		}
+
+		timer_advance(aCPU, used - 1);
+		tick_epilogue(aCPU);
+		ticks += used - 1;
+	}
+
+	return ticks;
+}
@@ -0,0 +1,367 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * breakpoint.c
+ * Execution breakpoints with optional conditions
+ *
+ * A bit per code address tells whether a breakpoint is set there, so the
+ * check after every instruction costs the same however many are set. Only
+ * at a set bit is the breakpoint looked up, its hit counted and its
+ * condition evaluated.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+// Condition parser state; with mCPU NULL it only checks the syntax
+struct parser {
+	const char *mText;
+	struct em8051 *mCPU;
+	unsigned long mHits;
+	bool mError;
+};
+
+// Registers by name, as SFR addresses; "r0".."r7", "c", "dptr", "pc" and
+// "hits" are handled separately
+static const struct {
+	const char *mName;
+	uint8_t mAddress;
+} registers[] = {
+	{ "a", 0xe0 }, { "acc", 0xe0 }, { "b", 0xf0 }, { "psw", 0xd0 }, { "sp", 0x81 },
+	{ "dpl", 0x82 }, { "dph", 0x83 }, { "p0", 0x80 }, { "p1", 0x90 }, { "p2", 0xa0 },
+	{ "p3", 0xb0 }, { "ie", 0xa8 }, { "ip", 0xb8 }, { "tcon", 0x88 }, { "tmod", 0x89 },
+	{ "tl0", 0x8a }, { "tl1", 0x8b }, { "th0", 0x8c }, { "th1", 0x8d }, { "scon", 0x98 },
+	{ "sbuf", 0x99 }, { "pcon", 0x87 }
+};
+
+static long parse_or(struct parser *aParser);
+
+static void skip_space(struct parser *aParser) {
+	while (isspace((unsigned char)*aParser->mText))
+		aParser->mText++;
+}
+
+// Consume aToken if it comes next
+static bool accept(struct parser *aParser, const char *aToken) {
+	size_t length = strlen(aToken);
+
+	skip_space(aParser);
+	if (strncmp(aParser->mText, aToken, length) != 0)
+		return false;
+	// don't take "<" out of "<=", or "&" out of "&&"
+	if (length == 1 && strchr("<>!", aToken[0]) && aParser->mText[1] == '=')
+		return false;
+	if (length == 1 && strchr("&|", aToken[0]) && aParser->mText[1] == aToken[0])
+		return false;
+	aParser->mText += length;
+	return true;
+}
+
+static uint8_t read_sfr(struct em8051 *aCPU, uint8_t aAddress) {
+	if (aAddress == 0xd0)
+		update_parity(aCPU);
+	return aCPU->mSFR[aAddress - 0x80];
+}
+
+// name[index]: the memories
+static long memory(struct parser *aParser, const char *aName, long aIndex) {
+	struct em8051 *cpu = aParser->mCPU;
+
+	if (strcmp(aName, "data") == 0) {
+		if (!cpu)
+			return 0;
+		if (aIndex & 0x80)
+			return cpu->mUpperData ? cpu->mUpperData[aIndex & 0x7f] : 0;
+		return cpu->mLowerData[aIndex & 0x7f];
+	}
+	if (strcmp(aName, "sfr") == 0)
+		return cpu ? read_sfr(cpu, aIndex | 0x80) : 0;
+	if (strcmp(aName, "xdata") == 0)
+		return cpu && cpu->mExtData ? cpu->mExtData[aIndex & cpu->mExtDataMaxIdx] : 0;
+	if (strcmp(aName, "code") == 0)
+		return cpu ? cpu->mCodeMem[aIndex & cpu->mCodeMemMaxIdx] : 0;
+	aParser->mError = true;
+	return 0;
+}
+
+static long variable(struct parser *aParser, const char *aName) {
+	struct em8051 *cpu = aParser->mCPU;
+	unsigned int i;
+
+	if (strcmp(aName, "hits") == 0)
+		return aParser->mHits;
+	if (strcmp(aName, "pc") == 0)
+		return cpu ? cpu->mPC : 0;
+	if (strcmp(aName, "dptr") == 0)
+		return cpu ? (cpu->mSFR[REG_DPH] << 8) | cpu->mSFR[REG_DPL] : 0;
+	if (strcmp(aName, "c") == 0)
+		return cpu ? (cpu->mSFR[REG_PSW] & PSWMASK_C) != 0 : 0;
+	if (aName[0] == 'r' && aName[1] >= '0' && aName[1] <= '7' && !aName[2]) {
+		int bank;
+		if (!cpu)
+			return 0;
+		bank = (cpu->mSFR[REG_PSW] & (PSWMASK_RS0 | PSWMASK_RS1)) >> PSW_RS0;
+		return cpu->mLowerData[bank * 8 + aName[1] - '0'];
+	}
+	for (i = 0; i < sizeof(registers) / sizeof(registers[0]); i++)
+		if (strcmp(aName, registers[i].mName) == 0)
+			return cpu ? read_sfr(cpu, registers[i].mAddress) : 0;
+	aParser->mError = true;
+	return 0;
+}
+
+static long parse_primary(struct parser *aParser) {
+	char name[8];
+	unsigned int length = 0;
+	long value;
+
+	skip_space(aParser);
+	if (accept(aParser, "(")) {
+		value = parse_or(aParser);
+		if (!accept(aParser, ")"))
+			aParser->mError = true;
+		return value;
+	}
+	if (isdigit((unsigned char)*aParser->mText)) {
+		char *end;
+		value = strtol(aParser->mText, &end, 0);
+		aParser->mText = end;
+		return value;
+	}
+	while (isalnum((unsigned char)*aParser->mText) && length < sizeof(name) - 1)
+		name[length++] = tolower((unsigned char)*aParser->mText++);
+	name[length] = 0;
+	if (!length || isalnum((unsigned char)*aParser->mText)) {
+		aParser->mError = true;
+		return 0;
+	}
+	if (accept(aParser, "[")) {
+		value = parse_or(aParser);
+		if (!accept(aParser, "]"))
+			aParser->mError = true;
+		return memory(aParser, name, value);
+	}
+	return variable(aParser, name);
+}
+
+static long parse_unary(struct parser *aParser) {
+	if (accept(aParser, "!"))
+		return !parse_unary(aParser);
+	if (accept(aParser, "~"))
+		return ~parse_unary(aParser);
+	if (accept(aParser, "-"))
+		return -parse_unary(aParser);
+	return parse_primary(aParser);
+}
+
+static long parse_product(struct parser *aParser) {
+	long value = parse_unary(aParser);
+
+	for (;;) {
+		if (accept(aParser, "*")) {
+			value *= parse_unary(aParser);
+		} else if (accept(aParser, "/")) {
+			long divisor = parse_unary(aParser);
+			value = divisor ? value / divisor : 0;
+		} else if (accept(aParser, "%")) {
+			long divisor = parse_unary(aParser);
+			value = divisor ? value % divisor : 0;
+		} else {
+			return value;
+		}
+	}
+}
+
+static long parse_sum(struct parser *aParser) {
+	long value = parse_product(aParser);
+
+	for (;;) {
+		if (accept(aParser, "+"))
+			value += parse_product(aParser);
+		else if (accept(aParser, "-"))
+			value -= parse_product(aParser);
+		else
+			return value;
+	}
+}
+
+static long parse_compare(struct parser *aParser) {
+	long value = parse_sum(aParser);
+
+	if (accept(aParser, "=="))
+		return value == parse_sum(aParser);
+	if (accept(aParser, "!="))
+		return value != parse_sum(aParser);
+	if (accept(aParser, "<="))
+		return value <= parse_sum(aParser);
+	if (accept(aParser, ">="))
+		return value >= parse_sum(aParser);
+	if (accept(aParser, "<"))
+		return value < parse_sum(aParser);
+	if (accept(aParser, ">"))
+		return value > parse_sum(aParser);
+	return value;
+}
+
+static long parse_bit_and(struct parser *aParser) {
+	long value = parse_compare(aParser);
+
+	while (accept(aParser, "&"))
+		value &= parse_compare(aParser);
+	return value;
+}
+
+static long parse_bit_xor(struct parser *aParser) {
+	long value = parse_bit_and(aParser);
+
+	while (accept(aParser, "^"))
+		value ^= parse_bit_and(aParser);
+	return value;
+}
+
+static long parse_bit_or(struct parser *aParser) {
+	long value = parse_bit_xor(aParser);
+
+	while (accept(aParser, "|"))
+		value |= parse_bit_xor(aParser);
+	return value;
+}
+
+static long parse_and(struct parser *aParser) {
+	long value = parse_bit_or(aParser);
+
+	while (accept(aParser, "&&")) {
+		long other = parse_bit_or(aParser);
+		value = value && other;
+	}
+	return value;
+}
+
+static long parse_or(struct parser *aParser) {
+	long value = parse_and(aParser);
+
+	while (accept(aParser, "||")) {
+		long other = parse_and(aParser);
+		value = value || other;
+	}
+	return value;
+}
+
+int expression_eval(struct em8051 *aCPU, const char *aExpression, unsigned long aHits, long *aValue) {
+	struct parser parser;
+	long value;
+
+	parser.mText = aExpression;
+	parser.mCPU = aCPU;
+	parser.mHits = aHits;
+	parser.mError = false;
+	value = parse_or(&parser);
+	skip_space(&parser);
+	if (parser.mError || *parser.mText)
+		return -1;
+	if (aValue)
+		*aValue = value;
+	return 0;
+}
+
+static struct em8051_breakpoint *find(struct em8051_breakpoints *aBreakpoints, uint16_t aAddress) {
+	unsigned int i;
+
+	for (i = 0; i < aBreakpoints->mCount; i++)
+		if (aBreakpoints->mList[i].mAddress == aAddress)
+			return &aBreakpoints->mList[i];
+	return NULL;
+}
+
+int breakpoint_set(struct em8051_breakpoints *aBreakpoints, uint16_t aAddress, const char *aCondition) {
+	struct em8051_breakpoint *breakpoint;
+	char *condition = NULL;
+
+	if (aCondition && !*aCondition)
+		aCondition = NULL;
+	if (aCondition) {
+		if (expression_eval(NULL, aCondition, 0, NULL) < 0)
+			return -1;
+		condition = malloc(strlen(aCondition) + 1);
+		if (!condition)
+			return -2;
+		strcpy(condition, aCondition);
+	}
+
+	breakpoint = find(aBreakpoints, aAddress);
+	if (!breakpoint) {
+		struct em8051_breakpoint *list = realloc(aBreakpoints->mList, (aBreakpoints->mCount + 1) * sizeof(struct em8051_breakpoint));
+		if (!list) {
+			free(condition);
+			return -2;
+		}
+		aBreakpoints->mList = list;
+		breakpoint = &list[aBreakpoints->mCount++];
+		breakpoint->mAddress = aAddress;
+		breakpoint->mCondition = NULL;
+	}
+	free(breakpoint->mCondition);
+	breakpoint->mCondition = condition;
+	breakpoint->mHits = 0;
+	aBreakpoints->mBits[aAddress >> 3] |= 1 << (aAddress & 7);
+	return 0;
+}
+
+bool breakpoint_clear(struct em8051_breakpoints *aBreakpoints, uint16_t aAddress) {
+	struct em8051_breakpoint *breakpoint = find(aBreakpoints, aAddress);
+
+	if (!breakpoint)
+		return false;
+	free(breakpoint->mCondition);
+	*breakpoint = aBreakpoints->mList[--aBreakpoints->mCount];
+	aBreakpoints->mBits[aAddress >> 3] &= ~(1 << (aAddress & 7));
+	return true;
+}
+
+void breakpoint_clear_all(struct em8051_breakpoints *aBreakpoints) {
+	unsigned int i;
+
+	for (i = 0; i < aBreakpoints->mCount; i++)
+		free(aBreakpoints->mList[i].mCondition);
+	free(aBreakpoints->mList);
+	memset(aBreakpoints, 0, sizeof(*aBreakpoints));
+}
+
+bool breakpoint_check(struct em8051_breakpoints *aBreakpoints, struct em8051 *aCPU) {
+	struct em8051_breakpoint *breakpoint;
+	long value;
+
+	if (!BREAKPOINT_AT(aBreakpoints, aCPU->mPC))
+		return false;
+	breakpoint = find(aBreakpoints, aCPU->mPC);
+	if (!breakpoint)
+		return false;
+	breakpoint->mHits++;
+	if (!breakpoint->mCondition)
+		return true;
+	// the condition parsed when it was set
+	return expression_eval(aCPU, breakpoint->mCondition, breakpoint->mHits, &value) == 0 && value;
+}
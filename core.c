@@ -28,6 +28,16 @@
 
 #define T0_MODE3_MASK (TMODMASK_M0_0 | TMODMASK_M1_0)
 
+// mTimerRun bits: the counters that count on every tick
+#define TIMER_RUN_T0  0x01 // timer 0 in mode 0, 1 or 2
+#define TIMER_RUN_TL0 0x02 // TL0 of timer 0 in mode 3
+#define TIMER_RUN_TH0 0x04 // TH0 of timer 0 in mode 3
+#define TIMER_RUN_T1  0x08 // timer 1 in mode 0, 1 or 2
+#define TIMER_RUN_EN1 0x10 // timer 1 enabled, whether it counts or not
+
+#define TIMER_NEVER UINT_MAX
+
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include "emu8051.h"
@@ -54,7 +64,7 @@ static void serial_tx(struct em8051 *aCPU) {
 	}
 }
 
-static void timer_tick(struct em8051 *aCPU) {
+static void timer_update(struct em8051 *aCPU) {
 	uint8_t increment;
 	uint16_t v;
 
@@ -266,13 +276,201 @@ static void timer_tick(struct em8051 *aCPU) {
 	// TODO: serial port, timer2, other stuff
 }
 
+// timer_update() increments timer 0 / 1 in this tick
+static bool timer0_running(struct em8051 *aCPU) {
+	return !(aCPU->mSFR[REG_TMOD] & (TMODMASK_GATE_0 | TMODMASK_CT_0)) &&
+		(aCPU->mSFR[REG_TCON] & TCONMASK_TR0);
+}
+
+static bool timer1_running(struct em8051 *aCPU) {
+	return !(aCPU->mSFR[REG_TMOD] & (TMODMASK_GATE_1 | TMODMASK_CT_1)) &&
+		(aCPU->mSFR[REG_TCON] & TCONMASK_TR1);
+}
+
+// ticks until a timer in mode aMode overflows
+static unsigned int timer_ticks_to_overflow(uint8_t aMode, uint8_t aTL, uint8_t aTH) {
+	switch (aMode) {
+	case 0: // 13-bit timer
+		return 0x2000 - ((aTH << 5) | (aTL & 0x1f));
+	case 1: // 16-bit timer/counter
+		return 0x10000 - ((aTH << 8) | aTL);
+	case 2: // 8-bit auto-reload timer
+		return 0x100 - aTL;
+	default:
+		return TIMER_NEVER;
+	}
+}
+
+static void timer_add(uint8_t aMode, uint8_t *aTL, uint8_t *aTH, unsigned int aTicks) {
+	unsigned int v;
+
+	switch (aMode) {
+	case 0: // 13-bit timer
+		v = ((*aTH << 5) | (*aTL & 0x1f)) + aTicks;
+		*aTL = (*aTL & ~0x1f) | (v & 0x1f);
+		*aTH = (v >> 5) & 0xff;
+		break;
+	case 1: // 16-bit timer/counter
+		v = ((*aTH << 8) | *aTL) + aTicks;
+		*aTL = v & 0xff;
+		*aTH = (v >> 8) & 0xff;
+		break;
+	case 2: // 8-bit auto-reload timer
+		*aTL = (*aTL + aTicks) & 0xff;
+		break;
+	}
+}
+
+void timer_schedule(struct em8051 *aCPU) {
+	unsigned int ticks = TIMER_NEVER, v;
+	uint8_t tmod = aCPU->mSFR[REG_TMOD];
+	uint8_t run = 0;
+
+	if (timer1_running(aCPU))
+		run |= TIMER_RUN_EN1;
+
+	if ((tmod & T0_MODE3_MASK) == T0_MODE3_MASK) {
+		// two 8-bit timers; TH0 runs with timer 1's controls
+		if (timer0_running(aCPU)) {
+			run |= TIMER_RUN_TL0;
+			ticks = 0x100 - aCPU->mSFR[REG_TL0];
+		}
+		if (run & TIMER_RUN_EN1) {
+			run |= TIMER_RUN_TH0;
+			v = 0x100 - aCPU->mSFR[REG_TH0];
+			if (v < ticks)
+				ticks = v;
+		}
+	} else if (timer0_running(aCPU)) {
+		run |= TIMER_RUN_T0;
+		ticks = timer_ticks_to_overflow(tmod & T0_MODE3_MASK, aCPU->mSFR[REG_TL0], aCPU->mSFR[REG_TH0]);
+	}
+
+	if (run & TIMER_RUN_EN1) {
+		if ((tmod & (TMODMASK_M0_1 | TMODMASK_M1_1)) != (TMODMASK_M0_1 | TMODMASK_M1_1))
+			run |= TIMER_RUN_T1;
+		v = timer_ticks_to_overflow((tmod >> 4) & 3, aCPU->mSFR[REG_TL1], aCPU->mSFR[REG_TH1]);
+		if (v < ticks)
+			ticks = v;
+		// a pending TF1 clocks the serial port on every tick
+		if ((aCPU->mSFR[REG_TCON] & TCONMASK_TF1) && (aCPU->mSFR[REG_SCON] & SCONMASK_SM1))
+			ticks = 1;
+	}
+
+	aCPU->mTimerRun = run;
+	aCPU->mTimerEvent = ticks;
+}
+
+void timer_advance(struct em8051 *aCPU, unsigned int aTicks) {
+	uint8_t tmod = aCPU->mSFR[REG_TMOD];
+
+	if (aCPU->mTimerEvent != TIMER_NEVER)
+		aCPU->mTimerEvent -= aTicks;
+	if (!(aCPU->mTimerRun & (TIMER_RUN_T0 | TIMER_RUN_TL0 | TIMER_RUN_TH0 | TIMER_RUN_T1)))
+		return;
+
+	if (aCPU->mTimerRun & TIMER_RUN_T0)
+		timer_add(tmod & T0_MODE3_MASK, &aCPU->mSFR[REG_TL0], &aCPU->mSFR[REG_TH0], aTicks);
+	if (aCPU->mTimerRun & TIMER_RUN_TL0)
+		aCPU->mSFR[REG_TL0] += aTicks;
+	if (aCPU->mTimerRun & TIMER_RUN_TH0)
+		aCPU->mSFR[REG_TH0] += aTicks;
+	if (aCPU->mTimerRun & TIMER_RUN_T1)
+		timer_add((tmod >> 4) & 3, &aCPU->mSFR[REG_TL1], &aCPU->mSFR[REG_TH1], aTicks);
+}
+
+// Counts the timers for one tick. The full timer_update() only runs on
+// ticks that have something else than counting to do.
+static void timer_tick(struct em8051 *aCPU) {
+	if (aCPU->mTimerEvent > 1) {
+		timer_advance(aCPU, 1);
+		return;
+	}
+	timer_update(aCPU);
+	timer_schedule(aCPU);
+	update_interrupts(aCPU);
+}
+
+void sfr_update(struct em8051 *aCPU, uint8_t aAddress) {
+	switch (aAddress - 0x80) {
+	case REG_IE:
+		update_interrupts(aCPU);
+		break;
+	case REG_TCON:
+		update_interrupts(aCPU);
+		timer_schedule(aCPU);
+		break;
+	case REG_TMOD:
+	case REG_TL0:
+	case REG_TH0:
+	case REG_TL1:
+	case REG_TH1:
+	case REG_SCON:
+		timer_schedule(aCPU);
+		break;
+	}
+}
+
+void update_interrupts(struct em8051 *aCPU) {
+	uint8_t ie = aCPU->mSFR[REG_IE];
+	uint8_t tcon = aCPU->mSFR[REG_TCON];
+	uint8_t requests = 0;
+
+	if (!(ie & IEMASK_EA)) {
+		aCPU->mInterruptPending = 0;
+		return;
+	}
+
+	if (tcon & TCONMASK_IE0)
+		requests |= IEMASK_EX0;
+	if (tcon & TCONMASK_TF0)
+		requests |= IEMASK_ET0;
+	if (tcon & TCONMASK_IE1)
+		requests |= IEMASK_EX1;
+	if (tcon & TCONMASK_TF1)
+		requests |= IEMASK_ET1;
+	if (aCPU->serial_interrupt_trigger)
+		requests |= IEMASK_ES;
+#ifdef __8052__
+	requests |= IEMASK_ET2;
+#endif // __8052__
+
+	aCPU->mInterruptPending = ie & requests;
+}
+
+unsigned int skip_halted(struct em8051 *aCPU, unsigned int aTicks) {
+	unsigned int ticks;
+
+	if (aCPU->mTickDelay != 1)
+		return 0;
+
+	// Power down: nothing changes until reset
+	if (aCPU->mSFR[REG_PCON] & 0x02)
+		return aTicks;
+
+	// Idle: only the timers count until they raise something. The last tick
+	// may have raised an interrupt already; that is taken on the next tick.
+	if (!(aCPU->mSFR[REG_PCON] & 0x01) || aCPU->mInterruptPending)
+		return 0;
+	ticks = aCPU->mTimerEvent - 1;
+	if (ticks > aTicks)
+		ticks = aTicks;
+	timer_advance(aCPU, ticks);
+	return ticks;
+}
+
+// Slot of the control transfer aFrom -> aTo in mEdges
+static uint16_t edge_index(uint16_t aFrom, uint16_t aTo) {
+	return ((aFrom * 0x9e37u) ^ aTo) & (EDGE_MAP_SIZE - 1);
+}
+
 void handle_interrupts(struct em8051 *aCPU) {
 	int16_t dest_ip = -1;
 	uint8_t hi = 0;
 	uint8_t lo = 0;
 
-	// can't interrupt high level
-	if (aCPU->mInterruptActive > 1)
+	// nothing requested, or can't interrupt high level
+	if (!aCPU->mInterruptPending || aCPU->mInterruptActive > 1)
 		return;
 
 	if (aCPU->mSFR[REG_IE] & IEMASK_EA) {
@@ -355,8 +553,13 @@ void handle_interrupts(struct em8051 *aCPU) {
 
 	// some interrupt occurs; perform LCALL
 	aCPU->mSFR[REG_PCON] &= ~0x01; // clear idle flag, but not Power down flag
+	INSTRUMENT_EVENT(aCPU, EVENT_INTERRUPT, dest_ip, 0);
 	push_to_stack(aCPU, aCPU->mPC & 0xff);
 	push_to_stack(aCPU, aCPU->mPC >> 8);
+	if (aCPU->mProfile)
+		profile_interrupt(aCPU, dest_ip);
+	if (aCPU->mEdges)
+		aCPU->mEdges[edge_index(aCPU->mPC, dest_ip)]++;
 	aCPU->mPC = dest_ip;
 	// wait for 2 ticks instead of one since we were not executing
 	// this LCALL before.
@@ -367,26 +570,26 @@ void handle_interrupts(struct em8051 *aCPU) {
 		break;
 	case ISR_TF1:
 		aCPU->mSFR[REG_TCON] &= ~TCONMASK_TF1; // clear overflow flag
+		timer_schedule(aCPU);
 		break;
 	case ISR_SR:
 		aCPU->serial_interrupt_trigger = 0; // handled the serial interrupt trigger
 		break;
 	}
+	update_interrupts(aCPU);
 
 	if (hi) {
 		aCPU->mInterruptActive |= 2;
 	} else {
 		aCPU->mInterruptActive = 1;
 	}
+	update_parity(aCPU);
 	aCPU->int_a[hi] = aCPU->mSFR[REG_ACC];
 	aCPU->int_psw[hi] = aCPU->mSFR[REG_PSW];
 	aCPU->int_sp[hi] = aCPU->mSFR[REG_SP];
 }
 
-bool tick(struct em8051 *aCPU) {
-	uint8_t v;
-	bool ticked = false;
-
+uint8_t tick_prologue(struct em8051 *aCPU) {
 	if (aCPU->mTickDelay) {
 		aCPU->mTickDelay--;
 	}
@@ -394,7 +597,7 @@ bool tick(struct em8051 *aCPU) {
 	// Test for Power Down
 	if (aCPU->mTickDelay == 0 && (aCPU->mSFR[REG_PCON]) & 0x02) {
 		aCPU->mTickDelay = 1;
-		return 1;
+		return TICK_HALTED;
 	}
 
 	// Interrupts are sent if the following cases are not true:
@@ -408,23 +611,125 @@ bool tick(struct em8051 *aCPU) {
 	if (aCPU->mTickDelay == 0) {
 		// IDL activate the idle mode to save power
 		bool is_idle = (aCPU->mSFR[REG_PCON]) & 0x01;
-		if (is_idle) {
-			aCPU->mTickDelay = 1;
-		} else {
-			aCPU->mTickDelay = aCPU->op[aCPU->mCodeMem[aCPU->mPC & (aCPU->mCodeMemMaxIdx)]](aCPU);
-		}
-		ticked = true;
-		// update parity bit
-		v = aCPU->mSFR[REG_ACC];
-		v ^= v >> 4;
-		v &= 0xf;
-		v = (0x6996 >> v) & 1;
-		aCPU->mSFR[REG_PSW] = (aCPU->mSFR[REG_PSW] & ~PSWMASK_P) | (v * PSWMASK_P);
+		if (!is_idle)
+			return TICK_EXECUTE;
+		aCPU->mTickDelay = 1;
+		tick_epilogue(aCPU);
+		return TICK_HALTED;
 	}
 
 	timer_tick(aCPU);
 
-	return ticked;
+	return TICK_NONE;
+}
+
+static uint8_t parity(uint8_t aValue) {
+	aValue ^= aValue >> 4;
+	aValue &= 0xf;
+	return (0x6996 >> aValue) & 1;
+}
+
+void update_parity(struct em8051 *aCPU) {
+	uint8_t v = parity(aCPU->mSFR[REG_ACC]);
+#ifdef PARITY_CHECK
+	// tick_epilogue() has stored the eager value; compare against that
+	if (((aCPU->mSFR[REG_PSW] & PSWMASK_P) != 0) != v && aCPU->except)
+		aCPU->except(aCPU, EXCEPTION_PARITY_MISMATCH);
+#else
+	aCPU->mSFR[REG_PSW] = (aCPU->mSFR[REG_PSW] & ~PSWMASK_P) | (v * PSWMASK_P);
+#endif
+}
+
+void tick_epilogue(struct em8051 *aCPU) {
+	// The parity bit is only updated when PSW is read, see update_parity()
+#ifdef PARITY_CHECK
+	uint8_t v = parity(aCPU->mSFR[REG_ACC]);
+	aCPU->mSFR[REG_PSW] = (aCPU->mSFR[REG_PSW] & ~PSWMASK_P) | (v * PSWMASK_P);
+#endif
+
+	timer_tick(aCPU);
+}
+
+// Edge coverage and the wild jump check after the instruction at aPC
+static void check_flow(struct em8051 *aCPU, uint16_t aPC) {
+	uint16_t next = aPC + op_lengths[aCPU->mCodeMem[aPC & (aCPU->mCodeMemMaxIdx)]];
+
+	if (aCPU->mEdges && aCPU->mPC != next)
+		aCPU->mEdges[edge_index(aPC, aCPU->mPC)]++;
+	// raised at the instruction that jumped, which tells more than the target
+	if (aCPU->mCodeEnd && aCPU->mPC >= aCPU->mCodeEnd && aCPU->except) {
+		uint16_t target = aCPU->mPC;
+		aCPU->mPC = aPC;
+		aCPU->except(aCPU, EXCEPTION_WILD_JUMP);
+		aCPU->mPC = target;
+	}
+}
+
+static uint8_t tick_state(struct em8051 *aCPU) {
+	uint8_t state = tick_prologue(aCPU);
+
+	if (state == TICK_EXECUTE) {
+		uint16_t pc = aCPU->mPC;
+#ifdef INSTRUMENT
+		uint8_t opcode = aCPU->mCodeMem[pc & (aCPU->mCodeMemMaxIdx)];
+		INSTRUMENT_EVENT(aCPU, EVENT_FETCH, pc, opcode);
+#endif
+		if (aCPU->mTrace)
+			trace_begin(aCPU);
+		if (aCPU->mProfile)
+			profile_begin(aCPU);
+		if (aCPU->mCoverage)
+			aCPU->mCoverage[aCPU->mPC & (aCPU->mCodeMemMaxIdx)] |= COVERAGE_RUN;
+		// The threaded engine only pays off over several instructions (see run()),
+		// so single ticks go through the function pointer table.
+		if (aCPU->mEngine == ENGINE_SWITCH)
+			aCPU->mTickDelay = do_op(aCPU);
+		else
+			aCPU->mTickDelay = aCPU->op[aCPU->mCodeMem[aCPU->mPC & (aCPU->mCodeMemMaxIdx)]](aCPU);
+		if (aCPU->mTrace)
+			trace_end(aCPU);
+		if (aCPU->mProfile)
+			profile_end(aCPU);
+		if (aCPU->mEdges || aCPU->mCodeEnd)
+			check_flow(aCPU, pc);
+		BREAKPOINT_STOP(aCPU);
+#ifdef INSTRUMENT
+		if (aCPU->mPC != (uint16_t)(pc + op_lengths[opcode]))
+			INSTRUMENT_EVENT(aCPU, EVENT_BRANCH, aCPU->mPC, opcode);
+#endif
+		tick_epilogue(aCPU);
+	}
+
+	return state;
+}
+
+bool tick(struct em8051 *aCPU) {
+	return tick_state(aCPU) != TICK_NONE;
+}
+
+unsigned int run(struct em8051 *aCPU, unsigned int aTicks) {
+	unsigned int i;
+
+	aCPU->mStop = 0;
+	// the other engines don't call the trace, profile, coverage, control
+	// flow or instrumentation hooks
+	if (!aCPU->mTrace && !aCPU->mProfile && !aCPU->mCoverage && !aCPU->mEdges && !aCPU->mCodeEnd &&
+		!INSTRUMENTED(aCPU)) {
+		if (aCPU->mEngine == ENGINE_THREADED)
+			return do_ops_threaded(aCPU, aTicks);
+		// nor do blocks stop right after the access a watchpoint caught
+		if ((aCPU->mEngine == ENGINE_BLOCK || aCPU->mEngine == ENGINE_JIT) &&
+			!(aCPU->mWatch && aCPU->mWatch->mCount))
+			return run_blocks(aCPU, aTicks);
+	}
+
+	for (i = 0; i < aTicks && !aCPU->mStop; i++)
+		if (tick_state(aCPU) == TICK_HALTED)
+			i += skip_halted(aCPU, aTicks - i - 1);
+
+	if (INSTRUMENTED(aCPU))
+		instrument_flush();
+	return i;
 }
 
 uint8_t decode(struct em8051 *aCPU, uint16_t aPosition, char *aBuffer) {
@@ -441,6 +746,27 @@ uint8_t decode(struct em8051 *aCPU, uint16_t aPosition, char *aBuffer) {
 	return aCPU->dec[aCPU->mCodeMem[aPosition & (aCPU->mCodeMemMaxIdx)]](aCPU, aPosition, aBuffer);
 }
 
+void invalidate_code(struct em8051 *aCPU, uint16_t aAddress, unsigned int aLength) {
+	unsigned int i;
+
+	if (!aCPU->mDecodeCache)
+		return;
+
+	if (aLength > aCPU->mCodeMemMaxIdx) {
+		memset(aCPU->mDecodeCache, 0, (aCPU->mCodeMemMaxIdx + 1) * sizeof(struct em8051_decoded));
+		return;
+	}
+
+	// instructions are up to 3 bytes long, so the two entries before the
+	// range may cover it as well; basic blocks up to BLOCK_MAX_LENGTH of them
+	for (i = 0; i < aLength + BLOCK_MAX_LENGTH * 3; i++) {
+		struct em8051_decoded *entry = &aCPU->mDecodeCache[(aAddress - BLOCK_MAX_LENGTH * 3 + i) & (aCPU->mCodeMemMaxIdx)];
+		entry->flags &= ~DECODED_BLOCK;
+		if (i >= BLOCK_MAX_LENGTH * 3 - 2)
+			entry->op = NULL;
+	}
+}
+
 void disasm_setptrs(struct em8051 *aCPU);
 void op_setptrs(struct em8051 *aCPU);
 
@@ -478,6 +804,7 @@ void reset(struct em8051 *aCPU, bool aWipe) {
 
 	disasm_setptrs(aCPU);
 	op_setptrs(aCPU);
+	invalidate_code(aCPU, 0, aCPU->mCodeMemMaxIdx + 1);
 
 	// Clean internal variables
 	aCPU->mInterruptActive = 0;
@@ -485,4 +812,77 @@ void reset(struct em8051 *aCPU, bool aWipe) {
 	// Clean Serial
 	aCPU->serial_interrupt_trigger = 0;
 	aCPU->serial_out_remaining_bits = 0;
+
+	timer_schedule(aCPU);
+	update_interrupts(aCPU);
+}
+
+int em8051_alloc_instance(struct em8051 *aCPU, uint8_t aEngine) {
+	memset(aCPU, 0, sizeof(*aCPU));
+	aCPU->mCodeMemMaxIdx = 65536 - 1;
+	aCPU->mCodeMem = calloc(aCPU->mCodeMemMaxIdx + 1, sizeof(unsigned char));
+	aCPU->mExtDataMaxIdx = 65536 - 1;
+	aCPU->mExtData = calloc(aCPU->mExtDataMaxIdx + 1, sizeof(unsigned char));
+	aCPU->mUpperData = calloc(128, sizeof(unsigned char));
+	aCPU->mDecodeCache = calloc(aCPU->mCodeMemMaxIdx + 1, sizeof(struct em8051_decoded));
+	if (!aCPU->mCodeMem || !aCPU->mExtData || !aCPU->mUpperData || !aCPU->mDecodeCache) {
+		em8051_free_instance(aCPU);
+		return -1;
+	}
+	aCPU->mEngine = aEngine;
+	reset(aCPU, 1);
+	return 0;
+}
+
+void em8051_free_instance(struct em8051 *aCPU) {
+	jit_free(aCPU);
+	free(aCPU->mDecodeCache);
+	free(aCPU->mUpperData);
+	free(aCPU->mExtData);
+	free(aCPU->mCodeMem);
+	aCPU->mDecodeCache = NULL;
+	aCPU->mUpperData = NULL;
+	aCPU->mExtData = NULL;
+	aCPU->mCodeMem = NULL;
+}
+
+static const char *const engine_names[] = { "table", "switch", "threaded", "block", "jit" };
+
+const char *engine_name(int aEngine) {
+	if (aEngine < 0 || aEngine >= ENGINE_COUNT)
+		return NULL;
+	return engine_names[aEngine];
+}
+
+int engine_by_name(const char *aName) {
+	int i;
+
+	for (i = 0; i < ENGINE_COUNT; i++)
+		if (strcmp(engine_names[i], aName) == 0)
+			return i;
+	return -1;
+}
+
+const char *exception_name(int aCode) {
+	switch (aCode) {
+	case EXCEPTION_STACK:
+		return "SP exception: stack address > 127 with no upper memory, or SP roll over";
+	case EXCEPTION_ACC_TO_A:
+		return "Invalid operation: acc-to-a move operation";
+	case EXCEPTION_IRET_PSW_MISMATCH:
+		return "PSW not preserved over interrupt call";
+	case EXCEPTION_IRET_SP_MISMATCH:
+		return "SP not preserved over interrupt call";
+	case EXCEPTION_IRET_ACC_MISMATCH:
+		return "ACC not preserved over interrupt call";
+	case EXCEPTION_ILLEGAL_OPCODE:
+		return "Invalid opcode: 0xA5 encountered";
+	case EXCEPTION_PARITY_MISMATCH:
+		return "Lazy parity differs from eager parity";
+	case EXCEPTION_WILD_JUMP:
+		return "Jump past the end of the code";
+	case EXCEPTION_STACK_OVERFLOW:
+		return "Stack overflow";
+	}
+	return "Unknown exception";
 }
@@ -0,0 +1,544 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * coverage.c
+ * Code coverage export
+ *
+ * While mCoverage is set, tick() marks every instruction it runs and the
+ * conditional branch handlers mark the way they went, one byte per code
+ * address. Here the marks are mapped back to source lines and written out.
+ *
+ * A line covers the instructions from its address up to the next address
+ * with a line, or up to an unconditional jump or return, whichever comes
+ * first, so that data after the code isn't taken for instructions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "emu8051.h"
+
+// longest listing or debug info line read; the rest of a longer one is skipped
+#define LINE_MAX_LENGTH 1024
+
+struct source_line {
+	uint16_t mAddress;
+	unsigned int mFile;
+	unsigned int mLine;
+};
+
+struct em8051_lines {
+	char **mFiles;
+	unsigned int mFileCount;
+	struct source_line *mLines;
+	unsigned int mCount;
+	unsigned int mSize;
+};
+
+// An instruction in the report
+struct coverage_item {
+	unsigned int mFile;
+	unsigned int mLine;
+	uint16_t mAddress;
+	uint8_t mBits; // see COVERAGE_BITS
+	bool mBranch;
+};
+
+struct coverage_counts {
+	unsigned int mLines;
+	unsigned int mLinesHit;
+	unsigned int mBranches;
+	unsigned int mBranchesHit;
+};
+
+static bool conditional(uint8_t aOpcode) {
+	switch (aOpcode) {
+	case 0x10: // jbc
+	case 0x20: // jb
+	case 0x30: // jnb
+	case 0x40: // jc
+	case 0x50: // jnc
+	case 0x60: // jz
+	case 0x70: // jnz
+	case 0xd5: // djnz mem
+		return true;
+	}
+	return (aOpcode >= 0xb4 && aOpcode <= 0xbf) || // cjne
+		(aOpcode & 0xf8) == 0xd8; // djnz rx
+}
+
+static bool ends_flow(uint8_t aOpcode) {
+	return (aOpcode & 0x1f) == 0x01 || // ajmp
+		aOpcode == 0x02 || // ljmp
+		aOpcode == 0x80 || // sjmp
+		aOpcode == 0x73 || // jmp @a+dptr
+		aOpcode == 0x22 || // ret
+		aOpcode == 0x32; // reti
+}
+
+static bool is_hex(const char *aToken, unsigned int aMin, unsigned int aMax) {
+	unsigned int length = strlen(aToken), i;
+
+	if (length < aMin || length > aMax)
+		return false;
+	for (i = 0; i < length; i++)
+		if (!isxdigit((unsigned char)aToken[i]))
+			return false;
+	return true;
+}
+
+// 0x1234, 1234h or decimal; -1 if not a code address
+static long parse_address(const char *aToken) {
+	char *end;
+	unsigned long value = strtoul(aToken, &end, 0);
+
+	if ((*end == 'h' || *end == 'H') && !end[1]) {
+		value = strtoul(aToken, &end, 16);
+		end++;
+	}
+	if (end == aToken || *end || value > 0xffff)
+		return -1;
+	return value;
+}
+
+static int add_file(struct em8051_lines *aLines, const char *aName) {
+	char **files = realloc(aLines->mFiles, (aLines->mFileCount + 1) * sizeof(char *));
+
+	if (!files)
+		return -1;
+	aLines->mFiles = files;
+	files[aLines->mFileCount] = strdup(aName);
+	if (!files[aLines->mFileCount])
+		return -1;
+	return aLines->mFileCount++;
+}
+
+static int add_line(struct em8051_lines *aLines, int aFile, unsigned int aLine, long aAddress) {
+	if (aFile < 0 || aAddress < 0)
+		return 0;
+	if (aLines->mCount == aLines->mSize) {
+		unsigned int size = aLines->mSize ? aLines->mSize * 2 : 1024;
+		struct source_line *lines = realloc(aLines->mLines, size * sizeof(struct source_line));
+		if (!lines)
+			return -1;
+		aLines->mLines = lines;
+		aLines->mSize = size;
+	}
+	aLines->mLines[aLines->mCount].mAddress = aAddress;
+	aLines->mLines[aLines->mCount].mFile = aFile;
+	aLines->mLines[aLines->mCount++].mLine = aLine;
+	return 0;
+}
+
+static int compare_lines(const void *aA, const void *aB) {
+	const struct source_line *a = aA, *b = aB;
+
+	if (a->mAddress != b->mAddress)
+		return a->mAddress - b->mAddress;
+	if (a->mFile != b->mFile)
+		return a->mFile < b->mFile ? -1 : 1;
+	return a->mLine < b->mLine ? -1 : a->mLine > b->mLine;
+}
+
+struct em8051_lines *lines_load(const char *aFilename) {
+	struct em8051_lines *lines;
+	char buffer[LINE_MAX_LENGTH];
+	int file = -1, listing = -1;
+	unsigned int number = 0;
+	int result = 0;
+	FILE *f;
+
+	f = fopen(aFilename, "r");
+	if (!f)
+		return NULL;
+	lines = calloc(1, sizeof(struct em8051_lines));
+	if (!lines) {
+		fclose(f);
+		return NULL;
+	}
+
+	while (result == 0 && fgets(buffer, sizeof(buffer), f)) {
+		char *token[3] = { NULL, NULL, NULL };
+		unsigned int count = 0;
+		char *p;
+
+		number++;
+		// skip the rest of an overlong line
+		if (!strchr(buffer, '\n') && !feof(f)) {
+			int c;
+			while ((c = fgetc(f)) != EOF && c != '\n')
+				;
+		}
+		for (p = strtok(buffer, " \t\r\n"); p && count < 3; p = strtok(NULL, " \t\r\n"))
+			token[count++] = p;
+		if (count < 2)
+			continue;
+
+		// NoICE: FILE name, then LINE number address
+		if (strcmp(token[0], "FILE") == 0) {
+			file = add_file(lines, token[1]);
+			result = file < 0 ? -1 : 0;
+			continue;
+		}
+		if (strcmp(token[0], "LINE") == 0) {
+			if (count == 3)
+				result = add_line(lines, file, atoi(token[1]), parse_address(token[2]));
+			continue;
+		}
+
+		// listing: an optional "line:", the address and the code bytes
+		if (count == 3 && token[0][strlen(token[0]) - 1] == ':') {
+			token[0] = token[1];
+			token[1] = token[2];
+		}
+		if (is_hex(token[0], 4, 6) && is_hex(token[1], 2, 8) && strlen(token[1]) % 2 == 0) {
+			if (listing < 0)
+				listing = add_file(lines, aFilename);
+			result = listing < 0 ? -1 : add_line(lines, listing, number, strtol(token[0], NULL, 16) & 0xffff);
+		}
+	}
+	fclose(f);
+
+	if (result < 0) {
+		lines_free(lines);
+		return NULL;
+	}
+	lines_sort(lines);
+	return lines;
+}
+
+void lines_free(struct em8051_lines *aLines) {
+	unsigned int i;
+
+	if (!aLines)
+		return;
+	for (i = 0; i < aLines->mFileCount; i++)
+		free(aLines->mFiles[i]);
+	free(aLines->mFiles);
+	free(aLines->mLines);
+	free(aLines);
+}
+
+struct em8051_lines *lines_new(void) {
+	return calloc(1, sizeof(struct em8051_lines));
+}
+
+int lines_add(struct em8051_lines *aLines, const char *aFile, unsigned int aLine, uint16_t aAddress) {
+	int file;
+
+	// the lines of a file mostly come together, so look from the last one
+	for (file = (int)aLines->mFileCount - 1; file >= 0; file--)
+		if (strcmp(aLines->mFiles[file], aFile) == 0)
+			break;
+	if (file < 0 && (file = add_file(aLines, aFile)) < 0)
+		return -1;
+	return add_line(aLines, file, aLine, aAddress);
+}
+
+void lines_sort(struct em8051_lines *aLines) {
+	qsort(aLines->mLines, aLines->mCount, sizeof(struct source_line), compare_lines);
+}
+
+bool lines_find(struct em8051_lines *aLines, uint16_t aAddress, const char **aFile, unsigned int *aLine) {
+	unsigned int low = 0, high = aLines->mCount;
+
+	// the first line at the highest address not above aAddress
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		if (aLines->mLines[middle].mAddress <= aAddress)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (!low)
+		return false;
+	for (low--; low && aLines->mLines[low - 1].mAddress == aLines->mLines[low].mAddress; low--)
+		;
+	*aFile = aLines->mFiles[aLines->mLines[low].mFile];
+	*aLine = aLines->mLines[low].mLine;
+	return true;
+}
+
+static int compare_items(const void *aA, const void *aB) {
+	const struct coverage_item *a = aA, *b = aB;
+
+	if (a->mFile != b->mFile)
+		return a->mFile < b->mFile ? -1 : 1;
+	if (a->mLine != b->mLine)
+		return a->mLine < b->mLine ? -1 : 1;
+	return a->mAddress - b->mAddress;
+}
+
+static bool add_item(struct coverage_item **aItems, unsigned int *aCount, unsigned int *aSize,
+	struct em8051 *aCPU, unsigned int aFile, unsigned int aLine, uint16_t aAddress) {
+	struct coverage_item *item;
+
+	if (*aCount == *aSize) {
+		unsigned int size = *aSize ? *aSize * 2 : 1024;
+		struct coverage_item *items = realloc(*aItems, size * sizeof(struct coverage_item));
+		if (!items)
+			return false;
+		*aItems = items;
+		*aSize = size;
+	}
+	item = &(*aItems)[(*aCount)++];
+	item->mFile = aFile;
+	item->mLine = aLine;
+	item->mAddress = aAddress;
+	item->mBits = aCPU->mCoverage[aAddress];
+	item->mBranch = conditional(aCPU->mCodeMem[aAddress]);
+	return true;
+}
+
+// The instructions of every line, sorted by file and line. Returns negative
+// if out of memory.
+static int get_items(struct em8051 *aCPU, struct em8051_lines *aLines, struct coverage_item **aItems, unsigned int *aCount) {
+	unsigned int i, j, size = 0;
+	bool ok = true;
+
+	*aItems = NULL;
+	*aCount = 0;
+	if (!aLines) {
+		for (i = 0; ok && i <= aCPU->mCodeMemMaxIdx; i++)
+			if (aCPU->mCoverage[i] & COVERAGE_RUN)
+				ok = add_item(aItems, aCount, &size, aCPU, 0, i + 1, i);
+	} else {
+		for (i = 0; ok && i < aLines->mCount; i++) {
+			unsigned long address = aLines->mLines[i].mAddress, end;
+			if (address > aCPU->mCodeMemMaxIdx)
+				continue;
+			for (j = i + 1; j < aLines->mCount && aLines->mLines[j].mAddress == address; j++)
+				;
+			end = j < aLines->mCount ? aLines->mLines[j].mAddress : aCPU->mCodeMemMaxIdx + 1UL;
+			while (ok && address < end) {
+				uint8_t opcode = aCPU->mCodeMem[address];
+				ok = add_item(aItems, aCount, &size, aCPU, aLines->mLines[i].mFile, aLines->mLines[i].mLine, address);
+				if (ends_flow(opcode))
+					break;
+				address += op_lengths[opcode];
+			}
+		}
+	}
+	if (!ok) {
+		free(*aItems);
+		return -1;
+	}
+	qsort(*aItems, *aCount, sizeof(struct coverage_item), compare_items);
+	return 0;
+}
+
+static const char *file_name(struct em8051_lines *aLines, unsigned int aFile) {
+	return aLines ? aLines->mFiles[aFile] : "code";
+}
+
+// Index of the first item past the line, or the file, of aItems[aFirst]
+static unsigned int line_end(struct coverage_item *aItems, unsigned int aCount, unsigned int aFirst) {
+	unsigned int i = aFirst;
+
+	while (i < aCount && aItems[i].mFile == aItems[aFirst].mFile && aItems[i].mLine == aItems[aFirst].mLine)
+		i++;
+	return i;
+}
+
+static unsigned int file_end(struct coverage_item *aItems, unsigned int aCount, unsigned int aFirst) {
+	unsigned int i = aFirst;
+
+	while (i < aCount && aItems[i].mFile == aItems[aFirst].mFile)
+		i++;
+	return i;
+}
+
+static bool line_hit(struct coverage_item *aItems, unsigned int aFirst, unsigned int aEnd) {
+	unsigned int i;
+
+	for (i = aFirst; i < aEnd; i++)
+		if (aItems[i].mBits & COVERAGE_RUN)
+			return true;
+	return false;
+}
+
+// Adds the lines and branch directions of aItems[aFirst..aEnd)
+static void count_items(struct coverage_counts *aCounts, struct coverage_item *aItems, unsigned int aFirst, unsigned int aEnd) {
+	unsigned int i, next;
+
+	for (i = aFirst; i < aEnd; i = next) {
+		next = line_end(aItems, aEnd, i);
+		aCounts->mLines++;
+		aCounts->mLinesHit += line_hit(aItems, i, next);
+	}
+	for (i = aFirst; i < aEnd; i++) {
+		if (!aItems[i].mBranch)
+			continue;
+		aCounts->mBranches += 2;
+		aCounts->mBranchesHit += !!(aItems[i].mBits & COVERAGE_TAKEN) + !!(aItems[i].mBits & COVERAGE_NOT_TAKEN);
+	}
+}
+
+static void write_lcov(FILE *aFile, struct em8051_lines *aLines, const char *aTest,
+	struct coverage_item *aItems, unsigned int aCount) {
+	unsigned int file, i, j, next;
+
+	for (file = 0; file < aCount; file = file_end(aItems, aCount, file)) {
+		struct coverage_counts counts = { 0, 0, 0, 0 };
+		unsigned int end = file_end(aItems, aCount, file);
+
+		fprintf(aFile, "TN:%s\nSF:%s\n", aTest, file_name(aLines, aItems[file].mFile));
+		for (i = file; i < end; i = next) {
+			next = line_end(aItems, end, i);
+			fprintf(aFile, "DA:%u,%d\n", aItems[i].mLine, line_hit(aItems, i, next));
+			// a block per branch instruction, taken first
+			for (j = i; j < next; j++) {
+				uint8_t bits = aItems[j].mBits;
+				if (!aItems[j].mBranch)
+					continue;
+				if (bits & COVERAGE_RUN)
+					fprintf(aFile, "BRDA:%u,%u,0,%d\nBRDA:%u,%u,1,%d\n",
+						aItems[j].mLine, aItems[j].mAddress, !!(bits & COVERAGE_TAKEN),
+						aItems[j].mLine, aItems[j].mAddress, !!(bits & COVERAGE_NOT_TAKEN));
+				else
+					fprintf(aFile, "BRDA:%u,%u,0,-\nBRDA:%u,%u,1,-\n",
+						aItems[j].mLine, aItems[j].mAddress, aItems[j].mLine, aItems[j].mAddress);
+			}
+		}
+		count_items(&counts, aItems, file, end);
+		fprintf(aFile, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n",
+			counts.mBranches, counts.mBranchesHit, counts.mLines, counts.mLinesHit);
+	}
+}
+
+int coverage_lcov(struct em8051 *aCPU, struct em8051_lines *aLines, const char *aTest, const char *aFilename) {
+	struct coverage_item *items;
+	unsigned int count;
+	int result;
+	FILE *f;
+
+	if (get_items(aCPU, aLines, &items, &count) < 0)
+		return -1;
+	f = fopen(aFilename, "w");
+	if (!f) {
+		free(items);
+		return -1;
+	}
+	write_lcov(f, aLines, aTest ? aTest : "", items, count);
+	free(items);
+	result = ferror(f) ? -1 : 0;
+	if (fclose(f))
+		result = -1;
+	return result;
+}
+
+static double rate(unsigned int aHit, unsigned int aCount) {
+	return aCount ? (double)aHit / aCount : 1.0;
+}
+
+static void write_escaped(FILE *aFile, const char *aText) {
+	for (; *aText; aText++) {
+		switch (*aText) {
+		case '&':
+			fputs("&amp;", aFile);
+			break;
+		case '<':
+			fputs("&lt;", aFile);
+			break;
+		case '>':
+			fputs("&gt;", aFile);
+			break;
+		case '"':
+			fputs("&quot;", aFile);
+			break;
+		default:
+			fputc(*aText, aFile);
+		}
+	}
+}
+
+static void write_cobertura(FILE *aFile, struct em8051_lines *aLines, struct coverage_item *aItems, unsigned int aCount) {
+	struct coverage_counts total = { 0, 0, 0, 0 };
+	unsigned int file, i, next;
+
+	count_items(&total, aItems, 0, aCount);
+	fprintf(aFile, "<?xml version=\"1.0\" ?>\n"
+		"<!DOCTYPE coverage SYSTEM \"http://cobertura.sourceforge.net/xml/coverage-04.dtd\">\n"
+		"<coverage line-rate=\"%.4f\" branch-rate=\"%.4f\" lines-covered=\"%u\" lines-valid=\"%u\" "
+		"branches-covered=\"%u\" branches-valid=\"%u\" complexity=\"0\" version=\"0\" timestamp=\"%lld\">\n"
+		"\t<sources>\n\t\t<source>.</source>\n\t</sources>\n"
+		"\t<packages>\n"
+		"\t\t<package name=\"firmware\" line-rate=\"%.4f\" branch-rate=\"%.4f\" complexity=\"0\">\n"
+		"\t\t\t<classes>\n",
+		rate(total.mLinesHit, total.mLines), rate(total.mBranchesHit, total.mBranches),
+		total.mLinesHit, total.mLines, total.mBranchesHit, total.mBranches, (long long)time(NULL) * 1000,
+		rate(total.mLinesHit, total.mLines), rate(total.mBranchesHit, total.mBranches));
+
+	for (file = 0; file < aCount; file = file_end(aItems, aCount, file)) {
+		struct coverage_counts counts = { 0, 0, 0, 0 };
+		unsigned int end = file_end(aItems, aCount, file);
+		const char *name = file_name(aLines, aItems[file].mFile);
+
+		count_items(&counts, aItems, file, end);
+		fputs("\t\t\t\t<class name=\"", aFile);
+		write_escaped(aFile, name);
+		fputs("\" filename=\"", aFile);
+		write_escaped(aFile, name);
+		fprintf(aFile, "\" line-rate=\"%.4f\" branch-rate=\"%.4f\" complexity=\"0\">\n"
+			"\t\t\t\t\t<methods/>\n\t\t\t\t\t<lines>\n",
+			rate(counts.mLinesHit, counts.mLines), rate(counts.mBranchesHit, counts.mBranches));
+		for (i = file; i < end; i = next) {
+			struct coverage_counts line = { 0, 0, 0, 0 };
+			next = line_end(aItems, end, i);
+			count_items(&line, aItems, i, next);
+			fprintf(aFile, "\t\t\t\t\t\t<line number=\"%u\" hits=\"%u\" branch=\"%s\"",
+				aItems[i].mLine, line.mLinesHit, line.mBranches ? "true" : "false");
+			if (line.mBranches)
+				fprintf(aFile, " condition-coverage=\"%u%% (%u/%u)\"",
+					line.mBranchesHit * 100 / line.mBranches, line.mBranchesHit, line.mBranches);
+			fputs("/>\n", aFile);
+		}
+		fputs("\t\t\t\t\t</lines>\n\t\t\t\t</class>\n", aFile);
+	}
+
+	fputs("\t\t\t</classes>\n\t\t</package>\n\t</packages>\n</coverage>\n", aFile);
+}
+
+int coverage_cobertura(struct em8051 *aCPU, struct em8051_lines *aLines, const char *aFilename) {
+	struct coverage_item *items;
+	unsigned int count;
+	int result;
+	FILE *f;
+
+	if (get_items(aCPU, aLines, &items, &count) < 0)
+		return -1;
+	f = fopen(aFilename, "w");
+	if (!f) {
+		free(items);
+		return -1;
+	}
+	write_cobertura(f, aLines, items, count);
+	free(items);
+	result = ferror(f) ? -1 : 0;
+	if (fclose(f))
+		result = -1;
+	return result;
+}
@@ -45,10 +45,9 @@
 #include "emu8051.h"
 #include "emulator.h"
 
-unsigned char history[HISTORY_LINES * (128 + 64 + sizeof(int))];
+// every instruction run, for the main view
+struct em8051_history *history = NULL;
 
-// current line in the history cyclic buffers
-int historyline = 0;
 // last known columns and rows; for screen resize detection
 int oldcols, oldrows;
 // are we in single-step or run mode
@@ -57,7 +56,7 @@ int runmode = 0;
 int speed = 6;
 
 // instruction count; needed to replay history correctly
-unsigned int icount = 0;
+unsigned long long icount = 0;
 
 // current clock count
 unsigned int clocks = 0;
@@ -68,7 +67,14 @@ int view = MAIN_VIEW;
 // old port out values
 int pout[4] = { 0 };
 
-int breakpoint = -1;
+struct em8051_breakpoints breakpoints;
+struct em8051_watchpoints watchpoints;
+
+// taken with 's', restored with 'x'
+struct em8051_snapshot *snapshot = NULL;
+
+// history for stepping backwards
+struct em8051_timeline timeline;
 
 // returns time in 1ms units
 int getTick() {
@@ -206,6 +212,10 @@ void refreshview(struct em8051 *aCPU) {
 	change_view(aCPU, view);
 }
 
+void emu_edited(struct em8051 *aCPU) {
+	timeline_cut(&timeline);
+}
+
 void change_view(struct em8051 *aCPU, int changeto) {
 	switch (view) {
 	case MAIN_VIEW:
@@ -238,19 +248,145 @@ void change_view(struct em8051 *aCPU, int changeto) {
 	}
 }
 
+// front-end state kept in the snapshot: clocks, icount, port values and the logic board
+#define FRONTEND_COUNTERS (sizeof(clocks) + sizeof(icount) + sizeof(pout[0]) * 4)
+
+static int save_frontend_state(struct em8051 *aCPU, unsigned char *aBuffer) {
+	if (aBuffer) {
+		memcpy(aBuffer, &clocks, sizeof(clocks));
+		memcpy(aBuffer + sizeof(clocks), &icount, sizeof(icount));
+		memcpy(aBuffer + sizeof(clocks) + sizeof(icount), pout, sizeof(pout[0]) * 4);
+		logicboard_save_state(aBuffer + FRONTEND_COUNTERS);
+	}
+	return FRONTEND_COUNTERS + logicboard_save_state(NULL);
+}
+
+static void load_frontend_state(struct em8051 *aCPU, const unsigned char *aBuffer) {
+	memcpy(&clocks, aBuffer, sizeof(clocks));
+	memcpy(&icount, aBuffer + sizeof(clocks), sizeof(icount));
+	memcpy(pout, aBuffer + sizeof(clocks) + sizeof(icount), sizeof(pout[0]) * 4);
+	logicboard_load_state(aBuffer + FRONTEND_COUNTERS);
+}
+
+void emu_save_snapshot(struct em8051 *aCPU) {
+	struct em8051_snapshot *taken;
+	int size = save_frontend_state(aCPU, NULL);
+	unsigned char *state = malloc(size);
+
+	if (!state) {
+		emu_popup(aCPU, "Snapshot", "Out of memory.");
+		return;
+	}
+	save_frontend_state(aCPU, state);
+	// share the unchanged pages with the previous snapshot
+	taken = snapshot_take(aCPU, snapshot, state, size);
+	free(state);
+	if (!taken) {
+		emu_popup(aCPU, "Snapshot", "Out of memory.");
+		return;
+	}
+	snapshot_free(snapshot);
+	snapshot = taken;
+	emu_popup(aCPU, "Snapshot", "Snapshot saved.");
+}
+
+void emu_restore_snapshot(struct em8051 *aCPU) {
+	unsigned char *state;
+
+	if (!snapshot) {
+		emu_popup(aCPU, "Snapshot", "No snapshot saved yet.");
+		return;
+	}
+	state = malloc(save_frontend_state(aCPU, NULL));
+	if (!state) {
+		emu_popup(aCPU, "Snapshot", "Out of memory.");
+		return;
+	}
+	snapshot_restore(aCPU, snapshot, state);
+	load_frontend_state(aCPU, state);
+	free(state);
+	timeline_cut(&timeline);
+	history_truncate(history, icount);
+}
+
+// the ticks timeline_seek() runs again, as in the run loop of main()
+static void replay_tick(struct em8051 *aCPU, bool aExecuted) {
+	clocks += 12;
+	if (aExecuted)
+		icount++;
+	logicboard_tick(aCPU);
+}
+
+static void seek_error(struct em8051 *aCPU) {
+	emu_popup(aCPU, "Step back", "Replay differs, history cut.");
+}
+
+static void seek(struct em8051 *aCPU, unsigned long long aPosition) {
+	// replaying isn't running the program again: leave the watchpoints out
+	aCPU->mWatch = NULL;
+	if (timeline_seek(&timeline, aPosition) < 0)
+		seek_error(aCPU);
+	aCPU->mWatch = &watchpoints;
+}
+
+void emu_step_back(struct em8051 *aCPU) {
+	if (timeline.mPosition == timeline_oldest(&timeline)) {
+		emu_popup(aCPU, "Step back", "Start of history reached.");
+		return;
+	}
+	seek(aCPU, timeline.mPosition - 1);
+	history_truncate(history, icount);
+}
+
+// runs back to the last breakpoint passed, or to the start of the history
+void emu_run_back(struct em8051 *aCPU) {
+	long long position = -1;
+
+	if (breakpoints.mCount)
+		position = timeline_find_breakpoint(&timeline, &breakpoints);
+	if (position == -1)
+		position = timeline_oldest(&timeline);
+	seek(aCPU, position);
+	history_truncate(history, icount);
+}
+
+// 'k': clears the breakpoint at the address asked for, or sets one there
+// with the condition asked for
+void emu_toggle_breakpoint(struct em8051 *aCPU) {
+	char condition[48] = "";
+	int address = emu_readvalue(aCPU, "Set or Clear Breakpoint", aCPU->mPC, 4);
+
+	if (breakpoint_clear(&breakpoints, address)) {
+		emu_popup(aCPU, "Breakpoint", "Breakpoint cleared.");
+		return;
+	}
+	emu_readstring(aCPU, "Condition (empty for none)", condition);
+	if (breakpoint_set(&breakpoints, address, condition) < 0)
+		emu_popup(aCPU, "Breakpoint", "Bad condition, not set.");
+}
+
+// 'w': adds the watchpoint asked for
+void emu_add_watchpoint(struct em8051 *aCPU) {
+	char spec[48] = "";
+
+	emu_readstring(aCPU, "Watchpoint, e.g. xdata:1F00+2,w,=55", spec);
+	if (spec[0] && watch_parse(&watchpoints, spec) < 0)
+		emu_popup(aCPU, "Watchpoint", "Bad watchpoint, not set.");
+}
+
 int main(int parc, char **pars) {
 	int ch = 0;
 	struct em8051 emu;
 	int i;
 	int ticked = 1;
+	int recording = 1;
 
-	memset(&emu, 0, sizeof(emu));
-	emu.mCodeMemMaxIdx = 65536 - 1;
-	emu.mCodeMem = calloc(emu.mCodeMemMaxIdx + 1, sizeof(unsigned char));
-	emu.mExtDataMaxIdx = 65536 - 1;
-	emu.mExtData = calloc(emu.mExtDataMaxIdx + 1, sizeof(unsigned char));
-	emu.mUpperData = calloc(128, sizeof(unsigned char));
+	if (em8051_alloc_instance(&emu, ENGINE_TABLE) != 0) {
+		printf("Out of memory\n");
+		return EXIT_FAILURE;
+	}
 	emu.except = &emu_exception;
+	emu.mWatch = &watchpoints;
 	emu.xread = NULL;
 	emu.xwrite = NULL;
 
@@ -261,8 +397,6 @@ int main(int parc, char **pars) {
 	emu.sfrread[REG_P2] = emu_sfrread;
 	emu.sfrread[REG_P3] = emu_sfrread;
 
-	reset(&emu, 1);
-
 	if (parc > 1) {
 		for (i = 1; i < parc; i++) {
 			if (pars[i][0] == '-' || pars[i][0] == '/') {
@@ -298,6 +432,16 @@ int main(int parc, char **pars) {
 					opt_input_outputlow = 0;
 				} else if (strcmp("iolowrand", pars[i] + 1) == 0) {
 					opt_input_outputlow = 2;
+				} else if (strcmp("engine=table", pars[i] + 1) == 0) {
+					emu.mEngine = ENGINE_TABLE;
+				} else if (strcmp("engine=switch", pars[i] + 1) == 0) {
+					emu.mEngine = ENGINE_SWITCH;
+				} else if (strcmp("engine=threaded", pars[i] + 1) == 0 || strcmp("engine=block", pars[i] + 1) == 0 ||
+					strcmp("engine=jit", pars[i] + 1) == 0) {
+					// the front-end steps with tick(), which only the table and switch engines change
+					printf("The %s engine only runs in emu8051-run; this front-end steps one tick at a time\n",
+						pars[i] + 8);
+					return -1;
 				} else if (strncmp("clock=", pars[i] + 1, 6) == 0) {
 					opt_clock_select = 12;
 					opt_clock_hz = atoi(pars[i] + 7);
@@ -317,7 +461,8 @@ int main(int parc, char **pars) {
 					       "-noexc_invalid_op -noiop      Disable invalid opcode exception\n"
 					       "-iolowlow         If out pin is low, hi input from same pin is low\n"
 					       "-iolowrand        If out pin is low, hi input from same pin is random\n"
-					       "-clock=value      Set clock speed, in Hz\n");
+					       "-clock=value      Set clock speed, in Hz\n"
+					       "-engine=name      Execution engine: table (default) or switch\n");
 					return -1;
 				}
 			} else {
@@ -331,6 +476,17 @@ int main(int parc, char **pars) {
 		}
 	}
 
+	timeline.mInterval = 10000;
+	timeline.mMaxCheckpoints = 1000;
+	timeline.save = save_frontend_state;
+	timeline.load = load_frontend_state;
+	timeline.replay = replay_tick;
+	history = history_create(1, 0);
+	if (!history || timeline_start(&timeline, &emu) < 0) {
+		printf("Out of memory\n");
+		return -1;
+	}
+
 	//  Initialize ncurses
 
 	slk_init(1);
@@ -380,21 +536,41 @@ int main(int parc, char **pars) {
 			change_view(&emu, (view + 1) % 4);
 			break;
 		case 'k':
-			if (breakpoint != -1) {
-				breakpoint = -1;
-				emu_popup(&emu, "Breakpoint", "Breakpoint cleared.");
-			} else {
-				breakpoint = emu_readvalue(&emu, "Set Breakpoint", emu.mPC, 4);
-			}
+			emu_toggle_breakpoint(&emu);
+			break;
+		case 'K':
+			breakpoint_clear_all(&breakpoints);
+			emu_popup(&emu, "Breakpoint", "All breakpoints cleared.");
+			break;
+		case 'w':
+			emu_add_watchpoint(&emu);
+			break;
+		case 'W':
+			watch_clear_all(&watchpoints);
+			emu_popup(&emu, "Watchpoint", "All watchpoints cleared.");
+			break;
+		case 's':
+			emu_save_snapshot(&emu);
+			break;
+		case 'x':
+			emu_restore_snapshot(&emu);
 			break;
 		case 'g':
 			emu.mPC = emu_readvalue(&emu, "Set Program Counter", emu.mPC, 4);
+			timeline_cut(&timeline);
+			break;
+		case ',':
+			emu_step_back(&emu);
+			break;
+		case '<':
+			emu_run_back(&emu);
 			break;
 		case 'h':
 			emu_help(&emu);
 			break;
 		case 'l':
 			emu_load(&emu);
+			timeline_cut(&timeline);
 			break;
 		case ' ':
 			runmode = 0;
@@ -432,14 +608,17 @@ int main(int parc, char **pars) {
 				clocks = 0;
 				ticked = 1;
 			}
+			timeline_cut(&timeline);
 			break;
 		case 'z':
 			// Equivalent of "R)eset (init regs, set PC to zero)"
 			reset(&emu, 0);
+			timeline_cut(&timeline);
 			break;
 		case 'Z':
 			// Equivalent of "W)ipe (init regs, set PC to zero, clear memory)"
 			reset(&emu, 1);
+			timeline_cut(&timeline);
 			break;
 		case KEY_END:
 			clocks = 0;
@@ -497,25 +676,35 @@ int main(int parc, char **pars) {
 					logicboard_tick(&emu);
 				}
 
-				if (emu.mPC == breakpoint)
+				if (ticked && breakpoint_check(&breakpoints, &emu))
 					emu_exception(&emu, -1);
+				if (watchpoints.mTriggered) {
+					char description[48];
+					watchpoints.mTriggered = false;
+					watch_describe(&watchpoints.mHit, description);
+					emu_popup(&emu, "Watchpoint", description);
+				}
 
 				if (ticked) {
 					icount++;
-
-					historyline = (historyline + 1) % HISTORY_LINES;
-
-					memcpy(history + (historyline * (128 + 64 + sizeof(int))), emu.mSFR, 128);
-					memcpy(history + (historyline * (128 + 64 + sizeof(int))) + 128, emu.mLowerData, 64);
-					memcpy(history + (historyline * (128 + 64 + sizeof(int))) + 128 + 64, &old_pc, sizeof(int));
+					timeline_record(&timeline);
+					// a gap would shift every later entry, so stop for good
+					if (recording && history_record(history, &emu, old_pc) < 0) {
+						recording = 0;
+						emu_popup(&emu, "History", "Out of memory, history stops.");
+					}
 				}
 			} while (targettime > getTick() && targetclocks > 0);
+			// tick() leaves the events of the frame buffered
+			if (INSTRUMENTED(&emu))
+				instrument_flush();
 
 			while (targettime > getTick()) {
 				emu_sleep(1);
 			}
 		}
 
+		update_parity(&emu);
 		switch (view) {
 		case MAIN_VIEW:
 			mainview_update(&emu);
@@ -533,58 +722,10 @@ int main(int parc, char **pars) {
 	} while ((ch = getch()) != 'Q');
 
 	endwin();
+	snapshot_free(snapshot);
+	timeline_stop(&timeline);
+	history_free(history);
+	em8051_free_instance(&emu);
 
 	return EXIT_SUCCESS;
 }
-
-int readbyte(FILE *f) {
-	char data[3];
-	data[0] = fgetc(f);
-	data[1] = fgetc(f);
-	data[2] = 0;
-	return strtol(data, NULL, 16);
-}
-
-int load_obj(struct em8051 *aCPU, char *aFilename) {
-	FILE *f;
-	if (aFilename == 0 || aFilename[0] == 0)
-		return -1;
-	f = fopen(aFilename, "r");
-	if (!f)
-		return -1;
-	if (fgetc(f) != ':') {
-		fclose(f);
-		return -2; // unsupported file format
-	}
-	while (!feof(f)) {
-		int recordlength;
-		int address;
-		int recordtype;
-		int checksum;
-		int i;
-		recordlength = readbyte(f);
-		address = readbyte(f);
-		address <<= 8;
-		address |= readbyte(f);
-		recordtype = readbyte(f);
-		if (recordtype == 1)
-			return 0; // we're done
-		if (recordtype != 0)
-			return -3; // unsupported record type
-		checksum = recordtype + recordlength + (address & 0xff) + (address >> 8); // final checksum = 1 + not(checksum)
-		for (i = 0; i < recordlength; i++) {
-			int data = readbyte(f);
-			checksum += data;
-			aCPU->mCodeMem[address + i] = data;
-		}
-		i = readbyte(f);
-		checksum &= 0xff;
-		checksum = 256 - checksum;
-		if (i != (checksum & 0xff))
-			return -4; // checksum failure
-		while (fgetc(f) != ':' && !feof(f)) {
-		} // skip newline
-	}
-	fclose(f);
-	return -5;
-}
@@ -59,6 +59,32 @@ typedef void (*em8051xwrite)(struct em8051 *aCPU, uint16_t aAddress, uint8_t aVa
 // (can be used to control some peripherals)
 typedef uint8_t (*em8051xread)(struct em8051 *aCPU, uint16_t aAddress);
 
+// Instrumentation event, see instrument_flush()
+struct em8051_event {
+		uint8_t mType; // see INSTRUMENT_EVENTS
+		uint8_t mValue; // fetch: opcode; read, write: the byte
+		uint16_t mPC; // address of the instruction, or the one interrupted
+		uint32_t mAddress; // see INSTRUMENT_EVENTS
+};
+
+// Callback: a batch of instrumentation events, oldest first
+typedef void (*em8051instrument)(struct em8051 *aCPU, const struct em8051_event *aEvents, unsigned int aCount);
+
+// Predecoded instruction, see mDecodeCache
+struct em8051_decoded {
+		em8051operation op; // opcode handler; NULL if the entry is not decoded
+		uint16_t address; // PC the entry was decoded for
+		uint8_t length; // instruction length in bytes
+		uint8_t operand1;
+		uint8_t operand2;
+		uint8_t flags; // control flow class, see DECODED_FLAGS
+		uint16_t target; // destination of direct jumps, calls and branches, else next PC
+		uint8_t block_length; // instructions in the basic block starting here, 0 if none (see ENGINE_BLOCK)
+		uint8_t block_ticks; // ticks from the first instruction of the block to its last one, inclusive
+		uint8_t block_hits; // times the block has been run, for ENGINE_JIT
+		em8051operation block_code; // the block compiled to native code, or NULL
+};
+
 struct em8051 {
 		unsigned char *mCodeMem; // 1k - 64k, must be power of 2
 		uint16_t mCodeMemMaxIdx;
@@ -76,9 +102,30 @@ struct em8051 {
 		em8051sfrwrite sfrwrite[128]; // callback array: SFR register written
 		em8051xread xread; // callback: external memory being read
 		em8051xwrite xwrite; // callback: external memory being written
+		uint8_t mEngine; // execution engine used by tick() and run(), see EM8051_ENGINE; may be changed at any time
+		struct em8051_decoded *mDecodeCache; // mCodeMemMaxIdx + 1 entries, zeroed, for ENGINE_BLOCK and ENGINE_JIT; leave to NULL if none
+		void *mJit; // native code buffer of ENGINE_JIT; NULL until needed, release with jit_free()
+		bool mStop; // set from a callback to make run() return after the current tick
+		void *mUserData; // free for the front-end, e.g. per-instance state for callbacks
+		struct em8051_timeline *mTimeline; // set while a timeline records, see timeline_start()
+		struct em8051_trace *mTrace; // set while tracing, see trace_open()
+		struct em8051_profile *mProfile; // set while profiling, see profile_start()
+		uint8_t *mCoverage; // mCodeMemMaxIdx + 1 zeroed bytes to collect coverage into, see coverage_lcov()
+		uint8_t *mEdges; // EDGE_MAP_SIZE bytes of hit counts per control transfer, for fuzzing; may be NULL
+		uint16_t mCodeEnd; // the code goes up to here; going further raises EXCEPTION_WILD_JUMP. 0 for no check
+		uint8_t mStackLimit; // SP going above this raises EXCEPTION_STACK_OVERFLOW; 0 for no check
+		struct em8051_watchpoints *mWatch; // data watchpoints to check, see watch_add(); may be NULL
+		struct em8051_breakpoints *mBreakpoints; // run() stops when PC gets to one, see breakpoint_set(); may be NULL
+		em8051instrument instrument; // callback: instrumentation events; INSTRUMENT builds only
+
+		// Everything below is internal CPU state, saved as is by snapshot_take()
 
 		// Internal values for interrupt services etc.
 		uint8_t mInterruptActive;
+		uint8_t mInterruptPending; // enabled interrupt requests, in IE bit order; see update_interrupts()
+		// Internal timer schedule, see timer_schedule()
+		unsigned int mTimerEvent; // ticks until the timers next do something else than count
+		uint8_t mTimerRun; // which counters count on every tick
 		// Stored register values for interrupts (exception checking)
 		uint8_t int_a[2];
 		uint8_t int_psw[2];
@@ -96,24 +143,697 @@ struct em8051 {
 // all memory to zero.
 void reset(struct em8051 *aCPU, bool aWipe);
 
+// Clear aCPU and give it 64k of code memory and external data, upper data and
+// a decode cache, then reset it with aEngine selected. Returns -1, with
+// nothing left allocated, if out of memory.
+int em8051_alloc_instance(struct em8051 *aCPU, uint8_t aEngine);
+
+// Free what em8051_alloc_instance() allocated, and the JIT code if any
+void em8051_free_instance(struct em8051 *aCPU);
+
 // run one emulator tick, or 12 hardware clock cycles.
 // returns "true" if a new operation was executed.
 bool tick(struct em8051 *aCPU);
 
+// run up to aTicks emulator ticks with the engine selected in mEngine.
+// Returns the number of ticks run, which is less if mStop got set. Clears
+// mStop on entry.
+unsigned int run(struct em8051 *aCPU, unsigned int aTicks);
+
+// bring the parity bit PSW.P up to date. The core only does that when code
+// reads PSW; call this before looking at PSW or the SFRs from outside.
+void update_parity(struct em8051 *aCPU);
+
+// tell the core that an SFR (aAddress 0x80..0xff) was changed from outside,
+// e.g. by an editor or a callback; code executed by the core doesn't need this.
+void sfr_update(struct em8051 *aCPU, uint8_t aAddress);
+
 // decode the next operation as character string.
 // buffer must be big enough (64 bytes is very safe).
 // Returns length of opcode.
 uint8_t decode(struct em8051 *aCPU, uint16_t aPosition, char *aBuffer);
 
-// Load an intel hex format object file. Returns negative for errors.
+// Decode the instruction at aAddress into the predecode cache, which must be present.
+// Returns the cache entry. An entry is valid if op is set and address matches the PC.
+struct em8051_decoded *predecode(struct em8051 *aCPU, uint16_t aAddress);
+
+// Drop predecoded instructions overlapping the given code memory range. Must be
+// called whenever code memory or op[] is modified outside the core, e.g. by an
+// xwrite callback or a memory editor. Writes done by the core itself are handled.
+void invalidate_code(struct em8051 *aCPU, uint16_t aAddress, unsigned int aLength);
+
+// What load_hex() loaded
+struct em8051_load_info {
+		unsigned int mLowest; // lowest and highest address written
+		unsigned int mHighest;
+		unsigned int mBytes; // data bytes written; 0 if none, and mLowest is meaningless
+		unsigned long mStart; // from a start address record (03 or 05) if mHasStart
+		bool mHasStart;
+		unsigned int mLine; // line of the record that failed to load, 0 if none
+};
+
+// Symbols and source lines of an image, see symbols_new()
+struct em8051_symbols;
+
+// Load an intel hex format object file into code memory, or external data with
+// aSpace LOAD_XDATA. Supports the data, end, extended segment and linear
+// address, and start address records. Returns negative for errors: -1 file
+// not found, -2 not intel hex, -3 unsupported record type, -4 checksum failure,
+// -5 no end record, -6 data outside the memory, -7 malformed record; whatever
+// came before the error stays loaded. aInfo may be NULL.
+int load_hex(struct em8051 *aCPU, const char *aFilename, int aSpace, struct em8051_load_info *aInfo);
+
+// Load a raw binary image to aBase in code memory, or external data with aSpace
+// LOAD_XDATA. Returns negative for errors, see load_hex().
+int load_bin(struct em8051 *aCPU, const char *aFilename, int aSpace, unsigned long aBase, struct em8051_load_info *aInfo);
+
+// Load an absolute OMF-51 object file, as linked by RL51, BL51 or LX51, into
+// code memory, and add its public and local symbols and line numbers to
+// aSymbols unless it's NULL. The lines are in a file named after the module.
+// With aCPU NULL only the symbols are read. Returns negative for errors, see
+// load_hex(); mLine is the record number, and -8 is a relocatable object file,
+// -9 out of memory.
+int load_omf(struct em8051 *aCPU, const char *aFilename, struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo);
+
+// Load the loadable segments of a 32 bit ELF executable into code memory at
+// their physical addresses, and add the function, object and untyped symbols
+// to aSymbols unless it's NULL; those in executable sections are code, others
+// external data. With aCPU NULL only the symbols are read. Returns negative
+// for errors, see load_omf(); mLine is the program header.
+int load_elf(struct em8051 *aCPU, const char *aFilename, struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo);
+
+// Load any of the above into code memory, by the file contents: intel hex,
+// ELF, OMF-51, or a raw binary at 0 if the name ends in .bin. A SDCC CDB file
+// only adds its symbols, see symbols_load_cdb(). Returns negative for errors,
+// -2 if the format isn't known.
+int load_image(struct em8051 *aCPU, const char *aFilename, struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo);
+
+// Load an object file into code memory, see load_image(). Returns negative for
+// errors.
 int load_obj(struct em8051 *aCPU, char *aFilename);
 
+// Message for a load_image() result
+const char *load_error(int aResult);
+
+// A symbol index: names by address, in TRACE_SPACE, and the source lines of
+// code addresses. Lookups are binary searches; adding sorts the index again
+// on the next lookup. Once sorted, by a load or a lookup, lookups may run
+// concurrently. Returns NULL if out of memory.
+struct em8051_symbols *symbols_new(void);
+
+void symbols_free(struct em8051_symbols *aSymbols);
+
+// Add a symbol at aAddress, TRACE_SPACE and address. Returns negative if out
+// of memory.
+int symbols_add(struct em8051_symbols *aSymbols, const char *aName, uint32_t aAddress);
+
+// Add a source line for a code address. Returns negative if out of memory.
+int symbols_add_line(struct em8051_symbols *aSymbols, const char *aFile, unsigned int aLine, uint16_t aAddress);
+
+// Read the symbols and C and assembler lines of a SDCC CDB debug info file.
+// Locals of functions are left out. Returns -1 if the file can't be read, -2
+// if it isn't CDB, -9 if out of memory.
+int symbols_load_cdb(struct em8051_symbols *aSymbols, const char *aFilename);
+
+// The symbol at or closest below aAddress in its space, with aOffset set to
+// the distance unless it's NULL; if several are at the same address, the first
+// by name. NULL if there is none in the space.
+const char *symbols_find(struct em8051_symbols *aSymbols, uint32_t aAddress, unsigned int *aOffset);
+
+// The source line at or closest below a code address. Returns false if none.
+bool symbols_line(struct em8051_symbols *aSymbols, uint16_t aAddress, const char **aFile, unsigned int *aLine);
+
+// The source lines, e.g. for coverage_lcov(); belong to aSymbols
+struct em8051_lines *symbols_lines(struct em8051_symbols *aSymbols);
+
+unsigned int symbols_count(struct em8051_symbols *aSymbols);
+
+// Saved emulator state, see snapshot_take()
+struct em8051_snapshot;
+
+// Save the registers, SFRs, internal, external and code memory, plus aExtraSize
+// bytes of front-end state from aExtra. Memory pages that are the same as in
+// aBase (may be NULL) are shared with it instead of copied. Returns NULL if
+// out of memory. Taking and freeing snapshots that share pages must not run
+// concurrently; restoring may.
+struct em8051_snapshot *snapshot_take(struct em8051 *aCPU, struct em8051_snapshot *aBase, const void *aExtra, unsigned int aExtraSize);
+
+// Put the state saved in aSnapshot back, and copy the front-end state into
+// aExtra unless it's NULL. The instance must have the same memory sizes as the
+// one saved; callbacks, the engine and mUserData are left alone. Returns
+// negative if the memory sizes differ.
+int snapshot_restore(struct em8051 *aCPU, struct em8051_snapshot *aSnapshot, void *aExtra);
+
+// Release a snapshot. Pages still used by other snapshots stay.
+void snapshot_free(struct em8051_snapshot *aSnapshot);
+
+// Reverse execution: a timeline records the instructions run with tick(), and
+// can go back to any of them by restoring the checkpoint before it and running
+// forward again. The values the sfrread and xread callbacks returned are logged,
+// and given back instead of calling them while running forward.
+struct em8051_timeline;
+
+// Callback: store the front-end state in aBuffer, unless NULL; returns its size
+typedef int (*em8051savestate)(struct em8051 *aCPU, unsigned char *aBuffer);
+
+// Callback: put the front-end state stored by em8051savestate back
+typedef void (*em8051loadstate)(struct em8051 *aCPU, const unsigned char *aBuffer);
+
+// Callback: a tick was run again by timeline_seek(); aExecuted as returned by tick()
+typedef void (*em8051replay)(struct em8051 *aCPU, bool aExecuted);
+
+struct timeline_segment;
+
+struct em8051_timeline {
+		unsigned int mInterval; // instructions between checkpoints
+		unsigned int mMaxCheckpoints; // the oldest ones are dropped past this; 0 for no limit
+		em8051savestate save; // callback: front-end state saved with each checkpoint; may be NULL
+		em8051loadstate load; // callback: front-end state restored by timeline_seek(); may be NULL
+		em8051replay replay; // callback: after each tick run by timeline_seek(); may be NULL
+		unsigned long long mPosition; // instructions recorded since timeline_start(); read only
+		// Internal
+		struct em8051 *mCPU;
+		struct timeline_segment *mSegments; // one per checkpoint, oldest first
+		unsigned int mSegmentCount;
+		unsigned int mSegmentSize;
+		unsigned int mCurrent; // segment holding mPosition
+		unsigned int mInput; // next input of the current segment
+		bool mReplaying;
+		em8051sfrread mSfrRead[128]; // the callbacks wrapped by the timeline
+		em8051xread mXRead;
+		em8051exception mExcept;
+};
+
+// Start recording from the current state, after the callbacks are set up.
+// Returns negative if out of memory.
+int timeline_start(struct em8051_timeline *aTimeline, struct em8051 *aCPU);
+
+// Stop recording, put the callbacks back and release the history
+void timeline_stop(struct em8051_timeline *aTimeline);
+
+// Call after each tick() that returned true. Going on from an earlier position
+// drops the history after it. Returns negative if out of memory.
+int timeline_record(struct em8051_timeline *aTimeline);
+
+// Call after changing the state outside the core, e.g. in an editor: starts a
+// new checkpoint here, and drops the history after it. Returns negative if out
+// of memory.
+int timeline_cut(struct em8051_timeline *aTimeline);
+
+// Go to aPosition, between timeline_oldest() and the last recorded position.
+// Exceptions aren't reported on the way. Returns negative if aPosition is out
+// of range, or if running forward went a different way than recorded, e.g.
+// because of a callback with side effects; the history after the point where
+// that happened is dropped.
+int timeline_seek(struct em8051_timeline *aTimeline, unsigned long long aPosition);
+
+// The oldest position timeline_seek() can go to
+unsigned long long timeline_oldest(struct em8051_timeline *aTimeline);
+
+// The last position before mPosition after which PC was aPC, or -1 if none is
+// recorded; for running backwards to a breakpoint
+long long timeline_find_pc(struct em8051_timeline *aTimeline, uint16_t aPC);
+
+// The same for any address with a breakpoint in aBreakpoints; conditions are
+// not evaluated
+struct em8051_breakpoints;
+long long timeline_find_breakpoint(struct em8051_timeline *aTimeline, struct em8051_breakpoints *aBreakpoints);
+
+// Execution history for display: the address of each instruction and the
+// internal memory and SFRs after it. Only the bytes that changed are stored,
+// in chunks that can be compressed once full.
+struct em8051_history;
+
+// One recorded instruction, see history_get()
+struct em8051_history_entry {
+		uint16_t mPC; // address of the instruction
+		unsigned char mLowerData[128]; // state after the instruction
+		unsigned char mSFR[128];
+		unsigned char mUpperData[128];
+};
+
+// Create an empty history. aCompress compresses the full chunks; aMaxChunks
+// limits the chunks kept by dropping the oldest ones, 0 for no limit.
+// Returns NULL if out of memory.
+struct em8051_history *history_create(bool aCompress, unsigned int aMaxChunks);
+
+// Release a history
+void history_free(struct em8051_history *aHistory);
+
+// Record the instruction at aPC, just run by tick(). Returns negative if out of memory.
+int history_record(struct em8051_history *aHistory, struct em8051 *aCPU, uint16_t aPC);
+
+// Number of instructions recorded, including the dropped ones
+unsigned long long history_count(struct em8051_history *aHistory);
+
+// Index of the oldest instruction still kept
+unsigned long long history_oldest(struct em8051_history *aHistory);
+
+// Fill in aEntry for the instruction at aIndex. Reading forward from the last
+// index read is fastest. Returns negative if aIndex is not kept.
+int history_get(struct em8051_history *aHistory, unsigned long long aIndex, struct em8051_history_entry *aEntry);
+
+// Forget the instructions from aCount on, e.g. after going back with
+// timeline_seek(). Returns negative if out of memory.
+int history_truncate(struct em8051_history *aHistory, unsigned long long aCount);
+
+// Cycle profile: instructions and machine cycles, the tick delay returned by
+// the opcode handler plus one, for every address run, and calls and
+// inclusive cycles for every call graph edge, from acall, lcall and
+// interrupt entries to the ret or reti back. An address belongs to the
+// function it was first run in. While profiling, run() goes through tick()
+// whatever the engine.
+struct em8051_profile;
+
+// Start profiling aCPU. Returns NULL if out of memory.
+struct em8051_profile *profile_start(struct em8051 *aCPU);
+
+// Name the functions and addresses in the reports after the code symbols in
+// aSymbols, NULL for none. The symbols must stay until the reports are written.
+void profile_symbols(struct em8051_profile *aProfile, struct em8051_symbols *aSymbols);
+
+// Stop profiling; the profile can still be written out
+void profile_stop(struct em8051_profile *aProfile);
+
+// Stop profiling if not stopped yet, and free the profile
+void profile_free(struct em8051_profile *aProfile);
+
+// Write a flat profile of the functions by self cycles, the call graph with
+// the inclusive cycles per caller and callee, and the hottest addresses
+// disassembled as text into aFilename. Calls not returned from yet count up
+// to now. The instance profiled must still be there.
+// Returns negative if the file can't be written.
+int profile_report(struct em8051_profile *aProfile, const char *aFilename);
+
+// Write the profile in the callgrind format, for KCachegrind or
+// callgrind_annotate: functions and positions are code addresses, the events
+// are cycles and instructions. Returns negative if the file can't be written.
+int profile_callgrind(struct em8051_profile *aProfile, const char *aFilename);
+
+// Code coverage: while mCoverage is set, every instruction run sets
+// COVERAGE_RUN at its address, and every conditional branch COVERAGE_TAKEN or
+// COVERAGE_NOT_TAKEN. While collecting, run() goes through tick() whatever
+// the engine.
+
+// Source lines of code addresses, from an assembler listing or debug info
+struct em8051_lines;
+
+// Read the source lines in aFilename: NoICE FILE and LINE commands, or
+// listing lines that start with an address and the code bytes, optionally
+// after a "line:" number; those are mapped to the listing itself.
+// Returns NULL if the file can't be read.
+struct em8051_lines *lines_load(const char *aFilename);
+
+void lines_free(struct em8051_lines *aLines);
+
+// The line at or closest below aAddress, as for symbols_line()
+bool lines_find(struct em8051_lines *aLines, uint16_t aAddress, const char **aFile, unsigned int *aLine);
+
+// Write the coverage collected in aCPU as an lcov tracefile, with the test
+// name aTest, for genhtml. Lines are hit if any of their instructions ran,
+// and every conditional branch on them is two lcov branches, taken and not
+// taken. Without aLines, line n of the file "code" stands for code address
+// n - 1, and only the instructions run are listed.
+// Returns negative if the file can't be written.
+int coverage_lcov(struct em8051 *aCPU, struct em8051_lines *aLines, const char *aTest, const char *aFilename);
+
+// Write the same as a Cobertura XML report
+int coverage_cobertura(struct em8051 *aCPU, struct em8051_lines *aLines, const char *aFilename);
+
+// Edge coverage for fuzzing: while mEdges is set, every control transfer
+// (taken branch, jump, call, return or interrupt entry) increments the byte
+// its source and target hash to. mEdges and mCodeEnd make run() go through
+// tick() whatever the engine.
+#define EDGE_MAP_SIZE 65536
+
+// Differential testing: where an engine first leaves the state another one
+// computes from the same start, see lockstep_run()
+struct em8051_divergence {
+		unsigned long long mTicks; // ticks both agreed for
+		uint16_t mPC; // the instruction the reference ran last, in the tick that differed
+		char mAssembly[128]; // its disassembly
+		char mWhat[24]; // the first state that differs: "PC", "SFR 90", "xdata 1234"...; empty if none
+		unsigned int mExpected; // its value in the reference
+		unsigned int mActual; // ... and in the instance under test
+};
+
+// A copy of aCPU to follow it with aEngine: same memory sizes, state and
+// callbacks, except for except. Returns NULL if out of memory.
+struct em8051 *lockstep_reference(struct em8051 *aCPU, uint8_t aEngine);
+
+void lockstep_free(struct em8051 *aReference);
+
+// Run aCPU for aTicks ticks, aStep ticks at a time with run(), and
+// aReference alongside one tick() at a time, comparing the registers, SFRs,
+// memories, interrupt and serial state after every step. A step of 1
+// compares after every instruction; the block engines only chain the blocks
+// that fit in a step. Both must start from the same state. Returns the ticks
+// run, fewer if aCPU->mStop got set or the state diverged; then
+// aDivergence->mWhat tells what, and both are left after the tick that
+// differed. The callbacks of both get called.
+unsigned int lockstep_run(struct em8051 *aCPU, struct em8051 *aReference, unsigned int aTicks, unsigned int aStep,
+	struct em8051_divergence *aDivergence);
+
+// Execution breakpoints: a bit per code address, and the breakpoints set,
+// each with an optional condition. Zero-initialized is an empty set.
+struct em8051_breakpoint {
+		uint16_t mAddress;
+		char *mCondition; // stop only when this is nonzero; NULL to always stop
+		unsigned long mHits; // times reached since it was set
+};
+
+struct em8051_breakpoints {
+		uint8_t mBits[65536 / 8]; // bit set for each address with a breakpoint
+		struct em8051_breakpoint *mList;
+		unsigned int mCount;
+};
+
+#define BREAKPOINT_AT(aBreakpoints, aAddress) \
+	((aBreakpoints)->mBits[(uint16_t)(aAddress) >> 3] & (1 << ((aAddress) & 7)))
+
+// Set a breakpoint at aAddress, replacing the one there. aCondition may be
+// NULL or empty. Returns -1 if the condition doesn't parse, -2 if out of memory.
+int breakpoint_set(struct em8051_breakpoints *aBreakpoints, uint16_t aAddress, const char *aCondition);
+
+// Returns false if there was no breakpoint at aAddress
+bool breakpoint_clear(struct em8051_breakpoints *aBreakpoints, uint16_t aAddress);
+
+void breakpoint_clear_all(struct em8051_breakpoints *aBreakpoints);
+
+// Call once per instruction executed: true if the breakpoint at PC, if any,
+// should stop. Counts its hit, then evaluates its condition, only when PC's
+// bit is set. With aBreakpoints in mBreakpoints, every engine does this after
+// each instruction and sets mStop; basic blocks end before a breakpoint, so
+// call invalidate_code() on the address after setting one there.
+bool breakpoint_check(struct em8051_breakpoints *aBreakpoints, struct em8051 *aCPU);
+
+// Evaluate a condition in C syntax (|| && == != < <= > >= + - * / % & | ^
+// ! ~ and parentheses) over numbers, registers (a, b, psw, sp, dpl, dph,
+// dptr, pc, c, r0..r7 of the current bank, p0..p3 and the other SFR names),
+// memories (data[], sfr[], xdata[], code[]) and hits. With aCPU NULL only
+// checks the syntax. Returns -1 on a syntax error.
+int expression_eval(struct em8051 *aCPU, const char *aExpression, unsigned long aHits, long *aValue);
+
+// Data watchpoints: while mWatch is set, the reads and writes by address of
+// internal memory, SFRs and external data are checked against these. That is
+// every access in TRACE_SPACE, as the trace sees them, plus the writes to Rn
+// and the bytes a bit operation changes; not A, B or DPTR as operands, nor the
+// reads of Rn and bits. Only accesses to a page with a watchpoint on it go
+// through the list. While any is set, run() doesn't use the block and
+// jit engines. Zero-initialized is an empty set.
+#define WATCH_PAGE_SIZE 16
+
+struct em8051_watchpoint {
+		uint32_t mAddress; // first address, TRACE_SPACE and address
+		uint32_t mLength; // bytes watched from there
+		uint8_t mFlags; // WATCH_FLAGS
+		uint8_t mMask; // only accesses of values with (value & mMask) == mValue count; 0 for any
+		uint8_t mValue;
+		unsigned long mHits;
+};
+
+struct em8051_watch_hit {
+		struct em8051_watchpoint *mWatchpoint; // valid until the set changes
+		uint32_t mAddress; // TRACE_SPACE and address
+		uint16_t mPC; // the instruction; the interrupted one for an interrupt entry
+		uint8_t mValue; // read or written
+		uint8_t mOld; // the value before a write; unknown with an xwrite callback
+		bool mWrite;
+};
+
+typedef void (*em8051watchlog)(struct em8051 *aCPU, const struct em8051_watch_hit *aHit);
+
+struct em8051_watchpoints {
+		uint8_t mPages[0x40000 / WATCH_PAGE_SIZE / 8]; // bit set for each page with a watchpoint
+		struct em8051_watchpoint *mList;
+		unsigned int mCount;
+		em8051watchlog log; // callback: every hit, of WATCH_LOG watchpoints too; may be NULL
+		bool mTriggered; // a watchpoint without WATCH_LOG was hit and set mStop; for the caller to clear
+		struct em8051_watch_hit mHit; // the last such hit
+};
+
+#define WATCHED(aWatch, aAddress) \
+	((aWatch)->mPages[(aAddress) / WATCH_PAGE_SIZE >> 3] & (1 << ((aAddress) / WATCH_PAGE_SIZE & 7)))
+
+// Watch aLength bytes from aAddress, in TRACE_DATA, TRACE_SFR or TRACE_EXT.
+// Returns -1 if the range is invalid, -2 if out of memory.
+int watch_add(struct em8051_watchpoints *aWatch, uint32_t aAddress, uint32_t aLength, uint8_t aFlags, uint8_t aMask,
+	uint8_t aValue);
+
+// Add a watchpoint given as text: space:address[+length] in hex, with data
+// (lower and upper, by indirect address), sfr or xdata, then any of ",r",
+// ",w", ",rw", ",=value" or ",=value&mask" in hex, and ",log". Writes by
+// default, e.g. "xdata:1F00+2,w,=0&80,log". Returns as watch_add(), -1 for a
+// bad text too.
+int watch_parse(struct em8051_watchpoints *aWatch, const char *aSpec);
+
+// Remove the last watchpoint added with aAddress, aLength and the same
+// WATCH_READ and WATCH_WRITE flags as aFlags; false if there was none
+bool watch_remove(struct em8051_watchpoints *aWatch, uint32_t aAddress, uint32_t aLength, uint8_t aFlags);
+
+void watch_clear_all(struct em8051_watchpoints *aWatch);
+
+// "PC: write VV over OO at space:address" into aBuffer, at most 40 characters.
+// Returns the length.
+int watch_describe(const struct em8051_watch_hit *aHit, char *aBuffer);
+
+// GDB remote serial protocol server. The registers, in 'g' packet order, are
+// r0-r7 of the current bank, a, b, psw and sp, a byte each, then dptr and pc,
+// 16 bits little endian; qXfer target.xml describes them. In the debugger's
+// address space code memory is at 0, external data at 0x10000, internal
+// memory by indirect address at 0x20000 and the SFRs at 0x30080-0x300FF.
+// Breakpoints go to mBreakpoints and watchpoints to mWatch, the instance's if
+// it has them, or else sets of the session's own. "monitor reset" resets the
+// CPU. POSIX only; elsewhere gdb_accept() fails.
+
+// Wait for a debugger to connect to aAddress: a TCP port on localhost, or a
+// Unix socket created at aAddress if it has a '/'. Returns the connection,
+// or -1.
+int gdb_accept(const char *aAddress);
+
+// Serve the debugger on socket aFd until it detaches or kills the target, or
+// the connection closes. A continue runs aPollTicks ticks at a time with run(),
+// checking the connection for an interrupt only in between. Exceptions stop
+// the target when the except callback sets mStop, or there is none. Returns
+// the ticks run.
+unsigned long long gdb_serve(struct em8051 *aCPU, int aFd, unsigned int aPollTicks);
+
+// Instrumentation: in builds with INSTRUMENT defined, the core reports
+// instruction fetches, memory reads and writes, branches taken, interrupt
+// entries and reti to the instrument callback of the instances that have one.
+// Events are batched in a buffer per thread, which is handed over when full,
+// when the instance changes, and at the end of run(), but not by tick():
+// callers that step with tick() call instrument_flush() when they want the
+// events delivered, as the curses front-end does after every frame, the GDB
+// stub after a single step and run_jobs() after a run callback. While
+// instrument is set, run() goes through tick() whatever the engine. The
+// callback must not run the emulator itself. Without INSTRUMENT the hooks
+// compile to nothing.
+
+// Hand the events buffered by this thread to their instrument callback
+void instrument_flush(void);
+
+// Binary execution trace in the BAP frame format: a std_frame for every
+// instruction run, with its address, its bytes, and the registers and memory
+// it read and wrote with their values before and after. SFRs and the
+// registers of the current bank are register operands named as in the
+// disassembly; other memory operands are at the addresses in TRACE_SPACE.
+// Frames are encoded and written on a thread of their own. While tracing,
+// run() goes through tick() whatever the engine.
+struct em8051_trace;
+
+// Start tracing aCPU into aFilename. With aMaxSize, a new file is started
+// before one would go over aMaxSize bytes: aFilename.1, aFilename.2 and so
+// on, each a complete trace. Returns NULL if the file can't be created.
+struct em8051_trace *trace_open(struct em8051 *aCPU, const char *aFilename, unsigned long long aMaxSize);
+
+// Start streaming the trace of aCPU into aFd, e.g. a pipe or a socket. Each
+// batch of frames is written as soon as it is full or flushed; the header
+// has no frame count and there is no table of contents. aFd is closed by
+// trace_close(). Returns NULL if out of memory.
+struct em8051_trace *trace_stream(struct em8051 *aCPU, int aFd);
+
+// Hand the frames recorded so far to the writer thread
+void trace_flush(struct em8051_trace *aTrace);
+
+// Stop tracing, write the remaining frames and finish the file. Returns
+// negative if writing failed at any point.
+int trace_close(struct em8051_trace *aTrace);
+
+// One independent emulator run for run_jobs()
+struct em8051_job;
+
+// Callback: a step of a batch job, see struct em8051_job
+typedef void (*em8051job)(struct em8051 *aCPU, struct em8051_job *aJob);
+
+struct em8051_job {
+		char *mFilename; // object file to load, see load_image(), or NULL to use mCode
+		const unsigned char *mCode; // code memory image, copied into the instance
+		unsigned int mCodeSize;
+		unsigned long long mTicks; // ticks to run, unless mStop gets set first
+		uint8_t mEngine; // see EM8051_ENGINE
+		struct em8051_snapshot *mSnapshot; // restored after the load, e.g. to skip a boot; may be shared by the jobs
+		void *mUserData; // copied into the instance's mUserData
+		em8051job setup; // callback: after reset and load; set inputs and callbacks here
+		em8051job run; // callback: run the instance; NULL for run() until mTicks or mStop
+		em8051job finish; // callback: after the run; collect results here
+		// Filled in by run_jobs()
+		int mResult; // 0, or the load_image() or snapshot_restore() error; -9 if out of memory
+		struct em8051_load_info mLoad;
+		unsigned long long mTicksRun;
+};
+
+// Run aCount jobs on aThreads threads (0 for one per CPU). Each job gets its own
+// em8051 with 64k code and external data, upper data and a decode cache, which is
+// freed after finish; the callbacks run on the worker threads. Idle threads steal
+// jobs from busy ones. Returns the number of jobs that failed to load or were
+// out of memory.
+int run_jobs(struct em8051_job *aJobs, unsigned int aCount, unsigned int aThreads);
+
+// Run aCount jobs of the same firmware in lanes, aWidth jobs to a group. Each
+// group is one job of run_jobs(): the first job's file or code and snapshot
+// are loaded once, and every lane starts as a copy of that instance, with its
+// own data memories and the group's code memory, decode cache and JIT code.
+// The lanes take turns running aStep ticks each; those with a run callback
+// run one after another first. The code memory is shared, so lanes must not
+// write to it or set breakpoints. Returns the number of jobs that failed to
+// load or were out of memory (mResult -9), or -1 if out of memory.
+int run_lanes(struct em8051_job *aJobs, unsigned int aCount, unsigned int aWidth, unsigned int aStep,
+	unsigned int aThreads);
+
 // Alternate way to execute an opcode (switch-structure instead of function pointers)
 uint8_t do_op(struct em8051 *aCPU);
 
+// Alternate way to run a number of ticks (direct-threaded dispatch with computed goto).
+// Falls back to calling tick() on compilers without the extension.
+unsigned int do_ops_threaded(struct em8051 *aCPU, unsigned int aTicks);
+
 // Internal: Pushes a value into stack
 void push_to_stack(struct em8051 *aCPU, uint8_t aValue);
 
+// Internal: tick() split in two for the execution engines. tick_prologue() returns
+// TICK_EXECUTE if the opcode at PC is due; the caller then runs it, stores the
+// result in mTickDelay and calls tick_epilogue(). Otherwise the tick is complete.
+uint8_t tick_prologue(struct em8051 *aCPU);
+void tick_epilogue(struct em8051 *aCPU);
+
+// Internal: timer schedule. timer_schedule() recomputes mTimerEvent and
+// mTimerRun from the timer SFRs, timer_advance() runs the timers for fewer
+// ticks than mTimerEvent.
+void timer_schedule(struct em8051 *aCPU);
+void timer_advance(struct em8051 *aCPU, unsigned int aTicks);
+
+// Internal: recompute mInterruptPending. Needed whenever IE, TCON or
+// serial_interrupt_trigger change.
+void update_interrupts(struct em8051 *aCPU);
+
+// Internal: after a tick spent in idle or power down mode, skips up to aTicks
+// more ticks that would only count the timers. Returns the ticks skipped.
+unsigned int skip_halted(struct em8051 *aCPU, unsigned int aTicks);
+
+// Internal: run() for ENGINE_BLOCK
+unsigned int run_blocks(struct em8051 *aCPU, unsigned int aTicks);
+
+// Internal: basic blocks are at most this many instructions long
+#define BLOCK_MAX_LENGTH 16
+
+// Internal: ENGINE_JIT compiles a block once it has been run this many times
+#define JIT_HOT_COUNT 16
+
+// Internal: value returned by each opcode's handler
+extern const uint8_t op_delays[256];
+
+// Internal: instruction lengths in bytes
+extern const uint8_t op_lengths[256];
+
+// Internal: compile the block starting at aEntry to native code, once its
+// block_hits reach JIT_HOT_COUNT. Compiled blocks are queued until a batch
+// of them is made executable; that happens once the batch is full, or on
+// the next call for a queued block, with block_hits past JIT_HOT_COUNT.
+// Returns the code, or NULL if it is queued, that isn't supported on this
+// platform, or the block can't be compiled.
+em8051operation jit_compile(struct em8051 *aCPU, struct em8051_decoded *aEntry);
+
+// Release the native code buffer of ENGINE_JIT, if any
+void jit_free(struct em8051 *aCPU);
+
+// Internal: trace hooks, called while mTrace is set. trace_begin() and
+// trace_end() go around each opcode handler; the memory accesses in between
+// are reported with aAddress in TRACE_SPACE.
+void trace_begin(struct em8051 *aCPU);
+void trace_end(struct em8051 *aCPU);
+void trace_read(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue);
+void trace_write(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue);
+
+// Internal: profile hooks, called while mProfile is set, around every
+// instruction and after an interrupt entry has pushed the return address
+void profile_begin(struct em8051 *aCPU);
+void profile_end(struct em8051 *aCPU);
+void profile_interrupt(struct em8051 *aCPU, uint16_t aVector);
+
+// Internal: breakpoint_check() on mBreakpoints, if set, after an instruction
+#define BREAKPOINT_STOP(aCPU) \
+	do { \
+		if ((aCPU)->mBreakpoints && BREAKPOINT_AT((aCPU)->mBreakpoints, (aCPU)->mPC) && \
+			breakpoint_check((aCPU)->mBreakpoints, (aCPU))) \
+			(aCPU)->mStop = 1; \
+	} while (0)
+
+// Internal: checks an access to a page WATCHED() by aCPU->mWatch
+void watch_access(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue, uint8_t aOld, bool aWrite);
+
+// Internal: instrumentation hooks, see instrument_flush()
+void instrument_event(struct em8051 *aCPU, uint8_t aType, uint32_t aAddress, uint8_t aValue);
+#ifdef INSTRUMENT
+#define INSTRUMENTED(aCPU) ((aCPU)->instrument != NULL)
+#define INSTRUMENT_EVENT(aCPU, aType, aAddress, aValue) \
+	do { \
+		if ((aCPU)->instrument) \
+			instrument_event(aCPU, aType, aAddress, aValue); \
+	} while (0)
+#else
+#define INSTRUMENTED(aCPU) 0
+#define INSTRUMENT_EVENT(aCPU, aType, aAddress, aValue) do { } while (0)
+#endif
+
+// Internal: the name the disassembler uses for direct address aValue
+void mem_memonic(int aValue, char *aBuffer);
+
+// Internal: building source line tables; lines_sort() before lines_find()
+struct em8051_lines *lines_new(void);
+int lines_add(struct em8051_lines *aLines, const char *aFile, unsigned int aLine, uint16_t aAddress);
+void lines_sort(struct em8051_lines *aLines);
+
+// Internal: sort the symbol index, see symbols_new()
+void symbols_sort(struct em8051_symbols *aSymbols);
+
+enum TICK_STATES {
+	TICK_NONE, // tick spent waiting for the current operation to finish
+	TICK_HALTED, // tick spent in idle or power down mode
+	TICK_EXECUTE // an operation is due
+};
+
+// Execution engines
+enum EM8051_ENGINE {
+	ENGINE_TABLE, // function pointers in op[] (default)
+	ENGINE_SWITCH, // the do_op() switch-structure
+	ENGINE_THREADED, // direct-threaded code; only differs from ENGINE_TABLE in run()
+	ENGINE_BLOCK, // basic blocks from mDecodeCache, chained in run(); table otherwise
+	ENGINE_JIT, // ENGINE_BLOCK, with hot blocks compiled to native code (x86-64 only)
+	ENGINE_COUNT
+};
+
+// The name of engine aEngine, as taken by -engine=, or NULL if there is none
+const char *engine_name(int aEngine);
+
+// The engine called aName, or -1 if there is none
+int engine_by_name(const char *aName);
+
+enum EM8051_LOAD_SPACE {
+	LOAD_CODE, // mCodeMem
+	LOAD_XDATA // mExtData
+};
+
 // SFR register locations
 enum SFR_REGS {
 	REG_ACC = 0xE0 - 0x80,
@@ -225,6 +945,17 @@ enum SCON_MASKS {
 	SCONMASK_SM0 = 0x80,
 };
 
+enum DECODED_FLAGS {
+	DECODED_BRANCH = 0x01, // conditional relative branch
+	DECODED_JUMP = 0x02, // unconditional jump with a known target
+	DECODED_CALL = 0x04, // acall / lcall
+	DECODED_RETURN = 0x08, // ret / reti
+	DECODED_INDIRECT = 0x10, // jmp @a+dptr; target unknown
+	DECODED_BLOCK = 0x20, // block_length and block_ticks are valid
+	DECODED_MOVX = 0x40, // the block starting here contains movx
+	DECODED_SFR = 0x80 // the block starting here accesses an SFR directly
+};
+
 enum ISR_VECTORS {
 	ISR_RST = 0x00,
 	ISR_INT0 = 0x03,
@@ -237,11 +968,50 @@ enum ISR_VECTORS {
 #endif // __8052__
 };
 
+// What a watchpoint watches, in mFlags
+enum WATCH_FLAGS {
+	WATCH_READ = 0x01,
+	WATCH_WRITE = 0x02,
+	WATCH_LOG = 0x04 // only report hits to the log callback, don't stop
+};
+
+// Marks in mCoverage
+enum COVERAGE_BITS {
+	COVERAGE_RUN = 0x01, // an instruction started here
+	COVERAGE_TAKEN = 0x02, // the conditional branch here was taken
+	COVERAGE_NOT_TAKEN = 0x04 // ... or not
+};
+
+// Instrumentation events; what mAddress holds
+enum INSTRUMENT_EVENTS {
+	EVENT_FETCH, // instruction at mPC is about to run; mAddress is mPC
+	EVENT_READ, // memory read by address, TRACE_SPACE and address; not A, B, Rn or DPTR as operands
+	EVENT_WRITE, // memory write by address, TRACE_SPACE and address; ditto
+	EVENT_BRANCH, // the instruction went elsewhere than the next one, calls and returns too: the target
+	EVENT_INTERRUPT, // interrupt entry before the instruction at mPC: the vector
+	EVENT_RETI // return from interrupt: the return address
+};
+
+// Address spaces of the trace memory operands and instrumentation events
+enum TRACE_SPACE {
+	TRACE_DATA = 0x00000, // internal memory by indirect address: lower and upper data
+	TRACE_EXT = 0x10000, // external data
+	TRACE_CODE = 0x20000, // code memory
+	TRACE_SFR = 0x30000, // SFRs by direct address; only used inside the core, and by symbols
+	TRACE_SPACE_MASK = 0x30000
+};
+
 enum EM8051_EXCEPTION {
 	EXCEPTION_STACK, // stack address > 127 with no upper memory, or roll over
 	EXCEPTION_ACC_TO_A, // acc-to-a move operation; illegal (acc-to-acc is ok, a-to-acc is ok..)
 	EXCEPTION_IRET_PSW_MISMATCH, // psw not preserved over interrupt call (doesn't care about P, F0 or UNUSED)
 	EXCEPTION_IRET_SP_MISMATCH, // sp not preserved over interrupt call
 	EXCEPTION_IRET_ACC_MISMATCH, // acc not preserved over interrupt call
-	EXCEPTION_ILLEGAL_OPCODE // for the single 'reserved' opcode in the architecture
+	EXCEPTION_ILLEGAL_OPCODE, // for the single 'reserved' opcode in the architecture
+	EXCEPTION_PARITY_MISMATCH, // lazy parity differs from the eager one; PARITY_CHECK builds only
+	EXCEPTION_WILD_JUMP, // the PC went to mCodeEnd or above; mPC is the instruction that sent it there
+	EXCEPTION_STACK_OVERFLOW // a push took SP above mStackLimit
 };
+
+// A description of exception aCode, see EM8051_EXCEPTION
+const char *exception_name(int aCode);
@@ -26,7 +26,7 @@
  * Curses-based emulator front-end
  */
 
-// how many lines of history to remember
+// how many lines of history to show
 #define HISTORY_LINES 20
 
 enum EMU_VIEWS {
@@ -36,17 +36,15 @@ enum EMU_VIEWS {
 	OPTIONS_VIEW = 3
 };
 
-// binary history buffer
-extern unsigned char history[];
+// every instruction run, for the main view
+extern struct em8051_history *history;
 
 // last used filename
 extern char filename[];
 
 // instruction count; needed to replay history correctly
-extern unsigned int icount;
+extern unsigned long long icount;
 
-// current line in the history cyclic buffers
-extern int historyline;
 // last known columns and rows; for screen resize detection
 extern int oldcols, oldrows;
 // are we in single-step or run mode
@@ -80,10 +78,13 @@ extern void setSpeed(int speed, int runmode);
 // extern uint8_t emu_sfrread(struct em8051 *aCPU, uint8_t aRegister);
 extern void refreshview(struct em8051 *aCPU);
 extern void change_view(struct em8051 *aCPU, int changeto);
+// the user changed a value; stepping back can't replay past that
+extern void emu_edited(struct em8051 *aCPU);
 
 // popups.c
 extern void emu_help(struct em8051 *aCPU);
 extern int emu_reset(struct em8051 *aCPU);
+extern void emu_readstring(struct em8051 *aCPU, const char *aPrompt, char *aBuffer);
 extern int emu_readvalue(struct em8051 *aCPU, const char *aPrompt, int aOldvalue, int aValueSize);
 extern int emu_readhz(struct em8051 *aCPU, const char *aPrompt, int aOldvalue);
 extern void emu_load(struct em8051 *aCPU);
@@ -102,6 +103,8 @@ extern void build_logicboard_view(struct em8051 *aCPU);
 extern void logicboard_editor_keys(struct em8051 *aCPU, int ch);
 extern void logicboard_update(struct em8051 *aCPU);
 extern void logicboard_tick(struct em8051 *aCPU);
+extern int logicboard_save_state(unsigned char *aBuffer);
+extern void logicboard_load_state(const unsigned char *aBuffer);
 
 // memeditor.c
 extern void wipe_memeditor_view();
@@ -0,0 +1,705 @@
+/* 8051 emulator
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ *
+ * fuzz.c
+ * Coverage-guided fuzzer for firmware input handlers
+ *
+ * The firmware boots once, and every run then restores the snapshot taken
+ * after the boot and reads its inputs from one byte stream: each read of the
+ * port pins, the serial receive buffer and a range of external memory takes
+ * the next byte. The control transfers a run takes are counted in an edge
+ * map; inputs that reach a new edge, or a new hit count bucket of a known
+ * one, join the corpus and get mutated further. Runs that raise an exception,
+ * including jumps past the code and stack overflows, are saved as crashes,
+ * one per exception and address.
+ */
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "emu8051.h"
+
+// exit codes
+enum FUZZ_RESULT {
+	RESULT_DONE = 0, // ran all runs without crashes
+	RESULT_ERROR = 1, // bad arguments or load failure
+	RESULT_CRASH = 2 // found crashes, or the -run input crashed
+};
+
+// Ticks between received serial bytes; about 115200 baud at 11.0592MHz
+#define RX_TICKS 80
+
+// Runs between updates of the shared counters
+#define SYNC_RUNS 64
+
+struct input {
+	unsigned char *mData;
+	unsigned int mLength;
+};
+
+// Per thread state, the mUserData of its instance
+struct worker {
+	uint32_t mRandom; // xorshift state
+	unsigned char *mBuffer; // opt_max_length bytes for the mutated input
+	const unsigned char *mData; // the input being run
+	unsigned int mLength;
+	unsigned int mPosition; // next byte of mData to read
+	int mException; // -1 if none
+	uint16_t mExceptionPC;
+	uint8_t mEdges[EDGE_MAP_SIZE];
+	uint8_t mVirgin[EDGE_MAP_SIZE]; // the bucket bits this worker hasn't seen yet
+};
+
+static unsigned long long opt_boot = 0;
+static unsigned long long opt_cycles = 100000;
+static unsigned long long opt_tail = 1000;
+static unsigned long long opt_runs = 0;
+static unsigned int opt_max_length = 1024;
+static char *opt_corpus = NULL;
+static char *opt_crashes = ".";
+static uint8_t opt_ports = 0x0f;
+static int opt_xread_start = -1;
+static int opt_xread_end = -1;
+static uint8_t opt_stack_limit = 0;
+static int opt_code_end = -1;
+
+static struct em8051_snapshot *boot;
+
+// Shared between the workers, under lock
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct input *corpus;
+static unsigned int corpus_count, corpus_size;
+static uint8_t virgin[EDGE_MAP_SIZE];
+static uint32_t *crashes; // exception << 16 | address
+static unsigned int crash_count;
+static unsigned long long total_runs;
+static time_t start_time, status_time;
+static bool done;
+
+static uint32_t random32(struct worker *aWorker) {
+	uint32_t x = aWorker->mRandom;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	aWorker->mRandom = x;
+	return x;
+}
+
+static uint8_t next_byte(struct worker *aWorker, uint8_t aDefault) {
+	if (aWorker->mPosition < aWorker->mLength)
+		return aWorker->mData[aWorker->mPosition++];
+	return aDefault;
+}
+
+// Unconnected pins read high once the input runs out
+static uint8_t fuzz_sfrread_port(struct em8051 *aCPU, uint8_t aRegister) {
+	return next_byte(aCPU->mUserData, 0xff);
+}
+
+static uint8_t fuzz_sfrread_SBUF(struct em8051 *aCPU, uint8_t aRegister) {
+	return next_byte(aCPU->mUserData, aCPU->mSFR[REG_SBUF]);
+}
+
+static void fuzz_sfrwrite_SBUF(struct em8051 *aCPU, uint8_t aRegister) {
+	aCPU->serial_out_remaining_bits = 8;
+}
+
+static uint8_t fuzz_xread(struct em8051 *aCPU, uint16_t aAddress) {
+	uint8_t value = aCPU->mExtData[aAddress & aCPU->mExtDataMaxIdx];
+
+	if (aAddress >= opt_xread_start && aAddress <= opt_xread_end)
+		return next_byte(aCPU->mUserData, value);
+	return value;
+}
+
+static void fuzz_exception(struct em8051 *aCPU, int aCode) {
+	struct worker *worker = aCPU->mUserData;
+
+	if (worker->mException == -1) {
+		worker->mException = aCode;
+		worker->mExceptionPC = aCPU->mPC;
+	}
+	aCPU->mStop = 1;
+}
+
+static void setup_instance(struct em8051 *aCPU, struct worker *aWorker) {
+	int i;
+
+	aCPU->mUserData = aWorker;
+	aCPU->except = &fuzz_exception;
+	for (i = 0; i < 4; i++)
+		if (opt_ports & (1 << i))
+			aCPU->sfrread[REG_P0 + i * 0x10] = fuzz_sfrread_port;
+	aCPU->sfrread[REG_SBUF] = fuzz_sfrread_SBUF;
+	aCPU->sfrwrite[REG_SBUF] = fuzz_sfrwrite_SBUF;
+	if (opt_xread_start != -1)
+		aCPU->xread = fuzz_xread;
+	aCPU->mEdges = aWorker->mEdges;
+	aCPU->mCodeEnd = opt_code_end;
+	aCPU->mStackLimit = opt_stack_limit;
+}
+
+// The core has no serial receiver: once the firmware listens and has taken
+// the previous byte, raise RI for the next one, which SBUF reads then return
+static void receive(struct em8051 *aCPU, struct worker *aWorker) {
+	if ((aCPU->mSFR[REG_SCON] & (SCONMASK_REN | SCONMASK_RI)) != SCONMASK_REN ||
+		aWorker->mPosition >= aWorker->mLength)
+		return;
+	aCPU->mSFR[REG_SCON] |= SCONMASK_RI;
+	if (aCPU->mSFR[REG_IE] & IEMASK_ES) {
+		aCPU->serial_interrupt_trigger = 1;
+		update_interrupts(aCPU);
+	}
+}
+
+// Run aData from the boot snapshot, until an exception, the cycle limit, or
+// -tail cycles after the input ran out. Returns the cycles run.
+static unsigned long long execute(struct em8051 *aCPU, struct worker *aWorker, const unsigned char *aData, unsigned int aLength) {
+	unsigned long long ticks = 0, tail = 0;
+
+	snapshot_restore(aCPU, boot, NULL);
+	memset(aWorker->mEdges, 0, EDGE_MAP_SIZE);
+	aWorker->mData = aData;
+	aWorker->mLength = aLength;
+	aWorker->mPosition = 0;
+	aWorker->mException = -1;
+
+	while (ticks < opt_cycles && aWorker->mException == -1) {
+		unsigned long long left = opt_cycles - ticks;
+		receive(aCPU, aWorker);
+		ticks += run(aCPU, left < RX_TICKS ? (unsigned int)left : RX_TICKS);
+		if (aWorker->mPosition >= aWorker->mLength) {
+			tail += RX_TICKS;
+			if (tail >= opt_tail)
+				break;
+		}
+	}
+	return ticks;
+}
+
+// Hit counts in AFL's buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+
+static uint8_t bucket(uint8_t aCount) {
+	if (aCount < 3)
+		return aCount;
+	if (aCount < 4)
+		return 0x04;
+	if (aCount < 8)
+		return 0x08;
+	if (aCount < 16)
+		return 0x10;
+	if (aCount < 32)
+		return 0x20;
+	if (aCount < 128)
+		return 0x40;
+	return 0x80;
+}
+
+// Clear the buckets of aEdges from aVirgin, returns whether any were left
+static bool new_bits(const uint8_t *aEdges, uint8_t *aVirgin) {
+	bool found = false;
+	unsigned int i, j;
+
+	for (i = 0; i < EDGE_MAP_SIZE; i += 8) {
+		uint64_t word;
+		memcpy(&word, aEdges + i, sizeof(word));
+		if (!word)
+			continue;
+		for (j = i; j < i + 8; j++) {
+			uint8_t bits = bucket(aEdges[j]) & aVirgin[j];
+			if (bits) {
+				aVirgin[j] &= ~bits;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+static unsigned int edge_count(void) {
+	unsigned int i, count = 0;
+
+	for (i = 0; i < EDGE_MAP_SIZE; i++)
+		if (virgin[i] != 0xff)
+			count++;
+	return count;
+}
+
+static int write_file(const char *aDir, const char *aName, const unsigned char *aData, unsigned int aLength) {
+	char *filename = malloc(strlen(aDir) + strlen(aName) + 2);
+	FILE *f;
+
+	if (!filename)
+		return -1;
+	sprintf(filename, "%s/%s", aDir, aName);
+	f = fopen(filename, "wb");
+	free(filename);
+	if (!f)
+		return -1;
+	if (fwrite(aData, 1, aLength, f) != aLength) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+// Reads at most opt_max_length bytes; returns NULL if the file can't be read
+static unsigned char *read_file(const char *aFilename, unsigned int *aLength) {
+	unsigned char *data = malloc(opt_max_length + 1);
+	FILE *f;
+
+	if (!data)
+		return NULL;
+	f = fopen(aFilename, "rb");
+	if (!f) {
+		free(data);
+		return NULL;
+	}
+	*aLength = fread(data, 1, opt_max_length, f);
+	fclose(f);
+	return data;
+}
+
+// Call with lock held. Returns -1, leaving the corpus as it was, if out of memory.
+static int add_input(const unsigned char *aData, unsigned int aLength, bool aSave) {
+	struct input *input;
+	unsigned char *data = malloc(aLength + 1);
+
+	if (!data)
+		return -1;
+	if (corpus_count == corpus_size) {
+		unsigned int size = corpus_size ? corpus_size * 2 : 64;
+		input = realloc(corpus, size * sizeof(struct input));
+		if (!input) {
+			free(data);
+			return -1;
+		}
+		corpus = input;
+		corpus_size = size;
+	}
+	input = &corpus[corpus_count++];
+	input->mData = data;
+	if (aLength)
+		memcpy(input->mData, aData, aLength);
+	input->mLength = aLength;
+
+	if (aSave && opt_corpus) {
+		// named after the session, so that earlier files stay
+		char name[48];
+		sprintf(name, "id-%llu-%06u", (unsigned long long)start_time, corpus_count - 1);
+		if (write_file(opt_corpus, name, aData, aLength) < 0)
+			fprintf(stderr, "Can't write '%s' into '%s'\n", name, opt_corpus);
+	}
+	return 0;
+}
+
+// Call with lock held
+static void add_crash(struct worker *aWorker) {
+	uint32_t key = (aWorker->mException << 16) | aWorker->mExceptionPC;
+	uint32_t *grown;
+	unsigned int i;
+	char name[32];
+
+	for (i = 0; i < crash_count; i++)
+		if (crashes[i] == key)
+			return;
+	sprintf(name, "crash-%d-%04X", aWorker->mException, aWorker->mExceptionPC);
+	grown = realloc(crashes, (crash_count + 1) * sizeof(uint32_t));
+	if (!grown) {
+		fprintf(stderr, "exception at %04X: out of memory, input not saved as '%s'\n", aWorker->mExceptionPC, name);
+		return;
+	}
+	crashes = grown;
+	crashes[crash_count++] = key;
+
+	fprintf(stderr, "exception at %04X: %s, input saved as '%s'\n", aWorker->mExceptionPC,
+		exception_name(aWorker->mException), name);
+	if (write_file(opt_crashes, name, aWorker->mData, aWorker->mLength) < 0)
+		fprintf(stderr, "Can't write '%s' into '%s'\n", name, opt_crashes);
+}
+
+// Call with lock held
+static void status(void) {
+	time_t now = time(NULL);
+	unsigned long long seconds = now > start_time ? now - start_time : 1;
+
+	fprintf(stderr, "runs %llu, %llu/s, corpus %u, edges %u, crashes %u\n", total_runs,
+		total_runs / seconds, corpus_count, edge_count(), crash_count);
+	status_time = now;
+}
+
+// Copy a random corpus input into mBuffer, sometimes spliced with another
+static unsigned int pick(struct worker *aWorker) {
+	struct input *input, *other;
+	unsigned int length, cut;
+
+	pthread_mutex_lock(&lock);
+	input = &corpus[random32(aWorker) % corpus_count];
+	length = input->mLength;
+	memcpy(aWorker->mBuffer, input->mData, length);
+	other = &corpus[random32(aWorker) % corpus_count];
+	if (random32(aWorker) % 8 == 0 && other->mLength) {
+		cut = random32(aWorker) % (length + 1);
+		length = cut + other->mLength - random32(aWorker) % other->mLength;
+		if (length > opt_max_length)
+			length = opt_max_length;
+		memcpy(aWorker->mBuffer + cut, other->mData + other->mLength - (length - cut), length - cut);
+	}
+	pthread_mutex_unlock(&lock);
+	return length;
+}
+
+static unsigned int mutate(struct worker *aWorker, unsigned int aLength) {
+	static const uint8_t interesting[] = {
+		0x00, 0x01, 0x02, 0x07, 0x08, 0x0a, 0x0d, 0x10, 0x20, 0x30, 0x40, 0x55, 0x7f, 0x80, 0xaa, 0xfe, 0xff
+	};
+	unsigned char *buffer = aWorker->mBuffer;
+	unsigned int i, count = 1 << (random32(aWorker) % 4);
+
+	for (i = 0; i < count; i++) {
+		unsigned int position = aLength ? random32(aWorker) % aLength : 0;
+		unsigned int size = 1 + random32(aWorker) % 8;
+
+		switch (random32(aWorker) % 7) {
+		case 0: // flip a bit
+			if (aLength)
+				buffer[position] ^= 1 << (random32(aWorker) % 8);
+			break;
+		case 1: // random byte
+			if (aLength)
+				buffer[position] = random32(aWorker);
+			break;
+		case 2: // interesting value
+			if (aLength)
+				buffer[position] = interesting[random32(aWorker) % sizeof(interesting)];
+			break;
+		case 3: // add or subtract a little
+			if (aLength)
+				buffer[position] += random32(aWorker) % 33 - 16;
+			break;
+		case 4: // insert random bytes, possibly at the end
+			position = random32(aWorker) % (aLength + 1);
+			if (aLength + size > opt_max_length)
+				size = opt_max_length - aLength;
+			memmove(buffer + position + size, buffer + position, aLength - position);
+			for (; size; size--, aLength++)
+				buffer[position++] = random32(aWorker);
+			break;
+		case 5: // delete bytes
+			if (size > aLength - position)
+				size = aLength - position;
+			memmove(buffer + position, buffer + position + size, aLength - position - size);
+			aLength -= size;
+			break;
+		case 6: // copy bytes over from elsewhere in the input
+			if (aLength) {
+				unsigned int from = random32(aWorker) % aLength;
+				if (size > aLength - position)
+					size = aLength - position;
+				if (size > aLength - from)
+					size = aLength - from;
+				memmove(buffer + position, buffer + from, size);
+			}
+			break;
+		}
+	}
+	return aLength;
+}
+
+// Run an input, save it if it crashed, keep it if it found new edges. Crashes
+// join the corpus too, for the code their other bytes lead to.
+static void fuzz_one(struct em8051 *aCPU, struct worker *aWorker, const unsigned char *aData, unsigned int aLength) {
+	execute(aCPU, aWorker, aData, aLength);
+
+	if (aWorker->mException != -1) {
+		pthread_mutex_lock(&lock);
+		add_crash(aWorker);
+		pthread_mutex_unlock(&lock);
+	}
+	if (new_bits(aWorker->mEdges, aWorker->mVirgin)) {
+		pthread_mutex_lock(&lock);
+		if (new_bits(aWorker->mEdges, virgin) && add_input(aData, aLength, true) < 0)
+			fprintf(stderr, "Out of memory, input with new edges dropped\n");
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static void fuzz_loop(struct em8051 *aCPU, struct em8051_job *aJob) {
+	struct worker *worker = aCPU->mUserData;
+	unsigned int runs = 0;
+	bool stop;
+
+	setup_instance(aCPU, worker);
+	pthread_mutex_lock(&lock);
+	memcpy(worker->mVirgin, virgin, EDGE_MAP_SIZE);
+	stop = done;
+	pthread_mutex_unlock(&lock);
+
+	// done is only looked at under the lock, once every SYNC_RUNS runs
+	while (!stop) {
+		unsigned int length = mutate(worker, pick(worker));
+		fuzz_one(aCPU, worker, worker->mBuffer, length);
+		if (++runs == SYNC_RUNS) {
+			aJob->mTicksRun += runs;
+			pthread_mutex_lock(&lock);
+			total_runs += runs;
+			if (opt_runs && total_runs >= opt_runs)
+				done = true;
+			if (time(NULL) != status_time)
+				status();
+			stop = done;
+			pthread_mutex_unlock(&lock);
+			runs = 0;
+		}
+	}
+}
+
+// Run the input in aFilename once, and tell how it went
+static int reproduce(struct em8051 *aCPU, struct worker *aWorker, const char *aFilename) {
+	unsigned long long ticks;
+	unsigned char *data;
+	unsigned int length;
+
+	data = read_file(aFilename, &length);
+	if (!data) {
+		fprintf(stderr, "Can't read '%s'\n", aFilename);
+		return RESULT_ERROR;
+	}
+	ticks = execute(aCPU, aWorker, data, length);
+	free(data);
+
+	printf("cycles %llu\n", ticks);
+	printf("input %u of %u bytes read\n", aWorker->mPosition, length);
+	if (aWorker->mException == -1) {
+		printf("no exception, pc %04X\n", aCPU->mPC);
+		return RESULT_DONE;
+	}
+	printf("exception at %04X: %s\n", aWorker->mExceptionPC, exception_name(aWorker->mException));
+	return RESULT_CRASH;
+}
+
+// The files in -corpus, or an empty input, as the first corpus. Runs on the
+// main thread before the workers start. Returns -1 if the corpus stays empty.
+static int load_corpus(struct em8051 *aCPU, struct worker *aWorker) {
+	DIR *dir = opt_corpus ? opendir(opt_corpus) : NULL;
+	struct dirent *entry;
+
+	while (dir && (entry = readdir(dir)) != NULL) {
+		char *filename;
+		unsigned char *data;
+		unsigned int length;
+
+		if (entry->d_name[0] == '.')
+			continue;
+		filename = malloc(strlen(opt_corpus) + strlen(entry->d_name) + 2);
+		if (!filename)
+			continue;
+		sprintf(filename, "%s/%s", opt_corpus, entry->d_name);
+		data = read_file(filename, &length);
+		free(filename);
+		if (!data)
+			continue;
+		// the seeds stay whatever they cover
+		execute(aCPU, aWorker, data, length);
+		if (aWorker->mException != -1)
+			add_crash(aWorker);
+		new_bits(aWorker->mEdges, virgin);
+		if (add_input(data, length, false) < 0)
+			fprintf(stderr, "Out of memory, seed '%s' dropped\n", entry->d_name);
+		free(data);
+	}
+	if (dir)
+		closedir(dir);
+	if (corpus_count == 0 && add_input(NULL, 0, false) < 0)
+		return -1;
+	return 0;
+}
+
+static void help() {
+	printf("Help:\n\n"
+	       "emu8051-fuzz [options] filename\n\n"
+	       "Fuzzes the inputs of an intel hex file: port reads, serial receive and\n"
+	       "external memory reads take their values from generated byte streams, and the\n"
+	       "streams that reach new code or raise exceptions are kept.\n"
+	       "Available options:\n\n"
+	       "-boot=value       Machine cycles to run before the snapshot every run starts from\n"
+	       "-cycles=value     Machine cycles per run at most; default 100000\n"
+	       "-tail=value       Machine cycles to run on after the input is used up; default 1000\n"
+	       "-runs=value       Stop after about this many runs; default is to run forever\n"
+	       "-maxlen=bytes     Longest input to generate; default 1024\n"
+	       "-threads=value    Threads to fuzz on; default is one per CPU\n"
+	       "-seed=value       Random seed\n"
+	       "-corpus=dir       Seed inputs to start from; the new inputs are saved there too\n"
+	       "-crashes=dir      Where to save the inputs that raise exceptions; default '.'\n"
+	       "-ports=digits     The ports whose pins the input drives; default 0123\n"
+	       "-xread=start-end  Hex range of external memory the input is read from\n"
+	       "-stack=address    Hex SP value above which the stack overflows\n"
+	       "-codeend=address  Hex address control must stay below; default is the end\n"
+	       "                  of the loaded code, 0 for no check\n"
+	       "-run=file         Run one input, e.g. a saved crash, and tell how it went\n\n"
+	       "Serial receive: while REN is set, every %u cycles RI is raised for the next\n"
+	       "byte once the last one was taken. Once the input is used up, ports read FF.\n\n"
+	       "Exit codes: 0 done, 1 error, 2 crashes found, or the -run input crashed\n", RX_TICKS);
+}
+
+int main(int parc, char **pars) {
+	struct em8051 emu;
+	struct worker *workers;
+	struct em8051_job *jobs;
+	char *filename = NULL, *opt_run = NULL;
+	unsigned long long ticks;
+	unsigned int threads = 0, seed = (unsigned int)time(NULL);
+	int i, result;
+
+	for (i = 1; i < parc; i++) {
+		if (pars[i][0] == '-' || pars[i][0] == '/') {
+			if (strncmp("boot=", pars[i] + 1, 5) == 0) {
+				opt_boot = strtoull(pars[i] + 6, NULL, 0);
+			} else if (strncmp("cycles=", pars[i] + 1, 7) == 0) {
+				opt_cycles = strtoull(pars[i] + 8, NULL, 0);
+			} else if (strncmp("tail=", pars[i] + 1, 5) == 0) {
+				opt_tail = strtoull(pars[i] + 6, NULL, 0);
+			} else if (strncmp("runs=", pars[i] + 1, 5) == 0) {
+				opt_runs = strtoull(pars[i] + 6, NULL, 0);
+			} else if (strncmp("maxlen=", pars[i] + 1, 7) == 0) {
+				opt_max_length = atoi(pars[i] + 8);
+			} else if (strncmp("threads=", pars[i] + 1, 8) == 0) {
+				threads = atoi(pars[i] + 9);
+			} else if (strncmp("seed=", pars[i] + 1, 5) == 0) {
+				seed = strtoul(pars[i] + 6, NULL, 0);
+			} else if (strncmp("corpus=", pars[i] + 1, 7) == 0) {
+				opt_corpus = pars[i] + 8;
+			} else if (strncmp("crashes=", pars[i] + 1, 8) == 0) {
+				opt_crashes = pars[i] + 9;
+			} else if (strncmp("ports=", pars[i] + 1, 6) == 0) {
+				char *digit;
+				opt_ports = 0;
+				for (digit = pars[i] + 7; *digit >= '0' && *digit <= '3'; digit++)
+					opt_ports |= 1 << (*digit - '0');
+			} else if (strncmp("xread=", pars[i] + 1, 6) == 0) {
+				char *end;
+				opt_xread_start = strtol(pars[i] + 7, &end, 16) & 0xffff;
+				opt_xread_end = *end == '-' ? strtol(end + 1, NULL, 16) & 0xffff : opt_xread_start;
+			} else if (strncmp("stack=", pars[i] + 1, 6) == 0) {
+				opt_stack_limit = strtol(pars[i] + 7, NULL, 16);
+			} else if (strncmp("codeend=", pars[i] + 1, 8) == 0) {
+				opt_code_end = strtol(pars[i] + 9, NULL, 16) & 0xffff;
+			} else if (strncmp("run=", pars[i] + 1, 4) == 0) {
+				opt_run = pars[i] + 5;
+			} else {
+				help();
+				return RESULT_ERROR;
+			}
+		} else if (!filename) {
+			filename = pars[i];
+		} else {
+			help();
+			return RESULT_ERROR;
+		}
+	}
+	if (!filename || !opt_max_length) {
+		help();
+		return RESULT_ERROR;
+	}
+	if (!threads)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+	// the same instance as run_jobs() gives the workers, for the boot
+	if (em8051_alloc_instance(&emu, ENGINE_BLOCK) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		return RESULT_ERROR;
+	}
+	emu.mSFR[REG_SBUF] = 0;
+	if (load_obj(&emu, filename) != 0) {
+		fprintf(stderr, "File '%s' load failure\n", filename);
+		return RESULT_ERROR;
+	}
+	if (opt_code_end == -1) {
+		for (opt_code_end = emu.mCodeMemMaxIdx + 1; opt_code_end > 0; opt_code_end--)
+			if (emu.mCodeMem[opt_code_end - 1])
+				break;
+	}
+
+	for (ticks = 0; ticks < opt_boot; ) {
+		unsigned long long left = opt_boot - ticks;
+		ticks += run(&emu, left < 65536 ? (unsigned int)left : 65536);
+	}
+	boot = snapshot_take(&emu, NULL, NULL, 0);
+
+	workers = calloc(threads, sizeof(struct worker));
+	jobs = calloc(threads, sizeof(struct em8051_job));
+	if (!boot || !workers || !jobs) {
+		fprintf(stderr, "Out of memory\n");
+		return RESULT_ERROR;
+	}
+	for (i = 0; i < (int)threads; i++) {
+		workers[i].mRandom = seed * 2654435761u + i * 40503u + 1;
+		workers[i].mBuffer = malloc(opt_max_length);
+		if (!workers[i].mBuffer) {
+			fprintf(stderr, "Out of memory\n");
+			return RESULT_ERROR;
+		}
+		jobs[i].mCode = emu.mCodeMem;
+		jobs[i].mCodeSize = emu.mCodeMemMaxIdx + 1;
+		jobs[i].mSnapshot = boot;
+		jobs[i].mUserData = &workers[i];
+		jobs[i].run = fuzz_loop;
+	}
+
+	// the main thread borrows the first worker for the seeds
+	setup_instance(&emu, &workers[0]);
+	if (opt_run) {
+		result = reproduce(&emu, &workers[0], opt_run);
+	} else {
+		start_time = time(NULL);
+		memset(virgin, 0xff, EDGE_MAP_SIZE);
+		if (load_corpus(&emu, &workers[0]) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			return RESULT_ERROR;
+		}
+		fprintf(stderr, "%u seeds, code ends at %04X, fuzzing on %u threads\n", corpus_count, opt_code_end, threads);
+
+		run_jobs(jobs, threads, threads);
+
+		status();
+		result = crash_count ? RESULT_CRASH : RESULT_DONE;
+	}
+
+	for (i = 0; i < (int)corpus_count; i++)
+		free(corpus[i].mData);
+	free(corpus);
+	free(crashes);
+	for (i = 0; i < (int)threads; i++)
+		free(workers[i].mBuffer);
+	free(workers);
+	free(jobs);
+	snapshot_free(boot);
+	em8051_free_instance(&emu);
+
+	return result;
+}
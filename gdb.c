@@ -0,0 +1,756 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * gdb.c
+ * GDB remote serial protocol server
+ *
+ * Packets are handled one at a time while the target is stopped. A continue
+ * goes through run() a chunk of ticks at a time, at full speed with whatever
+ * engine is selected, and only between chunks is the connection polled for
+ * the debugger's interrupt; breakpoints and watchpoints stop run() by
+ * themselves.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#ifndef _WIN32
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A debugger that went away makes send() fail with EPIPE, which ends the
+// session like a detach, instead of raising SIGPIPE. Where there is no
+// MSG_NOSIGNAL, gdb_serve() sets SO_NOSIGPIPE on the socket.
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Largest packet, as told to the debugger
+#define GDB_PACKET_SIZE 4096
+
+// Where the memory spaces are in the debugger's address space
+#define GDB_XDATA 0x10000
+#define GDB_IDATA 0x20000
+#define GDB_SFR 0x30000
+
+// Signals in stop replies
+#define SIGNAL_INT 2
+#define SIGNAL_ILL 4
+#define SIGNAL_TRAP 5
+#define SIGNAL_SEGV 11
+
+struct gdb_session {
+	struct em8051 *mCPU;
+	int mFd;
+	bool mAck; // until QStartNoAckMode
+	unsigned char mInput[GDB_PACKET_SIZE];
+	unsigned int mInputLength, mInputPosition;
+	em8051exception mExcept; // the instance's own callback
+	int mException; // that stopped the target, or -1
+	struct em8051_breakpoints mBreakpoints; // unless the instance has its own
+	struct em8051_watchpoints mWatch; // ditto
+	char mStopReply[48];
+	unsigned long long mTicks;
+};
+
+// exceptions come without a way back to the session
+static _Thread_local struct gdb_session *current;
+
+static const char target_xml[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target version=\"1.0\">"
+	"<feature name=\"org.emu8051.core\">"
+	"<reg name=\"r0\" bitsize=\"8\" type=\"uint8\" regnum=\"0\"/>"
+	"<reg name=\"r1\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"r2\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"r3\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"r4\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"r5\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"r6\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"r7\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"a\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"b\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"psw\" bitsize=\"8\" type=\"uint8\"/>"
+	"<reg name=\"sp\" bitsize=\"8\" type=\"data_ptr\"/>"
+	"<reg name=\"dptr\" bitsize=\"16\" type=\"data_ptr\"/>"
+	"<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>"
+	"</feature>"
+	"</target>";
+
+#define REGISTER_COUNT 14
+#define REGISTER_DPTR 12
+#define REGISTER_PC 13
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(char aDigit) {
+	if (aDigit >= '0' && aDigit <= '9')
+		return aDigit - '0';
+	if (aDigit >= 'a' && aDigit <= 'f')
+		return aDigit - 'a' + 10;
+	if (aDigit >= 'A' && aDigit <= 'F')
+		return aDigit - 'A' + 10;
+	return -1;
+}
+
+static char *put_hex(char *aBuffer, uint8_t aValue) {
+	*aBuffer++ = hex_digits[aValue >> 4];
+	*aBuffer++ = hex_digits[aValue & 15];
+	return aBuffer;
+}
+
+// Hex pairs into bytes; returns the bytes, or -1 on a bad digit
+static int get_bytes(const char *aHex, uint8_t *aBytes, int aCount) {
+	int i;
+
+	for (i = 0; i < aCount; i++) {
+		int high = hex_value(aHex[i * 2]), low;
+		if (high < 0)
+			return -1;
+		low = hex_value(aHex[i * 2 + 1]);
+		if (low < 0)
+			return -1;
+		aBytes[i] = (high << 4) | low;
+	}
+	return aCount;
+}
+
+// -1 when the connection is closed
+static int get_char(struct gdb_session *aSession) {
+	if (aSession->mInputPosition == aSession->mInputLength) {
+		ssize_t length = read(aSession->mFd, aSession->mInput, sizeof(aSession->mInput));
+		if (length <= 0)
+			return -1;
+		aSession->mInputLength = (unsigned int)length;
+		aSession->mInputPosition = 0;
+	}
+	return aSession->mInput[aSession->mInputPosition++];
+}
+
+// Whether a character has arrived, without waiting
+static bool input_pending(struct gdb_session *aSession) {
+	struct pollfd poll_fd;
+
+	if (aSession->mInputPosition < aSession->mInputLength)
+		return true;
+	poll_fd.fd = aSession->mFd;
+	poll_fd.events = POLLIN;
+	return poll(&poll_fd, 1, 0) > 0;
+}
+
+// Returns false if the connection is gone
+static bool put_bytes(struct gdb_session *aSession, const char *aData, size_t aLength) {
+	return send(aSession->mFd, aData, aLength, MSG_NOSIGNAL) == (ssize_t)aLength;
+}
+
+static int put_packet(struct gdb_session *aSession, const char *aData) {
+	size_t length = strlen(aData);
+	char *packet = malloc(length + 4);
+	uint8_t checksum = 0;
+	size_t i;
+	int ch;
+
+	if (!packet)
+		return -1;
+	packet[0] = '$';
+	for (i = 0; i < length; i++) {
+		packet[i + 1] = aData[i];
+		checksum += (uint8_t)aData[i];
+	}
+	packet[length + 1] = '#';
+	put_hex(packet + length + 2, checksum);
+
+	do {
+		if (!put_bytes(aSession, packet, length + 4)) {
+			free(packet);
+			return -1;
+		}
+		// anything but an ack or a nak is lost here; the debugger waits for the reply
+		do {
+			ch = aSession->mAck ? get_char(aSession) : '+';
+		} while (ch != '+' && ch != '-' && ch >= 0);
+	} while (ch == '-');
+	free(packet);
+	return ch < 0 ? -1 : 0;
+}
+
+// Reads a packet into aBuffer, at least GDB_PACKET_SIZE bytes. Returns its
+// length, -1 if the connection closed, or -2 for an interrupt.
+static int get_packet(struct gdb_session *aSession, char *aBuffer) {
+	for (;;) {
+		int ch, length = 0;
+		uint8_t checksum = 0, sent[1];
+
+		do {
+			ch = get_char(aSession);
+			if (ch == 3)
+				return -2;
+		} while (ch != '$' && ch >= 0);
+		while (ch >= 0) {
+			ch = get_char(aSession);
+			if (ch == '#' || ch < 0)
+				break;
+			if (length < GDB_PACKET_SIZE - 1)
+				aBuffer[length++] = ch;
+			checksum += ch;
+		}
+		if (ch < 0)
+			return -1;
+		aBuffer[length] = 0;
+
+		aBuffer[length + 1] = get_char(aSession);
+		aBuffer[length + 2] = get_char(aSession);
+		if (get_bytes(aBuffer + length + 1, sent, 1) == 1 && sent[0] == checksum) {
+			if (aSession->mAck && !put_bytes(aSession, "+", 1))
+				return -1;
+			return length;
+		}
+		if (!put_bytes(aSession, "-", 1))
+			return -1;
+	}
+}
+
+static bool read_byte(struct em8051 *aCPU, uint32_t aAddress, uint8_t *aValue) {
+	uint32_t offset = aAddress & 0xffff;
+
+	switch (aAddress & ~0xffff) {
+	case 0:
+		if (offset > aCPU->mCodeMemMaxIdx)
+			return false;
+		*aValue = aCPU->mCodeMem[offset];
+		return true;
+	case GDB_XDATA:
+		if (!aCPU->mExtData || offset > aCPU->mExtDataMaxIdx)
+			return false;
+		*aValue = aCPU->mExtData[offset];
+		return true;
+	case GDB_IDATA:
+		if (offset < 0x80)
+			*aValue = aCPU->mLowerData[offset];
+		else if (offset < 0x100 && aCPU->mUpperData)
+			*aValue = aCPU->mUpperData[offset - 0x80];
+		else
+			return false;
+		return true;
+	case GDB_SFR:
+		if (offset < 0x80 || offset > 0xff)
+			return false;
+		if (offset == REG_PSW + 0x80)
+			update_parity(aCPU);
+		*aValue = aCPU->mSFR[offset - 0x80];
+		return true;
+	}
+	return false;
+}
+
+// Writes go around the callbacks, but keep the core's bookkeeping
+static bool write_byte(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue) {
+	uint32_t offset = aAddress & 0xffff;
+	uint8_t old;
+
+	if (!read_byte(aCPU, aAddress, &old))
+		return false;
+	switch (aAddress & ~0xffff) {
+	case 0:
+		aCPU->mCodeMem[offset] = aValue;
+		invalidate_code(aCPU, offset, 1);
+		break;
+	case GDB_XDATA:
+		aCPU->mExtData[offset] = aValue;
+		if (aCPU->mExtData == aCPU->mCodeMem)
+			invalidate_code(aCPU, offset, 1);
+		break;
+	case GDB_IDATA:
+		if (offset < 0x80)
+			aCPU->mLowerData[offset] = aValue;
+		else
+			aCPU->mUpperData[offset - 0x80] = aValue;
+		break;
+	case GDB_SFR:
+		aCPU->mSFR[offset - 0x80] = aValue;
+		sfr_update(aCPU, offset);
+		break;
+	}
+	return true;
+}
+
+static uint8_t *bank_register(struct em8051 *aCPU, int aRegister) {
+	int bank = (aCPU->mSFR[REG_PSW] & (PSWMASK_RS0 | PSWMASK_RS1)) >> PSW_RS0;
+	return &aCPU->mLowerData[bank * 8 + aRegister];
+}
+
+// Register aRegister as little endian hex into aBuffer; returns the end
+static char *put_register(struct em8051 *aCPU, int aRegister, char *aBuffer) {
+	static const uint8_t sfrs[] = { REG_ACC, REG_B, REG_PSW, REG_SP };
+
+	if (aRegister < 8)
+		return put_hex(aBuffer, *bank_register(aCPU, aRegister));
+	if (aRegister < REGISTER_DPTR) {
+		if (sfrs[aRegister - 8] == REG_PSW)
+			update_parity(aCPU);
+		return put_hex(aBuffer, aCPU->mSFR[sfrs[aRegister - 8]]);
+	}
+	if (aRegister == REGISTER_DPTR)
+		return put_hex(put_hex(aBuffer, aCPU->mSFR[REG_DPL]), aCPU->mSFR[REG_DPH]);
+	return put_hex(put_hex(aBuffer, aCPU->mPC & 0xff), aCPU->mPC >> 8);
+}
+
+// From little endian hex; returns the characters used, or -1
+static int set_register(struct em8051 *aCPU, int aRegister, const char *aHex) {
+	static const uint8_t sfrs[] = { REG_ACC, REG_B, REG_PSW, REG_SP };
+	uint8_t bytes[2];
+
+	if (aRegister < 0 || aRegister >= REGISTER_COUNT)
+		return -1;
+	if (get_bytes(aHex, bytes, aRegister < REGISTER_DPTR ? 1 : 2) < 0)
+		return -1;
+	if (aRegister < 8) {
+		*bank_register(aCPU, aRegister) = bytes[0];
+		return 2;
+	}
+	if (aRegister < REGISTER_DPTR) {
+		aCPU->mSFR[sfrs[aRegister - 8]] = bytes[0];
+		sfr_update(aCPU, sfrs[aRegister - 8] + 0x80);
+		return 2;
+	}
+	if (aRegister == REGISTER_DPTR) {
+		aCPU->mSFR[REG_DPL] = bytes[0];
+		aCPU->mSFR[REG_DPH] = bytes[1];
+	} else {
+		aCPU->mPC = bytes[0] | (bytes[1] << 8);
+	}
+	return 4;
+}
+
+static void session_exception(struct em8051 *aCPU, int aCode) {
+	if (current->mExcept)
+		current->mExcept(aCPU, aCode);
+	else
+		aCPU->mStop = 1;
+	if (aCPU->mStop)
+		current->mException = aCode;
+}
+
+// The stop reply for why the target stopped last
+static void stopped(struct gdb_session *aSession) {
+	struct em8051_watchpoints *watch = aSession->mCPU->mWatch;
+
+	if (aSession->mException != -1) {
+		int signal = SIGNAL_TRAP;
+		if (aSession->mException == EXCEPTION_ILLEGAL_OPCODE)
+			signal = SIGNAL_ILL;
+		else if (aSession->mException == EXCEPTION_STACK || aSession->mException == EXCEPTION_STACK_OVERFLOW ||
+			aSession->mException == EXCEPTION_WILD_JUMP)
+			signal = SIGNAL_SEGV;
+		sprintf(aSession->mStopReply, "S%02x", signal);
+	} else if (watch->mTriggered) {
+		uint32_t address = watch->mHit.mAddress & 0xffff;
+		uint8_t flags = watch->mHit.mWatchpoint->mFlags & (WATCH_READ | WATCH_WRITE);
+
+		if ((watch->mHit.mAddress & TRACE_SPACE_MASK) == TRACE_EXT)
+			address += GDB_XDATA;
+		else if ((watch->mHit.mAddress & TRACE_SPACE_MASK) == TRACE_SFR)
+			address += GDB_SFR;
+		else
+			address += GDB_IDATA;
+		sprintf(aSession->mStopReply, "T%02x%s:%x;", SIGNAL_TRAP,
+			flags == WATCH_WRITE ? "watch" : flags == WATCH_READ ? "rwatch" : "awatch", address);
+	} else {
+		sprintf(aSession->mStopReply, "S%02x", SIGNAL_TRAP);
+	}
+}
+
+static void resume(struct gdb_session *aSession) {
+	aSession->mCPU->mStop = 0;
+	aSession->mException = -1;
+	aSession->mCPU->mWatch->mTriggered = false;
+}
+
+static void step(struct gdb_session *aSession) {
+	resume(aSession);
+	// until an instruction runs, or the CPU sleeps
+	do {
+		aSession->mTicks++;
+	} while (!tick(aSession->mCPU));
+	if (INSTRUMENTED(aSession->mCPU))
+		instrument_flush();
+	stopped(aSession);
+}
+
+// Returns -1 if the connection closed meanwhile
+static int go(struct gdb_session *aSession, unsigned int aPollTicks) {
+	resume(aSession);
+	for (;;) {
+		aSession->mTicks += run(aSession->mCPU, aPollTicks);
+		if (aSession->mCPU->mStop) {
+			stopped(aSession);
+			return 0;
+		}
+		while (input_pending(aSession)) {
+			int ch = get_char(aSession);
+			if (ch < 0)
+				return -1;
+			if (ch == 3) {
+				sprintf(aSession->mStopReply, "S%02x", SIGNAL_INT);
+				return 0;
+			}
+		}
+	}
+}
+
+// Z and z packets: type,address,kind
+static const char *breakpoint(struct gdb_session *aSession, const char *aPacket) {
+	struct em8051 *cpu = aSession->mCPU;
+	bool insert = aPacket[0] == 'Z';
+	char *end;
+	int type = aPacket[1] - '0';
+	uint32_t address, length, space;
+	uint8_t flags;
+
+	if (aPacket[2] != ',')
+		return "";
+	address = strtoul(aPacket + 3, &end, 16);
+	if (*end != ',')
+		return "E01";
+	length = strtoul(end + 1, NULL, 16);
+
+	if (type == 0 || type == 1) {
+		if (address > 0xffff)
+			return "E01";
+		if (insert ? breakpoint_set(cpu->mBreakpoints, address, NULL) < 0 :
+			!breakpoint_clear(cpu->mBreakpoints, address))
+			return "E01";
+		invalidate_code(cpu, address, 1);
+		return "OK";
+	}
+	if (type < 2 || type > 4)
+		return "";
+
+	switch (address & ~0xffff) {
+	case GDB_XDATA:
+		space = TRACE_EXT;
+		break;
+	case GDB_IDATA:
+		space = TRACE_DATA;
+		break;
+	case GDB_SFR:
+		space = TRACE_SFR;
+		break;
+	default:
+		return "E01";
+	}
+	address = space | (address & 0xffff);
+	flags = type == 2 ? WATCH_WRITE : type == 3 ? WATCH_READ : WATCH_READ | WATCH_WRITE;
+	if (!insert)
+		return watch_remove(cpu->mWatch, address, length, flags) ? "OK" : "E01";
+	if (watch_add(cpu->mWatch, address, length, flags, 0, 0) < 0)
+		return "E01";
+	return "OK";
+}
+
+// qXfer:features:read:target.xml:offset,length
+static void features(const char *aArguments, char *aReply) {
+	unsigned long offset, length;
+	char *end;
+
+	if (strncmp(aArguments, "target.xml:", 11) != 0) {
+		strcpy(aReply, "E00");
+		return;
+	}
+	offset = strtoul(aArguments + 11, &end, 16);
+	if (*end != ',') {
+		strcpy(aReply, "E01");
+		return;
+	}
+	length = strtoul(end + 1, NULL, 16);
+	if (offset > sizeof(target_xml) - 1)
+		offset = sizeof(target_xml) - 1;
+	if (length > GDB_PACKET_SIZE - 2)
+		length = GDB_PACKET_SIZE - 2;
+	if (length >= sizeof(target_xml) - 1 - offset) {
+		aReply[0] = 'l';
+		length = sizeof(target_xml) - 1 - offset;
+	} else {
+		aReply[0] = 'm';
+	}
+	memcpy(aReply + 1, target_xml + offset, length);
+	aReply[length + 1] = 0;
+}
+
+// qRcmd: "monitor" commands, hex encoded
+static const char *monitor(struct gdb_session *aSession, const char *aHex) {
+	char command[64];
+	int length = (int)strlen(aHex) / 2;
+
+	if (length >= (int)sizeof(command) || get_bytes(aHex, (uint8_t *)command, length) < 0)
+		return "E01";
+	command[length] = 0;
+	if (strcmp(command, "reset") == 0) {
+		reset(aSession->mCPU, false);
+		return "OK";
+	}
+	return "";
+}
+
+// Answers aPacket into aReply; returns false when the session is over
+static bool handle(struct gdb_session *aSession, char *aPacket, char *aReply, unsigned int aPollTicks) {
+	struct em8051 *cpu = aSession->mCPU;
+	unsigned long address, length, i;
+	char *end, *out = aReply;
+
+	aReply[0] = 0;
+	switch (aPacket[0]) {
+	case '?':
+		strcpy(aReply, aSession->mStopReply);
+		break;
+	case 'g':
+		for (i = 0; i < REGISTER_COUNT; i++)
+			out = put_register(cpu, i, out);
+		*out = 0;
+		break;
+	case 'G':
+		for (i = 0, end = aPacket + 1; i < REGISTER_COUNT; i++) {
+			int used = set_register(cpu, i, end);
+			if (used < 0)
+				break;
+			end += used;
+		}
+		strcpy(aReply, i == REGISTER_COUNT ? "OK" : "E01");
+		break;
+	case 'p':
+		i = strtoul(aPacket + 1, NULL, 16);
+		if (i < REGISTER_COUNT)
+			*put_register(cpu, i, aReply) = 0;
+		else
+			strcpy(aReply, "E01");
+		break;
+	case 'P':
+		i = strtoul(aPacket + 1, &end, 16);
+		strcpy(aReply, *end == '=' && set_register(cpu, i, end + 1) >= 0 ? "OK" : "E01");
+		break;
+	case 'm':
+		address = strtoul(aPacket + 1, &end, 16);
+		if (*end != ',') {
+			strcpy(aReply, "E01");
+			break;
+		}
+		length = strtoul(end + 1, NULL, 16);
+		if (length > (GDB_PACKET_SIZE - 1) / 2)
+			length = (GDB_PACKET_SIZE - 1) / 2;
+		for (i = 0; i < length; i++) {
+			uint8_t value;
+			if (!read_byte(cpu, address + i, &value))
+				break;
+			out = put_hex(out, value);
+		}
+		*out = 0;
+		if (!i && length)
+			strcpy(aReply, "E01");
+		break;
+	case 'M':
+		address = strtoul(aPacket + 1, &end, 16);
+		if (*end != ',') {
+			strcpy(aReply, "E01");
+			break;
+		}
+		length = strtoul(end + 1, &end, 16);
+		strcpy(aReply, *end == ':' ? "OK" : "E01");
+		for (i = 0; i < length && *end == ':'; i++) {
+			uint8_t value;
+			if (get_bytes(end + 1 + i * 2, &value, 1) < 0 || !write_byte(cpu, address + i, value)) {
+				strcpy(aReply, "E01");
+				break;
+			}
+		}
+		break;
+	case 'c':
+	case 's':
+		if (aPacket[1])
+			cpu->mPC = strtoul(aPacket + 1, NULL, 16);
+		if (aPacket[0] == 's')
+			step(aSession);
+		else if (go(aSession, aPollTicks) < 0)
+			return false;
+		strcpy(aReply, aSession->mStopReply);
+		break;
+	case 'Z':
+	case 'z':
+		strcpy(aReply, breakpoint(aSession, aPacket));
+		break;
+	case 'H':
+	case 'T':
+		strcpy(aReply, "OK");
+		break;
+	case 'D':
+		put_packet(aSession, "OK");
+		return false;
+	case 'k':
+		return false;
+	case 'q':
+		if (strncmp(aPacket, "qSupported", 10) == 0)
+			sprintf(aReply, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+", GDB_PACKET_SIZE);
+		else if (strncmp(aPacket, "qXfer:features:read:", 20) == 0)
+			features(aPacket + 20, aReply);
+		else if (strcmp(aPacket, "qAttached") == 0)
+			strcpy(aReply, "1");
+		else if (strncmp(aPacket, "qRcmd,", 6) == 0)
+			strcpy(aReply, monitor(aSession, aPacket + 6));
+		break;
+	case 'Q':
+		if (strcmp(aPacket, "QStartNoAckMode") == 0) {
+			if (put_packet(aSession, "OK") < 0)
+				return false;
+			aSession->mAck = false;
+			return true;
+		}
+		break;
+	}
+	return put_packet(aSession, aReply) == 0;
+}
+
+unsigned long long gdb_serve(struct em8051 *aCPU, int aFd, unsigned int aPollTicks) {
+	struct gdb_session *session = calloc(1, sizeof(struct gdb_session));
+	struct em8051_breakpoints *breakpoints = aCPU->mBreakpoints;
+	struct em8051_watchpoints *watch = aCPU->mWatch;
+	char *packet = malloc(GDB_PACKET_SIZE + 2), *reply = malloc(GDB_PACKET_SIZE + 1);
+	unsigned long long ticks;
+#ifdef SO_NOSIGPIPE
+	int one = 1;
+
+	setsockopt(aFd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+	if (!session || !packet || !reply) {
+		free(session);
+		free(packet);
+		free(reply);
+		return 0;
+	}
+	session->mCPU = aCPU;
+	session->mFd = aFd;
+	session->mAck = true;
+	session->mExcept = aCPU->except;
+	session->mException = -1;
+	strcpy(session->mStopReply, "S05");
+	current = session;
+	aCPU->except = session_exception;
+	if (!breakpoints)
+		aCPU->mBreakpoints = &session->mBreakpoints;
+	if (!watch)
+		aCPU->mWatch = &session->mWatch;
+	// blocks built before may run over the breakpoints to come
+	invalidate_code(aCPU, 0, aCPU->mCodeMemMaxIdx + 1);
+
+	for (;;) {
+		int length = get_packet(session, packet);
+		if (length == -1)
+			break;
+		// an interrupt with the target stopped has nothing to stop
+		if (length == -2)
+			continue;
+		if (!handle(session, packet, reply, aPollTicks ? aPollTicks : 1))
+			break;
+	}
+
+	aCPU->except = session->mExcept;
+	aCPU->mBreakpoints = breakpoints;
+	aCPU->mWatch = watch;
+	aCPU->mStop = 0;
+	breakpoint_clear_all(&session->mBreakpoints);
+	watch_clear_all(&session->mWatch);
+	invalidate_code(aCPU, 0, aCPU->mCodeMemMaxIdx + 1);
+	current = NULL;
+	ticks = session->mTicks;
+	free(session);
+	free(packet);
+	free(reply);
+	return ticks;
+}
+
+int gdb_accept(const char *aAddress) {
+	int listener, fd, one = 1;
+
+	if (strchr(aAddress, '/')) {
+		struct sockaddr_un address;
+
+		if (strlen(aAddress) >= sizeof(address.sun_path))
+			return -1;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, aAddress);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+			return -1;
+		unlink(aAddress);
+		if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0) {
+			close(listener);
+			return -1;
+		}
+		fd = accept(listener, NULL, NULL);
+		close(listener);
+		unlink(aAddress);
+		return fd;
+	} else {
+		struct sockaddr_in address;
+
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = htons((uint16_t)atoi(aAddress + (aAddress[0] == ':')));
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (listener < 0)
+			return -1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0) {
+			close(listener);
+			return -1;
+		}
+		fd = accept(listener, NULL, NULL);
+		close(listener);
+		if (fd >= 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		return fd;
+	}
+}
+
+#else
+
+int gdb_accept(const char *aAddress) {
+	return -1;
+}
+
+unsigned long long gdb_serve(struct em8051 *aCPU, int aFd, unsigned int aPollTicks) {
+	return 0;
+}
+
+#endif
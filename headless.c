@@ -0,0 +1,530 @@
+/* 8051 emulator
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * headless.c
+ * Batch front-end without a terminal: runs a program and dumps the final state
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emu8051.h"
+
+// exit codes
+enum HEADLESS_RESULT {
+	RESULT_DONE = 0, // ran all cycles, or reached the stop condition
+	RESULT_ERROR = 1, // bad arguments or load failure
+	RESULT_EXCEPTION = 2, // stopped on an exception
+	RESULT_TIMEOUT = 3, // -pc or -halt given, but the cycles ran out first
+	RESULT_DIVERGED = 4 // -lockstep found the engines disagree
+};
+
+// One program run, see main()
+struct program {
+	char *mFilename;
+	int mException; // -1 if none
+	int mResult; // see HEADLESS_RESULT
+	// final state, saved before the instance is freed
+	struct em8051 mState;
+	unsigned char mUpperData[128];
+	char mAssembly[128];
+	int mIndex;
+	struct em8051_trace *mTrace;
+	struct em8051_profile *mProfile;
+	struct em8051_watchpoints mWatch;
+};
+
+static int opt_halt = 0;
+static int opt_exceptions = 1;
+static int opt_stop_pc = -1;
+static char *opt_trace = NULL;
+static unsigned long long opt_trace_size = 0;
+static char *opt_profile = NULL;
+static char *opt_callgrind = NULL;
+static char *opt_lcov = NULL;
+static char *opt_cobertura = NULL;
+static int opt_lockstep = -1;
+static unsigned int opt_lockstep_size = 1;
+static char **opt_watch = NULL;
+static int opt_watch_count = 0;
+static char *opt_gdb = NULL;
+static unsigned int opt_gdb_poll = 100000;
+static unsigned int opt_lanes = 1;
+static unsigned int opt_lane_step = 10000;
+static struct em8051_lines *lines = NULL;
+static struct em8051_symbols *symbols = NULL;
+static int multiple_files;
+
+static void headless_exception(struct em8051 *aCPU, int aCode) {
+	struct program *program = aCPU->mUserData;
+	fprintf(stderr, "%s: exception at %04X: %s\n", program->mFilename, aCPU->mPC, exception_name(aCode));
+	if (opt_exceptions) {
+		program->mException = aCode;
+		aCPU->mStop = 1;
+	}
+}
+
+static void headless_watch(struct em8051 *aCPU, const struct em8051_watch_hit *aHit) {
+	struct program *program = aCPU->mUserData;
+	char description[48];
+
+	watch_describe(aHit, description);
+	fprintf(stderr, "%s: watchpoint %s\n", program->mFilename, description);
+	if (!(aHit->mWatchpoint->mFlags & WATCH_LOG))
+		program->mResult = RESULT_DONE;
+}
+
+static void headless_sfrwrite_SBUF(struct em8051 *aCPU, uint8_t aRegister) {
+	aCPU->serial_out_remaining_bits = 8;
+}
+
+// Power down, or idle with nothing that could wake the CPU up
+static bool halted(struct em8051 *aCPU) {
+	return (aCPU->mSFR[REG_PCON] & 0x02) ||
+		((aCPU->mSFR[REG_PCON] & 0x01) && !(aCPU->mSFR[REG_IE] & IEMASK_EA));
+}
+
+static void headless_sfrwrite_PCON(struct em8051 *aCPU, uint8_t aRegister) {
+	if (opt_halt && halted(aCPU))
+		aCPU->mStop = 1;
+}
+
+static void dump_memory(const char *aName, unsigned char *aMemory, int aOffset, int aLength) {
+	int i;
+	for (i = 0; i < aLength; i++) {
+		if (i % 16 == 0)
+			printf("%s %02X:", aName, aOffset + i);
+		printf(" %02X", aMemory[i]);
+		if (i % 16 == 15)
+			printf("\n");
+	}
+}
+
+static void dump_state(struct program *aProgram, unsigned long long aTicks) {
+	struct em8051 *cpu = &aProgram->mState;
+	int bank, i;
+
+	bank = ((cpu->mSFR[REG_PSW] & (PSWMASK_RS0 | PSWMASK_RS1)) >> PSW_RS0);
+
+	printf("cycles %llu\n", aTicks);
+	printf("pc %04X", cpu->mPC);
+	if (symbols) {
+		unsigned int offset;
+		const char *name = symbols_find(symbols, TRACE_CODE | cpu->mPC, &offset);
+		if (name && offset)
+			printf(" <%s+%u>", name, offset);
+		else if (name)
+			printf(" <%s>", name);
+	}
+	printf("  %s\n", aProgram->mAssembly);
+	printf("a %02X  b %02X  psw %02X  sp %02X  dptr %02X%02X\n",
+		cpu->mSFR[REG_ACC], cpu->mSFR[REG_B], cpu->mSFR[REG_PSW], cpu->mSFR[REG_SP],
+		cpu->mSFR[REG_DPH], cpu->mSFR[REG_DPL]);
+	printf("bank %d ", bank);
+	for (i = 0; i < 8; i++)
+		printf(" r%d %02X", i, cpu->mLowerData[bank * 8 + i]);
+	printf("\n");
+	dump_memory("sfr", cpu->mSFR, 0x80, 128);
+	dump_memory("lower", cpu->mLowerData, 0, 128);
+	dump_memory("upper", aProgram->mUpperData, 0x80, 128);
+
+	printf("serial");
+	for (i = 0; i < (int)sizeof(cpu->serial_out); i++)
+		printf(" %02X", (unsigned char)cpu->serial_out[(cpu->serial_out_idx + i) % sizeof(cpu->serial_out)]);
+	printf("\n");
+}
+
+// The -lines, or else the source lines of the -symbols files if they have any
+static struct em8051_lines *source_lines(void) {
+	const char *file;
+	unsigned int line;
+
+	if (lines || !symbols || !symbols_line(symbols, 0xffff, &file, &line))
+		return lines;
+	return symbols_lines(symbols);
+}
+
+// One output file per program: aName, or aName-index with several files
+static char *output_name(const char *aName, struct program *aProgram) {
+	char *filename = malloc(strlen(aName) + 16);
+
+	if (multiple_files)
+		sprintf(filename, "%s-%d", aName, aProgram->mIndex);
+	else
+		strcpy(filename, aName);
+	return filename;
+}
+
+static void setup_program(struct em8051 *aCPU, struct em8051_job *aJob) {
+	struct program *program = aCPU->mUserData;
+
+	aCPU->except = &headless_exception;
+	aCPU->sfrwrite[REG_SBUF] = headless_sfrwrite_SBUF;
+	aCPU->sfrwrite[REG_PCON] = headless_sfrwrite_PCON;
+
+	if (opt_trace) {
+		char *filename = output_name(opt_trace, program);
+		program->mTrace = trace_open(aCPU, filename, opt_trace_size);
+		if (!program->mTrace)
+			fprintf(stderr, "%s: can't create trace file '%s'\n", program->mFilename, filename);
+		free(filename);
+	}
+	if (opt_profile || opt_callgrind) {
+		program->mProfile = profile_start(aCPU);
+		if (!program->mProfile)
+			fprintf(stderr, "%s: out of memory for the profile\n", program->mFilename);
+		else
+			profile_symbols(program->mProfile, symbols);
+	}
+	if (opt_lcov || opt_cobertura) {
+		aCPU->mCoverage = calloc(aCPU->mCodeMemMaxIdx + 1, 1);
+		if (!aCPU->mCoverage)
+			fprintf(stderr, "%s: out of memory for the coverage\n", program->mFilename);
+	}
+	if (opt_watch_count) {
+		int i;
+		for (i = 0; i < opt_watch_count; i++)
+			if (watch_parse(&program->mWatch, opt_watch[i]) < 0)
+				fprintf(stderr, "%s: out of memory for watchpoint '%s'\n", program->mFilename, opt_watch[i]);
+		program->mWatch.log = headless_watch;
+		aCPU->mWatch = &program->mWatch;
+	}
+}
+
+// run() may go past the -pc address, so step instead
+static void run_to_pc(struct em8051 *aCPU, struct em8051_job *aJob) {
+	while (aJob->mTicksRun < aJob->mTicks) {
+		aJob->mTicksRun++;
+		if (tick(aCPU) && aCPU->mPC == opt_stop_pc) {
+			((struct program *)aCPU->mUserData)->mResult = RESULT_DONE;
+			break;
+		}
+		if (aCPU->mStop)
+			break;
+	}
+}
+
+// Run the -engine engine against the -lockstep one
+static void run_lockstep(struct em8051 *aCPU, struct em8051_job *aJob) {
+	struct program *program = aCPU->mUserData;
+	struct em8051 *reference = lockstep_reference(aCPU, opt_lockstep);
+	struct em8051_divergence divergence;
+
+	if (!reference) {
+		fprintf(stderr, "%s: out of memory for the reference\n", program->mFilename);
+		return;
+	}
+	while (aJob->mTicksRun < aJob->mTicks) {
+		unsigned long long left = aJob->mTicks - aJob->mTicksRun;
+		aJob->mTicksRun += lockstep_run(aCPU, reference, left < 65536 ? (unsigned int)left : 65536,
+			opt_lockstep_size, &divergence);
+		if (divergence.mWhat[0]) {
+			fprintf(stderr, "%s: engines diverge after %llu cycles, at %04X  %s: %s is %02X with %s, %02X with %s\n",
+				program->mFilename, aJob->mTicksRun, divergence.mPC, divergence.mAssembly, divergence.mWhat,
+				divergence.mExpected, engine_name(opt_lockstep), divergence.mActual, engine_name(aCPU->mEngine));
+			program->mResult = RESULT_DIVERGED;
+			break;
+		}
+		if (aCPU->mStop)
+			break;
+	}
+	lockstep_free(reference);
+}
+
+// Serve a debugger instead of running
+static void run_gdb(struct em8051 *aCPU, struct em8051_job *aJob) {
+	struct program *program = aCPU->mUserData;
+	int fd;
+
+	fprintf(stderr, "%s: waiting for the debugger on %s\n", program->mFilename, opt_gdb);
+	fd = gdb_accept(opt_gdb);
+	if (fd < 0) {
+		fprintf(stderr, "%s: can't listen on %s\n", program->mFilename, opt_gdb);
+		program->mResult = RESULT_ERROR;
+		return;
+	}
+	aJob->mTicksRun = gdb_serve(aCPU, fd, opt_gdb_poll);
+	close(fd);
+}
+
+static void finish_program(struct em8051 *aCPU, struct em8051_job *aJob) {
+	struct program *program = aCPU->mUserData;
+
+	update_parity(aCPU);
+	if (opt_halt && halted(aCPU))
+		program->mResult = RESULT_DONE;
+	if (program->mException != -1)
+		program->mResult = RESULT_EXCEPTION;
+
+	if (program->mTrace && trace_close(program->mTrace) < 0)
+		fprintf(stderr, "%s: writing the trace failed\n", program->mFilename);
+	if (program->mProfile) {
+		if (opt_profile) {
+			char *filename = output_name(opt_profile, program);
+			if (profile_report(program->mProfile, filename) < 0)
+				fprintf(stderr, "%s: can't write profile '%s'\n", program->mFilename, filename);
+			free(filename);
+		}
+		if (opt_callgrind) {
+			char *filename = output_name(opt_callgrind, program);
+			if (profile_callgrind(program->mProfile, filename) < 0)
+				fprintf(stderr, "%s: can't write profile '%s'\n", program->mFilename, filename);
+			free(filename);
+		}
+		profile_free(program->mProfile);
+	}
+	if (aCPU->mCoverage) {
+		if (opt_lcov) {
+			char *filename = output_name(opt_lcov, program);
+			if (coverage_lcov(aCPU, source_lines(), NULL, filename) < 0)
+				fprintf(stderr, "%s: can't write coverage '%s'\n", program->mFilename, filename);
+			free(filename);
+		}
+		if (opt_cobertura) {
+			char *filename = output_name(opt_cobertura, program);
+			if (coverage_cobertura(aCPU, source_lines(), filename) < 0)
+				fprintf(stderr, "%s: can't write coverage '%s'\n", program->mFilename, filename);
+			free(filename);
+		}
+		free(aCPU->mCoverage);
+		aCPU->mCoverage = NULL;
+	}
+	watch_clear_all(&program->mWatch);
+	aCPU->mWatch = NULL;
+
+	decode(aCPU, aCPU->mPC, program->mAssembly);
+	memcpy(&program->mState, aCPU, sizeof(*aCPU));
+	memcpy(program->mUpperData, aCPU->mUpperData, 128);
+}
+
+static void help() {
+	printf("Help:\n\n"
+	       "emu8051-run [options] filename [filename...]\n\n"
+	       "Runs intel hex, OMF-51, ELF or raw binary (.bin) files without a user interface\n"
+	       "and dumps the final state.\n"
+	       "Several files run in parallel, and are dumped in order.\n"
+	       "Available options:\n\n"
+	       "-cycles=value     Stop after this many machine cycles (12 clocks each)\n"
+	       "-pc=address       Stop when PC reaches this hex address\n"
+	       "-halt             Stop on power down, or idle with interrupts disabled\n"
+	       "-noexc            Report exceptions, but don't stop on them\n"
+	       "-engine=name      Execution engine: table, switch, threaded, block (default) or jit\n"
+	       "-threads=value    Threads to use for several files; default is one per CPU\n"
+	       "-trace=file       Write a BAP frame trace of every instruction; with several\n"
+	       "                  files, into file-0, file-1 and so on\n"
+	       "-tracesize=bytes  Start a new trace file, file.1, file.2..., at this size\n"
+	       "-profile=file     Write the cycles per function, call graph edge and\n"
+	       "                  address; with several files, into file-0 and so on\n"
+	       "-callgrind=file   Write the same profile for KCachegrind\n"
+	       "-lcov=file        Write the instruction and branch coverage as lcov data\n"
+	       "-cobertura=file   Write the same as a Cobertura XML report\n"
+	       "-lines=file       Source lines for the coverage: an assembler listing, or\n"
+	       "                  NoICE debug info; without, lines are code addresses\n"
+	       "-symbols=file     Symbols and source lines for the profile, the coverage and\n"
+	       "                  the final pc, from a SDCC CDB, OMF-51 or ELF file; may be\n"
+	       "                  repeated. -lines takes precedence for the coverage\n"
+	       "-lockstep=name    Run a reference engine alongside the -engine one, compare\n"
+	       "                  the whole state after every step, and report the first\n"
+	       "                  instruction where they differ\n"
+	       "-lockstepsize=n   Cycles per step; default 1, more lets block and jit chain\n"
+	       "                  blocks\n"
+	       "-watch=spec       Report accesses to memory and stop after the instruction;\n"
+	       "                  may be repeated. spec is space:address[+length] in hex,\n"
+	       "                  space being data, sfr or xdata, then any of ,r ,w ,rw\n"
+	       "                  (default w), ,=value or ,=value&mask in hex, and ,log to\n"
+	       "                  report without stopping; e.g. -watch=xdata:1F00+2,=0&80\n"
+	       "-gdb=port         Wait for GDB to connect to this TCP port on localhost, or\n"
+	       "                  Unix socket if it has a '/', and let it run the file\n"
+	       "-gdbpoll=cycles   Cycles run between checks for an interrupt from GDB;\n"
+	       "                  default 100000\n"
+	       "-lanes=n          Run every file n times, as lanes that share its code memory,\n"
+	       "                  decode cache and JIT code, and dump each run like a file\n"
+	       "-lanestep=cycles  Cycles a lane runs before the next one takes its turn;\n"
+	       "                  default 10000\n\n"
+	       "At least one of -cycles, -pc, -halt and -gdb is needed. -pc checks the PC after\n"
+	       "every instruction, so it runs without the block and jit engines, as do\n"
+	       "-trace, -profile, -callgrind, -lcov, -cobertura and -watch. -pc, -lockstep\n"
+	       "and -gdb don't go together, and -gdb takes a single file and no -lanes.\n\n"
+	       "Exit codes: 0 done, 1 error, 2 exception, 3 cycles ran out before -pc or -halt,\n"
+	       "4 the engines diverged; the highest one of all files\n");
+}
+
+int main(int parc, char **pars) {
+	struct em8051_job *jobs;
+	struct program *programs;
+	unsigned long long max_ticks = 0;
+	unsigned int count = 0, threads = 0;
+	uint8_t engine = ENGINE_BLOCK;
+	int has_limit = 0;
+	int result = RESULT_DONE;
+	int i;
+
+	jobs = calloc(parc, sizeof(struct em8051_job));
+	programs = calloc(parc, sizeof(struct program));
+
+	for (i = 1; i < parc; i++) {
+		if (pars[i][0] == '-' || pars[i][0] == '/') {
+			if (strncmp("cycles=", pars[i] + 1, 7) == 0) {
+				max_ticks = strtoull(pars[i] + 8, NULL, 0);
+				has_limit = 1;
+			} else if (strncmp("pc=", pars[i] + 1, 3) == 0) {
+				opt_stop_pc = strtol(pars[i] + 4, NULL, 16) & 0xffff;
+			} else if (strcmp("halt", pars[i] + 1) == 0) {
+				opt_halt = 1;
+			} else if (strcmp("noexc", pars[i] + 1) == 0) {
+				opt_exceptions = 0;
+			} else if (strncmp("trace=", pars[i] + 1, 6) == 0) {
+				opt_trace = pars[i] + 7;
+			} else if (strncmp("tracesize=", pars[i] + 1, 10) == 0) {
+				opt_trace_size = strtoull(pars[i] + 11, NULL, 0);
+			} else if (strncmp("profile=", pars[i] + 1, 8) == 0) {
+				opt_profile = pars[i] + 9;
+			} else if (strncmp("callgrind=", pars[i] + 1, 10) == 0) {
+				opt_callgrind = pars[i] + 11;
+			} else if (strncmp("lcov=", pars[i] + 1, 5) == 0) {
+				opt_lcov = pars[i] + 6;
+			} else if (strncmp("cobertura=", pars[i] + 1, 10) == 0) {
+				opt_cobertura = pars[i] + 11;
+			} else if (strncmp("lines=", pars[i] + 1, 6) == 0) {
+				lines = lines_load(pars[i] + 7);
+				if (!lines) {
+					fprintf(stderr, "Can't read source lines from '%s'\n", pars[i] + 7);
+					return RESULT_ERROR;
+				}
+			} else if (strncmp("symbols=", pars[i] + 1, 8) == 0) {
+				int loaded = -9;
+				if (!symbols)
+					symbols = symbols_new();
+				if (symbols)
+					loaded = load_image(NULL, pars[i] + 9, symbols, NULL);
+				if (loaded < 0) {
+					fprintf(stderr, "Can't read symbols from '%s': %s\n", pars[i] + 9, load_error(loaded));
+					return RESULT_ERROR;
+				}
+			} else if (strncmp("threads=", pars[i] + 1, 8) == 0) {
+				threads = atoi(pars[i] + 9);
+			} else if (strncmp("engine=", pars[i] + 1, 7) == 0 && engine_by_name(pars[i] + 8) != -1) {
+				engine = engine_by_name(pars[i] + 8);
+			} else if (strncmp("lockstep=", pars[i] + 1, 9) == 0 && engine_by_name(pars[i] + 10) != -1) {
+				opt_lockstep = engine_by_name(pars[i] + 10);
+			} else if (strncmp("lockstepsize=", pars[i] + 1, 13) == 0) {
+				opt_lockstep_size = strtoul(pars[i] + 14, NULL, 0);
+			} else if (strncmp("watch=", pars[i] + 1, 6) == 0) {
+				struct em8051_watchpoints check;
+				memset(&check, 0, sizeof(check));
+				if (watch_parse(&check, pars[i] + 7) == -1) {
+					fprintf(stderr, "Bad watchpoint '%s'\n", pars[i] + 7);
+					return RESULT_ERROR;
+				}
+				watch_clear_all(&check);
+				opt_watch = realloc(opt_watch, (opt_watch_count + 1) * sizeof(char *));
+				opt_watch[opt_watch_count++] = pars[i] + 7;
+			} else if (strncmp("gdb=", pars[i] + 1, 4) == 0) {
+				opt_gdb = pars[i] + 5;
+			} else if (strncmp("gdbpoll=", pars[i] + 1, 8) == 0) {
+				opt_gdb_poll = strtoul(pars[i] + 9, NULL, 0);
+			} else if (strncmp("lanes=", pars[i] + 1, 6) == 0 && strtoul(pars[i] + 7, NULL, 0) > 0) {
+				opt_lanes = strtoul(pars[i] + 7, NULL, 0);
+			} else if (strncmp("lanestep=", pars[i] + 1, 9) == 0 && strtoul(pars[i] + 10, NULL, 0) > 0) {
+				opt_lane_step = strtoul(pars[i] + 10, NULL, 0);
+			} else {
+				help();
+				return RESULT_ERROR;
+			}
+		} else {
+			jobs[count++].mFilename = pars[i];
+		}
+	}
+
+	if (!count || (!has_limit && opt_stop_pc == -1 && !opt_halt && !opt_gdb) ||
+		(opt_lockstep != -1 && opt_stop_pc != -1) ||
+		(opt_gdb && (count > 1 || opt_stop_pc != -1 || opt_lockstep != -1 || opt_lanes > 1))) {
+		help();
+		return RESULT_ERROR;
+	}
+	if (opt_lanes > 1) {
+		// every file once per lane, the lanes of a file next to each other
+		jobs = realloc(jobs, count * opt_lanes * sizeof(struct em8051_job));
+		programs = realloc(programs, count * opt_lanes * sizeof(struct program));
+		if (!jobs || !programs) {
+			fprintf(stderr, "Out of memory\n");
+			return RESULT_ERROR;
+		}
+		memset(programs, 0, count * opt_lanes * sizeof(struct program));
+		for (i = count * opt_lanes - 1; i >= 0; i--) {
+			char *filename = jobs[i / opt_lanes].mFilename;
+			memset(&jobs[i], 0, sizeof(jobs[i]));
+			jobs[i].mFilename = filename;
+		}
+		count *= opt_lanes;
+	}
+	multiple_files = count > 1;
+
+	for (i = 0; i < (int)count; i++) {
+		programs[i].mFilename = jobs[i].mFilename;
+		programs[i].mIndex = i;
+		programs[i].mException = -1;
+		programs[i].mResult = (opt_stop_pc == -1 && !opt_halt) ? RESULT_DONE : RESULT_TIMEOUT;
+		jobs[i].mTicks = has_limit ? max_ticks : ~0ULL;
+		jobs[i].mEngine = engine;
+		jobs[i].mUserData = &programs[i];
+		jobs[i].setup = setup_program;
+		jobs[i].run = opt_gdb ? run_gdb : opt_stop_pc != -1 ? run_to_pc : opt_lockstep != -1 ? run_lockstep : NULL;
+		jobs[i].finish = finish_program;
+	}
+
+	if (opt_lanes > 1) {
+		if (run_lanes(jobs, count, opt_lanes, opt_lane_step, threads) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			return RESULT_ERROR;
+		}
+	} else {
+		run_jobs(jobs, count, threads);
+	}
+
+	for (i = 0; i < (int)count; i++) {
+		if (multiple_files)
+			printf("file %s\n", jobs[i].mFilename);
+		if (jobs[i].mResult != 0) {
+			if (jobs[i].mLoad.mLine && jobs[i].mResult != -1)
+				fprintf(stderr, "File '%s' load failure: %s Line %u.\n", jobs[i].mFilename, load_error(jobs[i].mResult), jobs[i].mLoad.mLine);
+			else
+				fprintf(stderr, "File '%s' load failure: %s\n", jobs[i].mFilename, load_error(jobs[i].mResult));
+			programs[i].mResult = RESULT_ERROR;
+		} else {
+			dump_state(&programs[i], jobs[i].mTicksRun);
+		}
+		if (programs[i].mResult > result)
+			result = programs[i].mResult;
+	}
+
+	lines_free(lines);
+	symbols_free(symbols);
+	free(opt_watch);
+	free(programs);
+	free(jobs);
+
+	return result;
+}
@@ -0,0 +1,496 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * history.c
+ * Execution history stored as the changes made by each instruction
+ *
+ * The records are appended to chunks. A chunk starts with the full state, so
+ * any instruction can be rebuilt by applying the records of its chunk up to
+ * it. A record is one header byte, the instruction address only when it
+ * doesn't follow from the previous one, and an address and value pair for
+ * each byte of internal memory or SFRs that changed. Full chunks can be
+ * compressed with a small LZ4-style compressor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+// bytes of records per chunk
+#define CHUNK_SIZE 65536
+
+// state: lower data, SFRs at their direct addresses, then upper data
+#define STATE_SIZE 384
+#define UPPER_OFFSET 256
+
+// record header: instruction length, explicit address, and the number of
+// changed bytes in lower data and SFRs; RECORD_ESCAPE means two bytes with
+// that count, and a byte with the changes in upper data follow
+#define RECORD_LENGTH 0x03
+#define RECORD_PC 0x04
+#define RECORD_COUNT_SHIFT 3
+#define RECORD_ESCAPE 31
+
+// header, address, escape counts and every byte changed
+#define RECORD_MAX_SIZE (1 + 2 + 3 + 2 * STATE_SIZE)
+
+// compression hash table size
+#define HASH_BITS 12
+
+struct history_chunk {
+	unsigned long long mFirst; // index of the first instruction
+	unsigned int mCount;
+	unsigned char mKey[STATE_SIZE]; // state before the first instruction
+	unsigned char *mData;
+	unsigned int mSize; // bytes in mData
+	bool mCompressed;
+};
+
+// Position in the records, with the state after the instruction before it
+struct history_cursor {
+	unsigned long long mIndex; // next instruction
+	unsigned int mOffset; // its record in the chunk data
+	unsigned char mState[STATE_SIZE];
+	uint16_t mPC; // address of the previous instruction
+	uint8_t mLength; // and its length
+};
+
+struct em8051_history {
+	bool mCompress;
+	unsigned int mMaxChunks;
+	unsigned long long mCount;
+	struct history_chunk *mChunks; // oldest first; only the last one is open
+	unsigned int mChunkCount;
+	unsigned int mChunkSize;
+	struct history_cursor mEnd; // after the last instruction
+	// reading
+	struct history_cursor mRead;
+	unsigned long long mReadChunk; // mFirst of the chunk mRead is in, or ~0 if none
+	unsigned char *mBuffer; // decompressed chunk
+	unsigned long long mBufferChunk; // mFirst of the chunk in mBuffer, or ~0 if none
+};
+
+static unsigned int hash4(const unsigned char *aData) {
+	uint32_t value = aData[0] | (aData[1] << 8) | (aData[2] << 16) | ((uint32_t)aData[3] << 24);
+	return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Bytes of 255 after a nibble of 15, ending in one below 255
+static unsigned char *put_count(unsigned char *aOut, unsigned char *aEnd, unsigned int aCount) {
+	while (aCount >= 255) {
+		if (aOut >= aEnd)
+			return NULL;
+		*aOut++ = 255;
+		aCount -= 255;
+	}
+	if (aOut >= aEnd)
+		return NULL;
+	*aOut++ = aCount;
+	return aOut;
+}
+
+static unsigned int get_count(const unsigned char **aIn, unsigned int aCount) {
+	if (aCount == 15) {
+		unsigned char more;
+		do {
+			more = *(*aIn)++;
+			aCount += more;
+		} while (more == 255);
+	}
+	return aCount;
+}
+
+// One sequence: a token with the literal count in the high nibble and the
+// match length - 4 in the low one, the literals, and the match offset
+static unsigned char *put_sequence(unsigned char *aOut, unsigned char *aEnd, const unsigned char *aLiterals,
+	unsigned int aLiteralCount, unsigned int aOffset, unsigned int aLength) {
+	unsigned char *token = aOut++;
+
+	if (token >= aEnd)
+		return NULL;
+	*token = (aLiteralCount < 15 ? aLiteralCount : 15) << 4;
+	if (aLiteralCount >= 15 && !(aOut = put_count(aOut, aEnd, aLiteralCount - 15)))
+		return NULL;
+	if (aOut + aLiteralCount > aEnd)
+		return NULL;
+	memcpy(aOut, aLiterals, aLiteralCount);
+	aOut += aLiteralCount;
+	if (!aLength)
+		return aOut;
+
+	if (aOut + 2 > aEnd)
+		return NULL;
+	*aOut++ = aOffset & 0xff;
+	*aOut++ = aOffset >> 8;
+	*token |= aLength - 4 < 15 ? aLength - 4 : 15;
+	if (aLength - 4 >= 15 && !(aOut = put_count(aOut, aEnd, aLength - 4 - 15)))
+		return NULL;
+	return aOut;
+}
+
+// Returns the compressed size, or 0 if it isn't smaller than aSize
+static unsigned int compress(const unsigned char *aSrc, unsigned int aSize, unsigned char *aDst) {
+	unsigned int table[1 << HASH_BITS];
+	unsigned int pos = 0, anchor = 0;
+	unsigned char *out = aDst, *end = aDst + aSize;
+
+	memset(table, 0, sizeof(table));
+	while (pos + 4 <= aSize) {
+		unsigned int hash = hash4(aSrc + pos);
+		unsigned int candidate = table[hash];
+
+		table[hash] = pos + 1;
+		if (candidate && pos - (candidate - 1) <= 0xffff && memcmp(aSrc + candidate - 1, aSrc + pos, 4) == 0) {
+			unsigned int match = candidate - 1, length = 4;
+			while (pos + length < aSize && aSrc[match + length] == aSrc[pos + length])
+				length++;
+			out = put_sequence(out, end, aSrc + anchor, pos - anchor, pos - match, length);
+			if (!out)
+				return 0;
+			pos += length;
+			anchor = pos;
+		} else {
+			pos++;
+		}
+	}
+	out = put_sequence(out, end, aSrc + anchor, aSize - anchor, 0, 0);
+	if (!out || out == end)
+		return 0;
+	return out - aDst;
+}
+
+static void decompress(const unsigned char *aSrc, unsigned int aSize, unsigned char *aDst) {
+	const unsigned char *in = aSrc, *end = aSrc + aSize;
+	unsigned char *out = aDst;
+
+	while (in < end) {
+		unsigned int token = *in++, count, offset;
+
+		count = get_count(&in, token >> 4);
+		memcpy(out, in, count);
+		out += count;
+		in += count;
+		if (in >= end)
+			break;
+
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+		count = get_count(&in, token & 15) + 4;
+		// may overlap itself
+		while (count--) {
+			*out = *(out - offset);
+			out++;
+		}
+	}
+}
+
+// The records of a chunk, decompressed if needed
+static const unsigned char *chunk_data(struct em8051_history *aHistory, struct history_chunk *aChunk) {
+	if (!aChunk->mCompressed)
+		return aChunk->mData;
+	if (aHistory->mBufferChunk != aChunk->mFirst) {
+		decompress(aChunk->mData, aChunk->mSize, aHistory->mBuffer);
+		aHistory->mBufferChunk = aChunk->mFirst;
+	}
+	return aHistory->mBuffer;
+}
+
+static void start_cursor(struct history_cursor *aCursor, struct history_chunk *aChunk) {
+	aCursor->mIndex = aChunk->mFirst;
+	aCursor->mOffset = 0;
+	memcpy(aCursor->mState, aChunk->mKey, STATE_SIZE);
+	aCursor->mPC = 0;
+	aCursor->mLength = 0;
+}
+
+// Apply the record at the cursor, and move past it
+static void next_record(struct history_cursor *aCursor, const unsigned char *aData) {
+	const unsigned char *in = aData + aCursor->mOffset;
+	unsigned int header = *in++;
+	unsigned int direct = header >> RECORD_COUNT_SHIFT, upper = 0;
+
+	if (header & RECORD_PC) {
+		aCursor->mPC = in[0] | (in[1] << 8);
+		in += 2;
+	} else {
+		aCursor->mPC += aCursor->mLength;
+	}
+	aCursor->mLength = header & RECORD_LENGTH;
+	if (direct == RECORD_ESCAPE) {
+		direct = in[0] | (in[1] << 8);
+		upper = in[2];
+		in += 3;
+	}
+	for (; direct; direct--, in += 2)
+		aCursor->mState[in[0]] = in[1];
+	for (; upper; upper--, in += 2)
+		aCursor->mState[UPPER_OFFSET + in[0] - 0x80] = in[1];
+
+	aCursor->mOffset = in - aData;
+	aCursor->mIndex++;
+}
+
+static void drop_oldest(struct em8051_history *aHistory) {
+	free(aHistory->mChunks[0].mData);
+	aHistory->mChunkCount--;
+	memmove(aHistory->mChunks, aHistory->mChunks + 1, aHistory->mChunkCount * sizeof(struct history_chunk));
+}
+
+// Close the last chunk, and open a new one starting at mCount. On failure
+// the last chunk stays open and uncompressed.
+static int add_chunk(struct em8051_history *aHistory) {
+	struct history_chunk *chunk;
+	unsigned char *data = malloc(CHUNK_SIZE);
+
+	if (!data)
+		return -1;
+	if (aHistory->mChunkCount == aHistory->mChunkSize) {
+		unsigned int count = aHistory->mChunkSize ? aHistory->mChunkSize * 2 : 16;
+		chunk = realloc(aHistory->mChunks, count * sizeof(struct history_chunk));
+		if (!chunk) {
+			free(data);
+			return -1;
+		}
+		aHistory->mChunks = chunk;
+		aHistory->mChunkSize = count;
+	}
+
+	if (aHistory->mChunkCount && aHistory->mCompress) {
+		unsigned char *packed = malloc(CHUNK_SIZE);
+		unsigned int size;
+
+		chunk = &aHistory->mChunks[aHistory->mChunkCount - 1];
+		size = packed ? compress(chunk->mData, chunk->mSize, packed) : 0;
+		if (size) {
+			free(chunk->mData);
+			chunk->mData = realloc(packed, size);
+			if (!chunk->mData)
+				chunk->mData = packed;
+			chunk->mSize = size;
+			chunk->mCompressed = true;
+		} else {
+			free(packed);
+		}
+	}
+
+	chunk = &aHistory->mChunks[aHistory->mChunkCount];
+	memset(chunk, 0, sizeof(struct history_chunk));
+	chunk->mData = data;
+	chunk->mFirst = aHistory->mCount;
+	memcpy(chunk->mKey, aHistory->mEnd.mState, STATE_SIZE);
+	aHistory->mChunkCount++;
+	aHistory->mEnd.mOffset = 0;
+
+	if (aHistory->mMaxChunks && aHistory->mChunkCount > aHistory->mMaxChunks)
+		drop_oldest(aHistory);
+	return 0;
+}
+
+struct em8051_history *history_create(bool aCompress, unsigned int aMaxChunks) {
+	struct em8051_history *history = calloc(1, sizeof(struct em8051_history));
+
+	if (!history)
+		return NULL;
+	history->mCompress = aCompress;
+	history->mMaxChunks = aMaxChunks;
+	history->mReadChunk = ~0ULL;
+	history->mBufferChunk = ~0ULL;
+	history->mBuffer = malloc(CHUNK_SIZE);
+	if (!history->mBuffer || add_chunk(history) < 0) {
+		history_free(history);
+		return NULL;
+	}
+	return history;
+}
+
+void history_free(struct em8051_history *aHistory) {
+	unsigned int i;
+
+	if (!aHistory)
+		return;
+	for (i = 0; i < aHistory->mChunkCount; i++)
+		free(aHistory->mChunks[i].mData);
+	free(aHistory->mChunks);
+	free(aHistory->mBuffer);
+	free(aHistory);
+}
+
+// Write an address and value pair for each byte of aNew that differs from
+// aOld, and update aOld; compares eight bytes at a time, as most don't change
+static unsigned char *diff_bytes(const unsigned char *aNew, unsigned char *aOld, uint8_t aAddress, unsigned char *aOut) {
+	unsigned int i, j;
+
+	for (i = 0; i < 128; i += 8) {
+		uint64_t new_word, old_word;
+
+		memcpy(&new_word, aNew + i, 8);
+		memcpy(&old_word, aOld + i, 8);
+		if (new_word == old_word)
+			continue;
+		for (j = i; j < i + 8; j++) {
+			if (aNew[j] != aOld[j]) {
+				*aOut++ = aAddress + j;
+				*aOut++ = aNew[j];
+			}
+		}
+		memcpy(aOld + i, &new_word, 8);
+	}
+	return aOut;
+}
+
+int history_record(struct em8051_history *aHistory, struct em8051 *aCPU, uint16_t aPC) {
+	static const unsigned char no_upper_data[128];
+	struct history_cursor *end = &aHistory->mEnd;
+	struct history_chunk *chunk = &aHistory->mChunks[aHistory->mChunkCount - 1];
+	unsigned char changes[2 * STATE_SIZE], *direct_end, *upper_end;
+	unsigned char *out, *header;
+	unsigned int direct, upper;
+	uint8_t length = op_lengths[aCPU->mCodeMem[aPC & (aCPU->mCodeMemMaxIdx)]];
+
+	if (chunk->mSize + RECORD_MAX_SIZE > CHUNK_SIZE) {
+		if (add_chunk(aHistory) < 0)
+			return -1;
+		chunk = &aHistory->mChunks[aHistory->mChunkCount - 1];
+	}
+
+	update_parity(aCPU);
+	direct_end = diff_bytes(aCPU->mLowerData, end->mState, 0, changes);
+	direct_end = diff_bytes(aCPU->mSFR, end->mState + 128, 0x80, direct_end);
+	upper_end = diff_bytes(aCPU->mUpperData ? aCPU->mUpperData : no_upper_data,
+		end->mState + UPPER_OFFSET, 0x80, direct_end);
+	direct = (direct_end - changes) / 2;
+	upper = (upper_end - direct_end) / 2;
+
+	out = chunk->mData + chunk->mSize;
+	header = out++;
+	*header = length;
+	// the first record of a chunk has its address
+	if (!chunk->mCount || aPC != (uint16_t)(end->mPC + end->mLength)) {
+		*header |= RECORD_PC;
+		*out++ = aPC & 0xff;
+		*out++ = aPC >> 8;
+	}
+	if (direct < RECORD_ESCAPE && !upper) {
+		*header |= direct << RECORD_COUNT_SHIFT;
+	} else {
+		*header |= RECORD_ESCAPE << RECORD_COUNT_SHIFT;
+		*out++ = direct & 0xff;
+		*out++ = direct >> 8;
+		*out++ = upper;
+	}
+	memcpy(out, changes, upper_end - changes);
+	out += upper_end - changes;
+
+	end->mPC = aPC;
+	end->mLength = length;
+	chunk->mSize = out - chunk->mData;
+	end->mOffset = chunk->mSize;
+	chunk->mCount++;
+	aHistory->mCount++;
+	end->mIndex = aHistory->mCount;
+	return 0;
+}
+
+unsigned long long history_count(struct em8051_history *aHistory) {
+	return aHistory->mCount;
+}
+
+unsigned long long history_oldest(struct em8051_history *aHistory) {
+	return aHistory->mChunks[0].mFirst;
+}
+
+// The chunk holding aIndex
+static unsigned int find_chunk(struct em8051_history *aHistory, unsigned long long aIndex) {
+	unsigned int low = 0, high = aHistory->mChunkCount - 1;
+
+	while (low < high) {
+		unsigned int middle = (low + high + 1) / 2;
+		if (aHistory->mChunks[middle].mFirst <= aIndex)
+			low = middle;
+		else
+			high = middle - 1;
+	}
+	return low;
+}
+
+int history_get(struct em8051_history *aHistory, unsigned long long aIndex, struct em8051_history_entry *aEntry) {
+	struct history_cursor *cursor = &aHistory->mRead;
+	struct history_chunk *chunk;
+	const unsigned char *data;
+
+	if (aIndex < history_oldest(aHistory) || aIndex >= aHistory->mCount)
+		return -1;
+
+	chunk = &aHistory->mChunks[find_chunk(aHistory, aIndex)];
+	if (aHistory->mReadChunk != chunk->mFirst || cursor->mIndex > aIndex + 1) {
+		start_cursor(cursor, chunk);
+		aHistory->mReadChunk = chunk->mFirst;
+	}
+	data = chunk_data(aHistory, chunk);
+	while (cursor->mIndex <= aIndex)
+		next_record(cursor, data);
+
+	aEntry->mPC = cursor->mPC;
+	memcpy(aEntry->mLowerData, cursor->mState, 128);
+	memcpy(aEntry->mSFR, cursor->mState + 128, 128);
+	memcpy(aEntry->mUpperData, cursor->mState + UPPER_OFFSET, 128);
+	return 0;
+}
+
+int history_truncate(struct em8051_history *aHistory, unsigned long long aCount) {
+	struct history_chunk *chunk;
+	struct history_cursor *end = &aHistory->mEnd;
+	unsigned int i;
+
+	if (aCount >= aHistory->mCount)
+		return 0;
+	if (aCount < history_oldest(aHistory))
+		aCount = history_oldest(aHistory);
+
+	i = find_chunk(aHistory, aCount);
+	while (aHistory->mChunkCount > i + 1)
+		free(aHistory->mChunks[--aHistory->mChunkCount].mData);
+	chunk = &aHistory->mChunks[i];
+
+	// reopen the chunk
+	if (chunk->mCompressed) {
+		unsigned char *data = malloc(CHUNK_SIZE);
+		if (!data)
+			return -1;
+		decompress(chunk->mData, chunk->mSize, data);
+		free(chunk->mData);
+		chunk->mData = data;
+		chunk->mCompressed = false;
+	}
+	start_cursor(end, chunk);
+	while (end->mIndex < aCount)
+		next_record(end, chunk->mData);
+	chunk->mSize = end->mOffset;
+	chunk->mCount = (unsigned int)(aCount - chunk->mFirst);
+	aHistory->mCount = aCount;
+
+	aHistory->mReadChunk = ~0ULL;
+	aHistory->mBufferChunk = ~0ULL;
+	return 0;
+}
@@ -0,0 +1,80 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * instrument.c
+ * Instrumentation event buffers
+ *
+ * The hooks in the core append to a buffer of the calling thread, so that the
+ * callback is called once per batch instead of once per event, and instances
+ * running on different threads never share one. Without INSTRUMENT defined
+ * nothing calls in here.
+ */
+
+#include "emu8051.h"
+
+#define INSTRUMENT_BATCH 1024
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+struct instrument_buffer {
+	struct em8051 *mCPU; // owner of the buffered events
+	uint16_t mPC; // of the last fetch
+	unsigned int mCount;
+	struct em8051_event mEvents[INSTRUMENT_BATCH];
+};
+
+static THREAD_LOCAL struct instrument_buffer buffer;
+
+void instrument_flush(void) {
+	struct em8051 *cpu = buffer.mCPU;
+	unsigned int count = buffer.mCount;
+
+	buffer.mCount = 0;
+	if (count && cpu->instrument)
+		cpu->instrument(cpu, buffer.mEvents, count);
+}
+
+void instrument_event(struct em8051 *aCPU, uint8_t aType, uint32_t aAddress, uint8_t aValue) {
+	struct em8051_event *event;
+
+	if (buffer.mCPU != aCPU || buffer.mCount == INSTRUMENT_BATCH) {
+		instrument_flush();
+		buffer.mCPU = aCPU;
+	}
+	// an interrupt is taken between instructions, at the one it returns to
+	if (aType == EVENT_FETCH)
+		buffer.mPC = aAddress;
+	else if (aType == EVENT_INTERRUPT)
+		buffer.mPC = aCPU->mPC;
+
+	event = &buffer.mEvents[buffer.mCount++];
+	event->mType = aType;
+	event->mValue = aValue;
+	event->mPC = buffer.mPC;
+	event->mAddress = aAddress;
+}
@@ -0,0 +1,505 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * jit.c
+ * Compiles basic blocks (see block.c) to x86-64 code
+ *
+ * A compiled block behaves exactly like the block's opcode handlers called
+ * one after another: it takes the CPU, updates it and returns the last
+ * operation's delay, so block.c keeps doing all the tick accounting. Simple
+ * data moves, increments, logic on the accumulator and the common jumps
+ * and branches are emitted inline; everything else is a call to the opcode
+ * handler, with PC stored beforehand.
+ *
+ * The code buffer is never writable and executable at once. Blocks are
+ * packed into writable pages after the executable ones, and queued; a batch
+ * of them is made executable together, then their block_code is set. Only
+ * throwing all of the code away makes the buffer writable again.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "emu8051.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// address space only; pages take memory once a block is emitted into them
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+// enough for any block; the longest instruction sequence is a handler call
+#define JIT_MAX_BLOCK_SIZE (64 + BLOCK_MAX_LENGTH * 48)
+// blocks queued before they are made executable, at most
+#define JIT_BATCH 64
+
+// rbx holds the CPU; these are displacements from it
+#define OFS_PC      offsetof(struct em8051, mPC)
+#define OFS_LOWER   offsetof(struct em8051, mLowerData)
+#define OFS_SFR(x)  (offsetof(struct em8051, mSFR) + (x))
+
+// A compiled block waiting to be made executable
+struct jit_queued {
+	struct em8051_decoded *mEntry;
+	uint16_t mPC; // aEntry's address when it was compiled
+	uint32_t mCode; // offset in mCode
+};
+
+struct jit {
+	unsigned char *mCode; // NULL if executable memory couldn't be had
+	size_t mSealed; // up to here the pages are executable, the rest writable
+	size_t mUsed; // the queued blocks end here
+	size_t mPageSize;
+	unsigned int mQueued;
+	struct jit_queued mQueue[JIT_BATCH];
+};
+
+static unsigned char *emit8(unsigned char *aOut, uint8_t aValue) {
+	*aOut++ = aValue;
+	return aOut;
+}
+
+static unsigned char *emit16(unsigned char *aOut, uint16_t aValue) {
+	aOut = emit8(aOut, aValue & 0xff);
+	return emit8(aOut, aValue >> 8);
+}
+
+static unsigned char *emit32(unsigned char *aOut, uint32_t aValue) {
+	aOut = emit16(aOut, aValue & 0xffff);
+	return emit16(aOut, aValue >> 16);
+}
+
+static unsigned char *emit64(unsigned char *aOut, uint64_t aValue) {
+	aOut = emit32(aOut, aValue & 0xffffffff);
+	return emit32(aOut, aValue >> 32);
+}
+
+// <aOpcode> <modrm [rbx + disp32]>, with aReg in the reg field
+static unsigned char *emit_rbx(unsigned char *aOut, uint8_t aOpcode, uint8_t aReg, uint32_t aDisp) {
+	aOut = emit8(aOut, aOpcode);
+	aOut = emit8(aOut, 0x83 | (aReg << 3));
+	return emit32(aOut, aDisp);
+}
+
+// <aOpcode> <modrm [rbx + rax + disp32]>, with aReg in the reg field
+static unsigned char *emit_rbx_rax(unsigned char *aOut, uint8_t aOpcode, uint8_t aReg, uint32_t aDisp) {
+	aOut = emit8(aOut, aOpcode);
+	aOut = emit8(aOut, 0x84 | (aReg << 3));
+	aOut = emit8(aOut, 0x03);
+	return emit32(aOut, aDisp);
+}
+
+// mov word [rbx + mPC], aPC
+static unsigned char *emit_set_pc(unsigned char *aOut, uint16_t aPC) {
+	aOut = emit8(aOut, 0x66);
+	aOut = emit_rbx(aOut, 0xc7, 0, OFS_PC);
+	return emit16(aOut, aPC);
+}
+
+// eax = register bank offset in mLowerData
+static unsigned char *emit_bank(unsigned char *aOut) {
+	aOut = emit8(aOut, 0x0f);
+	aOut = emit_rbx(aOut, 0xb6, 0, OFS_SFR(REG_PSW)); // movzx eax, byte [psw]
+	aOut = emit8(aOut, 0x83);
+	aOut = emit8(aOut, 0xe0);
+	return emit8(aOut, PSWMASK_RS0 | PSWMASK_RS1); // and eax, 0x18
+}
+
+// Sets PC to aNext, and to aTarget if the condition code aSkip (for a short
+// jcc) doesn't hold. The flags must have been set before.
+static unsigned char *emit_branch(unsigned char *aOut, uint8_t aSkip, uint16_t aNext, uint16_t aTarget) {
+	aOut = emit_set_pc(aOut, aNext);
+	aOut = emit8(aOut, aSkip);
+	aOut = emit8(aOut, 9); // length of emit_set_pc()
+	return emit_set_pc(aOut, aTarget);
+}
+
+// Displacement of a direct address; blocks only contain safe ones
+static uint32_t direct(uint8_t aAddress) {
+	if (aAddress < 0x80)
+		return OFS_LOWER + aAddress;
+	return OFS_SFR(aAddress - 0x80);
+}
+
+// Emits the operation inline if possible. Returns NULL if not.
+static unsigned char *emit_inline(unsigned char *aOut, struct em8051_decoded *aEntry, uint8_t aOpcode) {
+	uint16_t next = aEntry->address + aEntry->length;
+	uint8_t rx = aOpcode & 7;
+
+	switch (aOpcode) {
+	case 0x00: // nop
+		return aOut;
+	case 0x04: // inc a
+		return emit_rbx(aOut, 0xfe, 0, OFS_SFR(REG_ACC));
+	case 0x14: // dec a
+		return emit_rbx(aOut, 0xfe, 1, OFS_SFR(REG_ACC));
+	case 0x08:
+	case 0x09:
+	case 0x0a:
+	case 0x0b:
+	case 0x0c:
+	case 0x0d:
+	case 0x0e:
+	case 0x0f: // inc rx
+		aOut = emit_bank(aOut);
+		return emit_rbx_rax(aOut, 0xfe, 0, OFS_LOWER + rx);
+	case 0x18:
+	case 0x19:
+	case 0x1a:
+	case 0x1b:
+	case 0x1c:
+	case 0x1d:
+	case 0x1e:
+	case 0x1f: // dec rx
+		aOut = emit_bank(aOut);
+		return emit_rbx_rax(aOut, 0xfe, 1, OFS_LOWER + rx);
+	case 0x05: // inc mem
+		return emit_rbx(aOut, 0xfe, 0, direct(aEntry->operand1));
+	case 0x15: // dec mem
+		return emit_rbx(aOut, 0xfe, 1, direct(aEntry->operand1));
+	case 0x44: // orl a, #data
+		aOut = emit_rbx(aOut, 0x80, 1, OFS_SFR(REG_ACC));
+		return emit8(aOut, aEntry->operand1);
+	case 0x54: // anl a, #data
+		aOut = emit_rbx(aOut, 0x80, 4, OFS_SFR(REG_ACC));
+		return emit8(aOut, aEntry->operand1);
+	case 0x64: // xrl a, #data
+		aOut = emit_rbx(aOut, 0x80, 6, OFS_SFR(REG_ACC));
+		return emit8(aOut, aEntry->operand1);
+	case 0x74: // mov a, #data
+		aOut = emit_rbx(aOut, 0xc6, 0, OFS_SFR(REG_ACC));
+		return emit8(aOut, aEntry->operand1);
+	case 0x75: // mov mem, #data
+		aOut = emit_rbx(aOut, 0xc6, 0, direct(aEntry->operand1));
+		return emit8(aOut, aEntry->operand2);
+	case 0x78:
+	case 0x79:
+	case 0x7a:
+	case 0x7b:
+	case 0x7c:
+	case 0x7d:
+	case 0x7e:
+	case 0x7f: // mov rx, #data
+		aOut = emit_bank(aOut);
+		aOut = emit_rbx_rax(aOut, 0xc6, 0, OFS_LOWER + rx);
+		return emit8(aOut, aEntry->operand1);
+	case 0x85: // mov mem, mem
+		aOut = emit_rbx(aOut, 0x8a, 1, direct(aEntry->operand1)); // mov cl, [src]
+		return emit_rbx(aOut, 0x88, 1, direct(aEntry->operand2)); // mov [dst], cl
+	case 0x88:
+	case 0x89:
+	case 0x8a:
+	case 0x8b:
+	case 0x8c:
+	case 0x8d:
+	case 0x8e:
+	case 0x8f: // mov mem, rx
+		aOut = emit_bank(aOut);
+		aOut = emit_rbx_rax(aOut, 0x8a, 1, OFS_LOWER + rx);
+		return emit_rbx(aOut, 0x88, 1, direct(aEntry->operand1));
+	case 0x90: // mov dptr, #data16
+		aOut = emit_rbx(aOut, 0xc6, 0, OFS_SFR(REG_DPH));
+		aOut = emit8(aOut, aEntry->operand1);
+		aOut = emit_rbx(aOut, 0xc6, 0, OFS_SFR(REG_DPL));
+		return emit8(aOut, aEntry->operand2);
+	case 0xa3: // inc dptr; DPL and DPH are a little-endian word
+		aOut = emit8(aOut, 0x66);
+		aOut = emit_rbx(aOut, 0x83, 0, OFS_SFR(REG_DPL));
+		return emit8(aOut, 1);
+	case 0xa8:
+	case 0xa9:
+	case 0xaa:
+	case 0xab:
+	case 0xac:
+	case 0xad:
+	case 0xae:
+	case 0xaf: // mov rx, mem
+		aOut = emit_rbx(aOut, 0x8a, 1, direct(aEntry->operand1));
+		aOut = emit_bank(aOut);
+		return emit_rbx_rax(aOut, 0x88, 1, OFS_LOWER + rx);
+	case 0xb3: // cpl c
+		aOut = emit_rbx(aOut, 0x80, 6, OFS_SFR(REG_PSW));
+		return emit8(aOut, PSWMASK_C);
+	case 0xc3: // clr c
+		aOut = emit_rbx(aOut, 0x80, 4, OFS_SFR(REG_PSW));
+		return emit8(aOut, (uint8_t)~PSWMASK_C);
+	case 0xd3: // setb c
+		aOut = emit_rbx(aOut, 0x80, 1, OFS_SFR(REG_PSW));
+		return emit8(aOut, PSWMASK_C);
+	case 0xc4: // swap a
+		aOut = emit_rbx(aOut, 0xc0, 0, OFS_SFR(REG_ACC));
+		return emit8(aOut, 4);
+	case 0xe4: // clr a
+		aOut = emit_rbx(aOut, 0xc6, 0, OFS_SFR(REG_ACC));
+		return emit8(aOut, 0);
+	case 0xf4: // cpl a
+		return emit_rbx(aOut, 0xf6, 2, OFS_SFR(REG_ACC));
+	case 0xe5: // mov a, mem
+		aOut = emit_rbx(aOut, 0x8a, 1, direct(aEntry->operand1));
+		return emit_rbx(aOut, 0x88, 1, OFS_SFR(REG_ACC));
+	case 0xf5: // mov mem, a
+		aOut = emit_rbx(aOut, 0x8a, 1, OFS_SFR(REG_ACC));
+		return emit_rbx(aOut, 0x88, 1, direct(aEntry->operand1));
+	case 0xe8:
+	case 0xe9:
+	case 0xea:
+	case 0xeb:
+	case 0xec:
+	case 0xed:
+	case 0xee:
+	case 0xef: // mov a, rx
+		aOut = emit_bank(aOut);
+		aOut = emit_rbx_rax(aOut, 0x8a, 1, OFS_LOWER + rx);
+		return emit_rbx(aOut, 0x88, 1, OFS_SFR(REG_ACC));
+	case 0xf8:
+	case 0xf9:
+	case 0xfa:
+	case 0xfb:
+	case 0xfc:
+	case 0xfd:
+	case 0xfe:
+	case 0xff: // mov rx, a
+		aOut = emit_bank(aOut);
+		aOut = emit_rbx(aOut, 0x8a, 1, OFS_SFR(REG_ACC));
+		return emit_rbx_rax(aOut, 0x88, 1, OFS_LOWER + rx);
+	case 0x02: // ljmp
+	case 0x80: // sjmp
+		return emit_set_pc(aOut, aEntry->target);
+	case 0x40: // jc
+		aOut = emit_rbx(aOut, 0xf6, 0, OFS_SFR(REG_PSW)); // test byte [psw], C
+		aOut = emit8(aOut, PSWMASK_C);
+		return emit_branch(aOut, 0x74, next, aEntry->target);
+	case 0x50: // jnc
+		aOut = emit_rbx(aOut, 0xf6, 0, OFS_SFR(REG_PSW));
+		aOut = emit8(aOut, PSWMASK_C);
+		return emit_branch(aOut, 0x75, next, aEntry->target);
+	case 0x60: // jz
+		aOut = emit_rbx(aOut, 0x80, 7, OFS_SFR(REG_ACC)); // cmp byte [acc], 0
+		aOut = emit8(aOut, 0);
+		return emit_branch(aOut, 0x75, next, aEntry->target);
+	case 0x70: // jnz
+		aOut = emit_rbx(aOut, 0x80, 7, OFS_SFR(REG_ACC));
+		aOut = emit8(aOut, 0);
+		return emit_branch(aOut, 0x74, next, aEntry->target);
+	case 0xd8:
+	case 0xd9:
+	case 0xda:
+	case 0xdb:
+	case 0xdc:
+	case 0xdd:
+	case 0xde:
+	case 0xdf: // djnz rx, offset
+		aOut = emit_bank(aOut);
+		aOut = emit_rbx_rax(aOut, 0xfe, 1, OFS_LOWER + rx);
+		return emit_branch(aOut, 0x74, next, aEntry->target);
+	case 0xd5: // djnz mem, offset
+		aOut = emit_rbx(aOut, 0xfe, 1, direct(aEntry->operand1));
+		return emit_branch(aOut, 0x74, next, aEntry->target);
+	}
+
+	// ajmp
+	if ((aOpcode & 0x1f) == 0x01)
+		return emit_set_pc(aOut, aEntry->target);
+
+	return NULL;
+}
+
+// Once the buffer can't be mapped or protected, nothing gets compiled any
+// more, and the blocks run as in ENGINE_BLOCK
+static void jit_fail(struct jit *aJit) {
+	aJit->mQueued = 0;
+	if (aJit->mCode)
+		munmap(aJit->mCode, JIT_BUFFER_SIZE);
+	aJit->mCode = NULL;
+}
+
+static struct jit *jit_get(struct em8051 *aCPU) {
+	struct jit *jit = aCPU->mJit;
+	void *code;
+
+	if (jit)
+		return jit;
+
+	jit = calloc(1, sizeof(struct jit));
+	if (!jit)
+		return NULL;
+	aCPU->mJit = jit;
+	jit->mPageSize = sysconf(_SC_PAGESIZE);
+	code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code != MAP_FAILED)
+		jit->mCode = code;
+	return jit;
+}
+
+// Drops all of the compiled code. The blocks start counting their hits
+// again, to be compiled anew once they are hot.
+static void jit_forget(struct em8051 *aCPU, struct jit *aJit) {
+	unsigned int i;
+
+	for (i = 0; i <= aCPU->mCodeMemMaxIdx; i++) {
+		aCPU->mDecodeCache[i].block_code = NULL;
+		aCPU->mDecodeCache[i].block_hits = 0;
+	}
+	aJit->mQueued = 0;
+	aJit->mSealed = aJit->mUsed = 0;
+}
+
+// Makes the queued blocks executable, and sets their block_code. A block
+// built again since it was queued has fewer hits, or was queued again
+// later; the later one wins.
+static bool jit_seal(struct em8051 *aCPU, struct jit *aJit) {
+	size_t end = (aJit->mUsed + aJit->mPageSize - 1) & ~(aJit->mPageSize - 1);
+	unsigned int i;
+
+	if (end > aJit->mSealed && mprotect(aJit->mCode + aJit->mSealed, end - aJit->mSealed, PROT_READ | PROT_EXEC))
+		return false;
+	for (i = 0; i < aJit->mQueued; i++) {
+		struct jit_queued *queued = &aJit->mQueue[i];
+		struct em8051_decoded *entry = queued->mEntry;
+
+		if ((entry->flags & DECODED_BLOCK) && entry->address == queued->mPC && entry->block_hits >= JIT_HOT_COUNT)
+			entry->block_code = (em8051operation)(aJit->mCode + queued->mCode);
+	}
+	aJit->mQueued = 0;
+	aJit->mSealed = aJit->mUsed = end;
+	return true;
+}
+
+em8051operation jit_compile(struct em8051 *aCPU, struct em8051_decoded *aEntry) {
+	struct jit *jit = jit_get(aCPU);
+	struct em8051_decoded *entry = aEntry;
+	unsigned char *start, *out;
+	uint8_t i, opcode, delay = 0;
+	bool pc_stored = true, called = false;
+
+	if (!jit || !jit->mCode)
+		return NULL;
+
+	// Queued already, and wanted now
+	if (aEntry->block_hits > JIT_HOT_COUNT) {
+		if (!jit_seal(aCPU, jit)) {
+			jit_fail(jit);
+			return NULL;
+		}
+		return aEntry->block_code;
+	}
+
+	// Out of space; throw all of the code away
+	if (jit->mUsed + JIT_MAX_BLOCK_SIZE > JIT_BUFFER_SIZE) {
+		jit_forget(aCPU, jit);
+		aEntry->block_hits = JIT_HOT_COUNT;
+		if (mprotect(jit->mCode, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE)) {
+			jit_fail(jit);
+			return NULL;
+		}
+	}
+
+	start = out = jit->mCode + jit->mUsed;
+	out = emit8(out, 0x53); // push rbx
+	out = emit8(out, 0x48);
+	out = emit8(out, 0x89);
+	out = emit8(out, 0xfb); // mov rbx, rdi
+
+	for (i = 0; i < aEntry->block_length; i++) {
+		unsigned char *next;
+
+		if (i) {
+			uint16_t pc = entry->address + entry->length;
+			entry = &aCPU->mDecodeCache[pc & (aCPU->mCodeMemMaxIdx)];
+			if (!entry->op || entry->address != pc)
+				entry = predecode(aCPU, pc);
+		}
+		opcode = aCPU->mCodeMem[entry->address & (aCPU->mCodeMemMaxIdx)];
+		delay = op_delays[opcode];
+
+		next = emit_inline(out, entry, opcode);
+		if (next) {
+			out = next;
+			pc_stored = (entry->flags & (DECODED_BRANCH | DECODED_JUMP)) != 0;
+			called = false;
+			continue;
+		}
+
+		// call the handler
+		if (!pc_stored)
+			out = emit_set_pc(out, entry->address);
+		out = emit8(out, 0x48);
+		out = emit8(out, 0x89);
+		out = emit8(out, 0xdf); // mov rdi, rbx
+		out = emit8(out, 0x48);
+		out = emit8(out, 0xb8);
+		out = emit64(out, (uintptr_t)entry->op); // mov rax, handler
+		out = emit8(out, 0xff);
+		out = emit8(out, 0xd0); // call rax
+		pc_stored = true;
+		called = true;
+	}
+
+	// a called handler left its result in al
+	if (!pc_stored)
+		out = emit_set_pc(out, entry->address + entry->length);
+	if (!called) {
+		out = emit8(out, 0xb8);
+		out = emit32(out, delay); // mov eax, delay
+	}
+	out = emit8(out, 0x5b); // pop rbx
+	out = emit8(out, 0xc3); // ret
+
+	// queue the block, and start the next one on a 16 byte boundary after it
+	jit->mQueue[jit->mQueued].mEntry = aEntry;
+	jit->mQueue[jit->mQueued].mPC = aEntry->address;
+	jit->mQueue[jit->mQueued].mCode = start - jit->mCode;
+	jit->mQueued++;
+	jit->mUsed = (out - jit->mCode + 15) & ~(size_t)15;
+	if (jit->mQueued == JIT_BATCH || jit->mUsed + JIT_MAX_BLOCK_SIZE > JIT_BUFFER_SIZE) {
+		if (!jit_seal(aCPU, jit)) {
+			jit_fail(jit);
+			return NULL;
+		}
+	}
+	return aEntry->block_code;
+}
+
+void jit_free(struct em8051 *aCPU) {
+	struct jit *jit = aCPU->mJit;
+
+	if (!jit)
+		return;
+	if (aCPU->mDecodeCache)
+		jit_forget(aCPU, jit);
+	jit_fail(jit);
+	free(jit);
+	aCPU->mJit = NULL;
+}
+
+#else
+
+em8051operation jit_compile(struct em8051 *aCPU, struct em8051_decoded *aEntry) {
+	return NULL;
+}
+
+void jit_free(struct em8051 *aCPU) {
+}
+
+#endif
@@ -0,0 +1,587 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * loader.c
+ * Object file loading: Intel HEX, raw binary, OMF-51 and ELF
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#ifdef _WIN32
+#define LOAD_READ
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Value of a hex digit, or 0x10 for anything else, so that or'ing the digits
+// of a record together tells whether they all were valid
+static const uint8_t hex_digit[256] = {
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 16, 16, 16, 16, 16, 16,
+	16, 10, 11, 12, 13, 14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 10, 11, 12, 13, 14, 15, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16
+};
+
+// The whole file in memory: mapped, or read where there's no mmap
+struct file_image {
+	const unsigned char *mData;
+	size_t mSize;
+	void *mHandle;
+};
+
+static bool image_open(struct file_image *aImage, const char *aFilename) {
+#ifdef LOAD_READ
+	FILE *f = fopen(aFilename, "rb");
+	long size;
+	unsigned char *data;
+
+	if (!f)
+		return false;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = malloc(size > 0 ? size : 1);
+	if (!data || size < 0 || fread(data, 1, size, f) != (size_t)size) {
+		free(data);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	aImage->mData = data;
+	aImage->mSize = size;
+	aImage->mHandle = data;
+	return true;
+#else
+	struct stat st;
+	void *data = NULL;
+	int fd = open(aFilename, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return false;
+	}
+	// an empty file can't be mapped, and has nothing to load anyway
+	if (st.st_size) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+	aImage->mData = data;
+	aImage->mSize = st.st_size;
+	aImage->mHandle = data;
+	return true;
+#endif
+}
+
+static void image_close(struct file_image *aImage) {
+#ifdef LOAD_READ
+	free(aImage->mHandle);
+#else
+	if (aImage->mHandle)
+		munmap(aImage->mHandle, aImage->mSize);
+#endif
+}
+
+// Decodes the record at aRecord, just after the ':', into aBytes; the first
+// four are the length, address and type. Returns the number of bytes, or
+// negative for bad hex digits or a record cut short.
+static int decode_record(const unsigned char *aRecord, const unsigned char *aEnd, uint8_t *aBytes) {
+	unsigned int i, count;
+	uint8_t bad;
+
+	if (aEnd - aRecord < 10)
+		return -1;
+	bad = hex_digit[aRecord[0]] | hex_digit[aRecord[1]];
+	// length, address, type, data and checksum
+	count = 5 + (hex_digit[aRecord[0]] << 4 | hex_digit[aRecord[1]]);
+	if ((bad & 0x10) || (size_t)(aEnd - aRecord) < count * 2)
+		return -1;
+	for (i = 0; i < count; i++) {
+		uint8_t high = hex_digit[aRecord[i * 2]], low = hex_digit[aRecord[i * 2 + 1]];
+		bad |= high | low;
+		aBytes[i] = high << 4 | low;
+	}
+	return (bad & 0x10) ? -1 : (int)count;
+}
+
+// Where a loader puts what it reads
+struct load_target {
+	struct em8051 *mCPU; // NULL to only read the symbols
+	unsigned char *mMemory;
+	unsigned int mMaxIdx;
+	unsigned long mBase; // for raw binaries
+	struct em8051_symbols *mSymbols; // NULL if not wanted
+	struct em8051_load_info *mInfo;
+};
+
+typedef int (*load_parser)(struct load_target *aTarget, const unsigned char *aData, size_t aSize);
+
+static int store(struct load_target *aTarget, unsigned long aAddress, const unsigned char *aData, unsigned long aLength) {
+	struct em8051_load_info *info = aTarget->mInfo;
+
+	if (!aLength || !aTarget->mCPU)
+		return 0;
+	if (!aTarget->mMemory || aAddress > aTarget->mMaxIdx || aLength - 1 > aTarget->mMaxIdx - aAddress)
+		return -6;
+	memcpy(aTarget->mMemory + aAddress, aData, aLength);
+	if (!info->mBytes || aAddress < info->mLowest)
+		info->mLowest = aAddress;
+	if (!info->mBytes || aAddress + aLength - 1 > info->mHighest)
+		info->mHighest = aAddress + aLength - 1;
+	info->mBytes += aLength;
+	return 0;
+}
+
+static int parse_hex(struct load_target *aTarget, const unsigned char *aData, size_t aSize) {
+	struct em8051_load_info *info = aTarget->mInfo;
+	const unsigned char *p = aData, *end = aData + aSize;
+	unsigned long base = 0;
+	bool first = true;
+
+	info->mLine = 1;
+	for (;;) {
+		uint8_t record[5 + 255];
+		unsigned int length, sum, i;
+		int count, result = 0;
+
+		// skip the line ends, and whitespace around the records
+		while (p < end && (*p == '\n' || *p == '\r' || *p == ' ' || *p == '\t')) {
+			if (*p == '\n')
+				info->mLine++;
+			p++;
+		}
+		if (p == end)
+			return -5; // no end of data record
+		if (*p != ':')
+			return first ? -2 : -7; // not intel hex, or garbage between the records
+		first = false;
+
+		count = decode_record(p + 1, end, record);
+		if (count < 0)
+			return -7;
+		p += 1 + count * 2;
+		length = record[0];
+		sum = 0;
+		for (i = 0; i < (unsigned int)count; i++)
+			sum += record[i];
+		if (sum & 0xff)
+			return -4; // the checksum makes the bytes add up to zero
+
+		switch (record[3]) {
+		case 0: // data
+			result = store(aTarget, base + (record[1] << 8 | record[2]), record + 4, length);
+			break;
+		case 1: // end of data
+			return 0;
+		case 2: // extended segment address, in 16 byte paragraphs
+		case 4: // extended linear address, the upper 16 bits
+			if (length != 2)
+				return -7;
+			base = (unsigned long)(record[4] << 8 | record[5]) << (record[3] == 2 ? 4 : 16);
+			break;
+		case 3: // start segment address, cs:ip
+		case 5: // start linear address
+			if (length != 4)
+				return -7;
+			info->mHasStart = true;
+			if (record[3] == 3)
+				info->mStart = ((unsigned long)(record[4] << 8 | record[5]) << 4) + (record[6] << 8 | record[7]);
+			else
+				info->mStart = (unsigned long)record[4] << 24 | (unsigned long)record[5] << 16 | record[6] << 8 | record[7];
+			break;
+		default:
+			return -3; // unsupported record type
+		}
+		if (result < 0)
+			return result;
+	}
+}
+
+static int parse_bin(struct load_target *aTarget, const unsigned char *aData, size_t aSize) {
+	return store(aTarget, aTarget->mBase, aData, aSize);
+}
+
+// OMF-51 symbol records: segment id, symbol info, offset, a zero and the name,
+// over and over. Only absolute symbols, segment id 0, are kept.
+static int omf_symbols(struct load_target *aTarget, const unsigned char *aItems, unsigned int aLength) {
+	while (aLength >= 6) {
+		unsigned int size = 6 + aItems[5];
+		unsigned int offset = aItems[2] | aItems[3] << 8;
+		uint32_t space = ~0u;
+		char name[256];
+
+		if (size > aLength)
+			return -7;
+		switch (aItems[1] & 7) { // segment type
+		case 0: // code
+			space = TRACE_CODE;
+			break;
+		case 1: // xdata
+			space = TRACE_EXT;
+			break;
+		case 2: // data, and the SFRs above it
+			space = offset > 0x7f ? TRACE_SFR : TRACE_DATA;
+			break;
+		case 3: // idata
+			space = TRACE_DATA;
+			break;
+		}
+		if (aItems[0] == 0 && space != ~0u && aItems[5]) {
+			memcpy(name, aItems + 6, aItems[5]);
+			name[aItems[5]] = 0;
+			if (symbols_add(aTarget->mSymbols, name, space | (offset & 0xffff)) < 0)
+				return -9;
+		}
+		aItems += size;
+		aLength -= size;
+	}
+	return 0;
+}
+
+// OMF-51 line numbers: segment id, offset and line, of the module's source
+static int omf_lines(struct load_target *aTarget, const char *aModule, const unsigned char *aItems, unsigned int aLength) {
+	for (; aLength >= 5; aItems += 5, aLength -= 5)
+		if (aItems[0] == 0 && symbols_add_line(aTarget->mSymbols, aModule, aItems[3] | aItems[4] << 8, aItems[1] | aItems[2] << 8) < 0)
+			return -9;
+	return 0;
+}
+
+// An absolute OMF-51 object file, as linked by RL51, BL51 or LX51: records of a
+// type byte, a little endian length, the content and a checksum that makes
+// them all add up to zero. mLine counts the records.
+static int parse_omf(struct load_target *aTarget, const unsigned char *aData, size_t aSize) {
+	const unsigned char *p = aData, *end = aData + aSize;
+	char module[256] = "";
+
+	aTarget->mInfo->mLine = 0;
+	for (;;) {
+		const unsigned char *content = p + 3;
+		unsigned int length, i;
+		uint8_t sum = 0;
+		int result = 0;
+
+		aTarget->mInfo->mLine++;
+		if (end - p < 4)
+			return p == aData ? -2 : -5; // no module end record
+		length = p[1] | p[2] << 8;
+		if (!length || (size_t)(end - content) < length)
+			return p == aData ? -2 : -7;
+		for (i = 0; i < length + 3; i++)
+			sum += p[i];
+		if (sum)
+			return p == aData ? -2 : -4;
+		if (p == aData && p[0] != 0x02)
+			return -2; // starts with the module header
+		length--; // the checksum
+
+		switch (p[0]) {
+		case 0x04: // module end
+			return 0;
+		case 0x06: // content: segment id, offset and the code
+			if (length < 3)
+				return -7;
+			if (content[0])
+				return -8;
+			result = store(aTarget, content[1] | content[2] << 8, content + 3, length - 3);
+			break;
+		case 0x08: // fixups
+			return -8;
+		case 0x10: // scope definition: block type and name; the modules name the lines
+			if (length >= 2 && content[0] == 0 && content[1] <= length - 2) {
+				memcpy(module, content + 2, content[1]);
+				module[content[1]] = 0;
+			}
+			break;
+		case 0x12: // debug items: local and public symbols, segments and line numbers
+			if (!aTarget->mSymbols || !length)
+				break;
+			if (content[0] == 0 || content[0] == 1)
+				result = omf_symbols(aTarget, content + 1, length - 1);
+			else if (content[0] == 3)
+				result = omf_lines(aTarget, module, content + 1, length - 1);
+			break;
+		case 0x16: // public definitions
+			if (aTarget->mSymbols)
+				result = omf_symbols(aTarget, content, length);
+			break;
+		}
+		if (result < 0)
+			return result;
+		p = content + length + 1;
+	}
+}
+
+static uint32_t elf_word(const unsigned char *aData, bool aBig, unsigned int aSize) {
+	uint32_t value = 0;
+	unsigned int i;
+
+	for (i = 0; i < aSize; i++)
+		value |= (uint32_t)aData[aBig ? aSize - 1 - i : i] << (i * 8);
+	return value;
+}
+
+#define ELF_HALF(aOffset) elf_word(aData + (aOffset), big, 2)
+#define ELF_WORD(aOffset) elf_word(aData + (aOffset), big, 4)
+
+// Functions, objects and untyped symbols from the symbol table; code if in an
+// executable section, external data otherwise
+static int elf_symbols(struct load_target *aTarget, const unsigned char *aData, size_t aSize, bool aBig) {
+	bool big = aBig;
+	uint32_t sections = ELF_WORD(32), size = ELF_HALF(46), count = ELF_HALF(48), i, j;
+
+	if (size < 40 || sections > aSize || (size_t)count * size > aSize - sections)
+		return -7;
+	for (i = 0; i < count; i++) {
+		const unsigned char *section = aData + sections + i * size;
+		uint32_t table, entries, strings, string_size, link;
+
+		if (elf_word(section + 4, big, 4) != 2) // SHT_SYMTAB
+			continue;
+		table = elf_word(section + 16, big, 4);
+		entries = elf_word(section + 20, big, 4) / 16;
+		link = elf_word(section + 24, big, 4);
+		if (link >= count || table > aSize || (size_t)entries * 16 > aSize - table)
+			return -7;
+		strings = elf_word(aData + sections + link * size + 16, big, 4);
+		string_size = elf_word(aData + sections + link * size + 20, big, 4);
+		if (strings > aSize || string_size > aSize - strings)
+			return -7;
+
+		for (j = 1; j < entries; j++) {
+			const unsigned char *symbol = aData + table + j * 16;
+			uint32_t name = elf_word(symbol, big, 4), value = elf_word(symbol + 4, big, 4);
+			unsigned int type = symbol[12] & 0xf, index = elf_word(symbol + 14, big, 2);
+			uint32_t flags;
+
+			if (type > 2 || !index || index >= count || name >= string_size ||
+				!memchr(aData + strings + name, 0, string_size - name) || !aData[strings + name])
+				continue;
+			flags = elf_word(aData + sections + index * size + 8, big, 4);
+			if (symbols_add(aTarget->mSymbols, (const char *)aData + strings + name,
+				((flags & 4) ? TRACE_CODE : TRACE_EXT) | (value & 0xffff)) < 0) // SHF_EXECINSTR
+				return -9;
+		}
+	}
+	return 0;
+}
+
+// A 32 bit ELF executable: the loadable segments go to code memory at their
+// physical address
+static int parse_elf(struct load_target *aTarget, const unsigned char *aData, size_t aSize) {
+	uint32_t headers, size, count, i;
+	bool big;
+
+	if (aSize < 52 || memcmp(aData, "\177ELF", 4))
+		return -2;
+	if (aData[4] != 1 || aData[5] < 1 || aData[5] > 2)
+		return -3; // only 32 bit
+	big = aData[5] == 2;
+	if (ELF_HALF(18) != 165 && ELF_HALF(18) != 0) // EM_8051, or EM_NONE
+		return -2;
+
+	headers = ELF_WORD(28);
+	size = ELF_HALF(42);
+	count = ELF_HALF(44);
+	if (count && (size < 32 || headers > aSize || (size_t)count * size > aSize - headers))
+		return -7;
+	for (i = 0; i < count; i++) {
+		const unsigned char *header = aData + headers + i * size;
+		uint32_t offset = elf_word(header + 4, big, 4), file_size = elf_word(header + 16, big, 4);
+		int result;
+
+		aTarget->mInfo->mLine = i + 1;
+		if (elf_word(header, big, 4) != 1) // PT_LOAD
+			continue;
+		if (offset > aSize || file_size > aSize - offset)
+			return -7;
+		result = store(aTarget, elf_word(header + 12, big, 4), aData + offset, file_size);
+		if (result < 0)
+			return result;
+	}
+	aTarget->mInfo->mLine = 0;
+	if (!aTarget->mSymbols || !ELF_WORD(32))
+		return 0;
+	return elf_symbols(aTarget, aData, aSize, big);
+}
+
+static bool is_omf(const unsigned char *aData, size_t aSize) {
+	unsigned int length, i;
+	uint8_t sum = 0;
+
+	if (aSize < 4 || aData[0] != 0x02)
+		return false;
+	length = aData[1] | aData[2] << 8;
+	if (!length || length > aSize - 3)
+		return false;
+	for (i = 0; i < length + 3; i++)
+		sum += aData[i];
+	return !sum;
+}
+
+static bool is_cdb(const unsigned char *aData, size_t aSize) {
+	return aSize >= 2 && strchr("MFSTL", aData[0]) && aData[0] && aData[1] == ':';
+}
+
+static bool has_extension(const char *aFilename, const char *aExtension) {
+	size_t length = strlen(aFilename), extension = strlen(aExtension);
+	const char *p;
+
+	if (length < extension)
+		return false;
+	for (p = aFilename + length - extension; *aExtension; p++, aExtension++)
+		if ((*p | 0x20) != *aExtension)
+			return false;
+	return true;
+}
+
+// Opens the file and runs aParse over it; picks the parser by the contents
+// if aParse is NULL
+static int load(struct em8051 *aCPU, const char *aFilename, int aSpace, unsigned long aBase,
+	struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo, load_parser aParse) {
+	struct em8051_load_info info;
+	struct load_target target;
+	struct file_image image;
+	int result;
+
+	if (!aInfo)
+		aInfo = &info;
+	memset(aInfo, 0, sizeof(*aInfo));
+	memset(&target, 0, sizeof(target));
+	target.mCPU = aCPU;
+	if (aCPU) {
+		target.mMemory = aSpace == LOAD_XDATA ? aCPU->mExtData : aCPU->mCodeMem;
+		target.mMaxIdx = aSpace == LOAD_XDATA ? aCPU->mExtDataMaxIdx : aCPU->mCodeMemMaxIdx;
+	}
+	target.mBase = aBase;
+	target.mSymbols = aSymbols;
+	target.mInfo = aInfo;
+
+	if (aFilename == 0 || aFilename[0] == 0 || !image_open(&image, aFilename))
+		return -1;
+	if (!aParse) {
+		size_t skip = 0;
+		while (skip < image.mSize && strchr(" \t\r\n", image.mData[skip]) && image.mData[skip])
+			skip++;
+		if (has_extension(aFilename, ".bin"))
+			aParse = parse_bin;
+		else if (skip < image.mSize && image.mData[skip] == ':')
+			aParse = parse_hex;
+		else if (image.mSize >= 4 && !memcmp(image.mData, "\177ELF", 4))
+			aParse = parse_elf;
+		else if (is_omf(image.mData, image.mSize))
+			aParse = parse_omf;
+		else if (is_cdb(image.mData + skip, image.mSize - skip)) {
+			image_close(&image);
+			return aSymbols ? symbols_load_cdb(aSymbols, aFilename) : -2;
+		} else {
+			image_close(&image);
+			return -2;
+		}
+	}
+
+	result = aParse(&target, image.mData, image.mSize);
+	image_close(&image);
+	if (!result)
+		aInfo->mLine = 0;
+
+	// one pass over everything loaded, rather than one per record
+	if (aInfo->mBytes && target.mMemory == aCPU->mCodeMem)
+		invalidate_code(aCPU, aInfo->mLowest, aInfo->mHighest - aInfo->mLowest + 1);
+	if (aSymbols)
+		symbols_sort(aSymbols);
+	return result;
+}
+
+int load_hex(struct em8051 *aCPU, const char *aFilename, int aSpace, struct em8051_load_info *aInfo) {
+	return load(aCPU, aFilename, aSpace, 0, NULL, aInfo, parse_hex);
+}
+
+int load_bin(struct em8051 *aCPU, const char *aFilename, int aSpace, unsigned long aBase, struct em8051_load_info *aInfo) {
+	return load(aCPU, aFilename, aSpace, aBase, NULL, aInfo, parse_bin);
+}
+
+int load_omf(struct em8051 *aCPU, const char *aFilename, struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo) {
+	return load(aCPU, aFilename, LOAD_CODE, 0, aSymbols, aInfo, parse_omf);
+}
+
+int load_elf(struct em8051 *aCPU, const char *aFilename, struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo) {
+	return load(aCPU, aFilename, LOAD_CODE, 0, aSymbols, aInfo, parse_elf);
+}
+
+int load_image(struct em8051 *aCPU, const char *aFilename, struct em8051_symbols *aSymbols, struct em8051_load_info *aInfo) {
+	return load(aCPU, aFilename, LOAD_CODE, 0, aSymbols, aInfo, NULL);
+}
+
+int load_obj(struct em8051 *aCPU, char *aFilename) {
+	return load_image(aCPU, aFilename, NULL, NULL);
+}
+
+const char *load_error(int aResult) {
+	switch (aResult) {
+	case 0:
+		return "Loaded.";
+	case -1:
+		return "File not found.";
+	case -2:
+		return "Bad file format.";
+	case -3:
+		return "Unsupported record type.";
+	case -4:
+		return "Checksum failure.";
+	case -5:
+		return "No end of data marker found.";
+	case -6:
+		return "Data outside memory.";
+	case -7:
+		return "Malformed record.";
+	case -8:
+		return "Not an absolute object file.";
+	case -9:
+		return "Out of memory.";
+	}
+	return "Unknown error.";
+}
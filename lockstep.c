@@ -0,0 +1,223 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ *
+ * lockstep.c
+ * Differential testing of the execution engines
+ *
+ * The instance under test runs with run() and its own engine, a step at a
+ * time; the reference follows one tick() at a time, and the whole state is
+ * compared after every step. Steps longer than a tick let the block engines
+ * chain blocks; when such a step goes wrong, it is run again from a snapshot
+ * taken before it, one tick longer every time, to find the first tick
+ * whose state differs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+struct em8051 *lockstep_reference(struct em8051 *aCPU, uint8_t aEngine) {
+	struct em8051 *reference = calloc(1, sizeof(struct em8051));
+	struct em8051_snapshot *snapshot;
+
+	if (!reference)
+		return NULL;
+	reference->mCodeMemMaxIdx = aCPU->mCodeMemMaxIdx;
+	reference->mCodeMem = calloc(aCPU->mCodeMemMaxIdx + 1, sizeof(unsigned char));
+	reference->mExtDataMaxIdx = aCPU->mExtDataMaxIdx;
+	if (aCPU->mExtData == aCPU->mCodeMem)
+		reference->mExtData = reference->mCodeMem;
+	else if (aCPU->mExtData)
+		reference->mExtData = calloc(aCPU->mExtDataMaxIdx + 1, sizeof(unsigned char));
+	if (aCPU->mUpperData)
+		reference->mUpperData = calloc(128, sizeof(unsigned char));
+	if (aCPU->mDecodeCache)
+		reference->mDecodeCache = calloc(aCPU->mCodeMemMaxIdx + 1, sizeof(struct em8051_decoded));
+	reference->mEngine = aEngine;
+	reset(reference, 1);
+
+	snapshot = snapshot_take(aCPU, NULL, NULL, 0);
+	if (!reference->mCodeMem || (aCPU->mExtData && !reference->mExtData) ||
+		(aCPU->mUpperData && !reference->mUpperData) || (aCPU->mDecodeCache && !reference->mDecodeCache) ||
+		!snapshot) {
+		snapshot_free(snapshot);
+		lockstep_free(reference);
+		return NULL;
+	}
+	snapshot_restore(reference, snapshot, NULL);
+	snapshot_free(snapshot);
+
+	memcpy(reference->sfrread, aCPU->sfrread, sizeof(aCPU->sfrread));
+	memcpy(reference->sfrwrite, aCPU->sfrwrite, sizeof(aCPU->sfrwrite));
+	reference->xread = aCPU->xread;
+	reference->xwrite = aCPU->xwrite;
+	reference->mUserData = aCPU->mUserData;
+	return reference;
+}
+
+void lockstep_free(struct em8051 *aReference) {
+	if (!aReference)
+		return;
+	jit_free(aReference);
+	free(aReference->mDecodeCache);
+	free(aReference->mUpperData);
+	if (aReference->mExtData != aReference->mCodeMem)
+		free(aReference->mExtData);
+	free(aReference->mCodeMem);
+	free(aReference);
+}
+
+static bool differ(struct em8051_divergence *aDivergence, const char *aWhat, unsigned int aExpected, unsigned int aActual) {
+	strcpy(aDivergence->mWhat, aWhat);
+	aDivergence->mExpected = aExpected;
+	aDivergence->mActual = aActual;
+	return true;
+}
+
+// The first byte where aMemory and aOther differ, or -1
+static int first_difference(const unsigned char *aMemory, const unsigned char *aOther, unsigned int aLength) {
+	unsigned int i;
+
+	if (memcmp(aMemory, aOther, aLength) == 0)
+		return -1;
+	for (i = 0; aMemory[i] == aOther[i]; i++)
+		;
+	return i;
+}
+
+// Fill in the first state that differs; returns whether any did
+static bool compare(struct em8051 *aCPU, struct em8051 *aReference, struct em8051_divergence *aDivergence) {
+	char what[sizeof(aDivergence->mWhat)];
+	int i;
+
+	update_parity(aCPU);
+	update_parity(aReference);
+
+	if (aCPU->mPC != aReference->mPC)
+		return differ(aDivergence, "PC", aReference->mPC, aCPU->mPC);
+	if (aCPU->mTickDelay != aReference->mTickDelay)
+		return differ(aDivergence, "tick delay", aReference->mTickDelay, aCPU->mTickDelay);
+	if ((i = first_difference(aReference->mSFR, aCPU->mSFR, 128)) != -1) {
+		sprintf(what, "SFR %02X", i + 0x80);
+		return differ(aDivergence, what, aReference->mSFR[i], aCPU->mSFR[i]);
+	}
+	if ((i = first_difference(aReference->mLowerData, aCPU->mLowerData, 128)) != -1) {
+		sprintf(what, "data %02X", i);
+		return differ(aDivergence, what, aReference->mLowerData[i], aCPU->mLowerData[i]);
+	}
+	if (aCPU->mUpperData && (i = first_difference(aReference->mUpperData, aCPU->mUpperData, 128)) != -1) {
+		sprintf(what, "data %02X", i + 0x80);
+		return differ(aDivergence, what, aReference->mUpperData[i], aCPU->mUpperData[i]);
+	}
+	// the core only writes code memory through external data
+	if (aCPU->mExtData &&
+		(i = first_difference(aReference->mExtData, aCPU->mExtData, aCPU->mExtDataMaxIdx + 1)) != -1) {
+		sprintf(what, "xdata %04X", i);
+		return differ(aDivergence, what, aReference->mExtData[i], aCPU->mExtData[i]);
+	}
+	if (aCPU->mInterruptActive != aReference->mInterruptActive)
+		return differ(aDivergence, "interrupts active", aReference->mInterruptActive, aCPU->mInterruptActive);
+	if (aCPU->serial_interrupt_trigger != aReference->serial_interrupt_trigger)
+		return differ(aDivergence, "serial interrupt", aReference->serial_interrupt_trigger, aCPU->serial_interrupt_trigger);
+	if (aCPU->serial_out_remaining_bits != aReference->serial_out_remaining_bits)
+		return differ(aDivergence, "serial bits", aReference->serial_out_remaining_bits, aCPU->serial_out_remaining_bits);
+	if (aCPU->serial_out_idx != aReference->serial_out_idx)
+		return differ(aDivergence, "serial out", aReference->serial_out_idx, aCPU->serial_out_idx);
+	return false;
+}
+
+// Tick aReference aTicks times; returns the address of the last instruction
+// started, or aPC if none was
+static uint16_t follow(struct em8051 *aReference, unsigned int aTicks, uint16_t aPC) {
+	unsigned int i;
+
+	for (i = 0; i < aTicks; i++) {
+		uint16_t pc = aReference->mPC;
+		if (tick(aReference))
+			aPC = pc;
+	}
+	return aPC;
+}
+
+// aCPU and aReference agree before aSnapshot plus aTicks, not after; find the
+// first tick in between after which they differ, and leave them there.
+// Returns the ticks before it.
+static unsigned int narrow(struct em8051 *aCPU, struct em8051 *aReference, struct em8051_snapshot *aSnapshot,
+	unsigned int aTicks, struct em8051_divergence *aDivergence) {
+	unsigned int ticks;
+
+	for (ticks = 1; ticks < aTicks; ticks++) {
+		snapshot_restore(aCPU, aSnapshot, NULL);
+		snapshot_restore(aReference, aSnapshot, NULL);
+		aDivergence->mPC = follow(aReference, ticks, aReference->mPC);
+		if (run(aCPU, ticks) == ticks && compare(aCPU, aReference, aDivergence))
+			return ticks - 1;
+	}
+	// the whole step, as before
+	snapshot_restore(aCPU, aSnapshot, NULL);
+	snapshot_restore(aReference, aSnapshot, NULL);
+	aDivergence->mPC = follow(aReference, run(aCPU, aTicks), aReference->mPC);
+	compare(aCPU, aReference, aDivergence);
+	return aTicks - 1;
+}
+
+unsigned int lockstep_run(struct em8051 *aCPU, struct em8051 *aReference, unsigned int aTicks, unsigned int aStep,
+	struct em8051_divergence *aDivergence) {
+	struct em8051_snapshot *snapshot = NULL;
+	unsigned int ticks = 0;
+
+	memset(aDivergence, 0, sizeof(*aDivergence));
+	if (!aStep)
+		aStep = 1;
+
+	while (ticks < aTicks && !aCPU->mStop) {
+		unsigned int step = aTicks - ticks < aStep ? aTicks - ticks : aStep;
+		unsigned int ran;
+
+		if (step > 1) {
+			struct em8051_snapshot *previous = snapshot;
+			snapshot = snapshot_take(aReference, previous, NULL, 0);
+			snapshot_free(previous);
+		}
+		aDivergence->mPC = aReference->mPC;
+		ran = run(aCPU, step);
+		aDivergence->mPC = follow(aReference, ran, aDivergence->mPC);
+		if (compare(aCPU, aReference, aDivergence)) {
+			if (ran > 1 && snapshot)
+				ran = narrow(aCPU, aReference, snapshot, ran, aDivergence);
+			else
+				ran--;
+			aDivergence->mTicks = ticks + ran;
+			decode(aReference, aDivergence->mPC, aDivergence->mAssembly);
+			ticks += ran;
+			break;
+		}
+		ticks += ran;
+	}
+
+	snapshot_free(snapshot);
+	return ticks;
+}
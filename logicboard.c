@@ -54,6 +54,46 @@ static int chardisplay4bmode = 0;
 static int chardisplaytick = 0;
 static int chardisplaybusy = 0;
 
+// the peripheral state, saved in snapshots
+static const struct {
+	void *mData;
+	int mSize;
+} savedstate[] = {
+	{ oldports, sizeof(oldports) },
+	{ shiftregisters, sizeof(shiftregisters) },
+	{ &audiotick, sizeof(audiotick) },
+	{ chardisplayram, sizeof(chardisplayram) },
+	{ chardisplaycgram, sizeof(chardisplaycgram) },
+	{ &chardisplaycp, sizeof(chardisplaycp) },
+	{ &chardisplayofs, sizeof(chardisplayofs) },
+	{ &chardisplaydir, sizeof(chardisplaydir) },
+	{ &chardisplayshift, sizeof(chardisplayshift) },
+	{ &chardisplaydcb, sizeof(chardisplaydcb) },
+	{ &chardisplaychargen, sizeof(chardisplaychargen) },
+	{ &chardisplaydata, sizeof(chardisplaydata) },
+	{ &chardisplay4bmode, sizeof(chardisplay4bmode) },
+	{ &chardisplaytick, sizeof(chardisplaytick) },
+	{ &chardisplaybusy, sizeof(chardisplaybusy) }
+};
+
+int logicboard_save_state(unsigned char *aBuffer) {
+	int i, size = 0;
+	for (i = 0; i < (int)(sizeof(savedstate) / sizeof(savedstate[0])); i++) {
+		if (aBuffer)
+			memcpy(aBuffer + size, savedstate[i].mData, savedstate[i].mSize);
+		size += savedstate[i].mSize;
+	}
+	return size;
+}
+
+void logicboard_load_state(const unsigned char *aBuffer) {
+	int i, size = 0;
+	for (i = 0; i < (int)(sizeof(savedstate) / sizeof(savedstate[0])); i++) {
+		memcpy(savedstate[i].mData, aBuffer + size, savedstate[i].mSize);
+		size += savedstate[i].mSize;
+	}
+}
+
 static void closeaudio(void) {
 	int len = ftell(audioout);
 	fseek(audioout, 4, SEEK_SET);
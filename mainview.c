@@ -43,7 +43,7 @@
  */
 
 // Last clock we updated the view
-static unsigned int lastclock = 0;
+static unsigned long long lastclock = 0;
 
 // Memory editor mode
 static int memmode = 0;
@@ -119,6 +119,16 @@ void wipe_main_view() {
 	delwin(miscview);
 }
 
+// where to start showing the last aLines lines of history
+static unsigned long long first_history_line(unsigned int aLines) {
+	unsigned long long count = history_count(history);
+	unsigned long long line = count > aLines ? count - aLines : 0;
+
+	if (line < history_oldest(history))
+		line = history_oldest(history);
+	return line;
+}
+
 void build_main_view(struct em8051 *aCPU) {
 	erase();
 
@@ -191,7 +201,7 @@ void build_main_view(struct em8051 *aCPU) {
 	wrefresh(ioregoutput);
 	wrefresh(spregoutput);
 
-	lastclock = icount - 8;
+	lastclock = first_history_line(8);
 
 	memarea = aCPU->mLowerData;
 }
@@ -394,6 +404,11 @@ void mainview_editor_keys(struct em8051 *aCPU, int ch) {
 				memarea[memoffset + (memcursorpos / 2)] = (memarea[memoffset + (memcursorpos / 2)] & 0xf0) | insert_value;
 			else
 				memarea[memoffset + (memcursorpos / 2)] = (memarea[memoffset + (memcursorpos / 2)] & 0x0f) | (insert_value << 4);
+			if (memarea == aCPU->mCodeMem)
+				invalidate_code(aCPU, memoffset + (memcursorpos / 2), 1);
+			if (memarea == aCPU->mSFR)
+				sfr_update(aCPU, 0x80 + memoffset + (memcursorpos / 2));
+			emu_edited(aCPU);
 			memcursorpos++;
 		}
 		if (focus == 1) {
@@ -406,6 +421,7 @@ void mainview_editor_keys(struct em8051 *aCPU, int ch) {
 				else
 					setregoutput(aCPU, cursorpos / 2, (getregoutput(aCPU, cursorpos / 2) & 0x0f) | (insert_value << 4));
 			}
+			emu_edited(aCPU);
 			cursorpos++;
 			if (cursorpos > 23)
 				cursorpos = 23;
@@ -468,27 +484,22 @@ void mainview_update(struct em8051 *aCPU) {
 	int opcode_bytes;
 	int stringpos;
 	int rx;
-	unsigned int hline;
+	unsigned long long count = history_count(history);
 
-	if ((speed != 0 || !runmode) && lastclock != icount) {
-		// make sure we only display HISTORY_LINES worth of data
-		if (icount - lastclock > HISTORY_LINES)
-			lastclock = icount - HISTORY_LINES;
+	if ((speed != 0 || !runmode) && lastclock != count) {
+		// make sure we only display HISTORY_LINES worth of data; going
+		// back in time shows the lines before the new position again
+		if (lastclock > count || count - lastclock > HISTORY_LINES)
+			lastclock = first_history_line(HISTORY_LINES);
 
-		// + HISTORY_LINES to force positive result
-		hline = historyline - (icount - lastclock) + HISTORY_LINES;
-
-		while (lastclock != icount) {
+		while (lastclock != count) {
+			struct em8051_history_entry entry;
 			char assembly[128];
 			char temp[256];
 			int old_pc;
-			int hoffs;
-
-			hline = (hline + 1) % HISTORY_LINES;
-
-			hoffs = (hline * (128 + 64 + sizeof(int)));
 
-			memcpy(&old_pc, history + hoffs + 128 + 64, sizeof(int));
+			history_get(history, lastclock, &entry);
+			old_pc = entry.mPC;
 			opcode_bytes = decode(aCPU, old_pc, assembly);
 			stringpos = 0;
 			stringpos += sprintf(temp + stringpos, "\n%04X  ", old_pc & 0xffff);
@@ -503,54 +514,54 @@ void mainview_update(struct em8051 *aCPU) {
 
 			wprintw(codeoutput, "%s", temp);
 
-			rx = 8 * ((history[hoffs + REG_PSW] & (PSWMASK_RS0 | PSWMASK_RS1)) >> PSW_RS0);
+			rx = 8 * ((entry.mSFR[REG_PSW] & (PSWMASK_RS0 | PSWMASK_RS1)) >> PSW_RS0);
 
 			sprintf(temp, "\n%02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %04X",
-				history[hoffs + REG_ACC],
-				history[hoffs + 128 + 0 + rx],
-				history[hoffs + 128 + 1 + rx],
-				history[hoffs + 128 + 2 + rx],
-				history[hoffs + 128 + 3 + rx],
-				history[hoffs + 128 + 4 + rx],
-				history[hoffs + 128 + 5 + rx],
-				history[hoffs + 128 + 6 + rx],
-				history[hoffs + 128 + 7 + rx],
-				history[hoffs + REG_B],
-				(history[hoffs + REG_DPH] << 8) | history[hoffs + REG_DPL]);
+				entry.mSFR[REG_ACC],
+				entry.mLowerData[0 + rx],
+				entry.mLowerData[1 + rx],
+				entry.mLowerData[2 + rx],
+				entry.mLowerData[3 + rx],
+				entry.mLowerData[4 + rx],
+				entry.mLowerData[5 + rx],
+				entry.mLowerData[6 + rx],
+				entry.mLowerData[7 + rx],
+				entry.mSFR[REG_B],
+				(entry.mSFR[REG_DPH] << 8) | entry.mSFR[REG_DPL]);
 			if (focus == 1)
 				refresh_regoutput(aCPU, 0);
 			wprintw(regoutput, "%s", temp);
 
 			sprintf(temp, "\n%d %d %d %d %d %d %d %d",
-				(history[hoffs + REG_PSW] >> 7) & 1,
-				(history[hoffs + REG_PSW] >> 6) & 1,
-				(history[hoffs + REG_PSW] >> 5) & 1,
-				(history[hoffs + REG_PSW] >> 4) & 1,
-				(history[hoffs + REG_PSW] >> 3) & 1,
-				(history[hoffs + REG_PSW] >> 2) & 1,
-				(history[hoffs + REG_PSW] >> 1) & 1,
-				(history[hoffs + REG_PSW] >> 0) & 1);
+				(entry.mSFR[REG_PSW] >> 7) & 1,
+				(entry.mSFR[REG_PSW] >> 6) & 1,
+				(entry.mSFR[REG_PSW] >> 5) & 1,
+				(entry.mSFR[REG_PSW] >> 4) & 1,
+				(entry.mSFR[REG_PSW] >> 3) & 1,
+				(entry.mSFR[REG_PSW] >> 2) & 1,
+				(entry.mSFR[REG_PSW] >> 1) & 1,
+				(entry.mSFR[REG_PSW] >> 0) & 1);
 			wprintw(pswoutput, "%s", temp);
 
 			sprintf(temp, "\n%02X %02X %02X %02X %02X %02X %02X",
-				history[hoffs + REG_SP],
-				history[hoffs + REG_P0],
-				history[hoffs + REG_P1],
-				history[hoffs + REG_P2],
-				history[hoffs + REG_P3],
-				history[hoffs + REG_IP],
-				history[hoffs + REG_IE]);
+				entry.mSFR[REG_SP],
+				entry.mSFR[REG_P0],
+				entry.mSFR[REG_P1],
+				entry.mSFR[REG_P2],
+				entry.mSFR[REG_P3],
+				entry.mSFR[REG_IP],
+				entry.mSFR[REG_IE]);
 			wprintw(ioregoutput, "%s", temp);
 
 			sprintf(temp, "\n%02X   %02X    %02X  %02X   %02X  %02X   %02X   %02X",
-				history[hoffs + REG_TMOD],
-				history[hoffs + REG_TCON],
-				history[hoffs + REG_TH0],
-				history[hoffs + REG_TL0],
-				history[hoffs + REG_TH1],
-				history[hoffs + REG_TL1],
-				history[hoffs + REG_SCON],
-				history[hoffs + REG_PCON]);
+				entry.mSFR[REG_TMOD],
+				entry.mSFR[REG_TCON],
+				entry.mSFR[REG_TH0],
+				entry.mSFR[REG_TL0],
+				entry.mSFR[REG_TH1],
+				entry.mSFR[REG_TL1],
+				entry.mSFR[REG_SCON],
+				entry.mSFR[REG_PCON]);
 			wprintw(spregoutput, "%s", temp);
 
 			lastclock++;
@@ -197,6 +197,11 @@ void memeditor_editor_keys(struct em8051 *aCPU, int ch) {
 			eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] = (eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] & 0xf0) | insert_value;
 		else
 			eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] = (eds[focus].memarea[eds[focus].memoffset + (eds[focus].cursorpos / 2)] & 0x0f) | (insert_value << 4);
+		if (eds[focus].memarea == aCPU->mCodeMem)
+			invalidate_code(aCPU, eds[focus].memoffset + (eds[focus].cursorpos / 2), 1);
+		if (eds[focus].memarea == aCPU->mSFR)
+			sfr_update(aCPU, 0x80 + eds[focus].memoffset + (eds[focus].cursorpos / 2));
+		emu_edited(aCPU);
 		eds[focus].cursorpos++;
 	}
 
@@ -47,51 +47,152 @@
 #define RX_ADDRESS       ((OPCODE & 7) + 8 * PSW_BANK)
 #define CARRY            ((PSW & PSWMASK_C) >> PSW_C)
 
+// Marks which way the conditional branch at PC went, see mCoverage
+#define COVER_BRANCH(aTaken) \
+	do { \
+		if (aCPU->mCoverage) \
+			aCPU->mCoverage[PC & (aCPU->mCodeMemMaxIdx)] |= (aTaken) ? COVERAGE_TAKEN : COVERAGE_NOT_TAKEN; \
+	} while (0)
+
+// Checks a memory access against the watchpoints, if there is one on its page
+#define WATCH(aAddress, aValue, aOld, aWrite) \
+	do { \
+		if (aCPU->mWatch && WATCHED(aCPU->mWatch, aAddress)) \
+			watch_access(aCPU, aAddress, aValue, aOld, aWrite); \
+	} while (0)
+
+// A store to ACC, B, DPL or DPH that doesn't go through write_mem()
+#define REG_WRITTEN(aRegister) \
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | ((aRegister) + 0x80), aCPU->mSFR[aRegister])
+
+// instruction lengths in bytes, indexed by opcode
+const uint8_t op_lengths[256] = {
+	1, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	3, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 1, 2, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 1, 1, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	3, 2, 2, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	2, 2, 2, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 1, 1, 3, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,
+	1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+// Value returned by each opcode's handler; the operation takes that many ticks, at least one.
+const uint8_t op_delays[256] = {
+	0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 0, 1, 3, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 0, 0, 0, 1, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static uint8_t read_sfr(struct em8051 *aCPU, uint8_t aAddress) {
+	uint8_t value;
+
+	if (aAddress == REG_PSW + 0x80)
+		update_parity(aCPU);
+	if (aCPU->sfrread[aAddress - 0x80])
+		value = aCPU->sfrread[aAddress - 0x80](aCPU, aAddress);
+	else
+		value = aCPU->mSFR[aAddress - 0x80];
+	if (aCPU->mTrace)
+		trace_read(aCPU, TRACE_SFR | aAddress, value);
+	INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_SFR | aAddress, value);
+	WATCH(TRACE_SFR | aAddress, value, value, false);
+	return value;
+}
+
 static uint8_t read_mem(struct em8051 *aCPU, uint8_t aAddress) {
 	if (aAddress > 0x7f) {
-		if (aCPU->sfrread[aAddress - 0x80])
-			return aCPU->sfrread[aAddress - 0x80](aCPU, aAddress);
-		else
-			return aCPU->mSFR[aAddress - 0x80];
+		return read_sfr(aCPU, aAddress);
 	} else {
+		if (aCPU->mTrace)
+			trace_read(aCPU, TRACE_DATA | aAddress, aCPU->mLowerData[aAddress]);
+		INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_DATA | aAddress, aCPU->mLowerData[aAddress]);
+		WATCH(TRACE_DATA | aAddress, aCPU->mLowerData[aAddress], aCPU->mLowerData[aAddress], false);
 		return aCPU->mLowerData[aAddress];
 	}
 }
 
 static uint8_t read_mem_indir(struct em8051 *aCPU, uint8_t aAddress) {
+	uint8_t value = BAD_VALUE;
+
 	if (aAddress > 0x7f) {
 		if (aCPU->mUpperData) {
-			return aCPU->mUpperData[aAddress - 0x80];
+			value = aCPU->mUpperData[aAddress - 0x80];
 		}
 	} else {
-		return aCPU->mLowerData[aAddress];
+		value = aCPU->mLowerData[aAddress];
 	}
 
-	return BAD_VALUE;
+	if (aCPU->mTrace)
+		trace_read(aCPU, TRACE_DATA | aAddress, value);
+	INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_DATA | aAddress, value);
+	WATCH(TRACE_DATA | aAddress, value, value, false);
+	return value;
+}
+
+// Core bookkeeping and the callback after an SFR has been written
+static void sfr_written(struct em8051 *aCPU, uint8_t aAddress) {
+	sfr_update(aCPU, aAddress);
+	if (aCPU->sfrwrite[aAddress - 0x80])
+		aCPU->sfrwrite[aAddress - 0x80](aCPU, aAddress);
 }
 
 static void write_mem(struct em8051 *aCPU, uint8_t aAddress, uint8_t value) {
+	if (aCPU->mTrace)
+		trace_write(aCPU, (aAddress > 0x7f ? TRACE_SFR : TRACE_DATA) | aAddress, value);
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, (aAddress > 0x7f ? TRACE_SFR : TRACE_DATA) | aAddress, value);
 	if (aAddress > 0x7f) {
+		WATCH(TRACE_SFR | aAddress, value, aCPU->mSFR[aAddress - 0x80], true);
 		aCPU->mSFR[aAddress - 0x80] = value;
-		if (aCPU->sfrwrite[aAddress - 0x80])
-			aCPU->sfrwrite[aAddress - 0x80](aCPU, aAddress);
+		sfr_written(aCPU, aAddress);
 	} else {
+		WATCH(TRACE_DATA | aAddress, value, aCPU->mLowerData[aAddress], true);
 		aCPU->mLowerData[aAddress] = value;
 	}
 }
 
 static void write_mem_indir(struct em8051 *aCPU, uint8_t aAddress, uint8_t value) {
+	if (aCPU->mTrace && (aAddress < 0x80 || aCPU->mUpperData))
+		trace_write(aCPU, TRACE_DATA | aAddress, value);
+	if (aAddress < 0x80 || aCPU->mUpperData)
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | aAddress, value);
 	if (aAddress > 0x7f) {
 		if (aCPU->mUpperData) {
+			WATCH(TRACE_DATA | aAddress, value, aCPU->mUpperData[aAddress - 0x80], true);
 			aCPU->mUpperData[aAddress - 0x80] = value;
 		}
 	} else {
+		WATCH(TRACE_DATA | aAddress, value, aCPU->mLowerData[aAddress], true);
 		aCPU->mLowerData[aAddress] = value;
 	}
 }
 
 void push_to_stack(struct em8051 *aCPU, uint8_t aValue) {
 	aCPU->mSFR[REG_SP]++;
+	if (aCPU->mStackLimit && aCPU->mSFR[REG_SP] > aCPU->mStackLimit)
+		if (aCPU->except)
+			aCPU->except(aCPU, EXCEPTION_STACK_OVERFLOW);
 	write_mem(aCPU, aCPU->mSFR[REG_SP], aValue);
 	if (aCPU->mSFR[REG_SP] == 0)
 		if (aCPU->except)
@@ -149,12 +250,14 @@ static uint8_t ljmp_address(struct em8051 *aCPU) {
 
 static uint8_t rr_a(struct em8051 *aCPU) {
 	ACC = (ACC >> 1) | (ACC << 7);
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
 
 static uint8_t inc_a(struct em8051 *aCPU) {
 	ACC++;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -185,14 +288,19 @@ static uint8_t jbc_bitaddr_offset(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
+		if (address == REG_PSW + 0x80)
+			update_parity(aCPU);
 		value = aCPU->mSFR[address - 0x80];
 
 		if (value & bitmask) {
+			INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, value & ~bitmask);
+			WATCH(TRACE_SFR | address, value & ~bitmask, value, true);
 			aCPU->mSFR[address - 0x80] &= ~bitmask;
+			COVER_BRANCH(true);
 			PC += (signed char)OPERAND2 + 3;
-			if (aCPU->sfrwrite[address - 0x80])
-				aCPU->sfrwrite[address - 0x80](aCPU, address);
+			sfr_written(aCPU, address);
 		} else {
+			COVER_BRANCH(false);
 			PC += 3;
 		}
 	} else {
@@ -201,9 +309,13 @@ static uint8_t jbc_bitaddr_offset(struct em8051 *aCPU) {
 		address >>= 3;
 		address += 0x20;
 		if (aCPU->mLowerData[address] & bitmask) {
+			INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, aCPU->mLowerData[address] & ~bitmask);
+			WATCH(TRACE_DATA | address, aCPU->mLowerData[address] & ~bitmask, aCPU->mLowerData[address], true);
 			aCPU->mLowerData[address] &= ~bitmask;
+			COVER_BRANCH(true);
 			PC += (signed char)OPERAND2 + 3;
 		} else {
+			COVER_BRANCH(false);
 			PC += 3;
 		}
 	}
@@ -230,6 +342,7 @@ static uint8_t rrc_a(struct em8051 *aCPU) {
 	uint8_t c = (PSW & PSWMASK_C) >> PSW_C;
 	uint8_t newc = ACC & 1;
 	ACC = (ACC >> 1) | (c << 7);
+	REG_WRITTEN(REG_ACC);
 	PSW = (PSW & ~PSWMASK_C) | (newc << PSW_C);
 	PC++;
 	return 0;
@@ -237,6 +350,7 @@ static uint8_t rrc_a(struct em8051 *aCPU) {
 
 static uint8_t dec_a(struct em8051 *aCPU) {
 	ACC--;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -264,14 +378,13 @@ static uint8_t jb_bitaddr_offset(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		if (value & bitmask) {
+			COVER_BRANCH(true);
 			PC += (signed char)OPERAND2 + 3;
 		} else {
+			COVER_BRANCH(false);
 			PC += 3;
 		}
 	} else {
@@ -280,8 +393,10 @@ static uint8_t jb_bitaddr_offset(struct em8051 *aCPU) {
 		address >>= 3;
 		address += 0x20;
 		if (aCPU->mLowerData[address] & bitmask) {
+			COVER_BRANCH(true);
 			PC += (signed char)OPERAND2 + 3;
 		} else {
+			COVER_BRANCH(false);
 			PC += 3;
 		}
 	}
@@ -289,13 +404,17 @@ static uint8_t jb_bitaddr_offset(struct em8051 *aCPU) {
 }
 
 static uint8_t ret(struct em8051 *aCPU) {
-	PC = pop_from_stack(aCPU) << 8;
-	PC |= pop_from_stack(aCPU);
+	uint8_t high;
+
+	// both pops happen at the ret's PC, as the watchpoints see it
+	high = pop_from_stack(aCPU);
+	PC = (high << 8) | pop_from_stack(aCPU);
 	return 1;
 }
 
 static uint8_t rl_a(struct em8051 *aCPU) {
 	ACC = (ACC << 1) | (ACC >> 7);
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -303,6 +422,7 @@ static uint8_t rl_a(struct em8051 *aCPU) {
 static uint8_t add_a_imm(struct em8051 *aCPU) {
 	add_solve_flags(aCPU, ACC, OPERAND1, 0);
 	ACC += OPERAND1;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -311,6 +431,7 @@ static uint8_t add_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, OPERAND1);
 	add_solve_flags(aCPU, ACC, value, 0);
 	ACC += value;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -320,6 +441,7 @@ static uint8_t add_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t value = read_mem_indir(aCPU, address);
 	add_solve_flags(aCPU, ACC, value, 0);
 	ACC += value;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -331,14 +453,13 @@ static uint8_t jnb_bitaddr_offset(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		if (!(value & bitmask)) {
+			COVER_BRANCH(true);
 			PC += (signed char)OPERAND2 + 3;
 		} else {
+			COVER_BRANCH(false);
 			PC += 3;
 		}
 	} else {
@@ -347,8 +468,10 @@ static uint8_t jnb_bitaddr_offset(struct em8051 *aCPU) {
 		address >>= 3;
 		address += 0x20;
 		if (!(aCPU->mLowerData[address] & bitmask)) {
+			COVER_BRANCH(true);
 			PC += (signed char)OPERAND2 + 3;
 		} else {
+			COVER_BRANCH(false);
 			PC += 3;
 		}
 	}
@@ -356,6 +479,8 @@ static uint8_t jnb_bitaddr_offset(struct em8051 *aCPU) {
 }
 
 static uint8_t reti(struct em8051 *aCPU) {
+	uint8_t high;
+
 	if (aCPU->mInterruptActive) {
 		if (aCPU->except) {
 			uint8_t hi = 0;
@@ -376,8 +501,9 @@ static uint8_t reti(struct em8051 *aCPU) {
 			aCPU->mInterruptActive = 0;
 	}
 
-	PC = pop_from_stack(aCPU) << 8;
-	PC |= pop_from_stack(aCPU);
+	high = pop_from_stack(aCPU);
+	PC = (high << 8) | pop_from_stack(aCPU);
+	INSTRUMENT_EVENT(aCPU, EVENT_RETI, PC, 0);
 	return 1;
 }
 
@@ -385,6 +511,7 @@ static uint8_t rlc_a(struct em8051 *aCPU) {
 	bool carry = CARRY;
 	bool new_carry = ACC >> 7;
 	ACC = (ACC << 1) | carry;
+	REG_WRITTEN(REG_ACC);
 	PSW = (PSW & ~PSWMASK_C) | (new_carry << PSW_C);
 	PC++;
 	return 0;
@@ -394,6 +521,7 @@ static uint8_t addc_a_imm(struct em8051 *aCPU) {
 	bool carry = CARRY;
 	add_solve_flags(aCPU, ACC, OPERAND1, carry);
 	ACC += OPERAND1 + carry;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -403,6 +531,7 @@ static uint8_t addc_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, OPERAND1);
 	add_solve_flags(aCPU, ACC, value, carry);
 	ACC += value + carry;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -413,14 +542,17 @@ static uint8_t addc_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t value = read_mem_indir(aCPU, address);
 	add_solve_flags(aCPU, ACC, value, carry);
 	ACC += value + carry;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
 
 static uint8_t jc_offset(struct em8051 *aCPU) {
 	if (PSW & PSWMASK_C) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND1 + 2;
 	} else {
+		COVER_BRANCH(false);
 		PC += 2;
 	}
 	return 1;
@@ -444,6 +576,7 @@ static uint8_t orl_mem_imm(struct em8051 *aCPU) {
 
 static uint8_t orl_a_imm(struct em8051 *aCPU) {
 	ACC |= OPERAND1;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -451,6 +584,7 @@ static uint8_t orl_a_imm(struct em8051 *aCPU) {
 static uint8_t orl_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, OPERAND1);
 	ACC |= value;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -459,6 +593,7 @@ static uint8_t orl_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t address = INDIR_RX_ADDRESS;
 	uint8_t value = read_mem_indir(aCPU, address);
 	ACC |= value;
+	REG_WRITTEN(REG_ACC);
 
 	PC++;
 	return 0;
@@ -466,8 +601,10 @@ static uint8_t orl_a_indir_rx(struct em8051 *aCPU) {
 
 static uint8_t jnc_offset(struct em8051 *aCPU) {
 	if (PSW & PSWMASK_C) {
+		COVER_BRANCH(false);
 		PC += 2;
 	} else {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND1 + 2;
 	}
 	return 1;
@@ -476,10 +613,13 @@ static uint8_t jnc_offset(struct em8051 *aCPU) {
 static uint8_t anl_mem_a(struct em8051 *aCPU) {
 	uint8_t address = OPERAND1;
 	if (address > 0x7f) {
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, aCPU->mSFR[address - 0x80] & ACC);
+		WATCH(TRACE_SFR | address, aCPU->mSFR[address - 0x80] & ACC, aCPU->mSFR[address - 0x80], true);
 		aCPU->mSFR[address - 0x80] &= ACC;
-		if (aCPU->sfrwrite[address - 0x80])
-			aCPU->sfrwrite[address - 0x80](aCPU, address);
+		sfr_written(aCPU, address);
 	} else {
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, aCPU->mLowerData[address] & ACC);
+		WATCH(TRACE_DATA | address, aCPU->mLowerData[address] & ACC, aCPU->mLowerData[address], true);
 		aCPU->mLowerData[address] &= ACC;
 	}
 	PC += 2;
@@ -496,6 +636,7 @@ static uint8_t anl_mem_imm(struct em8051 *aCPU) {
 
 static uint8_t anl_a_imm(struct em8051 *aCPU) {
 	ACC &= OPERAND1;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -503,6 +644,7 @@ static uint8_t anl_a_imm(struct em8051 *aCPU) {
 static uint8_t anl_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, OPERAND1);
 	ACC &= value;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -511,14 +653,17 @@ static uint8_t anl_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t address = INDIR_RX_ADDRESS;
 	uint8_t value = read_mem_indir(aCPU, address);
 	ACC &= value;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
 
 static uint8_t jz_offset(struct em8051 *aCPU) {
 	if (!ACC) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND1 + 2;
 	} else {
+		COVER_BRANCH(false);
 		PC += 2;
 	}
 	return 1;
@@ -527,10 +672,13 @@ static uint8_t jz_offset(struct em8051 *aCPU) {
 static uint8_t xrl_mem_a(struct em8051 *aCPU) {
 	uint8_t address = OPERAND1;
 	if (address > 0x7f) {
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, aCPU->mSFR[address - 0x80] ^ ACC);
+		WATCH(TRACE_SFR | address, aCPU->mSFR[address - 0x80] ^ ACC, aCPU->mSFR[address - 0x80], true);
 		aCPU->mSFR[address - 0x80] ^= ACC;
-		if (aCPU->sfrwrite[address - 0x80])
-			aCPU->sfrwrite[address - 0x80](aCPU, address);
+		sfr_written(aCPU, address);
 	} else {
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, aCPU->mLowerData[address] ^ ACC);
+		WATCH(TRACE_DATA | address, aCPU->mLowerData[address] ^ ACC, aCPU->mLowerData[address], true);
 		aCPU->mLowerData[address] ^= ACC;
 	}
 	PC += 2;
@@ -547,6 +695,7 @@ static uint8_t xrl_mem_imm(struct em8051 *aCPU) {
 
 static uint8_t xrl_a_imm(struct em8051 *aCPU) {
 	ACC ^= OPERAND1;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -554,6 +703,7 @@ static uint8_t xrl_a_imm(struct em8051 *aCPU) {
 static uint8_t xrl_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, OPERAND1);
 	ACC ^= value;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -562,14 +712,17 @@ static uint8_t xrl_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t address = INDIR_RX_ADDRESS;
 	uint8_t value = read_mem_indir(aCPU, address);
 	ACC ^= value;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
 
 static uint8_t jnz_offset(struct em8051 *aCPU) {
 	if (ACC) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND1 + 2;
 	} else {
+		COVER_BRANCH(false);
 		PC += 2;
 	}
 	return 1;
@@ -583,10 +736,7 @@ static uint8_t orl_c_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		value = (value & bitmask) ? 1 : carry;
 
@@ -611,6 +761,7 @@ static uint8_t jmp_indir_a_dptr(struct em8051 *aCPU) {
 
 static uint8_t mov_a_imm(struct em8051 *aCPU) {
 	ACC = OPERAND1;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -644,10 +795,7 @@ static uint8_t anl_c_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		value = (value & bitmask) ? carry : 0;
 
@@ -668,6 +816,10 @@ static uint8_t anl_c_bitaddr(struct em8051 *aCPU) {
 static uint8_t movc_a_indir_a_pc(struct em8051 *aCPU) {
 	uint16_t address = PC + 1 + ACC;
 	ACC = CODEMEM(address);
+	REG_WRITTEN(REG_ACC);
+	if (aCPU->mTrace)
+		trace_read(aCPU, TRACE_CODE | address, ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_CODE | address, ACC);
 	PC++;
 	return 0;
 }
@@ -686,6 +838,8 @@ static uint8_t div_ab(struct em8051 *aCPU) {
 	}
 	ACC = a;
 	aCPU->mSFR[REG_B] = b;
+	REG_WRITTEN(REG_ACC);
+	REG_WRITTEN(REG_B);
 	PC++;
 	return 3;
 }
@@ -711,6 +865,8 @@ static uint8_t mov_mem_indir_rx(struct em8051 *aCPU) {
 static uint8_t mov_dptr_imm(struct em8051 *aCPU) {
 	aCPU->mSFR[REG_DPH] = OPERAND1;
 	aCPU->mSFR[REG_DPL] = OPERAND2;
+	REG_WRITTEN(REG_DPH);
+	REG_WRITTEN(REG_DPL);
 	PC += 3;
 	return 1;
 }
@@ -725,14 +881,17 @@ static uint8_t mov_bitaddr_c(struct em8051 *aCPU) {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address &= 0xf8;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, (aCPU->mSFR[address - 0x80] & ~bitmask) | (carry << bitaddr));
+		WATCH(TRACE_SFR | address, (aCPU->mSFR[address - 0x80] & ~bitmask) | (carry << bitaddr), aCPU->mSFR[address - 0x80], true);
 		aCPU->mSFR[address - 0x80] = (aCPU->mSFR[address - 0x80] & ~bitmask) | (carry << bitaddr);
-		if (aCPU->sfrwrite[address - 0x80])
-			aCPU->sfrwrite[address - 0x80](aCPU, address);
+		sfr_written(aCPU, address);
 	} else {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address >>= 3;
 		address += 0x20;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, (aCPU->mLowerData[address] & ~bitmask) | (carry << bitaddr));
+		WATCH(TRACE_DATA | address, (aCPU->mLowerData[address] & ~bitmask) | (carry << bitaddr), aCPU->mLowerData[address], true);
 		aCPU->mLowerData[address] = (aCPU->mLowerData[address] & ~bitmask) | (carry << bitaddr);
 	}
 	PC += 2;
@@ -742,6 +901,10 @@ static uint8_t mov_bitaddr_c(struct em8051 *aCPU) {
 static uint8_t movc_a_indir_a_dptr(struct em8051 *aCPU) {
 	uint16_t address = DPTR + ACC;
 	ACC = CODEMEM(address);
+	REG_WRITTEN(REG_ACC);
+	if (aCPU->mTrace)
+		trace_read(aCPU, TRACE_CODE | address, ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_CODE | address, ACC);
 	PC++;
 	return 1;
 }
@@ -750,6 +913,7 @@ static uint8_t subb_a_imm(struct em8051 *aCPU) {
 	bool carry = CARRY;
 	sub_solve_flags(aCPU, ACC, OPERAND1, carry);
 	ACC -= OPERAND1 + carry;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -759,6 +923,7 @@ static uint8_t subb_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, OPERAND1);
 	sub_solve_flags(aCPU, ACC, value, carry);
 	ACC -= value + carry;
+	REG_WRITTEN(REG_ACC);
 
 	PC += 2;
 	return 0;
@@ -769,6 +934,7 @@ static uint8_t subb_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t value = read_mem_indir(aCPU, address);
 	sub_solve_flags(aCPU, ACC, value, carry);
 	ACC -= value + carry;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -781,10 +947,7 @@ static uint8_t orl_c_compl_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		value = (value & bitmask) ? carry : 1;
 
@@ -809,10 +972,7 @@ static uint8_t mov_c_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		value = (value & bitmask) ? 1 : 0;
 
@@ -833,8 +993,11 @@ static uint8_t mov_c_bitaddr(struct em8051 *aCPU) {
 
 static uint8_t inc_dptr(struct em8051 *aCPU) {
 	aCPU->mSFR[REG_DPL]++;
-	if (!aCPU->mSFR[REG_DPL])
+	REG_WRITTEN(REG_DPL);
+	if (!aCPU->mSFR[REG_DPL]) {
 		aCPU->mSFR[REG_DPH]++;
+		REG_WRITTEN(REG_DPH);
+	}
 	PC++;
 	return 1;
 }
@@ -845,6 +1008,8 @@ static uint8_t mul_ab(struct em8051 *aCPU) {
 	uint16_t res = a * b;
 	ACC = res & 0xff;
 	aCPU->mSFR[REG_B] = res >> 8;
+	REG_WRITTEN(REG_ACC);
+	REG_WRITTEN(REG_B);
 	PSW &= ~(PSWMASK_C | PSWMASK_OV);
 	if (aCPU->mSFR[REG_B])
 		PSW |= PSWMASK_OV;
@@ -869,10 +1034,7 @@ static uint8_t anl_c_compl_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitmask = (1 << bitaddr);
 		uint8_t value;
 		address &= 0xf8;
-		if (aCPU->sfrread[address - 0x80])
-			value = aCPU->sfrread[address - 0x80](aCPU, address);
-		else
-			value = aCPU->mSFR[address - 0x80];
+		value = read_sfr(aCPU, address);
 
 		value = (value & bitmask) ? 0 : carry;
 
@@ -899,14 +1061,17 @@ static uint8_t cpl_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address &= 0xf8;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, aCPU->mSFR[address - 0x80] ^ bitmask);
+		WATCH(TRACE_SFR | address, aCPU->mSFR[address - 0x80] ^ bitmask, aCPU->mSFR[address - 0x80], true);
 		aCPU->mSFR[address - 0x80] ^= bitmask;
-		if (aCPU->sfrwrite[address - 0x80])
-			aCPU->sfrwrite[address - 0x80](aCPU, address);
+		sfr_written(aCPU, address);
 	} else {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address >>= 3;
 		address += 0x20;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, aCPU->mLowerData[address] ^ bitmask);
+		WATCH(TRACE_DATA | address, aCPU->mLowerData[address] ^ bitmask, aCPU->mLowerData[address], true);
 		aCPU->mLowerData[address] ^= bitmask;
 	}
 	PC += 2;
@@ -929,8 +1094,10 @@ static uint8_t cjne_a_imm_offset(struct em8051 *aCPU) {
 	}
 
 	if (ACC != value) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND2 + 3;
 	} else {
+		COVER_BRANCH(false);
 		PC += 3;
 	}
 	return 1;
@@ -947,8 +1114,10 @@ static uint8_t cjne_a_mem_offset(struct em8051 *aCPU) {
 	}
 
 	if (ACC != value) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND2 + 3;
 	} else {
+		COVER_BRANCH(false);
 		PC += 3;
 	}
 	return 1;
@@ -965,8 +1134,10 @@ static uint8_t cjne_indir_rx_imm_offset(struct em8051 *aCPU) {
 	}
 
 	if (value1 != value2) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND2 + 3;
 	} else {
+		COVER_BRANCH(false);
 		PC += 3;
 	}
 	return 1;
@@ -988,14 +1159,17 @@ static uint8_t clr_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address &= 0xf8;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, aCPU->mSFR[address - 0x80] & ~bitmask);
+		WATCH(TRACE_SFR | address, aCPU->mSFR[address - 0x80] & ~bitmask, aCPU->mSFR[address - 0x80], true);
 		aCPU->mSFR[address - 0x80] &= ~bitmask;
-		if (aCPU->sfrwrite[address - 0x80])
-			aCPU->sfrwrite[address - 0x80](aCPU, address);
+		sfr_written(aCPU, address);
 	} else {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address >>= 3;
 		address += 0x20;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, aCPU->mLowerData[address] & ~bitmask);
+		WATCH(TRACE_DATA | address, aCPU->mLowerData[address] & ~bitmask, aCPU->mLowerData[address], true);
 		aCPU->mLowerData[address] &= ~bitmask;
 	}
 	PC += 2;
@@ -1010,6 +1184,7 @@ static uint8_t clr_c(struct em8051 *aCPU) {
 
 static uint8_t swap_a(struct em8051 *aCPU) {
 	ACC = (ACC << 4) | (ACC >> 4);
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1019,6 +1194,7 @@ static uint8_t xch_a_mem(struct em8051 *aCPU) {
 	uint8_t value = read_mem(aCPU, address);
 	write_mem(aCPU, address, ACC);
 	ACC = value;
+	REG_WRITTEN(REG_ACC);
 	PC += 2;
 	return 0;
 }
@@ -1028,6 +1204,7 @@ static uint8_t xch_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t value = read_mem_indir(aCPU, address);
 	write_mem_indir(aCPU, address, ACC);
 	ACC = value;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1049,14 +1226,17 @@ static uint8_t setb_bitaddr(struct em8051 *aCPU) {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address &= 0xf8;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_SFR | address, aCPU->mSFR[address - 0x80] | bitmask);
+		WATCH(TRACE_SFR | address, aCPU->mSFR[address - 0x80] | bitmask, aCPU->mSFR[address - 0x80], true);
 		aCPU->mSFR[address - 0x80] |= bitmask;
-		if (aCPU->sfrwrite[address - 0x80])
-			aCPU->sfrwrite[address - 0x80](aCPU, address);
+		sfr_written(aCPU, address);
 	} else {
 		uint8_t bitaddr = address & 7;
 		uint8_t bitmask = (1 << bitaddr);
 		address >>= 3;
 		address += 0x20;
+		INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | address, aCPU->mLowerData[address] | bitmask);
+		WATCH(TRACE_DATA | address, aCPU->mLowerData[address] | bitmask, aCPU->mLowerData[address], true);
 		aCPU->mLowerData[address] |= bitmask;
 	}
 	PC += 2;
@@ -1082,6 +1262,7 @@ static uint8_t da_a(struct em8051 *aCPU) {
 	if (result > 0x99)
 		PSW |= PSWMASK_C;
 	ACC = result;
+	REG_WRITTEN(REG_ACC);
 
 	/*
 	   // this is basically what intel datasheet says the op should do..
@@ -1106,8 +1287,10 @@ static uint8_t djnz_mem_offset(struct em8051 *aCPU) {
 	write_mem(aCPU, address, value);
 
 	if (value) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND2 + 3;
 	} else {
+		COVER_BRANCH(false);
 		PC += 3;
 	}
 	return 1;
@@ -1117,6 +1300,7 @@ static uint8_t xchd_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t address = INDIR_RX_ADDRESS;
 	uint8_t value = read_mem_indir(aCPU, address);
 	ACC = (ACC & 0xf0) | (value & 0x0f);
+	REG_WRITTEN(REG_ACC);
 	value = (value & 0xf0) | (ACC & 0x0f);
 	write_mem_indir(aCPU, address, value);
 	PC++;
@@ -1131,6 +1315,11 @@ static uint8_t movx_a_indir_dptr(struct em8051 *aCPU) {
 		if (aCPU->mExtData)
 			ACC = EXTDATA(dptr);
 	}
+	if (aCPU->mTrace)
+		trace_read(aCPU, TRACE_EXT | dptr, ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_EXT | dptr, ACC);
+	WATCH(TRACE_EXT | dptr, ACC, ACC, false);
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 1;
 }
@@ -1143,6 +1332,11 @@ static uint8_t movx_a_indir_rx(struct em8051 *aCPU) {
 		if (aCPU->mExtData)
 			ACC = EXTDATA(address);
 	}
+	if (aCPU->mTrace)
+		trace_read(aCPU, TRACE_EXT | address, ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_READ, TRACE_EXT | address, ACC);
+	WATCH(TRACE_EXT | address, ACC, ACC, false);
+	REG_WRITTEN(REG_ACC);
 
 	PC++;
 	return 1;
@@ -1150,6 +1344,7 @@ static uint8_t movx_a_indir_rx(struct em8051 *aCPU) {
 
 static uint8_t clr_a(struct em8051 *aCPU) {
 	ACC = 0;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1162,6 +1357,7 @@ static uint8_t mov_a_mem(struct em8051 *aCPU) {
 		if (aCPU->except)
 			aCPU->except(aCPU, EXCEPTION_ACC_TO_A);
 	ACC = value;
+	REG_WRITTEN(REG_ACC);
 
 	PC += 2;
 	return 0;
@@ -1170,17 +1366,26 @@ static uint8_t mov_a_mem(struct em8051 *aCPU) {
 static uint8_t mov_a_indir_rx(struct em8051 *aCPU) {
 	uint8_t address = INDIR_RX_ADDRESS;
 	ACC = read_mem_indir(aCPU, address);
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
 
 static uint8_t movx_indir_dptr_a(struct em8051 *aCPU) {
 	uint16_t dptr = DPTR;
+	if (aCPU->mTrace)
+		trace_write(aCPU, TRACE_EXT | dptr, ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_EXT | dptr, ACC);
+	WATCH(TRACE_EXT | dptr, ACC, aCPU->mExtData ? EXTDATA(dptr) : 0, true);
 	if (aCPU->xwrite) {
 		aCPU->xwrite(aCPU, dptr, ACC);
 	} else {
-		if (aCPU->mExtData)
+		if (aCPU->mExtData) {
 			EXTDATA(dptr) = ACC;
+			// self-modifying code
+			if (aCPU->mExtData == aCPU->mCodeMem)
+				invalidate_code(aCPU, dptr, 1);
+		}
 	}
 
 	PC++;
@@ -1190,11 +1395,19 @@ static uint8_t movx_indir_dptr_a(struct em8051 *aCPU) {
 static uint8_t movx_indir_rx_a(struct em8051 *aCPU) {
 	uint16_t address = INDIR_RX_ADDRESS;
 
+	if (aCPU->mTrace)
+		trace_write(aCPU, TRACE_EXT | address, ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_EXT | address, ACC);
+	WATCH(TRACE_EXT | address, ACC, aCPU->mExtData ? EXTDATA(address) : 0, true);
 	if (aCPU->xwrite) {
 		aCPU->xwrite(aCPU, address, ACC);
 	} else {
-		if (aCPU->mExtData)
+		if (aCPU->mExtData) {
 			EXTDATA(address) = ACC;
+			// self-modifying code
+			if (aCPU->mExtData == aCPU->mCodeMem)
+				invalidate_code(aCPU, address, 1);
+		}
 	}
 
 	PC++;
@@ -1203,6 +1416,7 @@ static uint8_t movx_indir_rx_a(struct em8051 *aCPU) {
 
 static uint8_t cpl_a(struct em8051 *aCPU) {
 	ACC = ~ACC;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1231,6 +1445,8 @@ static uint8_t nop(struct em8051 *aCPU) {
 
 static uint8_t inc_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, aCPU->mLowerData[rx] + 1);
+	WATCH(TRACE_DATA | rx, aCPU->mLowerData[rx] + 1, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx]++;
 	PC++;
 	return 0;
@@ -1238,6 +1454,8 @@ static uint8_t inc_rx(struct em8051 *aCPU) {
 
 static uint8_t dec_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, aCPU->mLowerData[rx] - 1);
+	WATCH(TRACE_DATA | rx, aCPU->mLowerData[rx] - 1, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx]--;
 	PC++;
 	return 0;
@@ -1247,6 +1465,7 @@ static uint8_t add_a_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	add_solve_flags(aCPU, aCPU->mLowerData[rx], ACC, 0);
 	ACC += aCPU->mLowerData[rx];
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1256,6 +1475,7 @@ static uint8_t addc_a_rx(struct em8051 *aCPU) {
 	bool carry = CARRY;
 	add_solve_flags(aCPU, aCPU->mLowerData[rx], ACC, carry);
 	ACC += aCPU->mLowerData[rx] + carry;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1263,6 +1483,7 @@ static uint8_t addc_a_rx(struct em8051 *aCPU) {
 static uint8_t orl_a_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	ACC |= aCPU->mLowerData[rx];
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1270,6 +1491,7 @@ static uint8_t orl_a_rx(struct em8051 *aCPU) {
 static uint8_t anl_a_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	ACC &= aCPU->mLowerData[rx];
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1277,12 +1499,15 @@ static uint8_t anl_a_rx(struct em8051 *aCPU) {
 static uint8_t xrl_a_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	ACC ^= aCPU->mLowerData[rx];
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
 
 static uint8_t mov_rx_imm(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, OPERAND1);
+	WATCH(TRACE_DATA | rx, OPERAND1, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx] = OPERAND1;
 	PC += 2;
 	return 0;
@@ -1301,6 +1526,7 @@ static uint8_t subb_a_rx(struct em8051 *aCPU) {
 	bool carry = CARRY;
 	sub_solve_flags(aCPU, ACC, aCPU->mLowerData[rx], carry);
 	ACC -= aCPU->mLowerData[rx] + carry;
+	REG_WRITTEN(REG_ACC);
 	PC++;
 	return 0;
 }
@@ -1308,6 +1534,8 @@ static uint8_t subb_a_rx(struct em8051 *aCPU) {
 static uint8_t mov_rx_mem(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	uint8_t value = read_mem(aCPU, OPERAND1);
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, value);
+	WATCH(TRACE_DATA | rx, value, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx] = value;
 
 	PC += 2;
@@ -1325,8 +1553,10 @@ static uint8_t cjne_rx_imm_offset(struct em8051 *aCPU) {
 	}
 
 	if (aCPU->mLowerData[rx] != value) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND2 + 3;
 	} else {
+		COVER_BRANCH(false);
 		PC += 3;
 	}
 	return 1;
@@ -1336,6 +1566,9 @@ static uint8_t xch_a_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	uint8_t a = ACC;
 	ACC = aCPU->mLowerData[rx];
+	REG_WRITTEN(REG_ACC);
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, a);
+	WATCH(TRACE_DATA | rx, a, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx] = a;
 	PC++;
 	return 0;
@@ -1343,10 +1576,14 @@ static uint8_t xch_a_rx(struct em8051 *aCPU) {
 
 static uint8_t djnz_rx_offset(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, aCPU->mLowerData[rx] - 1);
+	WATCH(TRACE_DATA | rx, aCPU->mLowerData[rx] - 1, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx]--;
 	if (aCPU->mLowerData[rx]) {
+		COVER_BRANCH(true);
 		PC += (signed char)OPERAND1 + 2;
 	} else {
+		COVER_BRANCH(false);
 		PC += 2;
 	}
 	return 1;
@@ -1355,6 +1592,7 @@ static uint8_t djnz_rx_offset(struct em8051 *aCPU) {
 static uint8_t mov_a_rx(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
 	ACC = aCPU->mLowerData[rx];
+	REG_WRITTEN(REG_ACC);
 
 	PC++;
 	return 0;
@@ -1362,6 +1600,8 @@ static uint8_t mov_a_rx(struct em8051 *aCPU) {
 
 static uint8_t mov_rx_a(struct em8051 *aCPU) {
 	uint8_t rx = RX_ADDRESS;
+	INSTRUMENT_EVENT(aCPU, EVENT_WRITE, TRACE_DATA | rx, ACC);
+	WATCH(TRACE_DATA | rx, ACC, aCPU->mLowerData[rx], true);
 	aCPU->mLowerData[rx] = ACC;
 	PC++;
 	return 0;
@@ -1532,6 +1772,82 @@ void op_setptrs(struct em8051 *aCPU) {
 	aCPU->op[0xf7] = &mov_indir_rx_a;
 }
 
+struct em8051_decoded *predecode(struct em8051 *aCPU, uint16_t aAddress) {
+	struct em8051_decoded *entry = &aCPU->mDecodeCache[aAddress & (aCPU->mCodeMemMaxIdx)];
+	uint8_t opcode = aCPU->mCodeMem[aAddress & (aCPU->mCodeMemMaxIdx)];
+	uint16_t next;
+
+	entry->address = aAddress;
+	entry->length = op_lengths[opcode];
+	entry->operand1 = aCPU->mCodeMem[(aAddress + 1) & (aCPU->mCodeMemMaxIdx)];
+	entry->operand2 = aCPU->mCodeMem[(aAddress + 2) & (aCPU->mCodeMemMaxIdx)];
+	next = aAddress + entry->length;
+	entry->target = next;
+	entry->flags = 0;
+
+	if ((opcode & 0x1f) == 0x01 || (opcode & 0x1f) == 0x11) {
+		// ajmp / acall
+		entry->target = (next & 0xf800) | entry->operand1 | ((opcode & 0xe0) << 3);
+		entry->flags = (opcode & 0x10) ? DECODED_CALL : DECODED_JUMP;
+	} else {
+		switch (opcode) {
+		case 0x02: // ljmp
+		case 0x12: // lcall
+			entry->target = (entry->operand1 << 8) | entry->operand2;
+			entry->flags = (opcode == 0x12) ? DECODED_CALL : DECODED_JUMP;
+			break;
+		case 0x22: // ret
+		case 0x32: // reti
+			entry->flags = DECODED_RETURN;
+			break;
+		case 0x73: // jmp @a+dptr
+			entry->flags = DECODED_INDIRECT;
+			break;
+		case 0x80: // sjmp
+			entry->target = next + (signed char)entry->operand1;
+			entry->flags = DECODED_JUMP;
+			break;
+		case 0x40: // jc
+		case 0x50: // jnc
+		case 0x60: // jz
+		case 0x70: // jnz
+		case 0xd8:
+		case 0xd9:
+		case 0xda:
+		case 0xdb:
+		case 0xdc:
+		case 0xdd:
+		case 0xde:
+		case 0xdf: // djnz rx
+			entry->target = next + (signed char)entry->operand1;
+			entry->flags = DECODED_BRANCH;
+			break;
+		case 0x10: // jbc
+		case 0x20: // jb
+		case 0x30: // jnb
+		case 0xb4:
+		case 0xb5:
+		case 0xb6:
+		case 0xb7:
+		case 0xb8:
+		case 0xb9:
+		case 0xba:
+		case 0xbb:
+		case 0xbc:
+		case 0xbd:
+		case 0xbe:
+		case 0xbf: // cjne
+		case 0xd5: // djnz mem
+			entry->target = next + (signed char)entry->operand2;
+			entry->flags = DECODED_BRANCH;
+			break;
+		}
+	}
+
+	entry->op = aCPU->op[opcode];
+	return entry;
+}
+
 uint8_t do_op(struct em8051 *aCPU) {
 	switch (OPCODE) {
 	case 0x00: return nop(aCPU);
@@ -1824,3 +2140,289 @@ uint8_t do_op(struct em8051 *aCPU) {
 	}
 	return 0;
 }
+
+unsigned int do_ops_threaded(struct em8051 *aCPU, unsigned int aTicks) {
+	unsigned int ticks = 0;
+#if defined(__GNUC__)
+	uint8_t opcode;
+	// Every handler ends in its own copy of the dispatch code, so the indirect
+	// jumps are spread over many branch sites instead of one.
+	static const void *const ops[256] = {
+		[0x00] = &&op_nop,
+		[0x01] = &&op_ajmp_offset,
+		[0x02] = &&op_ljmp_address,
+		[0x03] = &&op_rr_a,
+		[0x04] = &&op_inc_a,
+		[0x05] = &&op_inc_mem,
+		[0x06 ... 0x07] = &&op_inc_indir_rx,
+		[0x08 ... 0x0f] = &&op_inc_rx,
+		[0x10] = &&op_jbc_bitaddr_offset,
+		[0x11] = &&op_acall_offset,
+		[0x12] = &&op_lcall_address,
+		[0x13] = &&op_rrc_a,
+		[0x14] = &&op_dec_a,
+		[0x15] = &&op_dec_mem,
+		[0x16 ... 0x17] = &&op_dec_indir_rx,
+		[0x18 ... 0x1f] = &&op_dec_rx,
+		[0x20] = &&op_jb_bitaddr_offset,
+		[0x21] = &&op_ajmp_offset,
+		[0x22] = &&op_ret,
+		[0x23] = &&op_rl_a,
+		[0x24] = &&op_add_a_imm,
+		[0x25] = &&op_add_a_mem,
+		[0x26 ... 0x27] = &&op_add_a_indir_rx,
+		[0x28 ... 0x2f] = &&op_add_a_rx,
+		[0x30] = &&op_jnb_bitaddr_offset,
+		[0x31] = &&op_acall_offset,
+		[0x32] = &&op_reti,
+		[0x33] = &&op_rlc_a,
+		[0x34] = &&op_addc_a_imm,
+		[0x35] = &&op_addc_a_mem,
+		[0x36 ... 0x37] = &&op_addc_a_indir_rx,
+		[0x38 ... 0x3f] = &&op_addc_a_rx,
+		[0x40] = &&op_jc_offset,
+		[0x41] = &&op_ajmp_offset,
+		[0x42] = &&op_orl_mem_a,
+		[0x43] = &&op_orl_mem_imm,
+		[0x44] = &&op_orl_a_imm,
+		[0x45] = &&op_orl_a_mem,
+		[0x46 ... 0x47] = &&op_orl_a_indir_rx,
+		[0x48 ... 0x4f] = &&op_orl_a_rx,
+		[0x50] = &&op_jnc_offset,
+		[0x51] = &&op_acall_offset,
+		[0x52] = &&op_anl_mem_a,
+		[0x53] = &&op_anl_mem_imm,
+		[0x54] = &&op_anl_a_imm,
+		[0x55] = &&op_anl_a_mem,
+		[0x56 ... 0x57] = &&op_anl_a_indir_rx,
+		[0x58 ... 0x5f] = &&op_anl_a_rx,
+		[0x60] = &&op_jz_offset,
+		[0x61] = &&op_ajmp_offset,
+		[0x62] = &&op_xrl_mem_a,
+		[0x63] = &&op_xrl_mem_imm,
+		[0x64] = &&op_xrl_a_imm,
+		[0x65] = &&op_xrl_a_mem,
+		[0x66 ... 0x67] = &&op_xrl_a_indir_rx,
+		[0x68 ... 0x6f] = &&op_xrl_a_rx,
+		[0x70] = &&op_jnz_offset,
+		[0x71] = &&op_acall_offset,
+		[0x72] = &&op_orl_c_bitaddr,
+		[0x73] = &&op_jmp_indir_a_dptr,
+		[0x74] = &&op_mov_a_imm,
+		[0x75] = &&op_mov_mem_imm,
+		[0x76 ... 0x77] = &&op_mov_indir_rx_imm,
+		[0x78 ... 0x7f] = &&op_mov_rx_imm,
+		[0x80] = &&op_sjmp_offset,
+		[0x81] = &&op_ajmp_offset,
+		[0x82] = &&op_anl_c_bitaddr,
+		[0x83] = &&op_movc_a_indir_a_pc,
+		[0x84] = &&op_div_ab,
+		[0x85] = &&op_mov_mem_mem,
+		[0x86 ... 0x87] = &&op_mov_mem_indir_rx,
+		[0x88 ... 0x8f] = &&op_mov_mem_rx,
+		[0x90] = &&op_mov_dptr_imm,
+		[0x91] = &&op_acall_offset,
+		[0x92] = &&op_mov_bitaddr_c,
+		[0x93] = &&op_movc_a_indir_a_dptr,
+		[0x94] = &&op_subb_a_imm,
+		[0x95] = &&op_subb_a_mem,
+		[0x96 ... 0x97] = &&op_subb_a_indir_rx,
+		[0x98 ... 0x9f] = &&op_subb_a_rx,
+		[0xa0] = &&op_orl_c_compl_bitaddr,
+		[0xa1] = &&op_ajmp_offset,
+		[0xa2] = &&op_mov_c_bitaddr,
+		[0xa3] = &&op_inc_dptr,
+		[0xa4] = &&op_mul_ab,
+		[0xa5] = &&op_nop,
+		[0xa6 ... 0xa7] = &&op_mov_indir_rx_mem,
+		[0xa8 ... 0xaf] = &&op_mov_rx_mem,
+		[0xb0] = &&op_anl_c_compl_bitaddr,
+		[0xb1] = &&op_acall_offset,
+		[0xb2] = &&op_cpl_bitaddr,
+		[0xb3] = &&op_cpl_c,
+		[0xb4] = &&op_cjne_a_imm_offset,
+		[0xb5] = &&op_cjne_a_mem_offset,
+		[0xb6 ... 0xb7] = &&op_cjne_indir_rx_imm_offset,
+		[0xb8 ... 0xbf] = &&op_cjne_rx_imm_offset,
+		[0xc0] = &&op_push_mem,
+		[0xc1] = &&op_ajmp_offset,
+		[0xc2] = &&op_clr_bitaddr,
+		[0xc3] = &&op_clr_c,
+		[0xc4] = &&op_swap_a,
+		[0xc5] = &&op_xch_a_mem,
+		[0xc6 ... 0xc7] = &&op_xch_a_indir_rx,
+		[0xc8 ... 0xcf] = &&op_xch_a_rx,
+		[0xd0] = &&op_pop_mem,
+		[0xd1] = &&op_acall_offset,
+		[0xd2] = &&op_setb_bitaddr,
+		[0xd3] = &&op_setb_c,
+		[0xd4] = &&op_da_a,
+		[0xd5] = &&op_djnz_mem_offset,
+		[0xd6 ... 0xd7] = &&op_xchd_a_indir_rx,
+		[0xd8 ... 0xdf] = &&op_djnz_rx_offset,
+		[0xe0] = &&op_movx_a_indir_dptr,
+		[0xe1] = &&op_ajmp_offset,
+		[0xe2 ... 0xe3] = &&op_movx_a_indir_rx,
+		[0xe4] = &&op_clr_a,
+		[0xe5] = &&op_mov_a_mem,
+		[0xe6 ... 0xe7] = &&op_mov_a_indir_rx,
+		[0xe8 ... 0xef] = &&op_mov_a_rx,
+		[0xf0] = &&op_movx_indir_dptr_a,
+		[0xf1] = &&op_acall_offset,
+		[0xf2 ... 0xf3] = &&op_movx_indir_rx_a,
+		[0xf4] = &&op_cpl_a,
+		[0xf5] = &&op_mov_mem_a,
+		[0xf6 ... 0xf7] = &&op_mov_indir_rx_a,
+		[0xf8 ... 0xff] = &&op_mov_rx_a,
+	};
+
+#define THREADED_DISPATCH() \
+	while (ticks < aTicks && !aCPU->mStop) { \
+		uint8_t state; \
+		ticks++; \
+		state = tick_prologue(aCPU); \
+		if (state == TICK_EXECUTE) { \
+			opcode = OPCODE; \
+			goto *ops[opcode]; \
+		} \
+		if (state == TICK_HALTED) \
+			ticks += skip_halted(aCPU, aTicks - ticks); \
+	} \
+	return ticks;
+
+	// Same order as tick_state(). A handler replaced in aCPU->op[] is called
+	// through the table, so the engine runs whatever the table engine would.
+#define THREADED_OP(handler) \
+	op_##handler: \
+	if (aCPU->op[opcode] == &handler) \
+		aCPU->mTickDelay = handler(aCPU); \
+	else \
+		aCPU->mTickDelay = aCPU->op[opcode](aCPU); \
+	BREAKPOINT_STOP(aCPU); \
+	tick_epilogue(aCPU); \
+	THREADED_DISPATCH()
+
+	THREADED_DISPATCH()
+
+	THREADED_OP(nop)
+	THREADED_OP(ajmp_offset)
+	THREADED_OP(ljmp_address)
+	THREADED_OP(rr_a)
+	THREADED_OP(inc_a)
+	THREADED_OP(inc_mem)
+	THREADED_OP(inc_indir_rx)
+	THREADED_OP(inc_rx)
+	THREADED_OP(jbc_bitaddr_offset)
+	THREADED_OP(acall_offset)
+	THREADED_OP(lcall_address)
+	THREADED_OP(rrc_a)
+	THREADED_OP(dec_a)
+	THREADED_OP(dec_mem)
+	THREADED_OP(dec_indir_rx)
+	THREADED_OP(dec_rx)
+	THREADED_OP(jb_bitaddr_offset)
+	THREADED_OP(ret)
+	THREADED_OP(rl_a)
+	THREADED_OP(add_a_imm)
+	THREADED_OP(add_a_mem)
+	THREADED_OP(add_a_indir_rx)
+	THREADED_OP(add_a_rx)
+	THREADED_OP(jnb_bitaddr_offset)
+	THREADED_OP(reti)
+	THREADED_OP(rlc_a)
+	THREADED_OP(addc_a_imm)
+	THREADED_OP(addc_a_mem)
+	THREADED_OP(addc_a_indir_rx)
+	THREADED_OP(addc_a_rx)
+	THREADED_OP(jc_offset)
+	THREADED_OP(orl_mem_a)
+	THREADED_OP(orl_mem_imm)
+	THREADED_OP(orl_a_imm)
+	THREADED_OP(orl_a_mem)
+	THREADED_OP(orl_a_indir_rx)
+	THREADED_OP(orl_a_rx)
+	THREADED_OP(jnc_offset)
+	THREADED_OP(anl_mem_a)
+	THREADED_OP(anl_mem_imm)
+	THREADED_OP(anl_a_imm)
+	THREADED_OP(anl_a_mem)
+	THREADED_OP(anl_a_indir_rx)
+	THREADED_OP(anl_a_rx)
+	THREADED_OP(jz_offset)
+	THREADED_OP(xrl_mem_a)
+	THREADED_OP(xrl_mem_imm)
+	THREADED_OP(xrl_a_imm)
+	THREADED_OP(xrl_a_mem)
+	THREADED_OP(xrl_a_indir_rx)
+	THREADED_OP(xrl_a_rx)
+	THREADED_OP(jnz_offset)
+	THREADED_OP(orl_c_bitaddr)
+	THREADED_OP(jmp_indir_a_dptr)
+	THREADED_OP(mov_a_imm)
+	THREADED_OP(mov_mem_imm)
+	THREADED_OP(mov_indir_rx_imm)
+	THREADED_OP(mov_rx_imm)
+	THREADED_OP(sjmp_offset)
+	THREADED_OP(anl_c_bitaddr)
+	THREADED_OP(movc_a_indir_a_pc)
+	THREADED_OP(div_ab)
+	THREADED_OP(mov_mem_mem)
+	THREADED_OP(mov_mem_indir_rx)
+	THREADED_OP(mov_mem_rx)
+	THREADED_OP(mov_dptr_imm)
+	THREADED_OP(mov_bitaddr_c)
+	THREADED_OP(movc_a_indir_a_dptr)
+	THREADED_OP(subb_a_imm)
+	THREADED_OP(subb_a_mem)
+	THREADED_OP(subb_a_indir_rx)
+	THREADED_OP(subb_a_rx)
+	THREADED_OP(orl_c_compl_bitaddr)
+	THREADED_OP(mov_c_bitaddr)
+	THREADED_OP(inc_dptr)
+	THREADED_OP(mul_ab)
+	THREADED_OP(mov_indir_rx_mem)
+	THREADED_OP(mov_rx_mem)
+	THREADED_OP(anl_c_compl_bitaddr)
+	THREADED_OP(cpl_bitaddr)
+	THREADED_OP(cpl_c)
+	THREADED_OP(cjne_a_imm_offset)
+	THREADED_OP(cjne_a_mem_offset)
+	THREADED_OP(cjne_indir_rx_imm_offset)
+	THREADED_OP(cjne_rx_imm_offset)
+	THREADED_OP(push_mem)
+	THREADED_OP(clr_bitaddr)
+	THREADED_OP(clr_c)
+	THREADED_OP(swap_a)
+	THREADED_OP(xch_a_mem)
+	THREADED_OP(xch_a_indir_rx)
+	THREADED_OP(xch_a_rx)
+	THREADED_OP(pop_mem)
+	THREADED_OP(setb_bitaddr)
+	THREADED_OP(setb_c)
+	THREADED_OP(da_a)
+	THREADED_OP(djnz_mem_offset)
+	THREADED_OP(xchd_a_indir_rx)
+	THREADED_OP(djnz_rx_offset)
+	THREADED_OP(movx_a_indir_dptr)
+	THREADED_OP(movx_a_indir_rx)
+	THREADED_OP(clr_a)
+	THREADED_OP(mov_a_mem)
+	THREADED_OP(mov_a_indir_rx)
+	THREADED_OP(mov_a_rx)
+	THREADED_OP(movx_indir_dptr_a)
+	THREADED_OP(movx_indir_rx_a)
+	THREADED_OP(cpl_a)
+	THREADED_OP(mov_mem_a)
+	THREADED_OP(mov_indir_rx_a)
+	THREADED_OP(mov_rx_a)
+
+#undef THREADED_OP
+#undef THREADED_DISPATCH
+#else
+	while (ticks < aTicks && !aCPU->mStop) {
+		tick(aCPU);
+		ticks++;
+	}
+	return ticks;
+#endif
+}
@@ -116,32 +116,21 @@ void emu_exception(struct em8051 *aCPU, int aCode) {
 	wattroff(exc, A_REVERSE);
 	wmove(exc, 2, 2);
 
-	switch (aCode) {
-	case -1:
+	if (aCode == -1) {
 		waddstr(exc, "Breakpoint reached");
-		break;
-	case EXCEPTION_STACK:
-		waddstr(exc, "SP exception: stack address > 127");
-		wmove(exc, 3, 2);
-		waddstr(exc, "with no upper memory, or SP roll over.");
-		break;
-	case EXCEPTION_ACC_TO_A:
-		waddstr(exc, "Invalid operation: acc-to-a move operation");
-		break;
-	case EXCEPTION_IRET_PSW_MISMATCH:
-		waddstr(exc, "PSW not preserved over interrupt call");
-		break;
-	case EXCEPTION_IRET_SP_MISMATCH:
-		waddstr(exc, "SP not preserved over interrupt call");
-		break;
-	case EXCEPTION_IRET_ACC_MISMATCH:
-		waddstr(exc, "ACC not preserved over interrupt call");
-		break;
-	case EXCEPTION_ILLEGAL_OPCODE:
-		waddstr(exc, "Invalid opcode: 0xA5 encountered");
-		break;
-	default:
-		waddstr(exc, "Unknown exception");
+	} else {
+		const char *name = exception_name(aCode);
+		int length = (int)strlen(name);
+
+		// the longer ones go on two lines, split at a space
+		if (length > 46)
+			for (length = 46; length > 0 && name[length] != ' '; length--) {
+			}
+		waddnstr(exc, name, length);
+		if (name[length]) {
+			wmove(exc, 3, 2);
+			waddstr(exc, name + length + 1);
+		}
 	}
 	wmove(exc, 6, 12);
 	wattron(exc, A_REVERSE);
@@ -160,6 +149,7 @@ void emu_load(struct em8051 *aCPU) {
 	int pos = 0;
 	int ch = 0;
 	int result;
+	struct em8051_load_info info;
 	pos = (int)strlen(filename);
 
 	runmode = 0;
@@ -200,29 +190,68 @@ void emu_load(struct em8051 *aCPU) {
 		}
 	}
 
-	result = load_obj(aCPU, filename);
+	result = load_image(aCPU, filename, NULL, &info);
 	delwin(exc);
 	refreshview(aCPU);
 
-	switch (result) {
-	case -1:
-		emu_popup(aCPU, "Load error", "File not found.");
-		break;
-	case -2:
-		emu_popup(aCPU, "Load error", "Bad file format.");
-		break;
-	case -3:
-		emu_popup(aCPU, "Load error", "Unsupported HEX file version.");
-		break;
-	case -4:
-		emu_popup(aCPU, "Load error", "Checksum failure.");
-		break;
-	case -5:
-		emu_popup(aCPU, "Load error", "No end of data marker found.");
-		break;
+	if (result < 0) {
+		char message[64];
+		if (info.mLine && result != -1)
+			sprintf(message, "%s Line %u.", load_error(result), info.mLine);
+		else
+			strcpy(message, load_error(result));
+		emu_popup(aCPU, "Load error", message);
 	}
 }
 
+// Reads a line of at most 44 characters into aBuffer, starting from its
+// contents
+void emu_readstring(struct em8051 *aCPU, const char *aPrompt, char *aBuffer) {
+	WINDOW *exc;
+	int pos = (int)strlen(aBuffer);
+	int ch = 0;
+
+	runmode = 0;
+	setSpeed(speed, runmode);
+	exc = subwin(stdscr, 5, 50, (LINES - 6) / 2, (COLS - 50) / 2);
+	wattron(exc, A_REVERSE);
+	werase(exc);
+	box(exc, ACS_VLINE, ACS_HLINE);
+	mvwaddstr(exc, 0, 2, aPrompt);
+	wattroff(exc, A_REVERSE);
+	wmove(exc, 2, 2);
+	waddstr(exc, "[____________________________________________]");
+	wmove(exc, 2, 3);
+	waddstr(exc, aBuffer);
+	wrefresh(exc);
+
+	while (ch != '\n') {
+		ch = getch();
+		if ((ch > 31 && ch < 127) || (ch > 127 && ch < 255)) {
+			if (pos < 44) {
+				aBuffer[pos] = ch;
+				pos++;
+				aBuffer[pos] = 0;
+				waddch(exc, ch);
+				wrefresh(exc);
+			}
+		}
+		if (ch == KEY_DC || ch == 8 || ch == KEY_BACKSPACE) {
+			if (pos > 0) {
+				pos--;
+				aBuffer[pos] = 0;
+				wmove(exc, 2, 3 + pos);
+				waddch(exc, '_');
+				wmove(exc, 2, 3 + pos);
+				wrefresh(exc);
+			}
+		}
+	}
+
+	delwin(exc);
+	refreshview(aCPU);
+}
+
 int emu_readvalue(struct em8051 *aCPU, const char *aPrompt, int aOldvalue, int aValueSize) {
 	WINDOW *exc;
 	int pos = 0;
@@ -407,7 +436,7 @@ void emu_help(struct em8051 *aCPU) {
 
 	runmode = 0;
 	setSpeed(speed, runmode);
-	exc = subwin(stdscr, 14, 70, (LINES - 14) / 2, (COLS - 70) / 2);
+	exc = subwin(stdscr, 17, 70, (LINES - 17) / 2, (COLS - 70) / 2);
 	wattron(exc, A_REVERSE);
 	werase(exc);
 	box(exc, ACS_VLINE, ACS_HLINE);
@@ -419,7 +448,7 @@ void emu_help(struct em8051 *aCPU) {
 	waddstr(exc, "8051 Emulator v. 0.72 - http://iki.fi/sol/");
 	wmove(exc, 3, 2);
 	waddstr(exc, "Copyright (c) 2006 Jari Komppa");
-	wmove(exc, 13, 22);
+	wmove(exc, 16, 22);
 	wattron(exc, A_REVERSE);
 	waddstr(exc, "Press any key to continue");
 	wattroff(exc, A_REVERSE);
@@ -431,6 +460,8 @@ void emu_help(struct em8051 *aCPU) {
 	mvwaddstr(exc, 9, 2, "+ & - - Adjust run speed");
 	mvwaddstr(exc, 10, 6, "v - Change views");
 	mvwaddstr(exc, 11, 3, "home - Reset (with options)");
+	mvwaddstr(exc, 12, 6, "s - Save snapshot");
+	mvwaddstr(exc, 13, 6, "< - Run back to breakpoint");
 
 	mvwaddstr(exc, 5, 32, "shift-q - Quit");
 	mvwaddstr(exc, 6, 32, "cursors - Move cursor");
@@ -438,7 +469,12 @@ void emu_help(struct em8051 *aCPU) {
 	mvwaddstr(exc, 8, 36, "tab - Switch editor focus");
 	mvwaddstr(exc, 9, 36, "end - Reset tick/time counter");
 	mvwaddstr(exc, 10, 38, "k - Set or clear breakpoint");
+	mvwaddstr(exc, 14, 38, "K - Clear all breakpoints");
+	mvwaddstr(exc, 14, 6, "w - Add watchpoint");
+	mvwaddstr(exc, 15, 38, "W - Clear all watchpoints");
 	mvwaddstr(exc, 11, 38, "g - Go to address (adjust PC)");
+	mvwaddstr(exc, 12, 38, "x - Restore snapshot");
+	mvwaddstr(exc, 13, 38, ", - Step back");
 
 	wrefresh(exc);
 
@@ -0,0 +1,522 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * profile.c
+ * Cycle profiler
+ *
+ * Every instruction run adds its machine cycles, the tick delay its handler
+ * returned plus one, to its address. Calls are followed on a shadow stack:
+ * acall, lcall and interrupt entries push a frame, and a ret or reti pops
+ * the frame whose stack pointer it returns through, along with any frames
+ * above it that were never returned from. Popping a frame adds the cycles
+ * and instructions run since it was pushed to its call graph edge.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+// the 8051 stack holds at most 128 return addresses; a deeper shadow stack
+// has lost track, and drops its oldest frame
+#define PROFILE_MAX_DEPTH 256
+
+// lines in the hot spot list
+#define PROFILE_HOT_SPOTS 20
+
+// longest symbol name and offset in the reports
+#define PROFILE_NAME_LENGTH 128
+
+// A call graph edge: calls from mSite in mCaller to mCallee
+struct profile_edge {
+	uint16_t mCaller;
+	uint16_t mSite;
+	uint16_t mCallee;
+	bool mUsed;
+	unsigned long long mCalls;
+	unsigned long long mCycles; // inclusive
+	unsigned long long mInstructions; // inclusive
+};
+
+struct profile_frame {
+	uint16_t mFunction;
+	uint16_t mCaller;
+	uint16_t mSite;
+	int mSP; // after the return address was pushed; -1 for the root
+	bool mOutermost; // the function is not further down the stack
+	// totals when pushed, or when last settled
+	unsigned long long mCycles;
+	unsigned long long mInstructions;
+};
+
+struct profile_function {
+	unsigned long long mCycles; // inclusive, recursion counted once
+	unsigned long long mInstructions;
+	unsigned long long mCalls;
+	unsigned int mActive; // frames on the shadow stack
+	bool mSeen;
+};
+
+struct em8051_profile {
+	struct em8051 *mCPU; // NULL once stopped
+	struct em8051 *mCode; // for the disassembly in the report
+	struct em8051_symbols *mSymbols; // names in the reports, or NULL
+	unsigned long long mCycles;
+	unsigned long long mInstructions;
+	unsigned long long mInterrupts;
+	// instruction being run, see profile_begin()
+	uint16_t mPC;
+	uint8_t mOpcode;
+	uint8_t mSP;
+	unsigned int mDepth;
+	struct profile_frame mStack[PROFILE_MAX_DEPTH];
+	struct profile_edge *mEdges; // hash table
+	unsigned int mEdgeCount;
+	unsigned int mEdgeMask;
+	unsigned long long mCount[65536]; // instructions run per address
+	unsigned long long mAddressCycles[65536];
+	uint16_t mOwner[65536]; // the function the address was first run in
+	struct profile_function mFunctions[65536];
+};
+
+static unsigned int edge_hash(uint16_t aCaller, uint16_t aSite, uint16_t aCallee) {
+	uint32_t key = ((uint32_t)aSite << 16 | aCallee) ^ ((uint32_t)aCaller * 0x9e37u);
+	return (key * 2654435761u) >> 8;
+}
+
+static struct profile_edge *find_slot(struct profile_edge *aEdges, unsigned int aMask,
+	uint16_t aCaller, uint16_t aSite, uint16_t aCallee) {
+	unsigned int i = edge_hash(aCaller, aSite, aCallee) & aMask;
+
+	while (aEdges[i].mUsed &&
+		(aEdges[i].mCaller != aCaller || aEdges[i].mSite != aSite || aEdges[i].mCallee != aCallee))
+		i = (i + 1) & aMask;
+	return &aEdges[i];
+}
+
+// Returns the edge, added if new; NULL if out of memory
+static struct profile_edge *get_edge(struct em8051_profile *aProfile, uint16_t aCaller, uint16_t aSite, uint16_t aCallee) {
+	struct profile_edge *edge;
+
+	// keep the table at most half full
+	if (aProfile->mEdgeCount * 2 >= aProfile->mEdgeMask) {
+		unsigned int i, mask = aProfile->mEdgeMask * 2 + 1;
+		struct profile_edge *edges = calloc(mask + 1, sizeof(struct profile_edge));
+		if (!edges)
+			return NULL;
+		for (i = 0; i <= aProfile->mEdgeMask; i++) {
+			edge = &aProfile->mEdges[i];
+			if (edge->mUsed)
+				*find_slot(edges, mask, edge->mCaller, edge->mSite, edge->mCallee) = *edge;
+		}
+		free(aProfile->mEdges);
+		aProfile->mEdges = edges;
+		aProfile->mEdgeMask = mask;
+	}
+
+	edge = find_slot(aProfile->mEdges, aProfile->mEdgeMask, aCaller, aSite, aCallee);
+	if (!edge->mUsed) {
+		edge->mUsed = true;
+		edge->mCaller = aCaller;
+		edge->mSite = aSite;
+		edge->mCallee = aCallee;
+		aProfile->mEdgeCount++;
+	}
+	return edge;
+}
+
+static void push_frame(struct em8051_profile *aProfile, uint16_t aFunction, uint16_t aSite, int aSP) {
+	struct profile_frame *frame;
+	struct profile_edge *edge;
+
+	if (aProfile->mDepth == PROFILE_MAX_DEPTH) {
+		// keep the root
+		aProfile->mFunctions[aProfile->mStack[1].mFunction].mActive--;
+		memmove(&aProfile->mStack[1], &aProfile->mStack[2], (PROFILE_MAX_DEPTH - 2) * sizeof(struct profile_frame));
+		aProfile->mDepth--;
+	}
+
+	frame = &aProfile->mStack[aProfile->mDepth++];
+	frame->mFunction = aFunction;
+	frame->mCaller = aProfile->mDepth > 1 ? frame[-1].mFunction : aFunction;
+	frame->mSite = aSite;
+	frame->mSP = aSP;
+	frame->mOutermost = aProfile->mFunctions[aFunction].mActive++ == 0;
+	frame->mCycles = aProfile->mCycles;
+	frame->mInstructions = aProfile->mInstructions;
+	aProfile->mFunctions[aFunction].mSeen = true;
+
+	if (aSP < 0)
+		return;
+	aProfile->mFunctions[aFunction].mCalls++;
+	edge = get_edge(aProfile, frame->mCaller, aSite, aFunction);
+	if (edge)
+		edge->mCalls++;
+}
+
+// Adds the cycles since the frame was pushed, or last settled, to its edge
+// and function
+static void settle_frame(struct em8051_profile *aProfile, struct profile_frame *aFrame) {
+	unsigned long long cycles = aProfile->mCycles - aFrame->mCycles;
+	unsigned long long instructions = aProfile->mInstructions - aFrame->mInstructions;
+
+	if (aFrame->mOutermost) {
+		aProfile->mFunctions[aFrame->mFunction].mCycles += cycles;
+		aProfile->mFunctions[aFrame->mFunction].mInstructions += instructions;
+	}
+	if (aFrame->mSP >= 0) {
+		struct profile_edge *edge = get_edge(aProfile, aFrame->mCaller, aFrame->mSite, aFrame->mFunction);
+		if (edge) {
+			edge->mCycles += cycles;
+			edge->mInstructions += instructions;
+		}
+	}
+	aFrame->mCycles = aProfile->mCycles;
+	aFrame->mInstructions = aProfile->mInstructions;
+}
+
+// Pops the frames down to the one returned through with aSP, if any
+static void return_through(struct em8051_profile *aProfile, uint8_t aSP) {
+	unsigned int i = aProfile->mDepth;
+
+	while (i > 1 && aProfile->mStack[i - 1].mSP != aSP)
+		i--;
+	if (i <= 1)
+		return;
+	while (aProfile->mDepth >= i) {
+		struct profile_frame *frame = &aProfile->mStack[--aProfile->mDepth];
+		settle_frame(aProfile, frame);
+		aProfile->mFunctions[frame->mFunction].mActive--;
+	}
+}
+
+void profile_begin(struct em8051 *aCPU) {
+	struct em8051_profile *profile = aCPU->mProfile;
+
+	profile->mPC = aCPU->mPC;
+	profile->mOpcode = aCPU->mCodeMem[aCPU->mPC & (aCPU->mCodeMemMaxIdx)];
+	profile->mSP = aCPU->mSFR[REG_SP];
+	if (!profile->mDepth)
+		push_frame(profile, aCPU->mPC, aCPU->mPC, -1);
+}
+
+void profile_end(struct em8051 *aCPU) {
+	struct em8051_profile *profile = aCPU->mProfile;
+	uint16_t pc = profile->mPC;
+	unsigned int cycles = aCPU->mTickDelay + 1;
+
+	if (!profile->mCount[pc]++)
+		profile->mOwner[pc] = profile->mStack[profile->mDepth - 1].mFunction;
+	profile->mAddressCycles[pc] += cycles;
+	profile->mCycles += cycles;
+	profile->mInstructions++;
+
+	switch (profile->mOpcode) {
+	case 0x11:
+	case 0x31:
+	case 0x51:
+	case 0x71:
+	case 0x91:
+	case 0xb1:
+	case 0xd1:
+	case 0xf1: // acall
+	case 0x12: // lcall
+		push_frame(profile, aCPU->mPC, pc, aCPU->mSFR[REG_SP]);
+		break;
+	case 0x22: // ret
+	case 0x32: // reti
+		return_through(profile, profile->mSP);
+		break;
+	}
+}
+
+void profile_interrupt(struct em8051 *aCPU, uint16_t aVector) {
+	struct em8051_profile *profile = aCPU->mProfile;
+
+	if (!profile->mDepth)
+		push_frame(profile, aCPU->mPC, aCPU->mPC, -1);
+	// the two cycles of the hardware lcall go to the handler
+	push_frame(profile, aVector, aCPU->mPC, aCPU->mSFR[REG_SP]);
+	profile->mCycles += 2;
+	profile->mInterrupts++;
+}
+
+struct em8051_profile *profile_start(struct em8051 *aCPU) {
+	struct em8051_profile *profile = calloc(1, sizeof(struct em8051_profile));
+
+	if (!profile)
+		return NULL;
+	profile->mEdgeMask = 255;
+	profile->mEdges = calloc(profile->mEdgeMask + 1, sizeof(struct profile_edge));
+	if (!profile->mEdges) {
+		free(profile);
+		return NULL;
+	}
+	profile->mCPU = aCPU;
+	profile->mCode = aCPU;
+	aCPU->mProfile = profile;
+	return profile;
+}
+
+void profile_symbols(struct em8051_profile *aProfile, struct em8051_symbols *aSymbols) {
+	aProfile->mSymbols = aSymbols;
+}
+
+void profile_stop(struct em8051_profile *aProfile) {
+	if (aProfile->mCPU && aProfile->mCPU->mProfile == aProfile)
+		aProfile->mCPU->mProfile = NULL;
+	aProfile->mCPU = NULL;
+}
+
+void profile_free(struct em8051_profile *aProfile) {
+	if (!aProfile)
+		return;
+	profile_stop(aProfile);
+	free(aProfile->mEdges);
+	free(aProfile);
+}
+
+// The frames still on the shadow stack count up to now
+static void settle(struct em8051_profile *aProfile) {
+	unsigned int i;
+
+	for (i = 0; i < aProfile->mDepth; i++)
+		settle_frame(aProfile, &aProfile->mStack[i]);
+}
+
+// A function or an address in the report
+struct profile_row {
+	uint16_t mAddress;
+	unsigned long long mCycles; // sort key
+	unsigned long long mSelf;
+	unsigned long long mInstructions;
+};
+
+static int compare_rows(const void *aA, const void *aB) {
+	const struct profile_row *a = aA, *b = aB;
+
+	if (a->mCycles != b->mCycles)
+		return a->mCycles < b->mCycles ? 1 : -1;
+	return a->mAddress - b->mAddress;
+}
+
+// Self costs per function, most cycles first; returns the number of rows
+static unsigned int get_rows(struct em8051_profile *aProfile, struct profile_row *aRows) {
+	unsigned int i, count = 0;
+
+	memset(aRows, 0, 65536 * sizeof(struct profile_row));
+	for (i = 0; i < 65536; i++) {
+		if (!aProfile->mCount[i])
+			continue;
+		aRows[aProfile->mOwner[i]].mSelf += aProfile->mAddressCycles[i];
+		aRows[aProfile->mOwner[i]].mInstructions += aProfile->mCount[i];
+	}
+	for (i = 0; i < 65536; i++) {
+		if (!aProfile->mFunctions[i].mSeen)
+			continue;
+		aRows[count] = aRows[i];
+		aRows[count].mAddress = i;
+		aRows[count++].mCycles = aRows[i].mSelf;
+	}
+	qsort(aRows, count, sizeof(struct profile_row), compare_rows);
+	return count;
+}
+
+// The code symbol of aAddress, as " <name+offset>" in the text report and
+// " name+offset" in callgrind; empty without one
+static const char *code_name(struct em8051_profile *aProfile, uint16_t aAddress, bool aBrackets, char *aBuffer) {
+	unsigned int offset = 0;
+	const char *name = aProfile->mSymbols ? symbols_find(aProfile->mSymbols, TRACE_CODE | aAddress, &offset) : NULL;
+
+	if (!name)
+		aBuffer[0] = 0;
+	else if (offset)
+		snprintf(aBuffer, PROFILE_NAME_LENGTH, aBrackets ? " <%s+%u>" : " %s+%u", name, offset);
+	else
+		snprintf(aBuffer, PROFILE_NAME_LENGTH, aBrackets ? " <%s>" : " %s", name);
+	return aBuffer;
+}
+
+static double percent(unsigned long long aValue, unsigned long long aTotal) {
+	return aTotal ? 100.0 * aValue / aTotal : 0;
+}
+
+int profile_report(struct em8051_profile *aProfile, const char *aFilename) {
+	struct profile_row *rows = malloc(65536 * sizeof(struct profile_row));
+	unsigned long long total = aProfile->mCycles;
+	unsigned int i, j, count;
+	char name[PROFILE_NAME_LENGTH], other[PROFILE_NAME_LENGTH];
+	FILE *f;
+	int result;
+
+	if (!rows)
+		return -1;
+	f = fopen(aFilename, "w");
+	if (!f) {
+		free(rows);
+		return -1;
+	}
+	settle(aProfile);
+
+	fprintf(f, "%llu cycles, %llu instructions, %llu interrupts\n\n",
+		total, aProfile->mInstructions, aProfile->mInterrupts);
+
+	fprintf(f, "Flat profile, by self cycles:\n\n"
+		"        self       %%        instrs        calls     inclusive       %%  function\n");
+	count = get_rows(aProfile, rows);
+	for (i = 0; i < count; i++) {
+		struct profile_function *function = &aProfile->mFunctions[rows[i].mAddress];
+		fprintf(f, "%12llu %6.2f%% %13llu %12llu %13llu %6.2f%%  %04X%s\n",
+			rows[i].mSelf, percent(rows[i].mSelf, total), rows[i].mInstructions,
+			function->mCalls, function->mCycles, percent(function->mCycles, total), rows[i].mAddress,
+			code_name(aProfile, rows[i].mAddress, true, name));
+	}
+
+	// the same functions, by inclusive cycles
+	fprintf(f, "\nCall graph, by inclusive cycles:\n");
+	for (i = 0; i < count; i++)
+		rows[i].mCycles = aProfile->mFunctions[rows[i].mAddress].mCycles;
+	qsort(rows, count, sizeof(struct profile_row), compare_rows);
+	for (i = 0; i < count; i++) {
+		uint16_t function = rows[i].mAddress;
+		fprintf(f, "\n%04X%s: %llu cycles (%.2f%%) inclusive, %llu self, %llu calls\n",
+			function, code_name(aProfile, function, true, name), rows[i].mCycles, percent(rows[i].mCycles, total), rows[i].mSelf,
+			aProfile->mFunctions[function].mCalls);
+		for (j = 0; j <= aProfile->mEdgeMask; j++) {
+			struct profile_edge *edge = &aProfile->mEdges[j];
+			if (edge->mUsed && edge->mCallee == function)
+				fprintf(f, "        from %04X%s at %04X%s: %llu calls, %llu cycles\n",
+					edge->mCaller, code_name(aProfile, edge->mCaller, true, name),
+					edge->mSite, code_name(aProfile, edge->mSite, true, other), edge->mCalls, edge->mCycles);
+		}
+		for (j = 0; j <= aProfile->mEdgeMask; j++) {
+			struct profile_edge *edge = &aProfile->mEdges[j];
+			if (edge->mUsed && edge->mCaller == function)
+				fprintf(f, "        to   %04X%s at %04X%s: %llu calls, %llu cycles\n",
+					edge->mCallee, code_name(aProfile, edge->mCallee, true, name),
+					edge->mSite, code_name(aProfile, edge->mSite, true, other), edge->mCalls, edge->mCycles);
+		}
+	}
+
+	fprintf(f, "\nHot spots:\n\n"
+		"      cycles       %%         count  address  instruction\n");
+	count = 0;
+	for (i = 0; i < 65536; i++) {
+		if (!aProfile->mCount[i])
+			continue;
+		rows[count].mAddress = i;
+		rows[count].mCycles = aProfile->mAddressCycles[i];
+		rows[count++].mInstructions = aProfile->mCount[i];
+	}
+	qsort(rows, count, sizeof(struct profile_row), compare_rows);
+	for (i = 0; i < count && i < PROFILE_HOT_SPOTS; i++) {
+		char assembly[128];
+		decode(aProfile->mCode, rows[i].mAddress, assembly);
+		fprintf(f, "%12llu %6.2f%% %13llu     %04X%s  %s\n",
+			rows[i].mCycles, percent(rows[i].mCycles, total), rows[i].mInstructions,
+			rows[i].mAddress, code_name(aProfile, rows[i].mAddress, true, name), assembly);
+	}
+
+	free(rows);
+	result = ferror(f) ? -1 : 0;
+	if (fclose(f))
+		result = -1;
+	return result;
+}
+
+static int compare_edges(const void *aA, const void *aB) {
+	const struct profile_edge *a = aA, *b = aB;
+
+	if (a->mCaller != b->mCaller)
+		return a->mCaller - b->mCaller;
+	if (a->mSite != b->mSite)
+		return a->mSite - b->mSite;
+	return a->mCallee - b->mCallee;
+}
+
+static void write_callgrind(struct em8051_profile *aProfile, FILE *aFile,
+	struct profile_edge *aEdges, uint16_t *aAddresses, unsigned int *aStart) {
+	unsigned int i, j, edge = 0, count = 0;
+	char name[PROFILE_NAME_LENGTH];
+
+	for (i = 0; i <= aProfile->mEdgeMask; i++)
+		if (aProfile->mEdges[i].mUsed)
+			aEdges[count++] = aProfile->mEdges[i];
+	qsort(aEdges, count, sizeof(struct profile_edge), compare_edges);
+
+	// group the addresses by function: count, then place at the group ends
+	for (i = 0; i < 65536; i++)
+		if (aProfile->mCount[i])
+			aStart[aProfile->mOwner[i] + 1]++;
+	for (i = 0; i < 65536; i++)
+		aStart[i + 1] += aStart[i];
+	for (i = 0; i < 65536; i++)
+		if (aProfile->mCount[i])
+			aAddresses[aStart[aProfile->mOwner[i]]++] = i;
+	for (i = 65536; i > 0; i--)
+		aStart[i] = aStart[i - 1];
+	aStart[0] = 0;
+
+	fprintf(aFile, "# callgrind format\n"
+		"version: 1\n"
+		"creator: emu8051\n"
+		"positions: instr\n"
+		"events: Cycles Instructions\n");
+	for (i = 0; i < 65536; i++) {
+		if (!aProfile->mFunctions[i].mSeen)
+			continue;
+		fprintf(aFile, "\nfn=0x%04X%s\n", i, code_name(aProfile, i, false, name));
+		for (j = aStart[i]; j < aStart[i + 1]; j++)
+			fprintf(aFile, "0x%04X %llu %llu\n", aAddresses[j],
+				aProfile->mAddressCycles[aAddresses[j]], aProfile->mCount[aAddresses[j]]);
+		// callers are always seen
+		for (; edge < count && aEdges[edge].mCaller == i; edge++)
+			fprintf(aFile, "cfn=0x%04X%s\ncalls=%llu 0x%04X\n0x%04X %llu %llu\n",
+				aEdges[edge].mCallee, code_name(aProfile, aEdges[edge].mCallee, false, name), aEdges[edge].mCalls, aEdges[edge].mCallee,
+				aEdges[edge].mSite, aEdges[edge].mCycles, aEdges[edge].mInstructions);
+	}
+}
+
+int profile_callgrind(struct em8051_profile *aProfile, const char *aFilename) {
+	struct profile_edge *edges = malloc((aProfile->mEdgeCount + 1) * sizeof(struct profile_edge));
+	uint16_t *addresses = malloc(65536 * sizeof(uint16_t));
+	unsigned int *start = calloc(65537, sizeof(unsigned int));
+	FILE *f = NULL;
+	int result = -1;
+
+	if (edges && addresses && start)
+		f = fopen(aFilename, "w");
+	if (f) {
+		settle(aProfile);
+		write_callgrind(aProfile, f, edges, addresses, start);
+		result = ferror(f) ? -1 : 0;
+		if (fclose(f))
+			result = -1;
+	}
+
+	free(edges);
+	free(addresses);
+	free(start);
+	return result;
+}
@@ -0,0 +1,223 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * snapshot.c
+ * Saving and restoring the emulator state
+ *
+ * Code and external data memory are stored in 256-byte pages. A snapshot
+ * taken against an earlier one shares every page that hasn't changed since,
+ * and within a snapshot all zero pages share one copy, so many snapshots of
+ * a mostly idle memory cost little more than the CPU registers.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#define PAGE_SIZE 256
+
+struct snapshot_page {
+	unsigned int mRefs;
+	unsigned char mData[PAGE_SIZE];
+};
+
+// The internal state at the end of struct em8051
+#define STATE_START offsetof(struct em8051, mInterruptActive)
+#define STATE_SIZE (sizeof(struct em8051) - STATE_START)
+
+struct em8051_snapshot {
+	unsigned char mLowerData[128];
+	unsigned char mSFR[128];
+	uint16_t mPC;
+	uint8_t mTickDelay;
+	unsigned char mState[STATE_SIZE];
+	unsigned char mUpperData[128];
+	bool mHasUpperData;
+	unsigned int mCodeSize;
+	unsigned int mExtSize; // 0 if there is no external data, or it is the code memory
+	bool mExtIsCode;
+	unsigned int mCodePages;
+	unsigned int mPageCount;
+	struct snapshot_page **mPages; // code pages, then external data pages
+	unsigned char *mExtra;
+	unsigned int mExtraSize;
+};
+
+static unsigned int ext_size(struct em8051 *aCPU) {
+	if (!aCPU->mExtData || aCPU->mExtData == aCPU->mCodeMem)
+		return 0;
+	return aCPU->mExtDataMaxIdx + 1;
+}
+
+// Page aPage of aMemory, which is aSize bytes
+static unsigned int page_length(unsigned int aSize, unsigned int aPage) {
+	unsigned int left = aSize - aPage * PAGE_SIZE;
+	return left < PAGE_SIZE ? left : PAGE_SIZE;
+}
+
+static bool same_layout(struct em8051 *aCPU, struct em8051_snapshot *aSnapshot) {
+	return aSnapshot->mCodeSize == (unsigned int)aCPU->mCodeMemMaxIdx + 1 &&
+		aSnapshot->mExtSize == ext_size(aCPU) &&
+		aSnapshot->mExtIsCode == (aCPU->mExtData == aCPU->mCodeMem) &&
+		aSnapshot->mHasUpperData == (aCPU->mUpperData != NULL);
+}
+
+static bool is_zero(const unsigned char *aData, unsigned int aLength) {
+	unsigned int i;
+	for (i = 0; i < aLength; i++)
+		if (aData[i])
+			return false;
+	return true;
+}
+
+static struct snapshot_page *share(struct snapshot_page *aPage) {
+	aPage->mRefs++;
+	return aPage;
+}
+
+static void release(struct snapshot_page *aPage) {
+	if (aPage && --aPage->mRefs == 0)
+		free(aPage);
+}
+
+struct em8051_snapshot *snapshot_take(struct em8051 *aCPU, struct em8051_snapshot *aBase, const void *aExtra, unsigned int aExtraSize) {
+	struct em8051_snapshot *snapshot;
+	struct snapshot_page *zero = NULL;
+	unsigned int i;
+
+	snapshot = calloc(1, sizeof(struct em8051_snapshot));
+	if (!snapshot)
+		return NULL;
+
+	update_parity(aCPU);
+	memcpy(snapshot->mLowerData, aCPU->mLowerData, 128);
+	memcpy(snapshot->mSFR, aCPU->mSFR, 128);
+	snapshot->mPC = aCPU->mPC;
+	snapshot->mTickDelay = aCPU->mTickDelay;
+	memcpy(snapshot->mState, (unsigned char *)aCPU + STATE_START, STATE_SIZE);
+	snapshot->mHasUpperData = aCPU->mUpperData != NULL;
+	if (aCPU->mUpperData)
+		memcpy(snapshot->mUpperData, aCPU->mUpperData, 128);
+	snapshot->mCodeSize = aCPU->mCodeMemMaxIdx + 1;
+	snapshot->mExtSize = ext_size(aCPU);
+	snapshot->mExtIsCode = aCPU->mExtData == aCPU->mCodeMem;
+	snapshot->mCodePages = (snapshot->mCodeSize + PAGE_SIZE - 1) / PAGE_SIZE;
+	snapshot->mPageCount = snapshot->mCodePages + (snapshot->mExtSize + PAGE_SIZE - 1) / PAGE_SIZE;
+	snapshot->mPages = calloc(snapshot->mPageCount, sizeof(struct snapshot_page *));
+	if (aExtraSize) {
+		snapshot->mExtra = malloc(aExtraSize);
+		snapshot->mExtraSize = aExtraSize;
+	}
+	if (!snapshot->mPages || (aExtraSize && !snapshot->mExtra)) {
+		snapshot_free(snapshot);
+		return NULL;
+	}
+	if (aExtraSize)
+		memcpy(snapshot->mExtra, aExtra, aExtraSize);
+
+	if (aBase && !same_layout(aCPU, aBase))
+		aBase = NULL;
+
+	for (i = 0; i < snapshot->mPageCount; i++) {
+		unsigned char *data;
+		unsigned int length;
+
+		if (i < snapshot->mCodePages) {
+			data = aCPU->mCodeMem + i * PAGE_SIZE;
+			length = page_length(snapshot->mCodeSize, i);
+		} else {
+			data = aCPU->mExtData + (i - snapshot->mCodePages) * PAGE_SIZE;
+			length = page_length(snapshot->mExtSize, i - snapshot->mCodePages);
+		}
+
+		if (aBase && memcmp(aBase->mPages[i]->mData, data, length) == 0) {
+			snapshot->mPages[i] = share(aBase->mPages[i]);
+			continue;
+		}
+		if (zero && is_zero(data, length)) {
+			snapshot->mPages[i] = share(zero);
+			continue;
+		}
+
+		snapshot->mPages[i] = calloc(1, sizeof(struct snapshot_page));
+		if (!snapshot->mPages[i]) {
+			snapshot_free(snapshot);
+			return NULL;
+		}
+		snapshot->mPages[i]->mRefs = 1;
+		memcpy(snapshot->mPages[i]->mData, data, length);
+		if (!zero && is_zero(data, length))
+			zero = snapshot->mPages[i];
+	}
+
+	return snapshot;
+}
+
+int snapshot_restore(struct em8051 *aCPU, struct em8051_snapshot *aSnapshot, void *aExtra) {
+	unsigned int i;
+
+	if (!same_layout(aCPU, aSnapshot))
+		return -1;
+
+	memcpy(aCPU->mLowerData, aSnapshot->mLowerData, 128);
+	memcpy(aCPU->mSFR, aSnapshot->mSFR, 128);
+	aCPU->mPC = aSnapshot->mPC;
+	aCPU->mTickDelay = aSnapshot->mTickDelay;
+	memcpy((unsigned char *)aCPU + STATE_START, aSnapshot->mState, STATE_SIZE);
+	if (aCPU->mUpperData)
+		memcpy(aCPU->mUpperData, aSnapshot->mUpperData, 128);
+
+	// only drop the predecoded code that really changed
+	for (i = 0; i < aSnapshot->mCodePages; i++) {
+		unsigned char *data = aCPU->mCodeMem + i * PAGE_SIZE;
+		unsigned int length = page_length(aSnapshot->mCodeSize, i);
+		if (memcmp(data, aSnapshot->mPages[i]->mData, length) != 0) {
+			memcpy(data, aSnapshot->mPages[i]->mData, length);
+			invalidate_code(aCPU, i * PAGE_SIZE, length);
+		}
+	}
+	for (i = aSnapshot->mCodePages; i < aSnapshot->mPageCount; i++) {
+		unsigned int page = i - aSnapshot->mCodePages;
+		memcpy(aCPU->mExtData + page * PAGE_SIZE, aSnapshot->mPages[i]->mData, page_length(aSnapshot->mExtSize, page));
+	}
+
+	if (aExtra && aSnapshot->mExtraSize)
+		memcpy(aExtra, aSnapshot->mExtra, aSnapshot->mExtraSize);
+
+	return 0;
+}
+
+void snapshot_free(struct em8051_snapshot *aSnapshot) {
+	unsigned int i;
+
+	if (!aSnapshot)
+		return;
+	if (aSnapshot->mPages)
+		for (i = 0; i < aSnapshot->mPageCount; i++)
+			release(aSnapshot->mPages[i]);
+	free(aSnapshot->mPages);
+	free(aSnapshot->mExtra);
+	free(aSnapshot);
+}
@@ -0,0 +1,380 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * symbols.c
+ * Symbol index, and SDCC CDB debug info
+ *
+ * Symbols are kept in one array sorted by address, the address space in the
+ * upper bits, so that the symbol of an address is a binary search away. The
+ * names live in a single pool. Source lines go to an em8051_lines, the same
+ * as lines_load() builds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+// longest CDB line read; the rest of a longer one is skipped
+#define CDB_MAX_LENGTH 1024
+
+struct symbol {
+	uint32_t mAddress; // TRACE_SPACE and address
+	uint32_t mName; // offset in mNames
+	const char *mText; // the name, once sorted; mNames moves as it grows
+};
+
+struct em8051_symbols {
+	struct symbol *mList;
+	unsigned int mCount;
+	unsigned int mSize;
+	bool mSorted;
+	char *mNames;
+	size_t mNamesUsed;
+	size_t mNamesSize;
+	struct em8051_lines *mLines;
+};
+
+struct em8051_symbols *symbols_new(void) {
+	struct em8051_symbols *symbols = calloc(1, sizeof(struct em8051_symbols));
+
+	if (!symbols)
+		return NULL;
+	symbols->mLines = lines_new();
+	if (!symbols->mLines) {
+		free(symbols);
+		return NULL;
+	}
+	symbols->mSorted = true;
+	return symbols;
+}
+
+void symbols_free(struct em8051_symbols *aSymbols) {
+	if (!aSymbols)
+		return;
+	lines_free(aSymbols->mLines);
+	free(aSymbols->mList);
+	free(aSymbols->mNames);
+	free(aSymbols);
+}
+
+static int add_symbol(struct em8051_symbols *aSymbols, const char *aName, size_t aLength, uint32_t aAddress) {
+	if (aSymbols->mCount == aSymbols->mSize) {
+		unsigned int size = aSymbols->mSize ? aSymbols->mSize * 2 : 256;
+		struct symbol *list = realloc(aSymbols->mList, size * sizeof(struct symbol));
+		if (!list)
+			return -1;
+		aSymbols->mList = list;
+		aSymbols->mSize = size;
+	}
+	if (aSymbols->mNamesUsed + aLength + 1 > aSymbols->mNamesSize) {
+		size_t size = aSymbols->mNamesSize ? aSymbols->mNamesSize * 2 : 4096;
+		char *names;
+		while (size < aSymbols->mNamesUsed + aLength + 1)
+			size *= 2;
+		names = realloc(aSymbols->mNames, size);
+		if (!names)
+			return -1;
+		aSymbols->mNames = names;
+		aSymbols->mNamesSize = size;
+	}
+	memcpy(aSymbols->mNames + aSymbols->mNamesUsed, aName, aLength);
+	aSymbols->mNames[aSymbols->mNamesUsed + aLength] = 0;
+	aSymbols->mList[aSymbols->mCount].mAddress = aAddress;
+	aSymbols->mList[aSymbols->mCount++].mName = (uint32_t)aSymbols->mNamesUsed;
+	aSymbols->mNamesUsed += aLength + 1;
+	aSymbols->mSorted = false;
+	return 0;
+}
+
+int symbols_add(struct em8051_symbols *aSymbols, const char *aName, uint32_t aAddress) {
+	return add_symbol(aSymbols, aName, strlen(aName), aAddress);
+}
+
+int symbols_add_line(struct em8051_symbols *aSymbols, const char *aFile, unsigned int aLine, uint16_t aAddress) {
+	aSymbols->mSorted = false;
+	return lines_add(aSymbols->mLines, aFile, aLine, aAddress);
+}
+
+static int compare_symbols(const void *aA, const void *aB) {
+	const struct symbol *a = aA, *b = aB;
+
+	if (a->mAddress != b->mAddress)
+		return a->mAddress < b->mAddress ? -1 : 1;
+	return strcmp(a->mText, b->mText);
+}
+
+// Sorts the symbols and drops the ones given twice, e.g. by both the public
+// and the debug records of an object file
+void symbols_sort(struct em8051_symbols *aSymbols) {
+	unsigned int i, count = 0;
+
+	if (aSymbols->mSorted)
+		return;
+	for (i = 0; i < aSymbols->mCount; i++)
+		aSymbols->mList[i].mText = aSymbols->mNames + aSymbols->mList[i].mName;
+	qsort(aSymbols->mList, aSymbols->mCount, sizeof(struct symbol), compare_symbols);
+	for (i = 0; i < aSymbols->mCount; i++)
+		if (!count || compare_symbols(&aSymbols->mList[count - 1], &aSymbols->mList[i]))
+			aSymbols->mList[count++] = aSymbols->mList[i];
+	aSymbols->mCount = count;
+	lines_sort(aSymbols->mLines);
+	aSymbols->mSorted = true;
+}
+
+const char *symbols_find(struct em8051_symbols *aSymbols, uint32_t aAddress, unsigned int *aOffset) {
+	unsigned int low = 0, high;
+
+	symbols_sort(aSymbols);
+	high = aSymbols->mCount;
+	// past the last symbol at or below aAddress
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		if (aSymbols->mList[middle].mAddress <= aAddress)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (!low || (aSymbols->mList[low - 1].mAddress & TRACE_SPACE_MASK) != (aAddress & TRACE_SPACE_MASK))
+		return NULL;
+	// the first name of the address
+	for (low--; low && aSymbols->mList[low - 1].mAddress == aSymbols->mList[low].mAddress; low--)
+		;
+	if (aOffset)
+		*aOffset = aAddress - aSymbols->mList[low].mAddress;
+	return aSymbols->mList[low].mText;
+}
+
+bool symbols_line(struct em8051_symbols *aSymbols, uint16_t aAddress, const char **aFile, unsigned int *aLine) {
+	symbols_sort(aSymbols);
+	return lines_find(aSymbols->mLines, aAddress, aFile, aLine);
+}
+
+struct em8051_lines *symbols_lines(struct em8051_symbols *aSymbols) {
+	symbols_sort(aSymbols);
+	return aSymbols->mLines;
+}
+
+unsigned int symbols_count(struct em8051_symbols *aSymbols) {
+	symbols_sort(aSymbols);
+	return aSymbols->mCount;
+}
+
+// The address space of a CDB symbol record
+struct cdb_space {
+	uint32_t mKey; // offset of "scope$name$level$block" in mKeys
+	uint32_t mSpace; // TRACE_SPACE, or ~0 for none
+	const char *mText; // the key, once all are read
+};
+
+struct cdb {
+	struct cdb_space *mList;
+	unsigned int mCount;
+	unsigned int mSize;
+	char *mKeys;
+	size_t mKeysUsed;
+	size_t mKeysSize;
+};
+
+static int compare_spaces(const void *aA, const void *aB) {
+	const struct cdb_space *a = aA, *b = aB;
+	return strcmp(a->mText, b->mText);
+}
+
+static uint32_t cdb_space(char aSpace) {
+	switch (aSpace) {
+	case 'A': // external stack
+	case 'F': // external data
+	case 'P': // paged external data
+		return TRACE_EXT;
+	case 'B': // internal stack
+	case 'E': // lower data
+	case 'G': // indirect data
+	case 'H': // bit addressable data
+	case 'R': // registers
+		return TRACE_DATA;
+	case 'C': // code
+	case 'D': // code, static
+		return TRACE_CODE;
+	case 'I':
+		return TRACE_SFR;
+	}
+	return ~0u; // sbit, or no space
+}
+
+// S: and F: records, "S:G$name$0_0$0({2}SI:S),E,0,0": remembers the space of
+// the key for the L: record that gives the address
+static int cdb_add_space(struct cdb *aCdb, const char *aRecord) {
+	const char *type = strchr(aRecord, '('), *space;
+	size_t length;
+	int depth = 0;
+
+	if (!type)
+		return 0;
+	// the type may have parentheses of its own
+	for (space = type; *space; space++) {
+		if (*space == '(')
+			depth++;
+		else if (*space == ')' && --depth == 0)
+			break;
+	}
+	if (space[0] != ')' || space[1] != ',')
+		return 0;
+
+	length = type - aRecord;
+	if (aCdb->mCount == aCdb->mSize) {
+		unsigned int size = aCdb->mSize ? aCdb->mSize * 2 : 256;
+		struct cdb_space *list = realloc(aCdb->mList, size * sizeof(struct cdb_space));
+		if (!list)
+			return -9;
+		aCdb->mList = list;
+		aCdb->mSize = size;
+	}
+	if (aCdb->mKeysUsed + length + 1 > aCdb->mKeysSize) {
+		size_t size = aCdb->mKeysSize ? aCdb->mKeysSize * 2 : 4096;
+		char *keys;
+		while (size < aCdb->mKeysUsed + length + 1)
+			size *= 2;
+		keys = realloc(aCdb->mKeys, size);
+		if (!keys)
+			return -9;
+		aCdb->mKeys = keys;
+		aCdb->mKeysSize = size;
+	}
+	memcpy(aCdb->mKeys + aCdb->mKeysUsed, aRecord, length);
+	aCdb->mKeys[aCdb->mKeysUsed + length] = 0;
+	aCdb->mList[aCdb->mCount].mKey = (uint32_t)aCdb->mKeysUsed;
+	aCdb->mList[aCdb->mCount++].mSpace = cdb_space(space[2]);
+	aCdb->mKeysUsed += length + 1;
+	return 0;
+}
+
+// The space of an L: record's key; code if there was no S: or F: record
+static uint32_t cdb_find_space(struct cdb *aCdb, const char *aKey) {
+	unsigned int low = 0, high = aCdb->mCount;
+
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		int order = strcmp(aKey, aCdb->mList[middle].mText);
+		if (!order)
+			return aCdb->mList[middle].mSpace;
+		if (order < 0)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return TRACE_CODE;
+}
+
+// L: records: "G$name$0_0$0:62" and "Ffile$name$0_0$0:62" are addresses of
+// symbols, "C$file.c$12$1_0$1:6E" and "A$file$34:6E" of C and assembler lines.
+// Locals, "Lfunction$...", and function ends, "XG$...", are left out.
+static int cdb_link(struct em8051_symbols *aSymbols, struct cdb *aCdb, char *aRecord) {
+	char *colon = strrchr(aRecord, ':'), *name, *end;
+	unsigned long address;
+	uint32_t space;
+
+	if (!colon || colon == aRecord)
+		return 0;
+	*colon = 0;
+	address = strtoul(colon + 1, &end, 16);
+	if (end == colon + 1)
+		return 0;
+
+	if (aRecord[0] == 'C' || aRecord[0] == 'A') {
+		char *file = aRecord + 2, *line = strchr(file, '$');
+		char buffer[CDB_MAX_LENGTH];
+		if (aRecord[1] != '$' || !line)
+			return 0;
+		*line++ = 0;
+		// assembler files are named without the extension
+		if (aRecord[0] == 'A' && !strchr(file, '.')) {
+			snprintf(buffer, sizeof(buffer), "%s.asm", file);
+			file = buffer;
+		}
+		return symbols_add_line(aSymbols, file, atoi(line), address & 0xffff) < 0 ? -9 : 0;
+	}
+	if (aRecord[0] != 'G' && aRecord[0] != 'F')
+		return 0;
+	name = strchr(aRecord, '$');
+	end = name ? strchr(name + 1, '$') : NULL;
+	space = cdb_find_space(aCdb, aRecord);
+	if (!end || space == ~0u)
+		return 0;
+	return add_symbol(aSymbols, name + 1, end - name - 1, space | (address & 0xffff)) < 0 ? -9 : 0;
+}
+
+// Reads a line without the line end, skipping the rest of an overlong one
+static bool read_line(FILE *aFile, char *aBuffer, int aSize) {
+	char *end;
+
+	if (!fgets(aBuffer, aSize, aFile))
+		return false;
+	end = aBuffer + strcspn(aBuffer, "\r\n");
+	if (!*end && !feof(aFile)) {
+		int c;
+		while ((c = fgetc(aFile)) != EOF && c != '\n')
+			;
+	}
+	*end = 0;
+	return true;
+}
+
+int symbols_load_cdb(struct em8051_symbols *aSymbols, const char *aFilename) {
+	char buffer[CDB_MAX_LENGTH];
+	unsigned int i, records = 0;
+	struct cdb cdb;
+	int result = 0;
+	FILE *f;
+
+	f = fopen(aFilename, "r");
+	if (!f)
+		return -1;
+	memset(&cdb, 0, sizeof(cdb));
+
+	// the spaces first, then the L: records that refer to them
+	while (result == 0 && read_line(f, buffer, sizeof(buffer))) {
+		if (!buffer[0] || buffer[1] != ':' || !strchr("MFSTL", buffer[0]))
+			continue;
+		records++;
+		if (buffer[0] == 'S' || buffer[0] == 'F')
+			result = cdb_add_space(&cdb, buffer + 2);
+	}
+	if (result == 0 && !records)
+		result = -2; // not a CDB file
+	if (result == 0) {
+		for (i = 0; i < cdb.mCount; i++)
+			cdb.mList[i].mText = cdb.mKeys + cdb.mList[i].mKey;
+		qsort(cdb.mList, cdb.mCount, sizeof(struct cdb_space), compare_spaces);
+		rewind(f);
+	}
+	while (result == 0 && read_line(f, buffer, sizeof(buffer)))
+		if (buffer[0] == 'L' && buffer[1] == ':')
+			result = cdb_link(aSymbols, &cdb, buffer + 2);
+	fclose(f);
+	free(cdb.mList);
+	free(cdb.mKeys);
+	symbols_sort(aSymbols);
+	return result;
+}
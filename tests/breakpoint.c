@@ -0,0 +1,148 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * tests/breakpoint.c
+ * Evaluates breakpoint conditions, good and malformed, over a known CPU
+ * state, and checks hits counting on a conditional breakpoint. Run by
+ * `make check`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu8051.h"
+
+struct expression {
+	const char *mText;
+	int mResult; // of expression_eval()
+	long mValue; // if it parses
+};
+
+static const struct expression expressions[] = {
+	{ "a == 0x42", 0, 1 },
+	{ "A==66", 0, 1 },
+	{ "acc + b * 2", 0, 0x42 + 6 },
+	{ "(acc + b) * 2", 0, (0x42 + 3) * 2 },
+	{ "1 + 2 == 3 && 4 > 3", 0, 1 },
+	{ "1 | 2 ^ 3 & 6", 0, 1 | (2 ^ (3 & 6)) },
+	{ "6 & 3 == 3", 0, 6 & 1 },
+	{ "0 || !0", 0, 1 },
+	{ "~0 & 0xff", 0, 0xff },
+	{ "-1 < 0", 0, 1 },
+	{ "10 / 0 + 10 % 0", 0, 0 },
+	{ "017 != 15", 0, 0 },
+	{ "r1", 0, 0x11 },
+	{ "r0 == data[8]", 0, 1 },
+	{ "data[0x30] > 3", 0, 1 },
+	{ "data[0x90]", 0, 0x77 },
+	{ "sfr[0xe0] == a && psw >= 8", 0, 1 },
+	{ "xdata[0x1234] + code[0x100]", 0, 0x5a + 0x02 },
+	{ "dptr == 0x1234 && dpl == 0x34", 0, 1 },
+	{ "c", 0, 1 },
+	{ "pc", 0, 0x100 },
+	{ "hits == 3", 0, 1 },
+	{ "  sp  <=  7  ", 0, 1 },
+	{ "", -1, 0 },
+	{ "a ==", -1, 0 },
+	{ "a = 1", -1, 0 },
+	{ "(a == 1", -1, 0 },
+	{ "a == 1)", -1, 0 },
+	{ "data[0x30", -1, 0 },
+	{ "stack[0]", -1, 0 },
+	{ "r8", -1, 0 },
+	{ "accumulator", -1, 0 },
+	{ "0x", -1, 0 },
+	{ "1 $ 2", -1, 0 },
+};
+
+static int check(struct em8051 *aCPU, const struct expression *aExpression) {
+	long value = -12345;
+	int result = expression_eval(aCPU, aExpression->mText, 3, &value);
+
+	if (result != aExpression->mResult || (!result && value != aExpression->mValue)) {
+		printf("\"%s\": returned %d, value %ld, expected %d, value %ld\n", aExpression->mText,
+			result, result ? 0 : value, aExpression->mResult, aExpression->mValue);
+		return 1;
+	}
+	// without a CPU only the syntax counts
+	if (expression_eval(NULL, aExpression->mText, 3, NULL) != aExpression->mResult) {
+		printf("\"%s\": syntax check disagrees\n", aExpression->mText);
+		return 1;
+	}
+	return 0;
+}
+
+// A breakpoint with "hits == 3" stops only the third time; a malformed one isn't set
+static int check_breakpoint(struct em8051 *aCPU) {
+	struct em8051_breakpoints *breakpoints = calloc(1, sizeof(*breakpoints));
+	int failed = 0, i;
+
+	if (!breakpoints) {
+		printf("breakpoint: out of memory\n");
+		return 1;
+	}
+	if (breakpoint_set(breakpoints, 0x100, "hits == 3") || breakpoint_set(breakpoints, 0x200, "a ==") != -1 ||
+		BREAKPOINT_AT(breakpoints, 0x200) || !BREAKPOINT_AT(breakpoints, 0x100)) {
+		printf("breakpoint_set: wrong result\n");
+		failed = 1;
+	}
+	for (i = 1; i <= 4 && !failed; i++) {
+		if (breakpoint_check(breakpoints, aCPU) != (i == 3)) {
+			printf("breakpoint_check: wrong result on hit %d\n", i);
+			failed = 1;
+		}
+	}
+	breakpoint_clear_all(breakpoints);
+	free(breakpoints);
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	struct em8051 emu;
+	int failed = 0;
+	unsigned int i;
+
+	if (em8051_alloc_instance(&emu, ENGINE_TABLE)) {
+		printf("breakpoint: out of memory\n");
+		return 1;
+	}
+	emu.mPC = 0x100;
+	emu.mSFR[REG_ACC] = 0x42;
+	emu.mSFR[REG_B] = 3;
+	emu.mSFR[REG_PSW] = PSWMASK_C | PSWMASK_RS0; // bank 1
+	emu.mSFR[REG_DPH] = 0x12;
+	emu.mSFR[REG_DPL] = 0x34;
+	emu.mLowerData[8] = 0x10;
+	emu.mLowerData[9] = 0x11;
+	emu.mLowerData[0x30] = 4;
+	emu.mUpperData[0x10] = 0x77;
+	emu.mExtData[0x1234] = 0x5a;
+	emu.mCodeMem[0x100] = 0x02;
+
+	for (i = 0; i < sizeof(expressions) / sizeof(expressions[0]); i++)
+		failed += check(&emu, &expressions[i]);
+	failed += check_breakpoint(&emu);
+	em8051_free_instance(&emu);
+	return failed != 0;
+}
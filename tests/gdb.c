@@ -0,0 +1,165 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * tests/gdb.c
+ * Feeds gdb_serve() a scripted debugger session through a socket pair:
+ * framing, checksums, acks and retransmission, well-formed and malformed
+ * packets, and the connection closing mid-packet; then compares all it
+ * sent back with the expected transcript. Run by `make check`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "emu8051.h"
+
+// Everything the debugger sends, and everything it should receive
+struct transcript {
+	char mData[4096];
+	size_t mLength;
+};
+
+static void put_raw(struct transcript *aTranscript, const char *aData) {
+	size_t length = strlen(aData);
+
+	if (aTranscript->mLength + length < sizeof(aTranscript->mData)) {
+		memcpy(aTranscript->mData + aTranscript->mLength, aData, length);
+		aTranscript->mLength += length;
+	}
+}
+
+// $aData#checksum
+static void put_packet(struct transcript *aTranscript, const char *aData) {
+	char trailer[4];
+	uint8_t checksum = 0;
+	const char *p;
+
+	for (p = aData; *p; p++)
+		checksum += (uint8_t)*p;
+	sprintf(trailer, "#%02x", checksum);
+	put_raw(aTranscript, "$");
+	put_raw(aTranscript, aData);
+	put_raw(aTranscript, trailer);
+}
+
+// A packet the debugger sends and acks the reply of, and the reply, acked
+static void request(struct transcript *aSend, struct transcript *aExpect, const char *aPacket, const char *aReply) {
+	put_packet(aSend, aPacket);
+	put_raw(aSend, "+");
+	put_raw(aExpect, "+");
+	put_packet(aExpect, aReply);
+}
+
+// The same after QStartNoAckMode
+static void request_no_ack(struct transcript *aSend, struct transcript *aExpect, const char *aPacket, const char *aReply) {
+	put_packet(aSend, aPacket);
+	put_packet(aExpect, aReply);
+}
+
+static void script(struct transcript *aSend, struct transcript *aExpect) {
+	// noise and an interrupt before the first packet are skipped; bad checksums are naked
+	put_raw(aSend, "xyz\003$?#00$?#zz");
+	put_raw(aExpect, "--");
+	// a nak makes the reply go again
+	put_packet(aSend, "?");
+	put_raw(aSend, "-+");
+	put_raw(aExpect, "+");
+	put_packet(aExpect, "S05");
+	put_packet(aExpect, "S05");
+
+	request(aSend, aExpect, "m100,3", "020003");
+	request(aSend, aExpect, "m100", "E01");
+	request(aSend, aExpect, "M2000,2:55aa", "OK");
+	request(aSend, aExpect, "m2000,2", "55aa");
+	request(aSend, aExpect, "M2000,2:55zz", "E01");
+	request(aSend, aExpect, "M2000,2", "E01");
+	request(aSend, aExpect, "p8", "42");
+	request(aSend, aExpect, "p20", "E01");
+	request(aSend, aExpect, "P8=7", "E01");
+	request(aSend, aExpect, "P8", "E01");
+	request(aSend, aExpect, "P9=33", "OK");
+	request(aSend, aExpect, "p9", "33");
+	request(aSend, aExpect, "G00", "E01");
+	request(aSend, aExpect, "s", "S05");
+	request(aSend, aExpect, "pd", "0300");
+	request(aSend, aExpect, "Z0,100", "E01");
+	request(aSend, aExpect, "Z0,10000,1", "E01");
+	request(aSend, aExpect, "Z0,100,1", "OK");
+	request(aSend, aExpect, "z0,100,1", "OK");
+	request(aSend, aExpect, "z0,100,1", "E01");
+	request(aSend, aExpect, "Z9,0,0", "");
+	request(aSend, aExpect, "vMustReplyEmpty", "");
+
+	request(aSend, aExpect, "QStartNoAckMode", "OK");
+	request_no_ack(aSend, aExpect, "p8", "42");
+	put_raw(aSend, "$p8#00");
+	put_raw(aExpect, "-");
+	// and the debugger goes away halfway through a packet
+	put_raw(aSend, "$m100,");
+}
+
+int main(int argc, char **argv) {
+	static struct transcript requests, expect, received;
+	struct em8051 emu;
+	int fds[2];
+	ssize_t length;
+
+	if (em8051_alloc_instance(&emu, ENGINE_TABLE)) {
+		printf("gdb: out of memory\n");
+		return 1;
+	}
+	emu.mCodeMem[0x100] = 0x02; // ljmp 0x0003
+	emu.mCodeMem[0x102] = 0x03;
+	emu.mPC = 0x100;
+	emu.mSFR[REG_ACC] = 0x42;
+
+	// the whole session fits in the socket buffers, so one thread does
+	script(&requests, &expect);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) ||
+		write(fds[0], requests.mData, requests.mLength) != (ssize_t)requests.mLength) {
+		printf("gdb: can't set up the connection\n");
+		return 1;
+	}
+	shutdown(fds[0], SHUT_WR);
+	gdb_serve(&emu, fds[1], 1000);
+	close(fds[1]);
+	while ((length = read(fds[0], received.mData + received.mLength, sizeof(received.mData) - received.mLength - 1)) > 0)
+		received.mLength += length;
+	close(fds[0]);
+
+	if (received.mLength != expect.mLength || memcmp(received.mData, expect.mData, expect.mLength)) {
+		expect.mData[expect.mLength] = 0;
+		received.mData[received.mLength] = 0;
+		printf("gdb: sent back\n%s\nexpected\n%s\n", received.mData, expect.mData);
+		return 1;
+	}
+	if (emu.mBreakpoints || emu.mWatch) {
+		printf("gdb: the session's breakpoints were left in place\n");
+		return 1;
+	}
+	em8051_free_instance(&emu);
+	return 0;
+}
@@ -0,0 +1,120 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * tests/loader.c
+ * Loads small fixture images, good and broken, and checks what the loaders
+ * return, the record they blame and what they stored. Run by `make check`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "emu8051.h"
+
+struct fixture {
+	const char *mName; // also the file name; only .bin picks the format
+	const char *mData;
+	size_t mSize;
+	int mResult; // of load_image()
+	unsigned int mLine; // the record blamed, or 0
+	int mAddress; // a byte that must have been stored, or -1
+	uint8_t mValue;
+};
+
+#define DATA(aLiteral) aLiteral, sizeof(aLiteral) - 1
+
+// 52 byte ELF32 header for EM_8051 with one program header at 52, but no room for it
+#define ELF_HEADER \
+	"\177ELF\1\1\1\0\0\0\0\0\0\0\0\0" "\2\0\245\0\1\0\0\0" "\0\0\0\0\64\0\0\0" \
+	"\0\0\0\0\0\0\0\0" "\64\0\40\0\1\0\0\0\0\0\0\0"
+
+static const struct fixture fixtures[] = {
+	{ "good.hex", DATA(":03010000020003F7\n:00000001FF\n"), 0, 0, 0x102, 0x03 },
+	{ "checksum.hex", DATA(":0100000000FF\n:03000000020003F9\n:00000001FF\n"), -4, 2, -1, 0 },
+	{ "record.hex", DATA(":00000006FA\n:00000001FF\n"), -3, 1, -1, 0 },
+	{ "linear.hex", DATA(":020000040001F9\n:0100000000FF\n:00000001FF\n"), -6, 2, -1, 0 },
+	{ "wrap.hex", DATA(":04FFFE0001020304F5\n:00000001FF\n"), -6, 1, -1, 0 },
+	{ "noend.hex", DATA(":0100000000FF\n"), -5, 2, -1, 0 },
+	{ "good.omf", DATA("\2\2\0\0\374" "\6\5\0\0\0\1\252\112" "\4\1\0\373"), 0, 0, 0x100, 0xaa },
+	{ "header.omf", DATA("\2\12\0\0\0"), -2, 0, -1, 0 },
+	{ "content.omf", DATA("\2\2\0\0\374" "\6\20\0\0\0"), -7, 2, -1, 0 },
+	{ "noend.omf", DATA("\2\2\0\0\374" "\6\5\0\0\0\1\252\112"), -5, 3, -1, 0 },
+	{ "ident.elf", DATA("\177ELF\1\1\1"), -2, 0, -1, 0 },
+	{ "header.elf", DATA("\177ELF\1\1\1\0\0\0\0\0\0\0\0\0\2\0\245\0"), -2, 0, -1, 0 },
+	{ "phdr.elf", DATA(ELF_HEADER), -7, 0, -1, 0 },
+	{ "good.elf", DATA(ELF_HEADER
+		"\1\0\0\0\124\0\0\0\0\0\0\0\0\2\0\0" "\1\0\0\0\1\0\0\0\5\0\0\0\1\0\0\0" "\125"), 0, 0, 0x200, 0x55 },
+};
+
+static int check(struct em8051 *aCPU, const struct fixture *aFixture) {
+	struct em8051_load_info info;
+	FILE *f = fopen(aFixture->mName, "wb");
+	int result;
+
+	if (!f || fwrite(aFixture->mData, 1, aFixture->mSize, f) != aFixture->mSize) {
+		printf("%s: can't write the fixture\n", aFixture->mName);
+		if (f)
+			fclose(f);
+		return 1;
+	}
+	fclose(f);
+	memset(aCPU->mCodeMem, 0, aCPU->mCodeMemMaxIdx + 1);
+	memset(&info, 0, sizeof(info));
+	result = load_image(aCPU, aFixture->mName, NULL, &info);
+	remove(aFixture->mName);
+
+	if (result != aFixture->mResult || (aFixture->mResult && info.mLine != aFixture->mLine)) {
+		printf("%s: returned %d at record %u, expected %d at record %u\n", aFixture->mName,
+			result, info.mLine, aFixture->mResult, aFixture->mLine);
+		return 1;
+	}
+	if (aFixture->mAddress >= 0 && aCPU->mCodeMem[aFixture->mAddress] != aFixture->mValue) {
+		printf("%s: code[%04x] is %02x, expected %02x\n", aFixture->mName, aFixture->mAddress,
+			aCPU->mCodeMem[aFixture->mAddress], aFixture->mValue);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	char dir[] = "/tmp/emu8051-loader-XXXXXX";
+	struct em8051 emu;
+	int failed = 0;
+	unsigned int i;
+
+	if (!mkdtemp(dir) || chdir(dir)) {
+		printf("loader: can't make a directory for the fixtures\n");
+		return 1;
+	}
+	if (em8051_alloc_instance(&emu, ENGINE_TABLE)) {
+		printf("loader: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < sizeof(fixtures) / sizeof(fixtures[0]); i++)
+		failed += check(&emu, &fixtures[i]);
+	em8051_free_instance(&emu);
+	rmdir(dir);
+	return failed != 0;
+}
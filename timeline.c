@@ -0,0 +1,354 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * timeline.c
+ * Reverse execution with checkpoints and replay
+ *
+ * The history is split into segments. Each one starts with a snapshot, and
+ * logs the PC after every instruction and every value the input callbacks
+ * returned. Going back restores the snapshot of the segment and runs forward
+ * with tick(), feeding the logged inputs back, until the wanted instruction.
+ * The logged PCs catch a replay that goes a different way.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+struct timeline_segment {
+	struct em8051_snapshot *mSnapshot; // state at mStart
+	unsigned long long mStart;
+	uint16_t *mPC; // PC after each instruction, mInterval entries
+	unsigned int mCount;
+	uint8_t *mInput; // values returned by the sfrread and xread callbacks
+	unsigned int mInputCount;
+	unsigned int mInputSize;
+};
+
+static void free_segment(struct timeline_segment *aSegment) {
+	snapshot_free(aSegment->mSnapshot);
+	free(aSegment->mPC);
+	free(aSegment->mInput);
+}
+
+// Drop the segments after aLast
+static void drop_segments(struct em8051_timeline *aTimeline, unsigned int aLast) {
+	while (aTimeline->mSegmentCount > aLast + 1)
+		free_segment(&aTimeline->mSegments[--aTimeline->mSegmentCount]);
+}
+
+// Forget what was recorded after mPosition
+static void drop_future(struct em8051_timeline *aTimeline) {
+	struct timeline_segment *segment = &aTimeline->mSegments[aTimeline->mCurrent];
+
+	drop_segments(aTimeline, aTimeline->mCurrent);
+	segment->mCount = (unsigned int)(aTimeline->mPosition - segment->mStart);
+	segment->mInputCount = aTimeline->mInput;
+}
+
+static bool at_end(struct em8051_timeline *aTimeline) {
+	struct timeline_segment *segment = &aTimeline->mSegments[aTimeline->mCurrent];
+	return aTimeline->mCurrent == aTimeline->mSegmentCount - 1 &&
+		segment->mStart + segment->mCount == aTimeline->mPosition &&
+		segment->mInputCount == aTimeline->mInput;
+}
+
+// The front-end state, or NULL if there is none or out of memory
+static unsigned char *save_state(struct em8051_timeline *aTimeline, int *aSize) {
+	unsigned char *state;
+
+	*aSize = 0;
+	if (!aTimeline->save)
+		return NULL;
+	*aSize = aTimeline->save(aTimeline->mCPU, NULL);
+	state = malloc(*aSize);
+	if (state)
+		aTimeline->save(aTimeline->mCPU, state);
+	return state;
+}
+
+static struct em8051_snapshot *checkpoint(struct em8051_timeline *aTimeline, struct em8051_snapshot *aBase) {
+	struct em8051_snapshot *snapshot = NULL;
+	unsigned char *state;
+	int size;
+
+	state = save_state(aTimeline, &size);
+	if (state || !aTimeline->save)
+		snapshot = snapshot_take(aTimeline->mCPU, aBase, state, size);
+	free(state);
+	return snapshot;
+}
+
+// Start a segment at mPosition
+static int add_segment(struct em8051_timeline *aTimeline) {
+	struct timeline_segment *segment, *previous = NULL;
+
+	if (aTimeline->mSegmentCount == aTimeline->mSegmentSize) {
+		unsigned int count = aTimeline->mSegmentSize ? aTimeline->mSegmentSize * 2 : 16;
+		segment = realloc(aTimeline->mSegments, count * sizeof(struct timeline_segment));
+		if (!segment)
+			return -1;
+		aTimeline->mSegments = segment;
+		aTimeline->mSegmentSize = count;
+	}
+	if (aTimeline->mSegmentCount)
+		previous = &aTimeline->mSegments[aTimeline->mSegmentCount - 1];
+
+	segment = &aTimeline->mSegments[aTimeline->mSegmentCount];
+	memset(segment, 0, sizeof(struct timeline_segment));
+	segment->mStart = aTimeline->mPosition;
+	segment->mPC = malloc(aTimeline->mInterval * sizeof(uint16_t));
+	if (segment->mPC)
+		segment->mSnapshot = checkpoint(aTimeline, previous ? previous->mSnapshot : NULL);
+	if (!segment->mSnapshot) {
+		free_segment(segment);
+		return -1;
+	}
+
+	aTimeline->mCurrent = aTimeline->mSegmentCount++;
+	aTimeline->mInput = 0;
+
+	if (aTimeline->mMaxCheckpoints && aTimeline->mSegmentCount > aTimeline->mMaxCheckpoints) {
+		free_segment(&aTimeline->mSegments[0]);
+		aTimeline->mSegmentCount--;
+		memmove(aTimeline->mSegments, aTimeline->mSegments + 1, aTimeline->mSegmentCount * sizeof(struct timeline_segment));
+		aTimeline->mCurrent--;
+	}
+	return 0;
+}
+
+static uint8_t add_input(struct em8051_timeline *aTimeline, uint8_t aValue) {
+	struct timeline_segment *segment;
+
+	if (!at_end(aTimeline))
+		drop_future(aTimeline);
+	segment = &aTimeline->mSegments[aTimeline->mCurrent];
+	if (segment->mInputCount == segment->mInputSize) {
+		unsigned int size = segment->mInputSize ? segment->mInputSize * 2 : 256;
+		uint8_t *input = realloc(segment->mInput, size);
+		// out of memory; replays past here will be caught diverging
+		if (!input)
+			return aValue;
+		segment->mInput = input;
+		segment->mInputSize = size;
+	}
+	segment->mInput[segment->mInputCount++] = aValue;
+	aTimeline->mInput = segment->mInputCount;
+	return aValue;
+}
+
+static uint8_t next_input(struct em8051_timeline *aTimeline) {
+	struct timeline_segment *segment = &aTimeline->mSegments[aTimeline->mCurrent];
+	if (aTimeline->mInput < segment->mInputCount)
+		return segment->mInput[aTimeline->mInput++];
+	return 0;
+}
+
+static uint8_t timeline_sfrread(struct em8051 *aCPU, uint8_t aRegister) {
+	struct em8051_timeline *timeline = aCPU->mTimeline;
+	if (timeline->mReplaying)
+		return next_input(timeline);
+	return add_input(timeline, timeline->mSfrRead[aRegister - 0x80](aCPU, aRegister));
+}
+
+static uint8_t timeline_xread(struct em8051 *aCPU, uint16_t aAddress) {
+	struct em8051_timeline *timeline = aCPU->mTimeline;
+	if (timeline->mReplaying)
+		return next_input(timeline);
+	return add_input(timeline, timeline->mXRead(aCPU, aAddress));
+}
+
+static void timeline_except(struct em8051 *aCPU, int aCode) {
+	struct em8051_timeline *timeline = aCPU->mTimeline;
+	if (!timeline->mReplaying)
+		timeline->mExcept(aCPU, aCode);
+}
+
+int timeline_start(struct em8051_timeline *aTimeline, struct em8051 *aCPU) {
+	int i;
+
+	aTimeline->mCPU = aCPU;
+	aTimeline->mSegments = NULL;
+	aTimeline->mSegmentCount = 0;
+	aTimeline->mSegmentSize = 0;
+	aTimeline->mPosition = 0;
+	aTimeline->mReplaying = false;
+	if (!aTimeline->mInterval)
+		aTimeline->mInterval = 1;
+	if (add_segment(aTimeline) < 0)
+		return -1;
+
+	aCPU->mTimeline = aTimeline;
+	for (i = 0; i < 128; i++) {
+		aTimeline->mSfrRead[i] = aCPU->sfrread[i];
+		if (aCPU->sfrread[i])
+			aCPU->sfrread[i] = timeline_sfrread;
+	}
+	aTimeline->mXRead = aCPU->xread;
+	if (aCPU->xread)
+		aCPU->xread = timeline_xread;
+	aTimeline->mExcept = aCPU->except;
+	if (aCPU->except)
+		aCPU->except = timeline_except;
+	return 0;
+}
+
+void timeline_stop(struct em8051_timeline *aTimeline) {
+	struct em8051 *cpu = aTimeline->mCPU;
+	int i;
+
+	for (i = 0; i < 128; i++)
+		cpu->sfrread[i] = aTimeline->mSfrRead[i];
+	cpu->xread = aTimeline->mXRead;
+	cpu->except = aTimeline->mExcept;
+	cpu->mTimeline = NULL;
+
+	drop_segments(aTimeline, 0);
+	if (aTimeline->mSegmentCount)
+		free_segment(&aTimeline->mSegments[0]);
+	free(aTimeline->mSegments);
+	aTimeline->mSegments = NULL;
+	aTimeline->mSegmentCount = 0;
+	aTimeline->mSegmentSize = 0;
+}
+
+int timeline_record(struct em8051_timeline *aTimeline) {
+	struct timeline_segment *segment;
+
+	if (!at_end(aTimeline))
+		drop_future(aTimeline);
+	segment = &aTimeline->mSegments[aTimeline->mCurrent];
+	// a checkpoint failed earlier
+	if (segment->mCount == aTimeline->mInterval) {
+		if (add_segment(aTimeline) < 0)
+			return -1;
+		segment = &aTimeline->mSegments[aTimeline->mCurrent];
+	}
+	segment->mPC[segment->mCount++] = aTimeline->mCPU->mPC;
+	aTimeline->mPosition++;
+
+	if (segment->mCount == aTimeline->mInterval)
+		return add_segment(aTimeline);
+	return 0;
+}
+
+int timeline_cut(struct em8051_timeline *aTimeline) {
+	struct timeline_segment *segment;
+	struct em8051_snapshot *snapshot;
+
+	drop_future(aTimeline);
+	segment = &aTimeline->mSegments[aTimeline->mCurrent];
+	if (segment->mStart != aTimeline->mPosition)
+		return add_segment(aTimeline);
+
+	// nothing recorded since the checkpoint, so just take it again
+	snapshot = checkpoint(aTimeline, segment->mSnapshot);
+	if (!snapshot)
+		return -1;
+	snapshot_free(segment->mSnapshot);
+	segment->mSnapshot = snapshot;
+	return 0;
+}
+
+unsigned long long timeline_oldest(struct em8051_timeline *aTimeline) {
+	return aTimeline->mSegments[0].mStart;
+}
+
+// The last position before mPosition after which PC was aPC, or had its bit
+// set in aBits if that isn't NULL
+static long long find_pc(struct em8051_timeline *aTimeline, uint16_t aPC, const uint8_t *aBits) {
+	unsigned int i = aTimeline->mCurrent;
+	unsigned long long position;
+
+	// no PC is logged for the oldest position
+	for (position = aTimeline->mPosition - 1; position > timeline_oldest(aTimeline) && position < aTimeline->mPosition; position--) {
+		struct timeline_segment *segment;
+		uint16_t pc;
+		while (aTimeline->mSegments[i].mStart >= position)
+			i--;
+		segment = &aTimeline->mSegments[i];
+		pc = segment->mPC[position - segment->mStart - 1];
+		if (aBits ? (aBits[pc >> 3] & (1 << (pc & 7))) != 0 : pc == aPC)
+			return position;
+	}
+	return -1;
+}
+
+long long timeline_find_pc(struct em8051_timeline *aTimeline, uint16_t aPC) {
+	return find_pc(aTimeline, aPC, NULL);
+}
+
+long long timeline_find_breakpoint(struct em8051_timeline *aTimeline, struct em8051_breakpoints *aBreakpoints) {
+	return find_pc(aTimeline, 0, aBreakpoints->mBits);
+}
+
+int timeline_seek(struct em8051_timeline *aTimeline, unsigned long long aPosition) {
+	struct em8051 *cpu = aTimeline->mCPU;
+	struct timeline_segment *last = &aTimeline->mSegments[aTimeline->mSegmentCount - 1];
+	struct timeline_segment *segment;
+	unsigned char *state;
+	unsigned int i;
+	int size;
+	bool diverged = false;
+
+	if (aPosition < timeline_oldest(aTimeline) || aPosition > last->mStart + last->mCount)
+		return -1;
+
+	for (i = aTimeline->mSegmentCount - 1; aTimeline->mSegments[i].mStart > aPosition; i--)
+		;
+	segment = &aTimeline->mSegments[i];
+
+	// the buffer just needs the right size here
+	state = save_state(aTimeline, &size);
+	if (aTimeline->save && !state)
+		return -1;
+	snapshot_restore(cpu, segment->mSnapshot, state);
+	if (aTimeline->load)
+		aTimeline->load(cpu, state);
+	free(state);
+
+	aTimeline->mCurrent = i;
+	aTimeline->mPosition = segment->mStart;
+	aTimeline->mInput = 0;
+	aTimeline->mReplaying = true;
+	while (aTimeline->mPosition < aPosition) {
+		bool executed = tick(cpu);
+
+		if (aTimeline->replay)
+			aTimeline->replay(cpu, executed);
+		if (executed) {
+			diverged = cpu->mPC != segment->mPC[aTimeline->mPosition - segment->mStart];
+			segment->mPC[aTimeline->mPosition++ - segment->mStart] = cpu->mPC;
+			if (diverged)
+				break;
+		}
+	}
+	aTimeline->mReplaying = false;
+
+	if (diverged || aTimeline->mPosition != aPosition) {
+		drop_future(aTimeline);
+		return -1;
+	}
+	return 0;
+}
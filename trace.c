@@ -0,0 +1,883 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * trace.c
+ * Binary execution trace in the BAP frame format
+ *
+ * The interpreter side only copies the state before each instruction and
+ * notes the memory accesses the opcode handlers make; after the instruction
+ * the operands are worked out and appended to a batch as plain structs. Full
+ * batches go to a writer thread, which encodes them as protobuf std_frames
+ * and writes them out in a BAP trace container, so the interpreter only waits
+ * when the writer falls a whole ring of batches behind. On Windows there is
+ * no writer thread; each batch is written as soon as it is full.
+ *
+ * Container: a 48-byte header (magic, version, bfd architecture and machine,
+ * frame count and table of contents offset, all 64-bit little endian), the
+ * frames, each a 64-bit length and the encoded frame, and the table of
+ * contents: the frames per entry, then the offset of every that many'th frame.
+ */
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+#define TRACE_MAGIC 7456879624156307493ULL
+#define TRACE_VERSION 1
+// bfd_arch_unknown; binutils has no 8051
+#define TRACE_ARCH 0
+#define TRACE_MACHINE 0
+#define TRACE_HEADER_SIZE 48
+#define TRACE_FRAME_COUNT_OFFSET 32
+#define TRACE_TOC_STEP 10000
+
+// batches in the ring, and the bytes of records in each
+#define TRACE_BATCHES 8
+#define TRACE_BATCH_SIZE (256 * 1024)
+
+// operands kept per instruction; a callback writing more SFRs loses the rest
+#define TRACE_MAX_OPERANDS 48
+
+// encoded frame size limit: two lists of operands of up to 32 bytes each
+// with their keys, plus the address and code
+#define FRAME_MAX_SIZE (2 * TRACE_MAX_OPERANDS * 36 + 64)
+
+// address space of the state copy: the direct and indirect addresses
+#define STATE_SIZE 384
+#define UPPER_OFFSET 256
+
+// Registers and memory an opcode uses without going through the memory helpers
+enum TRACE_IMPLICIT {
+	USE_A = 0x01,
+	USE_B = 0x02,
+	USE_PSW = 0x04, // the flags
+	USE_SP = 0x08,
+	USE_DPTR = 0x10,
+	USE_RN = 0x20, // r0-r7, from the opcode
+	USE_RI = 0x40, // r0 or r1 as an indirect address
+	USE_BIT = 0x80 // the byte holding the bit in operand 1
+};
+
+enum TRACE_USAGE {
+	USAGE_READ = 0x01,
+	USAGE_WRITTEN = 0x02
+};
+
+struct trace_operand {
+	uint32_t mAddress; // TRACE_SPACE and address
+	uint8_t mUsage; // see TRACE_USAGE
+	uint8_t mPre;
+	uint8_t mPost;
+};
+
+// One instruction, followed by mCount operands in the batch
+struct trace_record {
+	uint16_t mPC;
+	uint8_t mLength;
+	uint8_t mBank; // register bank before the instruction
+	uint8_t mCode[3];
+	uint8_t mCount;
+};
+
+// An operand_info list element without its last byte, the value
+struct trace_encoded {
+	uint8_t mSize;
+	unsigned char mData[35];
+};
+
+struct trace_batch {
+	unsigned char *mData;
+	unsigned int mSize;
+};
+
+struct em8051_trace {
+	struct em8051 *mCPU;
+	// interpreter side
+	unsigned char mBefore[STATE_SIZE];
+	struct trace_record mRecord;
+	struct trace_operand mOperands[TRACE_MAX_OPERANDS];
+	unsigned int mFill; // batch being filled
+	// shared with the writer
+#ifndef _WIN32
+	pthread_t mThread;
+	pthread_mutex_t mLock;
+	pthread_cond_t mQueuedCond; // a batch was queued, or closing
+	pthread_cond_t mFreeCond; // a batch was written
+#endif
+	struct trace_batch mBatches[TRACE_BATCHES];
+	unsigned int mQueued; // full batches waiting, starting at mWrite
+	unsigned int mWrite;
+	bool mClosing;
+	// writer side
+	FILE *mFile;
+	char *mFilename; // NULL when streaming
+	unsigned long long mMaxSize; // 0 for no limit
+	unsigned int mFileIndex;
+	unsigned long long mFileSize;
+	unsigned long long mFrames; // in the current file
+	unsigned long long *mToc;
+	unsigned int mTocCount;
+	unsigned int mTocSize;
+	// list elements by state index, then r0-r7, and usage - 1
+	struct trace_encoded mEncoded[STATE_SIZE + 8][USAGE_READ | USAGE_WRITTEN];
+	bool mError;
+};
+
+// Opcode rows with the accumulator as the first operand of columns 4-f
+static bool a_row(uint8_t aRow) {
+	return aRow == 0x2 || aRow == 0x3 || aRow == 0x4 || aRow == 0x5 || aRow == 0x6 || aRow == 0x9 || aRow == 0xc;
+}
+
+// Opcode rows of arithmetic setting the flags in columns 4-f
+static bool flag_row(uint8_t aRow) {
+	return aRow == 0x2 || aRow == 0x3 || aRow == 0x9;
+}
+
+static uint8_t implicit_reads(uint8_t aOpcode) {
+	uint8_t row = aOpcode >> 4, column = aOpcode & 0x0f;
+	uint8_t reads = 0;
+
+	// mov rn,#data; mov rn,mem and mov rn,a only write rn
+	if (column >= 8 && row != 0x7 && row != 0xa && row != 0xf)
+		reads |= USE_RN;
+	if (column == 6 || column == 7 || ((row == 0xe || row == 0xf) && (column == 2 || column == 3)))
+		reads |= USE_RI;
+	if ((column >= 4 && a_row(row)) || (column == 2 && (row == 0x4 || row == 0x5 || row == 0x6)) ||
+		(row == 0xf && column != 1) || (row == 0xb && (column == 4 || column == 5)) ||
+		(row == 0xd && (column == 4 || column == 6 || column == 7)))
+		reads |= USE_A;
+	if (column >= 4 && (row == 0x3 || row == 0x9))
+		reads |= USE_PSW; // addc, subb
+	if ((aOpcode & 0x1f) == 0x11)
+		reads |= USE_SP; // acall
+
+	switch (aOpcode) {
+	case 0x03: // rr a
+	case 0x04: // inc a
+	case 0x14: // dec a
+	case 0x23: // rl a
+	case 0x60: // jz
+	case 0x70: // jnz
+	case 0x83: // movc a, @a+pc
+		reads |= USE_A;
+		break;
+	case 0x13: // rrc a
+	case 0x33: // rlc a
+	case 0xd4: // da a
+		reads |= USE_A | USE_PSW;
+		break;
+	case 0x40: // jc
+	case 0x50: // jnc
+	case 0xb3: // cpl c
+		reads |= USE_PSW;
+		break;
+	case 0x73: // jmp @a+dptr
+	case 0x93: // movc a, @a+dptr
+		reads |= USE_A | USE_DPTR;
+		break;
+	case 0xa3: // inc dptr
+	case 0xe0: // movx a, @dptr
+	case 0xf0: // movx @dptr, a
+		reads |= USE_DPTR;
+		break;
+	case 0x84: // div ab
+	case 0xa4: // mul ab
+		reads |= USE_A | USE_B;
+		break;
+	case 0x12: // lcall
+	case 0x22: // ret
+	case 0x32: // reti
+	case 0xc0: // push
+	case 0xd0: // pop
+		reads |= USE_SP;
+		break;
+	case 0x72: // orl c, bit
+	case 0x82: // anl c, bit
+	case 0x92: // mov bit, c
+	case 0xa0: // orl c, /bit
+	case 0xb0: // anl c, /bit
+		reads |= USE_PSW | USE_BIT;
+		break;
+	case 0x10: // jbc
+	case 0x20: // jb
+	case 0x30: // jnb
+	case 0xa2: // mov c, bit
+	case 0xb2: // cpl bit
+	case 0xc2: // clr bit
+	case 0xd2: // setb bit
+		reads |= USE_BIT;
+		break;
+	}
+	return reads;
+}
+
+// Writes that may leave the value as it was, so comparing the state before
+// and after the instruction can't tell; those that always change something,
+// like the stack pointer, are left to the comparison
+static uint8_t implicit_writes(uint8_t aOpcode) {
+	uint8_t row = aOpcode >> 4, column = aOpcode & 0x0f;
+	uint8_t writes = 0;
+
+	// inc, dec, mov rn,#data, mov rn,mem, xch, djnz and mov rn,a
+	if (column >= 8 && (row <= 0x1 || row == 0x7 || row == 0xa || row == 0xc || row == 0xd || row == 0xf))
+		writes |= USE_RN;
+	if (column >= 4 && (a_row(row) || row == 0xe))
+		writes |= USE_A;
+	if (column >= 4 && (flag_row(row) || row == 0xb))
+		writes |= USE_PSW; // and cjne
+
+	switch (aOpcode) {
+	case 0x03: // rr a
+	case 0x04: // inc a
+	case 0x14: // dec a
+	case 0x23: // rl a
+	case 0x74: // mov a, #data
+	case 0x83: // movc a, @a+pc
+	case 0x93: // movc a, @a+dptr
+	case 0xd6:
+	case 0xd7: // xchd a, @rx
+	case 0xe0:
+	case 0xe2:
+	case 0xe3: // movx a, ...
+	case 0xf4: // cpl a
+		writes |= USE_A;
+		break;
+	case 0x13: // rrc a
+	case 0x33: // rlc a
+	case 0xd4: // da a
+		writes |= USE_A | USE_PSW;
+		break;
+	case 0x84: // div ab
+	case 0xa4: // mul ab
+		writes |= USE_A | USE_B | USE_PSW;
+		break;
+	case 0x72: // orl c, bit
+	case 0x82: // anl c, bit
+	case 0xa0: // orl c, /bit
+	case 0xa2: // mov c, bit
+	case 0xb0: // anl c, /bit
+	case 0xb3: // cpl c
+	case 0xc3: // clr c
+	case 0xd3: // setb c
+		writes |= USE_PSW;
+		break;
+	case 0x90: // mov dptr, #data
+	case 0xa3: // inc dptr
+		writes |= USE_DPTR;
+		break;
+	case 0x92: // mov bit, c
+	case 0xb2: // cpl bit
+	case 0xc2: // clr bit
+	case 0xd2: // setb bit
+		writes |= USE_BIT;
+		break;
+	}
+	return writes;
+}
+
+static void get_state(struct em8051 *aCPU, unsigned char *aState) {
+	update_parity(aCPU);
+	memcpy(aState, aCPU->mLowerData, 128);
+	memcpy(aState + 128, aCPU->mSFR, 128);
+	if (aCPU->mUpperData)
+		memcpy(aState + UPPER_OFFSET, aCPU->mUpperData, 128);
+	else
+		memset(aState + UPPER_OFFSET, 0, 128);
+}
+
+// Position in the state copy, or -1 for external data and code
+static int state_index(uint32_t aAddress) {
+	uint8_t address = aAddress & 0xff;
+
+	switch (aAddress & TRACE_SPACE_MASK) {
+	case TRACE_DATA:
+		return address < 0x80 ? address : UPPER_OFFSET + address - 0x80;
+	case TRACE_SFR:
+		return address;
+	}
+	return -1;
+}
+
+// The operand at aAddress, added if it isn't there yet
+static struct trace_operand *find_operand(struct em8051_trace *aTrace, uint32_t aAddress) {
+	struct trace_operand *operand = aTrace->mOperands;
+	unsigned int i;
+
+	for (i = 0; i < aTrace->mRecord.mCount; i++, operand++)
+		if (operand->mAddress == aAddress)
+			return operand;
+	if (aTrace->mRecord.mCount == TRACE_MAX_OPERANDS)
+		return NULL;
+	aTrace->mRecord.mCount++;
+	operand->mAddress = aAddress;
+	operand->mUsage = 0;
+	return operand;
+}
+
+// The registers and memory in aUses as operands with aUsage; the values are
+// filled in by trace_end()
+static void add_implicit(struct em8051_trace *aTrace, uint8_t aUses, uint8_t aUsage) {
+	struct trace_record *record = &aTrace->mRecord;
+	uint32_t addresses[9];
+	unsigned int count = 0, i;
+
+	if (aUses & USE_A)
+		addresses[count++] = TRACE_SFR | (REG_ACC + 0x80);
+	if (aUses & USE_B)
+		addresses[count++] = TRACE_SFR | (REG_B + 0x80);
+	if (aUses & USE_PSW)
+		addresses[count++] = TRACE_SFR | (REG_PSW + 0x80);
+	if (aUses & USE_SP)
+		addresses[count++] = TRACE_SFR | (REG_SP + 0x80);
+	if (aUses & USE_DPTR) {
+		addresses[count++] = TRACE_SFR | (REG_DPL + 0x80);
+		addresses[count++] = TRACE_SFR | (REG_DPH + 0x80);
+	}
+	if (aUses & USE_RN)
+		addresses[count++] = TRACE_DATA | (record->mBank * 8 + (record->mCode[0] & 7));
+	if (aUses & USE_RI)
+		addresses[count++] = TRACE_DATA | (record->mBank * 8 + (record->mCode[0] & 1));
+	if (aUses & USE_BIT) {
+		uint8_t address = record->mCode[1];
+		if (address > 0x7f)
+			addresses[count++] = TRACE_SFR | (address & 0xf8);
+		else
+			addresses[count++] = TRACE_DATA | (0x20 + (address >> 3));
+	}
+
+	for (i = 0; i < count; i++) {
+		struct trace_operand *operand = find_operand(aTrace, addresses[i]);
+		if (!operand)
+			return;
+		// a read through the helpers has the value already
+		if ((aUsage & USAGE_READ) && !(operand->mUsage & USAGE_READ))
+			operand->mPre = aTrace->mBefore[state_index(addresses[i])];
+		operand->mUsage |= aUsage;
+	}
+}
+
+void trace_begin(struct em8051 *aCPU) {
+	struct em8051_trace *trace = aCPU->mTrace;
+	struct trace_record *record = &trace->mRecord;
+	uint8_t i;
+
+	get_state(aCPU, trace->mBefore);
+	record->mPC = aCPU->mPC;
+	record->mLength = op_lengths[aCPU->mCodeMem[aCPU->mPC & (aCPU->mCodeMemMaxIdx)]];
+	for (i = 0; i < record->mLength; i++)
+		record->mCode[i] = aCPU->mCodeMem[(aCPU->mPC + i) & (aCPU->mCodeMemMaxIdx)];
+	record->mBank = (trace->mBefore[128 + REG_PSW] & (PSWMASK_RS0 | PSWMASK_RS1)) >> PSW_RS0;
+	record->mCount = 0;
+}
+
+void trace_read(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue) {
+	struct trace_operand *operand = find_operand(aCPU->mTrace, aAddress);
+
+	// the first read sees the value before the instruction
+	if (operand && !(operand->mUsage & USAGE_READ)) {
+		operand->mUsage |= USAGE_READ;
+		operand->mPre = aValue;
+	}
+}
+
+void trace_write(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue) {
+	struct trace_operand *operand = find_operand(aCPU->mTrace, aAddress);
+
+	if (!operand)
+		return;
+	if (!operand->mUsage && (aAddress & TRACE_SPACE_MASK) == TRACE_EXT)
+		operand->mPre = aCPU->mExtData ? aCPU->mExtData[aAddress & (aCPU->mExtDataMaxIdx)] : aValue;
+	operand->mUsage |= USAGE_WRITTEN;
+	operand->mPost = aValue;
+}
+
+static void write_batch(struct em8051_trace *aTrace, struct trace_batch *aBatch);
+
+// Hand the batch being filled to the writer, and wait for a free one
+static void queue_batch(struct em8051_trace *aTrace) {
+#ifdef _WIN32
+	write_batch(aTrace, &aTrace->mBatches[aTrace->mFill]);
+#else
+	pthread_mutex_lock(&aTrace->mLock);
+	aTrace->mQueued++;
+	pthread_cond_signal(&aTrace->mQueuedCond);
+	while (aTrace->mQueued == TRACE_BATCHES)
+		pthread_cond_wait(&aTrace->mFreeCond, &aTrace->mLock);
+	pthread_mutex_unlock(&aTrace->mLock);
+#endif
+	aTrace->mFill = (aTrace->mFill + 1) % TRACE_BATCHES;
+	aTrace->mBatches[aTrace->mFill].mSize = 0;
+}
+
+void trace_end(struct em8051 *aCPU) {
+	struct em8051_trace *trace = aCPU->mTrace;
+	struct trace_record *record = &trace->mRecord;
+	struct trace_batch *batch;
+	unsigned char after[STATE_SIZE];
+	unsigned int i, size;
+
+	add_implicit(trace, implicit_reads(record->mCode[0]), USAGE_READ);
+	add_implicit(trace, implicit_writes(record->mCode[0]), USAGE_WRITTEN);
+
+	// written internal memory and SFRs, including the writes that left the
+	// value as it was and the side effects of the callbacks
+	get_state(aCPU, after);
+	for (i = 0; i < record->mCount; i++) {
+		struct trace_operand *operand = &trace->mOperands[i];
+		int index = state_index(operand->mAddress);
+		if (index >= 0 && (operand->mUsage & USAGE_WRITTEN))
+			operand->mPost = after[index];
+	}
+	for (i = 0; i < STATE_SIZE; i++) {
+		struct trace_operand *operand;
+		uint32_t address;
+		uint64_t before, now;
+
+		// most of the state stays the same: skip it eight bytes at a time
+		if (i % 8 == 0) {
+			memcpy(&before, trace->mBefore + i, 8);
+			memcpy(&now, after + i, 8);
+			if (before == now) {
+				i += 7;
+				continue;
+			}
+		}
+		if (after[i] == trace->mBefore[i])
+			continue;
+		if (i < 128)
+			address = TRACE_DATA | i;
+		else if (i < UPPER_OFFSET)
+			address = TRACE_SFR | i;
+		else
+			address = TRACE_DATA | (i - UPPER_OFFSET + 0x80);
+		operand = find_operand(trace, address);
+		if (!operand)
+			break;
+		operand->mUsage |= USAGE_WRITTEN;
+		operand->mPost = after[i];
+	}
+	for (i = 0; i < record->mCount; i++) {
+		struct trace_operand *operand = &trace->mOperands[i];
+		int index = state_index(operand->mAddress);
+		if (index >= 0 && !(operand->mUsage & USAGE_READ))
+			operand->mPre = trace->mBefore[index];
+	}
+
+	size = sizeof(struct trace_record) + record->mCount * sizeof(struct trace_operand);
+	batch = &trace->mBatches[trace->mFill];
+	if (batch->mSize + size > TRACE_BATCH_SIZE) {
+		queue_batch(trace);
+		batch = &trace->mBatches[trace->mFill];
+	}
+	memcpy(batch->mData + batch->mSize, record, sizeof(struct trace_record));
+	memcpy(batch->mData + batch->mSize + sizeof(struct trace_record), trace->mOperands,
+		record->mCount * sizeof(struct trace_operand));
+	batch->mSize += size;
+}
+
+// Protobuf encoding
+
+static unsigned char *put_varint(unsigned char *aOut, unsigned long long aValue) {
+	while (aValue >= 0x80) {
+		*aOut++ = (aValue & 0x7f) | 0x80;
+		aValue >>= 7;
+	}
+	*aOut++ = aValue;
+	return aOut;
+}
+
+static unsigned char *put_key(unsigned char *aOut, unsigned int aField, unsigned int aWireType) {
+	return put_varint(aOut, (aField << 3) | aWireType);
+}
+
+// A length delimited field holding the aSize bytes at aData
+static unsigned char *put_bytes(unsigned char *aOut, unsigned int aField, const void *aData, unsigned int aSize) {
+	aOut = put_key(aOut, aField, 2);
+	aOut = put_varint(aOut, aSize);
+	memcpy(aOut, aData, aSize);
+	return aOut + aSize;
+}
+
+static unsigned char *put_uint(unsigned char *aOut, unsigned int aField, unsigned long long aValue) {
+	return put_varint(put_key(aOut, aField, 0), aValue);
+}
+
+// The operand as a BAP operand_info; at most 32 bytes
+static unsigned char *put_operand(unsigned char *aOut, const struct trace_record *aRecord,
+	const struct trace_operand *aOperand, uint8_t aValue) {
+	unsigned char inner[16], specific[16], usage[8], taint[4], *out;
+	uint32_t address = aOperand->mAddress;
+	uint8_t low = address & 0xff;
+	char name[16] = "";
+
+	// operand_info_specific: reg_operand for the SFRs and the registers of
+	// the current bank, else mem_operand
+	if ((address & TRACE_SPACE_MASK) == TRACE_SFR)
+		mem_memonic(low, name);
+	else if ((address & TRACE_SPACE_MASK) == TRACE_DATA && low < 0x20 && low >> 3 == aRecord->mBank)
+		sprintf(name, "R%d", low & 7);
+	if (name[0]) {
+		out = put_bytes(inner, 1, name, strlen(name));
+		out = put_bytes(specific, 2, inner, out - inner);
+	} else {
+		out = put_uint(inner, 1, address);
+		out = put_bytes(specific, 1, inner, out - inner);
+	}
+	aOut = put_bytes(aOut, 1, specific, out - specific);
+
+	// bit_length, a piqi int: zigzag encoded
+	aOut = put_uint(aOut, 2, 8 << 1);
+
+	out = usage;
+	if (aOperand->mUsage & USAGE_READ)
+		out = put_uint(out, 1, 1);
+	if (aOperand->mUsage & USAGE_WRITTEN)
+		out = put_uint(out, 2, 1);
+	aOut = put_bytes(aOut, 3, usage, out - usage);
+
+	// taint_info: no_taint
+	out = put_uint(taint, 1, 1);
+	aOut = put_bytes(aOut, 4, taint, out - taint);
+
+	return put_bytes(aOut, 5, &aValue, 1);
+}
+
+// Index of the operand in mEncoded, or -1 if it isn't cached
+static int encoded_index(const struct trace_record *aRecord, const struct trace_operand *aOperand) {
+	uint8_t low = aOperand->mAddress & 0xff;
+	int index = state_index(aOperand->mAddress);
+
+	if (index >= 0 && index < 0x20 && low >> 3 == aRecord->mBank)
+		return STATE_SIZE + (low & 7);
+	return index;
+}
+
+// The operand list of one side of the instruction. The list elements are
+// the same but for the value, which is the last byte, so they are encoded
+// once for each register and internal address
+static unsigned char *put_operands(struct em8051_trace *aTrace, unsigned char *aOut,
+	const struct trace_record *aRecord, const struct trace_operand *aOperands, bool aPost) {
+	unsigned char operand[32];
+	unsigned int i;
+
+	for (i = 0; i < aRecord->mCount; i++) {
+		const struct trace_operand *source = &aOperands[i];
+		struct trace_encoded *encoded, uncached;
+		int index;
+
+		if (aPost && !(source->mUsage & USAGE_WRITTEN))
+			continue;
+		index = encoded_index(aRecord, source);
+		encoded = index >= 0 ? &aTrace->mEncoded[index][source->mUsage - 1] : &uncached;
+		if (index < 0 || !encoded->mSize) {
+			unsigned char *end = put_operand(operand, aRecord, source, 0);
+			end = put_bytes(encoded->mData, 1, operand, end - operand);
+			encoded->mSize = end - encoded->mData - 1;
+		}
+		memcpy(aOut, encoded->mData, encoded->mSize);
+		aOut += encoded->mSize;
+		*aOut++ = aPost ? source->mPost : source->mPre;
+	}
+	return aOut;
+}
+
+// Returns the size of the frame encoded into aOut
+static unsigned int encode_frame(struct em8051_trace *aTrace, unsigned char *aOut,
+	const struct trace_record *aRecord, const struct trace_operand *aOperands) {
+	unsigned char std_frame[FRAME_MAX_SIZE];
+	unsigned char list[TRACE_MAX_OPERANDS * 36];
+	unsigned char *out, *end;
+
+	out = put_uint(std_frame, 1, aRecord->mPC);
+	out = put_uint(out, 2, 0);
+	out = put_bytes(out, 3, aRecord->mCode, aRecord->mLength);
+	end = put_operands(aTrace, list, aRecord, aOperands, false);
+	out = put_bytes(out, 4, list, end - list);
+	end = put_operands(aTrace, list, aRecord, aOperands, true);
+	out = put_bytes(out, 5, list, end - list);
+
+	// frame variant: std_frame
+	return put_bytes(aOut, 1, std_frame, out - std_frame) - aOut;
+}
+
+// Container
+
+static void put_u64(unsigned char *aOut, unsigned long long aValue) {
+	int i;
+	for (i = 0; i < 8; i++)
+		aOut[i] = (aValue >> (i * 8)) & 0xff;
+}
+
+static void write_data(struct em8051_trace *aTrace, const void *aData, unsigned int aSize) {
+	if (fwrite(aData, 1, aSize, aTrace->mFile) != aSize)
+		aTrace->mError = true;
+	aTrace->mFileSize += aSize;
+}
+
+static void write_header(struct em8051_trace *aTrace, unsigned long long aTocOffset) {
+	unsigned char header[TRACE_HEADER_SIZE];
+
+	put_u64(header, TRACE_MAGIC);
+	put_u64(header + 8, TRACE_VERSION);
+	put_u64(header + 16, TRACE_ARCH);
+	put_u64(header + 24, TRACE_MACHINE);
+	put_u64(header + TRACE_FRAME_COUNT_OFFSET, aTrace->mFrames);
+	put_u64(header + 40, aTocOffset);
+	write_data(aTrace, header, TRACE_HEADER_SIZE);
+}
+
+static int open_file(struct em8051_trace *aTrace) {
+	char *filename = aTrace->mFilename;
+	char *numbered = NULL;
+
+	if (aTrace->mFileIndex) {
+		numbered = malloc(strlen(aTrace->mFilename) + 16);
+		if (!numbered)
+			return -1;
+		sprintf(numbered, "%s.%u", aTrace->mFilename, aTrace->mFileIndex);
+		filename = numbered;
+	}
+	aTrace->mFile = fopen(filename, "wb");
+	free(numbered);
+	if (!aTrace->mFile)
+		return -1;
+	aTrace->mFileSize = 0;
+	aTrace->mFrames = 0;
+	aTrace->mTocCount = 0;
+	// the frame count and table of contents are filled in by close_file()
+	write_header(aTrace, 0);
+	return 0;
+}
+
+// Write the table of contents and the header, and close the file
+static void close_file(struct em8051_trace *aTrace) {
+	unsigned long long toc_offset = aTrace->mFileSize;
+	unsigned char value[8];
+	unsigned int i;
+
+	put_u64(value, TRACE_TOC_STEP);
+	write_data(aTrace, value, 8);
+	for (i = 0; i < aTrace->mTocCount; i++) {
+		put_u64(value, aTrace->mToc[i]);
+		write_data(aTrace, value, 8);
+	}
+	if (fseek(aTrace->mFile, 0, SEEK_SET) != 0)
+		aTrace->mError = true;
+	write_header(aTrace, toc_offset);
+	if (fclose(aTrace->mFile) != 0)
+		aTrace->mError = true;
+	aTrace->mFile = NULL;
+}
+
+static void write_frame(struct em8051_trace *aTrace, const unsigned char *aFrame, unsigned int aSize) {
+	unsigned char length[8];
+
+	if (aTrace->mFilename) {
+		// start the next file rather than go over the limit, but never leave one empty
+		if (aTrace->mMaxSize && aTrace->mFrames &&
+			aTrace->mFileSize + 8 + aSize + 8 * (aTrace->mTocCount + 2) > aTrace->mMaxSize) {
+			close_file(aTrace);
+			aTrace->mFileIndex++;
+			if (open_file(aTrace) < 0) {
+				aTrace->mError = true;
+				return;
+			}
+		}
+		if (aTrace->mFrames && aTrace->mFrames % TRACE_TOC_STEP == 0) {
+			if (aTrace->mTocCount == aTrace->mTocSize) {
+				unsigned int size = aTrace->mTocSize ? aTrace->mTocSize * 2 : 64;
+				unsigned long long *toc = realloc(aTrace->mToc, size * sizeof(unsigned long long));
+				if (!toc) {
+					aTrace->mError = true;
+					return;
+				}
+				aTrace->mToc = toc;
+				aTrace->mTocSize = size;
+			}
+			aTrace->mToc[aTrace->mTocCount++] = aTrace->mFileSize;
+		}
+	}
+	put_u64(length, aSize);
+	write_data(aTrace, length, 8);
+	write_data(aTrace, aFrame, aSize);
+	aTrace->mFrames++;
+}
+
+static void write_batch(struct em8051_trace *aTrace, struct trace_batch *aBatch) {
+	unsigned char frame[FRAME_MAX_SIZE + 8];
+	unsigned int offset = 0;
+
+	while (offset < aBatch->mSize && aTrace->mFile) {
+		struct trace_record record;
+		struct trace_operand operands[TRACE_MAX_OPERANDS];
+
+		memcpy(&record, aBatch->mData + offset, sizeof(record));
+		offset += sizeof(record);
+		memcpy(operands, aBatch->mData + offset, record.mCount * sizeof(struct trace_operand));
+		offset += record.mCount * sizeof(struct trace_operand);
+		write_frame(aTrace, frame, encode_frame(aTrace, frame, &record, operands));
+	}
+	if (!aTrace->mFilename && fflush(aTrace->mFile) != 0)
+		aTrace->mError = true;
+}
+
+#ifndef _WIN32
+static void *writer(void *aTrace) {
+	struct em8051_trace *trace = aTrace;
+
+	pthread_mutex_lock(&trace->mLock);
+	for (;;) {
+		struct trace_batch *batch;
+
+		while (!trace->mQueued && !trace->mClosing)
+			pthread_cond_wait(&trace->mQueuedCond, &trace->mLock);
+		if (!trace->mQueued)
+			break;
+		batch = &trace->mBatches[trace->mWrite];
+		pthread_mutex_unlock(&trace->mLock);
+
+		write_batch(trace, batch);
+
+		pthread_mutex_lock(&trace->mLock);
+		trace->mWrite = (trace->mWrite + 1) % TRACE_BATCHES;
+		trace->mQueued--;
+		pthread_cond_signal(&trace->mFreeCond);
+	}
+	pthread_mutex_unlock(&trace->mLock);
+	return NULL;
+}
+#endif
+
+static void free_trace(struct em8051_trace *aTrace) {
+	unsigned int i;
+
+	for (i = 0; i < TRACE_BATCHES; i++)
+		free(aTrace->mBatches[i].mData);
+	free(aTrace->mToc);
+	free(aTrace->mFilename);
+	free(aTrace);
+}
+
+// Allocate the batches and start the writer; the file is open already
+static struct em8051_trace *start(struct em8051_trace *aTrace, struct em8051 *aCPU) {
+	unsigned int i;
+
+	for (i = 0; i < TRACE_BATCHES; i++) {
+		aTrace->mBatches[i].mData = malloc(TRACE_BATCH_SIZE);
+		if (!aTrace->mBatches[i].mData)
+			break;
+	}
+#ifdef _WIN32
+	if (i < TRACE_BATCHES) {
+		fclose(aTrace->mFile);
+		free_trace(aTrace);
+		return NULL;
+	}
+#else
+	pthread_mutex_init(&aTrace->mLock, NULL);
+	pthread_cond_init(&aTrace->mQueuedCond, NULL);
+	pthread_cond_init(&aTrace->mFreeCond, NULL);
+	if (i < TRACE_BATCHES || pthread_create(&aTrace->mThread, NULL, writer, aTrace) != 0) {
+		pthread_cond_destroy(&aTrace->mFreeCond);
+		pthread_cond_destroy(&aTrace->mQueuedCond);
+		pthread_mutex_destroy(&aTrace->mLock);
+		fclose(aTrace->mFile);
+		free_trace(aTrace);
+		return NULL;
+	}
+#endif
+	aTrace->mCPU = aCPU;
+	aCPU->mTrace = aTrace;
+	return aTrace;
+}
+
+struct em8051_trace *trace_open(struct em8051 *aCPU, const char *aFilename, unsigned long long aMaxSize) {
+	struct em8051_trace *trace = calloc(1, sizeof(struct em8051_trace));
+
+	if (!trace)
+		return NULL;
+	trace->mFilename = malloc(strlen(aFilename) + 1);
+	if (!trace->mFilename) {
+		free_trace(trace);
+		return NULL;
+	}
+	strcpy(trace->mFilename, aFilename);
+	trace->mMaxSize = aMaxSize;
+	if (open_file(trace) < 0) {
+		free_trace(trace);
+		return NULL;
+	}
+	return start(trace, aCPU);
+}
+
+struct em8051_trace *trace_stream(struct em8051 *aCPU, int aFd) {
+	struct em8051_trace *trace = calloc(1, sizeof(struct em8051_trace));
+
+	if (!trace)
+		return NULL;
+	trace->mFile = fdopen(aFd, "wb");
+	if (!trace->mFile) {
+		free_trace(trace);
+		return NULL;
+	}
+	// the frame count can't be filled in later; 0 as for an unfinished file
+	write_header(trace, 0);
+	return start(trace, aCPU);
+}
+
+void trace_flush(struct em8051_trace *aTrace) {
+	if (aTrace->mBatches[aTrace->mFill].mSize)
+		queue_batch(aTrace);
+}
+
+int trace_close(struct em8051_trace *aTrace) {
+	int result;
+
+	trace_flush(aTrace);
+#ifndef _WIN32
+	pthread_mutex_lock(&aTrace->mLock);
+	aTrace->mClosing = true;
+	pthread_cond_signal(&aTrace->mQueuedCond);
+	pthread_mutex_unlock(&aTrace->mLock);
+	pthread_join(aTrace->mThread, NULL);
+	pthread_cond_destroy(&aTrace->mFreeCond);
+	pthread_cond_destroy(&aTrace->mQueuedCond);
+	pthread_mutex_destroy(&aTrace->mLock);
+#endif
+
+	if (aTrace->mFile) {
+		if (aTrace->mFilename)
+			close_file(aTrace);
+		else if (fclose(aTrace->mFile) != 0)
+			aTrace->mError = true;
+	}
+	aTrace->mCPU->mTrace = NULL;
+	result = aTrace->mError ? -1 : 0;
+	free_trace(aTrace);
+	return result;
+}
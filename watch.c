@@ -0,0 +1,213 @@
+/* 8051 emulator core
+ * Copyright 2006 Jari Komppa
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject
+ * to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ * (i.e. the MIT License)
+ *
+ * watch.c
+ * Data watchpoints
+ *
+ * The memory accesses of the core check a bit per WATCH_PAGE_SIZE bytes of
+ * address space first; only an access to a page with a watchpoint on it
+ * goes through the list.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emu8051.h"
+
+static const struct {
+	const char *mName;
+	uint32_t mSpace;
+	uint32_t mSize;
+} spaces[] = {
+	{ "data", TRACE_DATA, 0x100 },
+	{ "sfr", TRACE_SFR, 0x100 },
+	{ "xdata", TRACE_EXT, 0x10000 }
+};
+
+static void set_pages(struct em8051_watchpoints *aWatch, struct em8051_watchpoint *aWatchpoint) {
+	uint32_t page;
+
+	for (page = aWatchpoint->mAddress / WATCH_PAGE_SIZE;
+		page <= (aWatchpoint->mAddress + aWatchpoint->mLength - 1) / WATCH_PAGE_SIZE; page++)
+		aWatch->mPages[page >> 3] |= 1 << (page & 7);
+}
+
+int watch_add(struct em8051_watchpoints *aWatch, uint32_t aAddress, uint32_t aLength, uint8_t aFlags, uint8_t aMask,
+	uint8_t aValue) {
+	struct em8051_watchpoint *list, *watchpoint;
+	uint32_t space = aAddress & TRACE_SPACE_MASK;
+
+	if (!aLength || aLength > 0x10000 - (aAddress & 0xffff) || space == TRACE_CODE ||
+		(space != TRACE_EXT && aAddress + aLength - 1 > (space | 0xff)) ||
+		(space == TRACE_SFR && (aAddress & 0xff) < 0x80) || !(aFlags & (WATCH_READ | WATCH_WRITE)))
+		return -1;
+
+	list = realloc(aWatch->mList, (aWatch->mCount + 1) * sizeof(struct em8051_watchpoint));
+	if (!list)
+		return -2;
+	aWatch->mList = list;
+	watchpoint = &list[aWatch->mCount++];
+	watchpoint->mAddress = aAddress;
+	watchpoint->mLength = aLength;
+	watchpoint->mFlags = aFlags;
+	watchpoint->mMask = aMask;
+	watchpoint->mValue = aValue & aMask;
+	watchpoint->mHits = 0;
+	set_pages(aWatch, watchpoint);
+	return 0;
+}
+
+int watch_parse(struct em8051_watchpoints *aWatch, const char *aSpec) {
+	uint32_t address, length = 1;
+	uint8_t flags = 0, mask = 0, value = 0;
+	unsigned int i;
+	char *end;
+
+	for (i = 0; i < sizeof(spaces) / sizeof(spaces[0]); i++) {
+		size_t name = strlen(spaces[i].mName);
+		if (strncmp(aSpec, spaces[i].mName, name) == 0 && aSpec[name] == ':')
+			break;
+	}
+	if (i == sizeof(spaces) / sizeof(spaces[0]))
+		return -1;
+	aSpec += strlen(spaces[i].mName) + 1;
+	address = strtoul(aSpec, &end, 16);
+	if (end == aSpec || address >= spaces[i].mSize)
+		return -1;
+	aSpec = end;
+	if (*aSpec == '+') {
+		length = strtoul(aSpec + 1, &end, 0);
+		aSpec = end;
+	}
+
+	while (*aSpec == ',') {
+		aSpec++;
+		if (strncmp(aSpec, "rw", 2) == 0) {
+			flags |= WATCH_READ | WATCH_WRITE;
+			aSpec += 2;
+		} else if (*aSpec == 'r') {
+			flags |= WATCH_READ;
+			aSpec++;
+		} else if (*aSpec == 'w') {
+			flags |= WATCH_WRITE;
+			aSpec++;
+		} else if (strncmp(aSpec, "log", 3) == 0) {
+			flags |= WATCH_LOG;
+			aSpec += 3;
+		} else if (*aSpec == '=') {
+			value = strtoul(aSpec + 1, &end, 16);
+			mask = 0xff;
+			if (end == aSpec + 1)
+				return -1;
+			aSpec = end;
+			if (*aSpec == '&') {
+				mask = strtoul(aSpec + 1, &end, 16);
+				if (end == aSpec + 1 || !mask)
+					return -1;
+				aSpec = end;
+			}
+		} else {
+			return -1;
+		}
+	}
+	if (*aSpec)
+		return -1;
+	if (!(flags & (WATCH_READ | WATCH_WRITE)))
+		flags |= WATCH_WRITE;
+	return watch_add(aWatch, spaces[i].mSpace | address, length, flags, mask, value);
+}
+
+bool watch_remove(struct em8051_watchpoints *aWatch, uint32_t aAddress, uint32_t aLength, uint8_t aFlags) {
+	unsigned int i;
+
+	// the last one added that matches
+	for (i = aWatch->mCount; i > 0; i--) {
+		struct em8051_watchpoint *watchpoint = &aWatch->mList[i - 1];
+		if (watchpoint->mAddress == aAddress && watchpoint->mLength == aLength &&
+			(watchpoint->mFlags & (WATCH_READ | WATCH_WRITE)) == (aFlags & (WATCH_READ | WATCH_WRITE)))
+			break;
+	}
+	if (i == 0)
+		return false;
+	memmove(&aWatch->mList[i - 1], &aWatch->mList[i], (aWatch->mCount - i) * sizeof(struct em8051_watchpoint));
+	aWatch->mCount--;
+	memset(aWatch->mPages, 0, sizeof(aWatch->mPages));
+	for (i = 0; i < aWatch->mCount; i++)
+		set_pages(aWatch, &aWatch->mList[i]);
+	return true;
+}
+
+void watch_clear_all(struct em8051_watchpoints *aWatch) {
+	free(aWatch->mList);
+	aWatch->mList = NULL;
+	aWatch->mCount = 0;
+	aWatch->mTriggered = false;
+	memset(aWatch->mPages, 0, sizeof(aWatch->mPages));
+}
+
+int watch_describe(const struct em8051_watch_hit *aHit, char *aBuffer) {
+	const char *space = "data";
+	int length;
+
+	if ((aHit->mAddress & TRACE_SPACE_MASK) == TRACE_SFR)
+		space = "sfr";
+	else if ((aHit->mAddress & TRACE_SPACE_MASK) == TRACE_EXT)
+		space = "xdata";
+	if (aHit->mWrite)
+		length = sprintf(aBuffer, "%04X: write %02X over %02X", aHit->mPC, aHit->mValue, aHit->mOld);
+	else
+		length = sprintf(aBuffer, "%04X: read %02X", aHit->mPC, aHit->mValue);
+	return length + sprintf(aBuffer + length, " at %s:%0*X", space,
+		(aHit->mAddress & TRACE_SPACE_MASK) == TRACE_EXT ? 4 : 2, aHit->mAddress & 0xffff);
+}
+
+void watch_access(struct em8051 *aCPU, uint32_t aAddress, uint8_t aValue, uint8_t aOld, bool aWrite) {
+	struct em8051_watchpoints *watch = aCPU->mWatch;
+	unsigned int i;
+
+	for (i = 0; i < watch->mCount; i++) {
+		struct em8051_watchpoint *watchpoint = &watch->mList[i];
+		struct em8051_watch_hit hit;
+
+		if (aAddress - watchpoint->mAddress >= watchpoint->mLength ||
+			!(watchpoint->mFlags & (aWrite ? WATCH_WRITE : WATCH_READ)) ||
+			(aValue & watchpoint->mMask) != watchpoint->mValue)
+			continue;
+
+		watchpoint->mHits++;
+		hit.mWatchpoint = watchpoint;
+		hit.mAddress = aAddress;
+		hit.mPC = aCPU->mPC;
+		hit.mValue = aValue;
+		hit.mOld = aOld;
+		hit.mWrite = aWrite;
+		if (watch->log)
+			watch->log(aCPU, &hit);
+		if (!(watchpoint->mFlags & WATCH_LOG)) {
+			watch->mHit = hit;
+			watch->mTriggered = true;
+			aCPU->mStop = 1;
+		}
+	}
+}